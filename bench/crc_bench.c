@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Throughput of each CRC32 kernel this CPU can run, for a few buffer sizes:
+// journal records, a page, a snapshot block. Built against the library
+// source so it can reach the kernels directly, "make crc_bench"
+
+#include "../kvdblite.c"
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(void) {
+  static const size_t sizes[] = {16, 64, 256, 4096, KVDBLITE_SNAP_BLOCK};
+  const size_t total = 256 << 20; // Bytes checksummed per measurement
+  uint8_t *buf = malloc(KVDBLITE_SNAP_BLOCK);
+  volatile uint32_t sink = 0;
+
+  if (buf == NULL)
+    return 1;
+  for (size_t i = 0; i < KVDBLITE_SNAP_BLOCK; i++)
+    buf[i] = (uint8_t)(i * 131 + 7);
+  pthread_once(&crc_once, crc_init);
+  printf("calc_CRC32() uses %s\n", crc_kernel->name);
+  printf("%-10s %10s %10s\n", "kernel", "bytes", "MB/s");
+
+  for (size_t k = 0; k < sizeof crc_kernels / sizeof crc_kernels[0]; k++) {
+    const struct crc_kernel *c = &crc_kernels[k];
+    if (c->usable != NULL && !c->usable())
+      continue;
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+      size_t n = total / sizes[s];
+      uint32_t crc = 0;
+      double t = now();
+      for (size_t i = 0; i < n; i++)
+        crc = c->fn(buf, sizes[s], crc);
+      t = now() - t;
+      sink ^= crc;
+      printf("%-10s %10zu %10.0f\n", c->name, sizes[s], (double)(n * sizes[s]) / t / 1e6);
+    }
+  }
+  free(buf);
+  return sink == 0xffffffff;
+}
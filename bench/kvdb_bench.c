@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Benchmark of every engine operation. For each key count, key/value size
+// profile and thread count it runs, in this order:
+//   insert  - every key once, in random order, into an empty database
+//   replay  - reopen the database, so the inserts come back from the journal
+//   lookup  - random reads, for each access distribution
+//   update  - random overwrites, for each access distribution
+//   save    - avl_save_database()
+//   load    - reopen the database from the snapshot
+//   remove  - every key once, in random order
+// One CSV line per step: throughput, per operation latency percentiles for
+// the steps made of single operations, and the resident set size after it.
+// With -e avl,btree every configuration runs on both in-memory engines,
+// one after the other, for a head to head comparison. avl+hash and
+// btree+hash add the hash index for point lookups (avl_options.hash_index).
+// Build with "make kvdb_bench", "make bench" runs a quick set.
+
+#include <errno.h>
+#include <getopt.h>
+#include <glob.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../kvdblite.h"
+
+// Key and value sizes, picked uniformly from [min, max]. Keys are at least 8
+// bytes, the first 8 make them unique.
+struct profile {
+  const char *name;
+  uint32_t kmin, kmax, vmin, vmax;
+};
+
+static const struct profile profiles[] = {
+    {"small", 16, 16, 32, 128},
+    {"medium", 16, 64, 100, 1000},
+    {"large", 32, 32, 1024, 4096},
+};
+
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+static const char *dist_names[] = {"uniform", "zipf"};
+
+// KVDBLITE_ENGINE_* in the low bit, avl_options.hash_index in the next
+static const char *engine_names[] = {"avl", "btree", "avl+hash", "btree+hash"};
+
+#define MAX_LIST 16
+#define MAX_VALUE 4096
+
+// YCSB style Zipfian ranks, see Gray et al., "Quickly generating
+// billion-record synthetic databases". Rank 0 is the hottest, ranks are
+// scattered over the key space by key_id().
+struct zipf {
+  uint64_t n;
+  double theta, alpha, zetan, eta, half_pow;
+};
+
+struct bench {
+  const char *path;
+  struct avl_options opts;
+  struct avltree *db;
+  const struct profile *prof;
+  int engine; // Index into engine_names
+  uint64_t nkeys, nops;
+  unsigned threads;
+  uint32_t *order; // A shuffle of the key numbers, for insert and remove
+  struct zipf zipf;
+  FILE *csv;
+};
+
+#define OP_INSERT 0
+#define OP_LOOKUP 1
+#define OP_UPDATE 2
+#define OP_REMOVE 3
+
+struct worker {
+  struct bench *b;
+  pthread_t thread;
+  int op, dist;
+  uint64_t lo, hi; // Slice of b->order, or a count of random operations
+  uint64_t rng;
+  uint32_t *lat;   // Nanoseconds per operation
+  uint64_t nlat, errors;
+};
+
+static uint8_t filler[MAX_VALUE];
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// A bijection, so different key numbers give different keys
+static uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t rng_next(uint64_t *s) {
+  *s += 0x9e3779b97f4a7c15ULL;
+  return mix(*s);
+}
+
+static double rng_double(uint64_t *s) { return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0); }
+
+static uint32_t pick(uint64_t r, uint32_t lo, uint32_t hi) { return lo + r % (hi - lo + 1); }
+
+static uint32_t make_key(const struct profile *p, uint64_t id, uint8_t *key) {
+  uint64_t h = mix(id);
+  uint32_t klen = pick(mix(h), p->kmin, p->kmax);
+  int i;
+  for (i = 0; i < 8; i++)
+    key[i] = (uint8_t)(h >> (56 - 8 * i));
+  memcpy(key + 8, filler, klen - 8);
+  return klen;
+}
+
+static void zipf_init(struct zipf *z, uint64_t n, double theta) {
+  uint64_t i;
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1.0 / (1.0 - theta);
+  z->zetan = 0;
+  for (i = 1; i <= n; i++)
+    z->zetan += 1.0 / pow((double)i, theta);
+  z->half_pow = pow(0.5, theta);
+  z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - (1 + z->half_pow) / z->zetan);
+}
+
+static uint64_t zipf_next(const struct zipf *z, uint64_t *rng) {
+  double u = rng_double(rng), uz = u * z->zetan;
+  uint64_t r;
+  if (uz < 1)
+    return 0;
+  if (uz < 1 + z->half_pow)
+    return 1;
+  r = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return r < z->n ? r : z->n - 1;
+}
+
+static uint64_t key_id(struct worker *w) {
+  struct bench *b = w->b;
+  if (w->dist == DIST_ZIPF)
+    return mix(zipf_next(&b->zipf, &w->rng) + 1) % b->nkeys;
+  return rng_next(&w->rng) % b->nkeys;
+}
+
+static void *worker_run(void *arg) {
+  struct worker *w = arg;
+  struct bench *b = w->b;
+  const struct profile *p = b->prof;
+  uint8_t key[64];
+  struct avl_view v;
+  uint64_t i, id, t;
+  uint32_t klen, vlen;
+  int rc = 0;
+
+  for (i = w->lo; i < w->hi; i++) {
+    id = w->op == OP_INSERT || w->op == OP_REMOVE ? b->order[i] : key_id(w);
+    klen = make_key(p, id, key);
+    vlen = pick(rng_next(&w->rng), p->vmin, p->vmax);
+    t = now_ns();
+    switch (w->op) {
+    case OP_INSERT:
+    case OP_UPDATE:
+      rc = avl_put(b->db, key, klen, filler, vlen);
+      break;
+    case OP_LOOKUP:
+      rc = avl_get_view(b->db, key, klen, &v);
+      break;
+    case OP_REMOVE:
+      rc = avl_del(b->db, key, klen);
+      break;
+    }
+    t = now_ns() - t;
+    w->lat[w->nlat++] = t > UINT32_MAX ? UINT32_MAX : (uint32_t)t;
+    if (rc < 0)
+      w->errors++;
+  }
+  return NULL;
+}
+
+static size_t rss_kb(void) {
+  char line[256];
+  size_t kb = 0;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL)
+    return 0;
+  while (fgets(line, sizeof line, f) != NULL) {
+    if (sscanf(line, "VmRSS: %zu", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint32_t *lat, uint64_t n, double p) {
+  uint64_t i = (uint64_t)(p * n);
+  return n == 0 ? 0 : lat[i < n ? i : n - 1] / 1000.0;
+}
+
+static void report(struct bench *b, const char *op, const char *dist, uint64_t ops, double secs,
+                   uint32_t *lat, uint64_t nlat, uint64_t errors) {
+  FILE *out = b->csv;
+  fprintf(out, "%s,%llu,%s,%s,%s,%u,%llu,%.6f,%.0f,", op, (unsigned long long)b->nkeys,
+          b->prof->name, engine_names[b->engine], dist, b->threads, (unsigned long long)ops,
+          secs, secs > 0 ? ops / secs : 0);
+  if (nlat > 0) {
+    qsort(lat, nlat, sizeof *lat, cmp_u32);
+    fprintf(out, "%.3f,%.3f,%.3f,", percentile(lat, nlat, 0.50), percentile(lat, nlat, 0.99),
+            percentile(lat, nlat, 0.999));
+  } else {
+    fprintf(out, ",,,");
+  }
+  fprintf(out, "%zu,%llu\n", rss_kb(), (unsigned long long)errors);
+  fflush(out);
+  fprintf(stderr, "%-7s %9llu keys %-7s %-10s %-8s %2u threads %12.0f ops/s\n", op,
+          (unsigned long long)b->nkeys, b->prof->name, engine_names[b->engine], dist,
+          b->threads, secs > 0 ? ops / secs : 0);
+}
+
+// Run one step on b->threads threads, each taking an equal share of n
+static int run_step(struct bench *b, int op, int dist, uint64_t n, uint32_t *lat) {
+  struct worker w[64];
+  uint64_t nlat = 0, errors = 0;
+  unsigned i;
+  double t;
+
+  for (i = 0; i < b->threads; i++) {
+    w[i] = (struct worker){.b = b, .op = op, .dist = dist};
+    w[i].lo = n * i / b->threads;
+    w[i].hi = n * (i + 1) / b->threads;
+    w[i].rng = mix(op * 1000003ULL + dist * 101 + i + 1);
+    w[i].lat = lat + w[i].lo;
+  }
+  t = now();
+  for (i = 0; i < b->threads; i++) {
+    if (pthread_create(&w[i].thread, NULL, worker_run, &w[i]) != 0)
+      return -1;
+  }
+  for (i = 0; i < b->threads; i++) {
+    pthread_join(w[i].thread, NULL);
+    errors += w[i].errors;
+  }
+  t = now() - t;
+  // The slices are contiguous, so the latencies are too
+  for (i = 0; i < b->threads; i++)
+    nlat += w[i].nlat;
+  static const char *names[] = {"insert", "lookup", "update", "remove"};
+  report(b, names[op], op == OP_LOOKUP || op == OP_UPDATE ? dist_names[dist] : "-", n, t, lat,
+         nlat, errors);
+  return 0;
+}
+
+static void remove_files(const char *path, unsigned nshards) {
+  static const char *suffix[] = {"", ".jnl", ".jnl.1", ".tmp"};
+  char fn[4096];
+  unsigned i, s;
+
+  for (s = 0; s < 4; s++) {
+    snprintf(fn, sizeof fn, "%s%s", path, suffix[s]);
+    unlink(fn);
+    for (i = 0; nshards > 1 && i < nshards; i++) {
+      snprintf(fn, sizeof fn, "%s.%u%s", path, i, suffix[s]);
+      unlink(fn);
+    }
+  }
+  // Value log segments, <path>[.<shard>].vlog.<n>
+  for (s = 0; s < 2; s++) {
+    glob_t g;
+    snprintf(fn, sizeof fn, s == 0 ? "%s.vlog.*" : "%s.*.vlog.*", path);
+    if (glob(fn, 0, NULL, &g) == 0) {
+      for (i = 0; i < g.gl_pathc; i++)
+        unlink(g.gl_pathv[i]);
+      globfree(&g);
+    }
+  }
+}
+
+// Close and reopen, the time to open is what is measured
+static int reopen(struct bench *b, const char *op) {
+  double t;
+  avl_free(b->db);
+  t = now();
+  b->db = avl_make_with_options((uint8_t *)b->path, &b->opts);
+  t = now() - t;
+  if (b->db == NULL)
+    return -1;
+  report(b, op, "-", b->nkeys, t, NULL, 0, 0);
+  return 0;
+}
+
+static int run_config(struct bench *b, const int *dists, int ndists) {
+  uint32_t *lat = malloc((b->nops > b->nkeys ? b->nops : b->nkeys) * sizeof *lat);
+  uint64_t i, j, rng = 42;
+  double t;
+  int d, rc = -1;
+
+  b->order = malloc(b->nkeys * sizeof *b->order);
+  if (lat == NULL || b->order == NULL)
+    goto out;
+  for (i = 0; i < b->nkeys; i++)
+    b->order[i] = (uint32_t)i;
+  for (i = b->nkeys - 1; i > 0; i--) {
+    uint32_t x;
+    j = rng_next(&rng) % (i + 1);
+    x = b->order[i];
+    b->order[i] = b->order[j];
+    b->order[j] = x;
+  }
+
+  remove_files(b->path, b->opts.nshards);
+  if ((b->db = avl_make_with_options((uint8_t *)b->path, &b->opts)) == NULL)
+    goto out;
+  if (run_step(b, OP_INSERT, DIST_UNIFORM, b->nkeys, lat) < 0 || reopen(b, "replay") < 0)
+    goto out;
+  for (d = 0; d < ndists; d++) {
+    if (run_step(b, OP_LOOKUP, dists[d], b->nops, lat) < 0 ||
+        run_step(b, OP_UPDATE, dists[d], b->nops, lat) < 0)
+      goto out;
+  }
+  t = now();
+  if (avl_save_database(b->db) < 0)
+    goto out;
+  report(b, "save", "-", b->nkeys, now() - t, NULL, 0, 0);
+  if (reopen(b, "load") < 0 || run_step(b, OP_REMOVE, DIST_UNIFORM, b->nkeys, lat) < 0)
+    goto out;
+  rc = 0;
+out:
+  if (b->db != NULL)
+    avl_free(b->db);
+  b->db = NULL;
+  remove_files(b->path, b->opts.nshards);
+  free(b->order);
+  free(lat);
+  return rc;
+}
+
+// Comma separated list of numbers, returns how many
+static int parse_list(const char *s, uint64_t *out) {
+  int n = 0;
+  char *end;
+  while (*s != '\0' && n < MAX_LIST) {
+    errno = 0;
+    out[n++] = strtoull(s, &end, 10);
+    if (errno != 0 || end == s)
+      return -1;
+    // 1e6 style counts
+    if (*end == 'e') {
+      unsigned long long x = strtoull(end + 1, &end, 10);
+      while (x-- > 0)
+        out[n - 1] *= 10;
+    }
+    s = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0')
+      return -1;
+  }
+  return n;
+}
+
+static int parse_names(const char *s, const char **names, int nnames, int *out) {
+  int n = 0, i;
+  char buf[256], *tok, *save;
+  snprintf(buf, sizeof buf, "%s", s);
+  for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    for (i = 0; i < nnames && strcmp(tok, names[i]) != 0; i++)
+      ;
+    if (i == nnames || n == MAX_LIST)
+      return -1;
+    out[n++] = i;
+  }
+  return n;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: kvdb_bench [options]\n"
+          "  -n LIST   key counts, e.g. 1e4,1e5,1e6 (default 1e4,1e5,1e6)\n"
+          "  -N N      lookups and updates per step (default: key count, at least 1e5)\n"
+          "  -p LIST   size profiles: small, medium, large (default small,medium)\n"
+          "  -d LIST   access distributions: uniform, zipf (default uniform,zipf)\n"
+          "  -z THETA  Zipfian skew (default 0.99)\n"
+          "  -t LIST   thread counts (default 1,4)\n"
+          "  -s N      shards (default 1)\n"
+          "  -e LIST   engines: avl, btree, avl+hash, btree+hash (default avl)\n"
+          "  -m        MVCC mode, AVL engine only\n"
+          "  -c        compact (format 3) snapshots\n"
+          "  -Z N      keep values of N bytes and more compressed (compress_values)\n"
+          "  -C        compressed snapshots (compress_snapshots)\n"
+          "  -V N      values of N bytes and more go to the value log (value_log)\n"
+          "  -M MB     value log cache size (value_cache_bytes, default 64)\n"
+          "  -L        no latency histograms in the library (stats_latency = 0)\n"
+          "  -f PATH   database file (default kvdb_bench.kvb), removed afterwards\n"
+          "  -o FILE   CSV output (default stdout)\n");
+}
+
+int main(int argc, char **argv) {
+  uint64_t keys[MAX_LIST] = {10000, 100000, 1000000}, threads[MAX_LIST] = {1, 4}, nops = 0;
+  int nkeys = 3, nthreads = 2, prof[MAX_LIST] = {0, 1}, nprof = 2, dists[MAX_LIST] = {0, 1};
+  int ndists = 2, engines[MAX_LIST] = {KVDBLITE_ENGINE_AVL}, nengines = 1, k, p, e, t, c, rc = 0;
+  const char *pnames[sizeof profiles / sizeof profiles[0]];
+  double theta = 0.99;
+  struct bench b = {.path = "kvdb_bench.kvb", .csv = stdout};
+
+  for (k = 0; k < (int)(sizeof profiles / sizeof profiles[0]); k++)
+    pnames[k] = profiles[k].name;
+  avl_default_options(&b.opts);
+  while ((c = getopt(argc, argv, "n:N:p:d:e:z:t:s:mcZ:CV:M:Lf:o:h")) != -1) {
+    switch (c) {
+    case 'n':
+      nkeys = parse_list(optarg, keys);
+      break;
+    case 'N':
+      nops = strtoull(optarg, NULL, 10);
+      break;
+    case 'p':
+      nprof = parse_names(optarg, pnames, sizeof profiles / sizeof profiles[0], prof);
+      break;
+    case 'd':
+      ndists = parse_names(optarg, dist_names, 2, dists);
+      break;
+    case 'e':
+      nengines = parse_names(optarg, engine_names, 4, engines);
+      break;
+    case 'z':
+      theta = atof(optarg);
+      break;
+    case 't':
+      nthreads = parse_list(optarg, threads);
+      break;
+    case 's':
+      b.opts.nshards = atoi(optarg);
+      break;
+    case 'm':
+      b.opts.mvcc = 1;
+      break;
+    case 'c':
+      b.opts.compact_snapshots = 1;
+      break;
+    case 'Z':
+      b.opts.compress_values = (uint32_t)strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      b.opts.compress_snapshots = 1;
+      break;
+    case 'V':
+      b.opts.value_log = (uint32_t)strtoul(optarg, NULL, 10);
+      break;
+    case 'M':
+      b.opts.value_cache_bytes = strtoull(optarg, NULL, 10) << 20;
+      break;
+    case 'L':
+      b.opts.stats_latency = 0;
+      break;
+    case 'f':
+      b.path = optarg;
+      break;
+    case 'o':
+      if ((b.csv = fopen(optarg, "w")) == NULL) {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    default:
+      usage();
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (nkeys <= 0 || nprof <= 0 || ndists <= 0 || nengines <= 0 || nthreads <= 0 || theta <= 0 ||
+      theta >= 1) {
+    usage();
+    return 1;
+  }
+  for (t = 0; t < nthreads; t++) {
+    if (threads[t] < 1 || threads[t] > 64) {
+      fprintf(stderr, "1 to 64 threads\n");
+      return 1;
+    }
+  }
+  for (k = 0; k < nkeys; k++) {
+    if (keys[k] < 1 || keys[k] > UINT32_MAX) {
+      fprintf(stderr, "1 to 2^32-1 keys\n");
+      return 1;
+    }
+  }
+  for (k = 0; k < MAX_VALUE; k++)
+    filler[k] = 'a' + k % 26;
+
+  fprintf(b.csv, "op,keys,profile,engine,dist,threads,ops,seconds,ops_per_sec,p50_us,p99_us,"
+                 "p999_us,rss_kb,errors\n");
+  for (k = 0; k < nkeys && rc == 0; k++) {
+    b.nkeys = keys[k];
+    b.nops = nops > 0 ? nops : b.nkeys > 100000 ? b.nkeys : 100000;
+    zipf_init(&b.zipf, b.nkeys, theta);
+    for (p = 0; p < nprof && rc == 0; p++) {
+      b.prof = &profiles[prof[p]];
+      for (e = 0; e < nengines && rc == 0; e++) {
+        b.engine = engines[e];
+        b.opts.engine = b.engine & 1;
+        b.opts.hash_index = b.engine >> 1;
+        for (t = 0; t < nthreads && rc == 0; t++) {
+          b.threads = (unsigned)threads[t];
+          if ((rc = run_config(&b, dists, ndists)) < 0)
+            fprintf(stderr, "failed: %llu keys %s %s %u threads\n", (unsigned long long)b.nkeys,
+                    b.prof->name, engine_names[b.engine], b.threads);
+        }
+      }
+    }
+  }
+  if (b.csv != stdout)
+    fclose(b.csv);
+  return rc < 0;
+}
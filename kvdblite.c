@@ -6,803 +6,8195 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "kvdblite.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define KVDBLITE_CRC_PCLMUL
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define KVDBLITE_HIDX_SSE2
+#endif
+
+// The journal writer submits through io_uring, see jring_init()
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+#define KVDBLITE_IO_URING
+#endif
+#endif
+#endif
+
 #define KVDBLITE_OP_INSERT 43
 #define KVDBLITE_OP_REMOVE 45
+#define KVDBLITE_OP_BATCH_BEGIN 66  // 'B'
+#define KVDBLITE_OP_BATCH_COMMIT 67 // 'C'
+// An INSERT/REMOVE record followed by the CRC32 of the whole record. Journals
+// written before records had a CRC hold the plain ones, batches still do.
+#define KVDBLITE_OP_INSERT_CRC 73 // 'I'
+#define KVDBLITE_OP_REMOVE_CRC 82 // 'R'
+// The same with LEB128 varint lengths, see add_transaction(). Batches hold
+// PUT/DEL records, everything else PUT_CRC/DEL_CRC ones.
+#define KVDBLITE_OP_PUT 80      // 'P'
+#define KVDBLITE_OP_DEL 68      // 'D'
+#define KVDBLITE_OP_PUT_CRC 112 // 'p'
+#define KVDBLITE_OP_DEL_CRC 100 // 'd'
+// A batch's part in one shard of several, and the end of one that never
+// committed, see kvdb_write_batch_commit()
+#define KVDBLITE_OP_BATCH_PART 98  // 'b'
+#define KVDBLITE_OP_BATCH_ABORT 65 // 'A'
+
+// Journal records are encoded into this buffer and written out in one go
+// when it fills up, when the durability policy asks for it, on
+// avl_flush_journal()/avl_sync() and in avl_free()
+#define KVDBLITE_JOURNAL_BUF_SIZE (64 * 1024)
+
+// Automatic checkpoints, see checkpoint_policy_thread()
+#define KVDBLITE_CKPT_POLL_MS 250
+#define KVDBLITE_CKPT_MIN_JOURNAL (1024 * 1024) // Smaller journals never pass ckpt_journal_pct
+#define KVDBLITE_CKPT_RETRY_S 10               // Wait after a checkpoint failed
+
+// Startup speeds in bytes per second for avl_recovery_estimate() when the open
+// had less than KVDBLITE_RATE_MIN_BYTES to measure: loading a snapshot, and
+// replaying a journal of mostly distinct keys, on a single core
+#define KVDBLITE_LOAD_RATE (256.0 * 1024 * 1024)
+#define KVDBLITE_REPLAY_RATE (16.0 * 1024 * 1024)
+#define KVDBLITE_RATE_MIN_BYTES (1024 * 1024)
+
+// First word of the database file of a sharded database, see load_shard_manifest()
+#define KVDBLITE_SHARD_MAGIC 0x4b445348 // "HSDK"
+
+// Snapshot file format 2, see save_tree_to_disk()
+#define KVDBLITE_SNAP_MAGIC 0x3253564b       // "KVS2"
+#define KVDBLITE_SNAP_INDEX_MAGIC 0x5844494b // "KIDX"
+#define KVDBLITE_SNAP_BLOCKS_MAGIC 0x4b4c424b // "KBLK"
+#define KVDBLITE_SNAP_BATCH_MAGIC 0x324c424b  // "KBL2"
+#define KVDBLITE_SNAP_BLOCK (256 * 1024)
+#define KVDBLITE_MAP_CHUNK_SHIFT 18 // Mapped snapshots are CRC checked 256 KiB at a time
+// Format 3, avl_options.compact_snapshots
+#define KVDBLITE_SNAP3_MAGIC 0x3353564b // "KVS3"
+#define KVDBLITE_SNAP_RESTART 16        // Entries between full keys
+#define KVDBLITE_SNAP_LZ 0x80000000u      // Block length flags, see struct snap_writer
+#define KVDBLITE_SNAP_ZVALUES 0x40000000u
+#define KVDBLITE_SNAP_VLOG 0x20000000u
+#define KVDBLITE_SNAP_FLAGS (KVDBLITE_SNAP_LZ | KVDBLITE_SNAP_ZVALUES | KVDBLITE_SNAP_VLOG)
+
+// Value log, see struct vlog
+#define KVDBLITE_VLOG_REF 16            // [u32 segment][u64 offset][u32 size] in place of a value
+#define KVDBLITE_VLOG_SEGMENT (64 << 20) // Default avl_options.value_log_segment_bytes
+#define KVDBLITE_VLOG_GC_POLL_MS 1000
 
 // TODO
-// Increase performance of adding 100,000 entries. Seems creating journal file is slow.
 // Error handling needs to be robust and consistent
 // avl_import(char * fn) and avl_append(char *fn). The import needs to check that root is NULL.
 // Memory protection using mprotect() for struct avltree, 
-// Make thread safe (mutex locking etc)
-// Use network order when writing binary int32/uint32 etc, for cross platform compatibility
 
 struct node {
   struct node *left, *right;
-  int diff;
+  int8_t diff;
+  uint8_t zvalue;      // value is [le32 length][LZ data], see value_pack()
+  uint8_t logged;      // value is a reference into the value log, see struct vlog
+  uint32_t size;       // Number of nodes in this subtree, for rank/select
+  uint32_t klen, vlen; // Key and value are also NUL terminated for the string API
+  uint32_t vcap;       // Space for an inline value after the key, see node_make()
+  uint32_t cow;        // Copy on write: bit 0 marks a private copy made by the write in
+                       // progress, the rest is the checkpoint it was made during, see node_cow()
   avl_key_t *key;
   avl_value_t *value;
 };
 
-struct avltree {
+// An AVL tree of height h has at least fib(h + 2) - 1 nodes, so with 32 bit
+// subtree sizes 64 levels is never reached
+#define AVL_MAX_HEIGHT 64
+
+// KVDBLITE_ENGINE_BTREE: the same nodes hold keys and values, a B+tree
+// indexes them. Every node of the B+tree is a few cache lines, aligned to
+// them, starting with the first 8 bytes of its keys as big endian integers
+// (see bt_prefix()), so a binary search within a node only touches the keys
+// themselves when two prefixes are equal. Inner nodes also keep the number
+// of keys under each child, for rank/select. All leaves are at the same
+// depth and linked in key order.
+#define BT_ORDER 32            // Entries of a leaf, children of an inner node
+#define BT_MIN (BT_ORDER / 4)  // Fewer and a node is merged with or refilled from a neighbour
+#define BT_FILL (BT_ORDER * 3 / 4) // How full bt_build() makes the nodes
+#define BT_MAX_HEIGHT 16       // BT_MIN^15 is more than any shard can hold
+
+// A separator between two children of an inner node, a copy of a key
+struct bt_sep {
+  uint32_t klen;
+  avl_key_t key[];
+};
+
+struct bt_leaf {
+  uint64_t pfx[BT_ORDER];
+  struct node *ent[BT_ORDER];
+  struct bt_leaf *prev, *next;
+  uint32_t n;
+} __attribute__((aligned(64)));
+
+// child[i] holds the keys from sep[i - 1] up to but not including sep[i]
+struct bt_inner {
+  uint64_t pfx[BT_ORDER - 1];
+  uint32_t n; // Children
+  void *child[BT_ORDER];
+  struct bt_sep *sep[BT_ORDER - 1];
+  uint32_t cnt[BT_ORDER]; // Keys under each child
+} __attribute__((aligned(64)));
+
+// Position in the leaves, leaf is NULL off either end
+struct bt_iter {
+  struct bt_leaf *leaf;
+  uint32_t pos;
+};
+
+// avl_options.hash_index: an open addressing table from key to node next to
+// the tree, see hidx_find(). Slots are probed a group at a time, the group's
+// control bytes are compared at once against 7 bits of the key's hash, so
+// keys are only read for the slots that match.
+#define HIDX_GROUP 16
+#define HIDX_EMPTY 0x80
+#define HIDX_DELETED 0xfe // Tombstone, lookups keep probing past it
+
+struct hidx {
+  uint8_t *ctrl;      // HIDX_EMPTY, HIDX_DELETED or the low 7 bits of the hash, slots follow
+  struct node **slot; // NULL when there is no table
+  size_t cap;         // A power of two, at least HIDX_GROUP
+  size_t used, deleted;
+  int on; // avl_options.hash_index
+};
+
+#define SLAB_CHUNK_SIZE (256 * 1024)
+#define SLAB_MAX_SIZE 4096
+#define SLAB_NCLASSES 28 // slab_class(SLAB_MAX_SIZE) + 1
+
+struct slab_chunk {
+  struct slab_chunk *next;
+  uint64_t pad; // Keep blocks 16 byte aligned
+};
+
+struct slab_free {
+  struct slab_free *next;
+};
+
+struct slab_big {
+  struct slab_big *prev, *next;
+};
+
+struct slab {
+  struct slab_chunk *chunk; // Chunk being carved up, head of the list of all chunks
+  size_t chunk_used;
+  struct slab_free *free_list[SLAB_NCLASSES];
+  struct slab_big big; // List of blocks too large for a size class
+  size_t bytes_in_use;
+};
+
+struct journal_buf {
+  uint8_t *data;
+  size_t len, cap;
+};
+
+// MVCC: a slab block unlinked from the tree, freed once no reader can see it
+struct retired {
+  void *p;
+  size_t size;    // As passed to slab_alloc()
+  uint64_t epoch; // Global epoch after the change was published, see shard_reclaim()
+};
+
+// MVCC: the epoch a reader entered at, 0 when the slot is free
+struct epoch_slot {
+  uint64_t epoch;
+} __attribute__((aligned(64)));
+
+#define KVDBLITE_MVCC_SLOTS 256
+#define KVDBLITE_MVCC_RECLAIM 256 // Retired blocks before the first reclaim attempt
+
+// Operation counters, see stat_stripe()
+#define KVDBLITE_STAT_STRIPE_BITS 6
+#define KVDBLITE_STAT_STRIPES (1 << KVDBLITE_STAT_STRIPE_BITS)
+#define STAT_INSERT 0
+#define STAT_LOOKUP 1
+#define STAT_REMOVE 2
+#define STAT_FLUSH 3
+#define STAT_NHIST 4
+
+struct stat_stripe {
+  struct kvdb_histogram hist[STAT_NHIST];
+  uint64_t lookup_misses, batches, journal_bytes, fsyncs, fsync_ns;
+} __attribute__((aligned(64)));
+
+// A format 2 snapshot mapped by a read only database, see map_snapshot()
+struct snap_map {
+  const uint8_t *base;
+  size_t size;
+  uint64_t count;
+  const uint8_t *index; // count u64 file offsets of the entries, in key order
+  uint64_t *shadow;     // Fenwick tree over the entries, see map_shadow_add()
+  uint64_t *blocks;     // Block index, [offset, first entry] pairs
+  uint64_t nblocks;
+  uint8_t *checked; // Per chunk of the file: 0 unchecked, 1 its blocks are good, 2 one isn't
+  int bad;          // A block failed its CRC, reads of the shard return KVDBLITE_CORRUPT
+};
+
+// Values read back from the value log, CLOCK evicted once they take more
+// than budget bytes. Entries are found by segment and offset through a
+// chained hash table.
+#define VCACHE_NONE UINT32_MAX
+
+struct vcache_ent {
+  uint64_t off;
+  uint32_t seg;  // 0 for a free entry
+  uint32_t size;
+  uint32_t next; // Hash chain, or the free list
+  uint8_t ref;   // Used since the hand last passed
+  uint8_t *data;
+};
+
+struct vcache {
+  struct vcache_ent *ents;
+  uint32_t n, cap, free, hand;
+  uint32_t *heads; // cap of them
+  uint64_t bytes, budget;
+  uint64_t hits, misses;
+};
+
+// A file of the value log, <dbname>.vlog.<id>
+struct vlog_seg {
+  uint32_t id;
+  int fd;
+  int dirty;     // Written since a checkpoint last synced it
+  uint64_t size; // Bytes written
+  uint64_t live; // Bytes of the records nodes point to
+  uint64_t dead; // No node points into it. Deleted by the checkpoint
+                 // numbered this or later, so no snapshot still needs it.
+};
+
+// Value log (avl_options.value_log): large values are appended to segment
+// files as [u32 klen][u32 size][key][value][u32 CRC32 of all before], and
+// the node keeps KVDBLITE_VLOG_REF bytes pointing at the value instead.
+// Snapshots store the references, journals still hold whole values. Only the
+// newest segment is appended to. A segment that has become mostly garbage is
+// collected by copying the records nodes still point at to the end of the
+// log (see vlog_collect()). It is deleted after the next checkpoint, whose
+// snapshot no longer points into it.
+struct vlog {
+  pthread_mutex_t lock; // Everything here, taken after the shard's rwlock
+  char *prefix;         // <dbname>.vlog.
+  struct vlog_seg *segs; // By id
+  size_t nsegs, segcap;
+  uint32_t active;      // Segment appended to, 0 until the first append
+  uint32_t next_id;
+  int created;          // A segment file was made since the directory was synced
+  int readonly;
+  uint64_t seg_bytes;   // Segments are closed at this size
+  uint64_t ckpt;        // Checkpoints started, see vlog_checkpoint_begin()
+  uint64_t collected;   // Segments deleted
+  struct vcache cache;
+};
+
+// A database is split into one or more shards, each an independent tree
+// with its own lock, journal and files. Keys are spread over the shards by
+// hash, so threads working on different shards don't contend.
+struct shard {
+  struct avltree *avl;
   struct node *root;
+  size_t count;     // Number of keys, same as root->size
+  // KVDBLITE_ENGINE_BTREE, root is unused then. bt_root is a leaf if
+  // bt_height is 1, NULL if it is 0.
+  int btree;
+  unsigned bt_height;
+  void *bt_root;
+  size_t bt_bytes; // B+tree nodes, outside the slab
+  struct hidx hidx; // avl_options.hash_index, indexes the nodes of either engine
+  struct vlog *vlog; // NULL without a value log
+  uint64_t version; // Bumped by every change to the tree, see struct avl_cursor
+  struct slab slab;
   uint8_t *dbname;
   uint8_t *journalname;
+  uint8_t *rotatedname; // <journalname>.1, see checkpoint_shard()
+  uint64_t snapshot_bytes; // Size of dbname
+
+  // Read only databases: the tree only holds changes made on top of the
+  // mapped snapshot, deleted snapshot keys are nodes without a value
+  struct snap_map map;
+
+  // Readers share it, writers take it exclusively. Taken before journal_lock.
+  // In MVCC mode readers don't take it.
+  pthread_rwlock_t rwlock;
+
+  // MVCC, see node_cow(). Writers build the new tree from work_root and
+  // publish it in root with one atomic store.
+  int mvcc;
+  struct node *work_root;
+  struct node **cow; // Private copies made by the write in progress
+  size_t ncow, cowcap;
+  struct retired *retired; // [0, ntagged) have their epoch set
+  size_t nretired, ntagged, retiredcap, reclaim_at;
+
+  // Background checkpoint, see checkpoint_shard(). While ckpt_stamp is set
+  // the tree is copy on write and replaced nodes of the frozen tree are kept
+  // in frozen until the snapshot is on disk.
+  uint32_t ckpt_stamp;
+  struct retired *frozen;
+  size_t nfrozen, frozencap;
+
+  // Protects the journal state below
+  pthread_mutex_t journal_lock;
+  pthread_cond_t journal_cond; // Broadcast whenever a flush completes
+
+  int journal_fd;                  // -1 until the first flush opens it
+  struct journal_buf journal;      // Records appended since the last flush
+  struct journal_buf journal_spare; // Swapped in while a flush is writing
+  int journal_flushing;            // A flush is running outside the lock
+  int journal_leader;              // A group commit leader is waiting for company
+  pthread_cond_t leader_cond;      // Signalled once the leader's group is complete
+  int journal_kicked;              // The journal writer has been told about this buffer
+  int journal_err;                 // Sticky write error
+  uint64_t journal_lsn;            // Sequence number of the last appended record
+  uint64_t written_lsn;            // Handed to the kernel up to here
+  uint64_t synced_lsn;             // fdatasync()'d up to here
+  uint64_t group_size;             // Records the last synced flush took, see journal_group_wait()
+  uint64_t journal_bytes;          // Written to <journal> and <journal>.1, read without the lock
+  uint64_t rotated_bytes;          // The part moved to <journal>.1 by the last rotation
+  uint64_t batch_lsn;              // Sequence number of the last batch part, see checkpoint_shard()
+
+  // The last batch of several shards with a part in this shard, and the
+  // one the snapshot that was loaded goes up to, see kvdb_write_batch_commit()
+  uint64_t batch_id;
+  uint64_t snap_batch;
+} __attribute__((aligned(64)));    // Keep shards off each other's cache lines
+
+struct avltree {
+  struct shard *shards;
+  unsigned nshards;
+  uint8_t *dbname;
+  struct avl_options opts;
+  int readonly; // Opened by avl_open_readonly()
+  int overlay;  // Read only, but writes go to memory
+
+  // MVCC epoch based reclamation
+  uint64_t epoch;
+  struct epoch_slot *slots; // KVDBLITE_MVCC_SLOTS of them
+  uint64_t publish_seq;     // Odd while a change to several shards is being published
+
+  uint64_t batch_seq; // Id of the last batch of several shards
+
+  // KVDBLITE_SYNC_INTERVAL background flusher
+  pthread_t sync_thread;
+  pthread_mutex_t sync_lock;
+  pthread_cond_t sync_cond;
+  int sync_thread_running;
+  int sync_thread_stop;
+
+  // avl_options.journal_writer, see journal_writer_thread()
+  pthread_t writer_thread;
+  pthread_mutex_t writer_lock;
+  pthread_cond_t writer_cond;
+  struct journal_io *writer_ios; // One per shard
+  int writer_running;
+  int writer_stop;
+  int writer_pending; // Set by journal_kick()
+
+  // Background checkpoint
+  pthread_t ckpt_thread;
+  pthread_mutex_t ckpt_lock;
+  int ckpt_started; // ckpt_thread has to be joined
+  int ckpt_running;
+  int ckpt_rc;        // Result of the last checkpoint
+  uint32_t ckpt_seq;
+  uint64_t ckpt_last_us; // When the last checkpoint started
+
+  // Value log collection, see vlog_gc_thread()
+  int vlog; // Some shard has a value log
+  pthread_t gc_thread;
+  pthread_mutex_t gc_lock;
+  pthread_cond_t gc_cond;
+  pthread_mutex_t gc_run; // Held by a collection pass
+  int gc_thread_running;
+  int gc_thread_stop;
+
+  // Automatic checkpoints, see checkpoint_policy_thread()
+  pthread_t policy_thread;
+  pthread_mutex_t policy_lock;
+  pthread_cond_t policy_cond;
+  int policy_thread_running;
+  int policy_thread_stop;
+
+  // Startup cost measured by db_open(), see avl_recovery_estimate()
+  uint64_t load_bytes, load_us, replay_bytes, replay_us;
+  uint64_t replay_records, replay_applied; // Before and after dropping replaced records
+
+  // See kvdb_get_stats()
+  struct stat_stripe *stats; // KVDBLITE_STAT_STRIPES of them
+  struct kvdb_histogram ckpt_hist;
+  uint64_t ckpt_failures, ckpt_last_ns;
 };
 
 // Forwards
-static int insert(avl_key_t *key, avl_value_t *value, struct node **rp);
-static int remove_root(struct node **rp);
-static int remove_(avl_key_t *key, struct node **rp);
-static int truncate_transaction_file(struct avltree *avl);
+static int insert(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                  const avl_value_t *value, uint32_t vlen, struct node **rp);
+static int remove_(struct shard *sh, const avl_key_t *key, uint32_t klen, struct node **rp);
+static struct node *node_make(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                              const avl_value_t *value, uint32_t vlen);
+static struct node *node_make_packed(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                                     const uint8_t *p, size_t vsize, int kind, uint32_t vlen);
+static inline size_t node_value_bytes(const struct node *a);
+static inline void fix_size(struct node *a);
+static inline int keycmp(const avl_key_t *a, uint32_t alen, const avl_key_t *b, uint32_t blen);
+static struct node *avl_search(const avl_key_t *key, uint32_t klen, struct node *root);
+static int shard_lookup(struct shard *sh, struct node *root, const avl_key_t *key, uint32_t klen,
+                        struct avl_view *v);
+static inline void node_free_value(struct shard *sh, struct node *a);
+static void node_free(struct shard *sh, struct node *a);
+static int node_value_copy(struct shard *sh, const struct node *a, uint8_t *dst);
+static int vlog_append(struct vlog *vl, const avl_key_t *key, uint32_t klen, const uint8_t *data,
+                       size_t size, uint8_t *ref);
+static int vlog_fetch(struct shard *sh, const struct node *a, uint8_t **out);
+static void vlog_ref_add(struct vlog *vl, const uint8_t *ref, uint32_t klen);
+static void vlog_ref_drop(struct vlog *vl, const uint8_t *ref, uint32_t klen);
+static int vlog_open(struct shard *sh);
+static void vlog_trim(struct vlog *vl);
+static void vlog_settle(struct vlog *vl);
+static void vlog_close(struct vlog *vl);
+static void *vlog_gc_thread(void *arg);
+static uint64_t hash_key(const avl_key_t *key, uint32_t klen);
+static int batch_abort(struct shard *sh, uint64_t id, uint64_t *lsn);
+static void *checkpoint_policy_thread(void *arg);
+static struct bt_leaf *bt_first_leaf(struct shard *sh);
+static int bt_build(struct shard *sh, struct node **nodes, size_t n);
+static void bt_adopt(struct shard *sh);
+static int bt_insert(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                     const avl_value_t *value, uint32_t vlen);
+static int bt_remove(struct shard *sh, const avl_key_t *key, uint32_t klen);
+static size_t bt_size(struct shard *sh);
+static inline struct node *bt_iter_node(struct bt_iter *it);
+static void bt_iter_first(struct bt_iter *it, struct shard *sh);
+static void bt_iter_last(struct bt_iter *it, struct shard *sh);
+static void bt_iter_seek(struct bt_iter *it, struct shard *sh, const avl_key_t *key,
+                         uint32_t klen);
+static void bt_iter_next(struct bt_iter *it);
+static void bt_iter_prev(struct bt_iter *it);
+static int hidx_reserve(struct shard *sh, size_t n);
+static inline void hidx_add(struct shard *sh, struct node *a);
+static void hidx_del(struct shard *sh, struct node *a);
+static void hidx_move(struct shard *sh, struct node *a, struct node *b);
+static void hidx_build(struct shard *sh, struct node **nodes, size_t n);
+static void hidx_build_tree(struct shard *sh);
 
 //
-// CRC32
+// Slab allocator
 //
 
-// Precomputed table for CRC32 checksums
-uint32_t crc32_table[256];
-
-// Initialize the precomputed table
-void generate_CRC32_table() {
-    uint32_t c;
-    for (int i = 0; i < 256; i++) {
-        c = i;
-        for (int j = 0; j < 8; j++) {
-            if (c & 1) {
-                c = 0xEDB88320L ^ (c >> 1);
-            } else {
-                c = c >> 1;
-            }
-        }
-        crc32_table[i] = c;
+// Every tree owns a slab. Nodes are carved out of large chunks together with
+// their key bytes and, when it fits, the value bytes, so a lookup touches one
+// allocation per level. Freed blocks go onto per size class free lists and
+// are reused by later inserts. Blocks bigger than SLAB_MAX_SIZE come from
+// malloc() but are still tracked so that avl_free() can tear everything down
+// without walking the tree.
+
+static inline int slab_class(size_t size) {
+  if (size <= 128)
+    return size == 0 ? 0 : (int)((size - 1) >> 4);
+  // Four classes per power of two above 128
+  int shift = 63 - __builtin_clzll(size - 1);
+  return 8 + (shift - 7) * 4 + (int)(((size - 1) >> (shift - 2)) & 3);
+}
+
+static inline size_t slab_class_size(int c) {
+  if (c < 8)
+    return (size_t)(c + 1) * 16;
+  int shift = 7 + (c - 8) / 4;
+  return ((size_t)1 << shift) + (size_t)((c - 8) % 4 + 1) * ((size_t)1 << (shift - 2));
+}
+
+// Size of the block slab_alloc() actually hands out for a request of size bytes
+static inline size_t slab_usable_size(size_t size) {
+  return size > SLAB_MAX_SIZE ? size : slab_class_size(slab_class(size));
+}
+
+static void *slab_alloc(struct slab *slab, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    struct slab_big *b = malloc(sizeof *b + size);
+    if (b == NULL)
+      return NULL;
+    b->next = slab->big.next;
+    b->prev = &slab->big;
+    b->next->prev = b;
+    slab->big.next = b;
+    slab->bytes_in_use += size;
+    return b + 1;
+  }
+
+  int c = slab_class(size);
+  size = slab_class_size(c);
+  slab->bytes_in_use += size;
+
+  struct slab_free *f = slab->free_list[c];
+  if (f != NULL) {
+    slab->free_list[c] = f->next;
+    return f;
+  }
+
+  if (slab->chunk == NULL || slab->chunk_used + size > SLAB_CHUNK_SIZE) {
+    struct slab_chunk *ch = malloc(SLAB_CHUNK_SIZE);
+    if (ch == NULL) {
+      slab->bytes_in_use -= size;
+      return NULL;
     }
+    ch->next = slab->chunk;
+    slab->chunk = ch;
+    slab->chunk_used = sizeof *ch;
+  }
+  void *p = (uint8_t *)slab->chunk + slab->chunk_used;
+  slab->chunk_used += size;
+  return p;
 }
 
-// Compute the CRC32 checksum
-uint32_t calc_CRC32(unsigned char *buf, int len, uint32_t prev_crc) {
-    uint32_t crc = ~prev_crc;
-    while (len--) {
-        crc = crc32_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+// size must be the size that was passed to slab_alloc()
+static void slab_free(struct slab *slab, void *p, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    struct slab_big *b = (struct slab_big *)p - 1;
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    free(b);
+    slab->bytes_in_use -= size;
+    return;
+  }
+
+  int c = slab_class(size);
+  struct slab_free *f = p;
+  f->next = slab->free_list[c];
+  slab->free_list[c] = f;
+  slab->bytes_in_use -= slab_class_size(c);
+}
+
+static void slab_init(struct slab *slab) {
+  memset(slab, 0, sizeof *slab);
+  slab->big.next = slab->big.prev = &slab->big;
+}
+
+// Hand every block of src over to dst, src is left empty. dst keeps
+// carving up its own chunk, what is left of src's is lost.
+static void slab_merge(struct slab *dst, struct slab *src) {
+  struct slab_chunk *ch = src->chunk;
+  if (ch != NULL) {
+    while (ch->next != NULL)
+      ch = ch->next;
+    if (dst->chunk == NULL) {
+      dst->chunk = src->chunk;
+      dst->chunk_used = src->chunk_used;
+    } else {
+      ch->next = dst->chunk->next;
+      dst->chunk->next = src->chunk;
     }
-    return crc ^ 0xFFFFFFFF;
+  }
+  for (int c = 0; c < SLAB_NCLASSES; c++) {
+    struct slab_free *f = src->free_list[c];
+    if (f == NULL)
+      continue;
+    while (f->next != NULL)
+      f = f->next;
+    f->next = dst->free_list[c];
+    dst->free_list[c] = src->free_list[c];
+  }
+  if (src->big.next != &src->big) {
+    src->big.next->prev = &dst->big;
+    src->big.prev->next = dst->big.next;
+    dst->big.next->prev = src->big.prev;
+    dst->big.next = src->big.next;
+  }
+  dst->bytes_in_use += src->bytes_in_use;
+  slab_init(src);
 }
 
-// Wrapper function for calculating the CRC32 for two concatenated memory blocks
-uint32_t key_and_value_CRC32(avl_key_t *k, int klen, avl_value_t *v, int vlen) {
-    uint32_t crc = 0; // Initial CRC value
-    crc = calc_CRC32(k, klen, crc);
-    crc = calc_CRC32(v, vlen, crc);
-    return crc;
+// Release every block at once
+static void slab_destroy(struct slab *slab) {
+  struct slab_chunk *ch, *next_ch;
+  for (ch = slab->chunk; ch != NULL; ch = next_ch) {
+    next_ch = ch->next;
+    free(ch);
+  }
+  struct slab_big *b, *next_b;
+  for (b = slab->big.next; b != &slab->big; b = next_b) {
+    next_b = b->next;
+    free(b);
+  }
+  slab_init(slab);
 }
 
 //
-// END CRC32
+// END Slab allocator
 //
 
 //
-// DISK IO
+// MVCC
 //
 
-static int fwrite_str(uint8_t *s, FILE *file) {
-  size_t itemsWritten = fwrite(s, strlen(s), 1, file);
-  if (itemsWritten != 1) {
-    return -1;
+// With avl_options.mvcc set, writers never change a node a reader could be
+// looking at. They copy the path from the root down to the change (see
+// node_cow()) and publish the new root with one atomic store, so readers
+// need no lock at all. Blocks dropped from the tree go onto the shard's
+// retired list and are freed by epoch based reclamation: a reader holds an
+// epoch slot while it looks at the tree, and a block is only freed once
+// every reader holding a slot entered after the change was published.
+
+static void *mvcc_grow(void *p, size_t *cap, size_t elem) {
+  size_t n = *cap ? *cap * 2 : 64;
+  p = realloc(p, n * elem);
+  if (p == NULL) {
+    perror("Failed to allocate memory for MVCC bookkeeping");
+    exit(EXIT_FAILURE);
   }
-  return 1;
+  *cap = n;
+  return p;
 }
-static int fwrite_uint32_t(uint32_t value, FILE *file) {
-  // Need to use network order for cross platform compatibility
-  size_t itemsWritten = fwrite(&value, sizeof(uint32_t), 1, file);
-  if (itemsWritten != 1) {
-    return -11;
-  }
-  return 1;
+
+// Link writers change the tree through
+static inline struct node **shard_wroot(struct shard *sh) {
+  return sh->mvcc ? &sh->work_root : &sh->root;
 }
 
-static int fwrite_uint8_t(uint8_t value, FILE *file) {
-  size_t itemsWritten = fwrite(&value, sizeof(uint8_t), 1, file);
-  if (itemsWritten != 1) {
-    return -11;
+// Give a block back to the shard's slab. frozen says the block may belong to
+// the tree a running checkpoint is writing out. Called by writers only.
+static void shard_free_block(struct shard *sh, void *p, size_t size, int frozen) {
+  if (frozen && sh->ckpt_stamp) {
+    if (sh->nfrozen == sh->frozencap)
+      sh->frozen = mvcc_grow(sh->frozen, &sh->frozencap, sizeof *sh->frozen);
+    sh->frozen[sh->nfrozen].p = p;
+    sh->frozen[sh->nfrozen].size = size;
+    sh->nfrozen++;
+    return;
   }
-  return 1;
+  if (!sh->mvcc || !sh->avl->opts.mvcc) {
+    slab_free(&sh->slab, p, size);
+    return;
+  }
+  if (sh->nretired == sh->retiredcap)
+    sh->retired = mvcc_grow(sh->retired, &sh->retiredcap, sizeof *sh->retired);
+  sh->retired[sh->nretired].p = p;
+  sh->retired[sh->nretired].size = size;
+  sh->nretired++;
 }
 
-static int fread_str(uint8_t **v, uint32_t l, FILE *file) {
-  // TODO: Maybe sanity check the string length
-  if(l==0)
-    return -1;
-  *v = malloc(l + 1);
-  size_t itemsRead = fread(*v, l, 1, file);
-  if (itemsRead != 1) {
-    free(*v);
-    *v = NULL;
-    return -1;
+// Free the retired blocks no reader can reach any more
+static void shard_reclaim(struct shard *sh) {
+  struct avltree *avl = sh->avl;
+  size_t i, n;
+
+  // Readers entering from now on can only see published trees
+  uint64_t min = __atomic_add_fetch(&avl->epoch, 1, __ATOMIC_SEQ_CST);
+  for (i = 0; i < KVDBLITE_MVCC_SLOTS; i++) {
+    uint64_t e = __atomic_load_n(&avl->slots[i].epoch, __ATOMIC_SEQ_CST);
+    if (e != 0 && e < min)
+      min = e;
   }
-  (*v)[l] = 0;
 
-  return 1;
+  // Epochs only grow along the list
+  for (n = 0; n < sh->ntagged && sh->retired[n].epoch < min; n++)
+    slab_free(&sh->slab, sh->retired[n].p, sh->retired[n].size);
+  memmove(sh->retired, sh->retired + n, (sh->nretired - n) * sizeof *sh->retired);
+  sh->nretired -= n;
+  sh->ntagged -= n;
+  // Readers that hang on to old trees leave a backlog, don't rescan it every time
+  sh->reclaim_at = sh->ntagged + (sh->ntagged / 4 > KVDBLITE_MVCC_RECLAIM ? sh->ntagged / 4
+                                                                          : KVDBLITE_MVCC_RECLAIM);
 }
 
-static int fread_uint32_t(uint32_t *value, FILE *file) {
-  size_t itemsRead = fread(value, sizeof(uint32_t), 1, file);
+// Start a change to the shard, called with sh->rwlock held exclusively
+static void shard_write_begin(struct shard *sh) {
+  if (sh->mvcc)
+    sh->work_root = sh->root;
+}
 
-  if (itemsRead != 1) {
-    return -1;
-  }
-  return 1;
+// Make the change visible to lock free readers
+static void shard_publish(struct shard *sh) {
+  size_t i;
+  if (!sh->mvcc)
+    return;
+  __atomic_store_n(&sh->root, sh->work_root, __ATOMIC_SEQ_CST);
+  for (i = 0; i < sh->ncow; i++)
+    sh->cow[i]->cow &= ~1u;
+  sh->ncow = 0;
 }
 
-static int fread_uint8_t(uint8_t *value, FILE *file) {
-  size_t itemsRead = fread(value, sizeof(uint8_t), 1, file);
+// Second half of publishing, once every shard in the change has published
+static void shard_retire_published(struct shard *sh) {
+  if (!sh->mvcc || sh->ntagged == sh->nretired)
+    return;
+  uint64_t e = __atomic_load_n(&sh->avl->epoch, __ATOMIC_SEQ_CST);
+  for (; sh->ntagged < sh->nretired; sh->ntagged++)
+    sh->retired[sh->ntagged].epoch = e;
+  if (sh->ntagged >= sh->reclaim_at)
+    shard_reclaim(sh);
+}
 
-  if (itemsRead != 1) {
-    return -1;
+static void shard_write_end(struct shard *sh) {
+  shard_publish(sh);
+  shard_retire_published(sh);
+}
+
+// Enter the current epoch, readers must stay in it while they look at nodes
+static struct epoch_slot *epoch_enter(struct avltree *avl) {
+  unsigned i = (unsigned)(((uintptr_t)pthread_self() >> 6) * 0x9e3779b1u);
+  for (;; sched_yield()) {
+    for (unsigned k = 0; k < KVDBLITE_MVCC_SLOTS; k++) {
+      struct epoch_slot *s = &avl->slots[(i + k) % KVDBLITE_MVCC_SLOTS];
+      uint64_t e = __atomic_load_n(&avl->epoch, __ATOMIC_SEQ_CST), zero = 0;
+      if (__atomic_load_n(&s->epoch, __ATOMIC_RELAXED) == 0 &&
+          __atomic_compare_exchange_n(&s->epoch, &zero, e, 0, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_RELAXED))
+        return s;
+    }
+    // More than KVDBLITE_MVCC_SLOTS readers, wait for one to leave
   }
+}
 
-  return 1;
+static void epoch_exit(struct epoch_slot *s) {
+  __atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
 }
 
-static void save_tree_to_disk(struct node *root, FILE *file) {
-  uint32_t l;
+//
+// END MVCC
+//
 
-  // First save magic number
-  uint32_t magic = 0x42473000;
-  fwrite_uint32_t(magic, file);
+//
+// Statistics
+//
 
-  if (root == NULL) {
-    l = 0;
-    fwrite_uint32_t(l, file);
-    return;
-  }
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  // Save current node's key and value
-  l = strlen(root->key);
-  fwrite_uint32_t(l, file);
-  fwrite_str(root->key, file);
+static uint64_t now_us(void) { return now_ns() / 1000; }
 
-  l = strlen(root->value);
-  fwrite_uint32_t(l, file);
-  fwrite_str(root->value, file);
+// The stripe a thread counts into, by a hash of its id. Thread ids are far
+// apart, so it is the top bits of the hash that differ.
+static inline struct stat_stripe *stat_stripe(struct avltree *avl) {
+  uint32_t h = (uint32_t)((uintptr_t)pthread_self() >> 6) * 0x9e3779b1u;
+  return &avl->stats[h >> (32 - KVDBLITE_STAT_STRIPE_BITS)];
+}
 
-  // Save CRC32 of key and value concatenated
-  fwrite_uint32_t(key_and_value_CRC32(root->key, strlen(root->key), root->value,
-                                      strlen(root->value)),
-                  file);
+static inline void hist_add(struct kvdb_histogram *h, uint64_t ns, int timed) {
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  if (timed) {
+    unsigned b = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[b < KVDB_HIST_BUCKETS ? b : KVDB_HIST_BUCKETS - 1], 1,
+                       __ATOMIC_RELAXED);
+  }
+}
 
-  // Save diff value
-  fwrite_uint32_t((uint32_t) root->diff, file);
+// Around an insert, lookup or remove, which is STAT_*
+static inline uint64_t stat_begin(struct avltree *avl) {
+  return avl->opts.stats_latency ? now_ns() : 0;
+}
 
-  // Save left subtree
-  save_tree_to_disk(root->left, file);
+static inline void stat_end(struct avltree *avl, int which, uint64_t start) {
+  hist_add(&stat_stripe(avl)->hist[which], start != 0 ? now_ns() - start : 0, start != 0);
+}
 
-  // Save right subtree
-  save_tree_to_disk(root->right, file);
+static inline void stat_count(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-int avl_save_database(struct avltree *avl) {
-  if(avl->dbname==NULL) {
-    return KVDBLITE_DBNAME_IS_NULL;
-  }
+//
+// END Statistics
+//
 
-  FILE *file = fopen(avl->dbname, "wb");
-  if (!file) {
-    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+//
+// CRC32
+//
+
+// CRC-32 with the zlib/Ethernet polynomial (reflected), used for snapshot
+// blocks, batches and journal records. calc_CRC32() runs the fastest kernel
+// the CPU has, picked once by crc_init(). Every kernel gives the same
+// result, so files don't depend on the machine that wrote them.
+
+// Tables for slicing by 8, crc32_table[0] is the byte at a time table
+static uint32_t crc32_table[8][256];
+
+static void generate_CRC32_table(void) {
+  uint32_t c;
+  for (int i = 0; i < 256; i++) {
+    c = i;
+    for (int j = 0; j < 8; j++)
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc32_table[0][i] = c;
+  }
+  for (int i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++)
+      crc32_table[k][i] = (crc32_table[k - 1][i] >> 8) ^ crc32_table[0][crc32_table[k - 1][i] & 0xff];
   }
+}
 
-  save_tree_to_disk(avl->root, file);
+// The kernels work on the inverted CRC register, see the wrappers below
+static uint32_t crc32_bytewise_reg(uint32_t c, const uint8_t *p, size_t len) {
+  while (len--)
+    c = crc32_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+  return c;
+}
 
-  fclose(file);
-  // If crash happens here, after fclose but before transaction file is truncated
-  // then at reload the transactions will be applied aghain, but they will be duplicates
-  // and have no affect on the final state of the database
-  truncate_transaction_file(avl);
-  return KVDBLITE_SUCCESS;
+// Eight table lookups per 8 bytes instead of one per byte, with no chain
+// of dependent loads between them
+static uint32_t crc32_slice8_reg(uint32_t c, const uint8_t *p, size_t len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t w;
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, sizeof w);
+    w ^= c;
+    c = crc32_table[7][w & 0xff] ^ crc32_table[6][(w >> 8) & 0xff] ^
+        crc32_table[5][(w >> 16) & 0xff] ^ crc32_table[4][(w >> 24) & 0xff] ^
+        crc32_table[3][(w >> 32) & 0xff] ^ crc32_table[2][(w >> 40) & 0xff] ^
+        crc32_table[1][(w >> 48) & 0xff] ^ crc32_table[0][w >> 56];
+  }
+#endif
+  return crc32_bytewise_reg(c, p, len);
 }
 
-static struct node *load_tree_from_disk(FILE *file) {
-  //char key[256], value[256];
-  uint32_t l, crc_calculated, crc_from_file;
-  uint8_t *v;
-  
-  // Magic number (0x42473000)
-  if (fread_uint32_t(&l, file) < 0)
-    return NULL;
-  if (l == 0)
-    return NULL;
-  if (l!=0x42473000) {
-    // Bad magic number
-    return NULL;
+#ifdef KVDBLITE_CRC_PCLMUL
+// Carry-less multiply folding ("Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ", Intel 2009): four 128 bit lanes are folded over the data
+// 64 bytes at a time, then folded into one and Barrett reduced to 32 bits.
+// len must be at least 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc32_pclmul_reg(uint32_t c, const uint8_t *p, size_t len) {
+  // x^(4*128+32) mod P, x^(4*128-32) mod P, then the same for 128, and so on
+  static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+  static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+  static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+  static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+  x0 = _mm_load_si128((const __m128i *)k1k2);
+  for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
   }
 
-  // Read the key length
-  if (fread_uint32_t(&l, file) < 0)
-    return NULL;
-  if (l == 0) {
-    // A length of zero here also marks the end of a branch
-    return NULL;
+  // Fold the four lanes into one, then any 16 byte blocks left
+  x0 = _mm_load_si128((const __m128i *)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+  for (; len >= 16; p += 16, len -= 16) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
   }
 
-  // Read the key
-  fread_str(&v, l, file);
+  // 128 bits to 64
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x00), x2);
 
-  struct node *new_node = malloc(sizeof *new_node);
-  if (!new_node) {
-    perror("Failed to allocate memory for node");
-    exit(EXIT_FAILURE);
-  }
-  new_node->key = strdup(v);
-  free(v);
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128((const __m128i *)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
 
-  // Read the value length
-  if (fread_uint32_t(&l, file) < 0)
-    return NULL;
-  // Read the value
-  fread_str(&v, l, file);
-  new_node->value = strdup(v);
-  free(v);
+static int crc32_pclmul_usable(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
 
-  // Read the CRC32 and check
-  if (fread_uint32_t(&crc_from_file, file) < 0)
-    return NULL;
-  crc_calculated = key_and_value_CRC32(new_node->key, strlen(new_node->key), new_node->value, strlen(new_node->value));
-  if (crc_calculated!=crc_from_file) {
-    // CRC error
-    return NULL;
+static uint32_t crc32_pclmul(const uint8_t *buf, size_t len, uint32_t prev_crc) {
+  uint32_t c = ~prev_crc;
+  if (len >= 64) {
+    size_t n = len & ~(size_t)15;
+    c = crc32_pclmul_reg(c, buf, n);
+    buf += n;
+    len -= n;
   }
+  return ~crc32_slice8_reg(c, buf, len);
+}
+#endif
 
-  // Load diff value
-  if (fread_uint32_t(&new_node->diff, file) < 0)
-    return NULL;
-
-  new_node->left = load_tree_from_disk(file);
-  new_node->right = load_tree_from_disk(file);
+static uint32_t crc32_bytewise(const uint8_t *buf, size_t len, uint32_t prev_crc) {
+  return ~crc32_bytewise_reg(~prev_crc, buf, len);
+}
 
-  return new_node;
+static uint32_t crc32_slice8(const uint8_t *buf, size_t len, uint32_t prev_crc) {
+  return ~crc32_slice8_reg(~prev_crc, buf, len);
 }
 
-static int load_avl_tree(struct avltree *avl, const char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (!file) {
-    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+// Slowest first. usable is NULL for kernels that run anywhere.
+struct crc_kernel {
+  const char *name;
+  uint32_t (*fn)(const uint8_t *buf, size_t len, uint32_t prev_crc);
+  int (*usable)(void);
+};
+
+static const struct crc_kernel crc_kernels[] = {
+  {"bytewise", crc32_bytewise, NULL},
+  {"slice8", crc32_slice8, NULL},
+#ifdef KVDBLITE_CRC_PCLMUL
+  {"pclmul", crc32_pclmul, crc32_pclmul_usable},
+#endif
+};
+
+static const struct crc_kernel *crc_kernel = &crc_kernels[0];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// Build the tables and pick the kernel, once per process
+static void crc_init(void) {
+  generate_CRC32_table();
+  for (size_t i = 0; i < sizeof crc_kernels / sizeof crc_kernels[0]; i++) {
+    if (crc_kernels[i].usable == NULL || crc_kernels[i].usable())
+      crc_kernel = &crc_kernels[i];
   }
+}
 
-  avl->root = load_tree_from_disk(file);
+// Compute the CRC32 checksum
+static inline uint32_t calc_CRC32(const uint8_t *buf, size_t len, uint32_t prev_crc) {
+  return crc_kernel->fn(buf, len, prev_crc);
+}
 
-  fclose(file);
-  return 0;
+// Wrapper function for calculating the CRC32 for two concatenated memory blocks
+static uint32_t key_and_value_CRC32(avl_key_t *k, int klen, avl_value_t *v, int vlen) {
+  uint32_t crc = 0; // Initial CRC value
+  crc = calc_CRC32(k, klen, crc);
+  crc = calc_CRC32(v, vlen, crc);
+  return crc;
 }
+
 //
-// END DISK
+// END CRC32
 //
 
 //
-// Journalling
+// LZ compression
 //
 
-static int truncate_transaction_file(struct avltree *avl) {
-  FILE *file = fopen(avl->journalname, "wb");
-  if (!file) {
-    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
-  }
+// Values of at least avl_options.compress_values bytes, and snapshot blocks
+// with avl_options.compress_snapshots, are compressed with a small LZ77 in
+// the LZ4 block layout. The data is a run of sequences
+//   [token][literal length][literals][le16 offset][match length]
+// where the token holds the literal length and the match length - 4 in 4
+// bits each, and 15 means the rest follows as bytes that are added up until
+// one is less than 255. The last sequence has literals only. Matches come
+// from a hash table holding the last place each 4 byte string was seen, so
+// it is built for speed rather than ratio.
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
 
-  fclose(file);
-  return KVDBLITE_SUCCESS;
+static inline uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
 }
 
-static int add_transaction(struct avltree *avl, uint8_t op, avl_key_t *key, avl_value_t *value) {
-  FILE *file = fopen(avl->journalname, "ab");
-  if (!file) {
-    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
-  }
+static inline uint64_t lz_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
 
-  // INSERT or DELETE or DONE
-  fwrite_uint8_t(op, file);
+// Bytes that are the same at the start of two 8 byte reads, x is their xor
+static inline size_t lz_first_diff(uint64_t x) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_ctzll(x) >> 3;
+#else
+  return __builtin_clzll(x) >> 3;
+#endif
+}
 
-  // KEY
-  fwrite_uint32_t((uint32_t)strlen(key), file);
-  fwrite_str(key, file);
+static inline uint32_t lz_hash(uint32_t v, int bits) { return (v * 2654435761u) >> (32 - bits); }
 
-  if (op == KVDBLITE_OP_INSERT) {
-    // VALUE
-    fwrite_uint32_t((uint32_t)strlen(value), file);
-    fwrite_str(value, file);
-  }
+// Room lz_compress() needs for n bytes that don't compress at all
+static inline size_t lz_bound(size_t n) { return n + n / 255 + 16; }
 
-  fclose(file);
-  return 0;
+static inline uint8_t *lz_put_len(uint8_t *op, size_t len) {
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (uint8_t)len;
+  return op;
 }
 
-static int debug_dump_transactions(char *journalname) {
-  uint32_t l;
-  uint8_t *v;
-
-  FILE *file = fopen(journalname, "r");
+// One sequence, 0 if it doesn't fit before oend
+static inline uint8_t *lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                                  size_t off, size_t mlen) {
+  if ((size_t)(oend - op) < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1)
+    return NULL;
+  uint8_t *token = op++;
+  *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+  if (nlit >= 15)
+    op = lz_put_len(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (off == 0)
+    return op; // The last sequence
+  *op++ = (uint8_t)off;
+  *op++ = (uint8_t)(off >> 8);
+  mlen -= LZ_MIN_MATCH;
+  *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+  if (mlen >= 15)
+    op = lz_put_len(op, mlen - 15);
+  return op;
+}
+
+// Compress src[0, n) into dst[0, cap). Returns the compressed size, 0 if it
+// didn't fit. table needs 1 << LZ_HASH_BITS entries.
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap,
+                          uint32_t *table) {
+  const uint8_t *ip = src, *anchor = src, *end = src + n, *ref, *m;
+  uint8_t *op = dst, *oend = dst + cap;
+  size_t misses = 0, off;
+  uint64_t x = 0;
+  int bits = LZ_HASH_BITS;
+
+  // Small inputs don't need the whole table, or the time to clear it
+  while (bits > 8 && ((size_t)1 << (bits - 2)) >= n)
+    bits--;
+  memset(table, 0, sizeof *table << bits);
+  while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+    uint32_t seq = lz_read32(ip), h = lz_hash(seq, bits);
+    ref = src + table[h];
+    table[h] = (uint32_t)(ip - src);
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+      ip += 1 + (misses++ >> 6); // Speed up through data that doesn't compress
+      continue;
+    }
+    misses = 0;
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    off = ip - ref;
+    m = ip + LZ_MIN_MATCH;
+    // 8 bytes at a time, then the first byte that differs
+    while (end - m >= 8 && (x = lz_read64(m) ^ lz_read64(m - off)) == 0)
+      m += 8;
+    if (end - m >= 8)
+      m += lz_first_diff(x);
+    else
+      while (m < end && *m == m[-off])
+        m++;
+    if ((op = lz_put_seq(op, oend, anchor, ip - anchor, off, m - ip)) == NULL)
+      return 0;
+    ip = anchor = m;
+    if (m - 2 > src && m - 2 <= end - LZ_MIN_MATCH)
+      table[lz_hash(lz_read32(m - 2), bits)] = (uint32_t)(m - 2 - src);
+  }
+  if ((op = lz_put_seq(op, oend, anchor, end - anchor, 0, 0)) == NULL)
+    return 0;
+  return op - dst;
+}
+
+static inline int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+// Decompress src[0, n) into dst, which it must fill exactly. Returns 0, or -1
+// if the data is malformed.
+static int lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t dlen) {
+  const uint8_t *ip = src, *iend = src + n, *m;
+  uint8_t *op = dst, *oend = dst + dlen, *e;
+  size_t len, off;
+
+  for (;;) {
+    if (ip >= iend)
+      return -1;
+    uint8_t token = *ip++;
+    if ((len = token >> 4) == 15 && lz_get_len(&ip, iend, &len) < 0)
+      return -1;
+    if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+      return -1;
+    // Short runs are copied 16 bytes at a time where there is room, what
+    // goes past the end is overwritten next
+    if (len <= 16 && iend - ip >= 16 && oend - op >= 16)
+      memcpy(op, ip, 16);
+    else
+      memcpy(op, ip, len);
+    ip += len;
+    op += len;
+    if (ip == iend)
+      return op == oend ? 0 : -1;
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if (off == 0 || off > (size_t)(op - dst))
+      return -1;
+    if ((len = token & 15) == 15 && lz_get_len(&ip, iend, &len) < 0)
+      return -1;
+    len += LZ_MIN_MATCH;
+    if ((size_t)(oend - op) < len)
+      return -1;
+    m = op - off;
+    e = op + len;
+    if (off >= 16 && (size_t)(oend - op) >= len + 16) {
+      for (; op < e; op += 16, m += 16)
+        memcpy(op, m, 16);
+      op = e;
+    } else if (off >= 8 && (size_t)(oend - op) >= len + 8) {
+      for (; op < e; op += 8, m += 8)
+        memcpy(op, m, 8);
+      op = e;
+    } else {
+      // A run, the match overlaps what it writes
+      while (len-- > 0)
+        *op++ = *m++;
+    }
+  }
+}
+
+// Every thread gets buffers to compress values into and to decompress them
+// into for views, see node_view(), and to read the value log into
+struct lz_scratch {
+  uint8_t *pack, *view, *fetch;
+  size_t packcap, viewcap, fetchcap;
+  uint8_t ref[KVDBLITE_VLOG_REF];
+  uint32_t table[1 << LZ_HASH_BITS];
+};
+
+static pthread_key_t lz_key;
+static pthread_once_t lz_once = PTHREAD_ONCE_INIT;
+
+static void lz_scratch_free(void *arg) {
+  struct lz_scratch *s = arg;
+  free(s->pack);
+  free(s->view);
+  free(s->fetch);
+  free(s);
+}
+
+static void lz_key_init(void) { pthread_key_create(&lz_key, lz_scratch_free); }
+
+static struct lz_scratch *lz_scratch(void) {
+  pthread_once(&lz_once, lz_key_init);
+  struct lz_scratch *s = pthread_getspecific(lz_key);
+  if (s == NULL && (s = calloc(1, sizeof *s)) != NULL && pthread_setspecific(lz_key, s) != 0) {
+    free(s);
+    s = NULL;
+  }
+  return s;
+}
+
+// Make *buf at least need bytes
+static uint8_t *lz_grow(uint8_t **buf, size_t *cap, size_t need) {
+  if (need > *cap) {
+    uint8_t *p = realloc(*buf, need);
+    if (p == NULL)
+      return NULL;
+    *buf = p;
+    *cap = need;
+  }
+  return *buf;
+}
+
+//
+// END LZ
+//
+
+//
+// DISK IO
+//
+
+static int fwrite_str(uint8_t *s, uint32_t l, FILE *file) {
+  if (l == 0)
+    return 1;
+  size_t itemsWritten = fwrite(s, l, 1, file);
+  if (itemsWritten != 1) {
+    return -1;
+  }
+  return 1;
+}
+static int fwrite_uint32_t(uint32_t value, FILE *file) {
+  uint8_t b[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16),
+                  (uint8_t)(value >> 24)};
+  size_t itemsWritten = fwrite(b, sizeof b, 1, file);
+  if (itemsWritten != 1) {
+    return -11;
+  }
+  return 1;
+}
+
+// Reads l bytes into a new buffer, which is NUL terminated for convenience.
+// Zero length strings are fine (empty values).
+static int fread_str(uint8_t **v, uint32_t l, FILE *file) {
+  // TODO: Maybe sanity check the string length
+  *v = malloc(l + 1);
+  if (*v == NULL)
+    return -1;
+  if (l > 0 && fread(*v, l, 1, file) != 1) {
+    free(*v);
+    *v = NULL;
+    return -1;
+  }
+  (*v)[l] = 0;
+
+  return 1;
+}
+
+static int fread_uint32_t(uint32_t *value, FILE *file) {
+  uint8_t b[4];
+  size_t itemsRead = fread(b, sizeof b, 1, file);
+
+  if (itemsRead != 1) {
+    return -1;
+  }
+  *value = (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+  return 1;
+}
+
+static int fread_uint8_t(uint8_t *value, FILE *file) {
+  size_t itemsRead = fread(value, sizeof(uint8_t), 1, file);
+
+  if (itemsRead != 1) {
+    return -1;
+  }
+
+  return 1;
+}
+
+// Fixed width fields in files are little endian whatever the machine. Files
+// written before this were in the machine's order, which is the same on x86
+// and ARM.
+static inline void put_le32(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+  p[2] = (uint8_t)(value >> 16);
+  p[3] = (uint8_t)(value >> 24);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void put_le64(uint8_t *p, uint64_t value) {
+  put_le32(p, (uint32_t)value);
+  put_le32(p + 4, (uint32_t)(value >> 32));
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+  return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+// LEB128: 7 bits a byte, lowest first, the top bit set on all but the last.
+// A 32 bit value takes 1 to 5 bytes.
+#define VARINT_MAX 5
+
+static inline size_t varint_size(uint32_t value) {
+  size_t n = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static inline size_t varint_put(uint8_t *p, uint32_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    p[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  p[n++] = (uint8_t)value;
+  return n;
+}
+
+// Returns the bytes used, 0 if p[0, len) doesn't start with a valid varint
+static inline size_t varint_get(const uint8_t *p, size_t len, uint32_t *value) {
+  uint32_t v = 0;
+  for (size_t i = 0; i < len && i < VARINT_MAX; i++) {
+    v |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+    if (!(p[i] & 0x80)) {
+      if (i == VARINT_MAX - 1 && p[i] > 0x0f)
+        return 0; // More than 32 bits
+      *value = v;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static int fread_varint(uint32_t *value, FILE *file) {
+  uint8_t buf[VARINT_MAX];
+  for (size_t i = 0; i < VARINT_MAX; i++) {
+    if (fread_uint8_t(&buf[i], file) < 0)
+      return -1;
+    if (!(buf[i] & 0x80))
+      return varint_get(buf, i + 1, value) ? 1 : -1;
+  }
+  return -1;
+}
+
+// Snapshot format 2: a header of [magic][u64 count][u32 CRC32 of the two],
+// then the entries in key order packed into blocks of
+//   [u32 len][u32 n][n x ([u32 klen][u32 vlen][key][value])][u32 CRC32]
+// with len covering the entries. Then the index, the u64 file offset of
+// every entry in key order, so read only databases can binary search the
+// file in place (see map_snapshot()), and the block index, a
+// [u64 offset][u64 first entry] pair per block, so blocks can be loaded in
+// parallel. The footer is
+//   [u64 batch][u64 block index offset][u64 blocks][u64 index offset]
+//   [u64 count][u32 KVDBLITE_SNAP_BATCH_MAGIC][u32 CRC32]
+// where batch is the last batch of several shards the snapshot holds a part
+// of (see kvdb_write_batch_commit()). Files written before that end in the
+// same without batch and with KVDBLITE_SNAP_BLOCKS_MAGIC, files written
+// before the block index in the last 24 bytes of that with
+// KVDBLITE_SNAP_INDEX_MAGIC. Format 1 files (a preorder dump, one record per
+// node, starting with 0x42473000) can still be loaded.
+//
+// Format 3 (avl_options.compact_snapshots) starts with KVDBLITE_SNAP3_MAGIC
+// and has no entry index, the index offset in the footer is the block index
+// offset. Its entries are
+//   [varint shared][varint klen - shared][varint vlen][key from shared][value]
+// where shared is how many leading bytes the key has in common with the key
+// before it. It is 0 for the first entry of a block and every
+// KVDBLITE_SNAP_RESTART entries after that, so every block can be decoded
+// on its own, and a long run of similar keys doesn't chain every key to the
+// start of the block. Read only databases load format 3 files instead of
+// mapping them.
+//
+// With avl_options.compress_snapshots, format 3 blocks are LZ compressed
+// when that saves at least a sixteenth. Their len has KVDBLITE_SNAP_LZ set
+// and the entries are replaced by [u32 length of the entries][LZ data], the
+// CRC32 covers what is in the file. With avl_options.compress_values, values
+// kept compressed in memory go into format 3 blocks as they are, so neither
+// saving nor loading has to touch them. Such blocks have
+// KVDBLITE_SNAP_ZVALUES set in len, shared becomes shared * 2 + 1 for a
+// compressed value and shared * 2 for any other, and a compressed value is
+// [u32 length][LZ data] with vlen the length it decompresses to. Shards with
+// a value log write KVDBLITE_SNAP_VLOG blocks instead, where shared is
+// shared * 4 + 2 for a value in the log, plus 1 if it is compressed there,
+// and the value is its KVDBLITE_VLOG_REF byte reference. The flags leave
+// format 3 blocks under 512 MiB.
+//
+// Fixed width fields are little endian in formats 2 and 3.
+struct snap_writer {
+  struct shard *sh;
+  FILE *file;
+  uint8_t *buf;
+  size_t len, cap;
+  uint32_t n;       // Entries in buf
+  uint64_t pos;     // File offset of the block in buf
+  uint64_t entries; // Entries in the blocks written so far
+  uint64_t *blocks; // Block index, two u64 per block
+  size_t nblocks, blockscap;
+  int indexing;     // Second pass, only writes the offsets of the entries
+  int compact;      // Format 3
+  struct node *prev; // Format 3: the entry before, for the shared prefix
+  int compress;      // LZ compress the blocks into zbuf
+  int kinds;         // Bits of shared that say how the value is stored, see snap_shared_field()
+  uint8_t *zbuf;
+  size_t zcap;
+  int err;
+};
+
+static void snap_flush_block(struct snap_writer *w) {
+  uint8_t head[8], crc[4], *data = w->buf;
+  size_t len = w->len, room = w->len - w->len / 16, zlen;
+  uint32_t flag = w->kinds == 2 ? KVDBLITE_SNAP_VLOG : w->kinds ? KVDBLITE_SNAP_ZVALUES : 0;
+  struct lz_scratch *s;
+
+  if (w->n == 0)
+    return;
+  if (w->compact && w->len > ~KVDBLITE_SNAP_FLAGS) {
+    w->err = KVDBLITE_DB_WRITE_ERR;
+    return;
+  }
+  if (!w->indexing) {
+    if (w->nblocks == w->blockscap) {
+      size_t cap = w->blockscap ? w->blockscap * 2 : 256;
+      uint64_t *p = realloc(w->blocks, cap * 2 * sizeof *p);
+      if (p == NULL) {
+        w->err = KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+        return;
+      }
+      w->blocks = p;
+      w->blockscap = cap;
+    }
+    w->blocks[2 * w->nblocks] = w->pos;
+    w->blocks[2 * w->nblocks + 1] = w->entries;
+    w->nblocks++;
+    // Compressed if that saves a sixteenth
+    if (w->compress && room > 4 && (s = lz_scratch()) != NULL &&
+        lz_grow(&w->zbuf, &w->zcap, room) != NULL &&
+        (zlen = lz_compress(w->buf, w->len, w->zbuf + 4, room - 4, s->table)) > 0) {
+      put_le32(w->zbuf, (uint32_t)w->len);
+      data = w->zbuf;
+      len = 4 + zlen;
+      flag |= KVDBLITE_SNAP_LZ;
+    }
+    put_le32(head, (uint32_t)len | flag);
+    put_le32(head + 4, w->n);
+    put_le32(crc, calc_CRC32(data, len, 0));
+    if (fwrite_str(head, sizeof head, w->file) < 0 ||
+        fwrite_str(data, (uint32_t)len, w->file) < 0 ||
+        fwrite_str(crc, sizeof crc, w->file) < 0)
+      w->err = KVDBLITE_DB_WRITE_ERR;
+  }
+  w->entries += w->n;
+  w->pos += 8 + len + 4;
+  w->len = 0;
+  w->n = 0;
+}
+
+// Format 3: bytes of a's key to take from the entry before, 0 at a restart
+static uint32_t snap_shared(const struct snap_writer *w, const struct node *a) {
+  uint32_t i = 0, n;
+  if (w->n % KVDBLITE_SNAP_RESTART == 0)
+    return 0;
+  n = a->klen < w->prev->klen ? a->klen : w->prev->klen;
+  if (n > UINT32_MAX >> w->kinds)
+    return 0; // shared shifted by kinds has to fit
+  while (i < n && a->key[i] == w->prev->key[i])
+    i++;
+  return i;
+}
+
+// Format 3: the shared field, and the bytes the value takes. Values that
+// are compressed or in the value log are written as they are stored.
+static inline uint32_t snap_shared_field(const struct snap_writer *w, const struct node *a,
+                                         uint32_t shared) {
+  return w->kinds ? shared << w->kinds | a->logged << 1 | a->zvalue : shared;
+}
+
+static inline int snap_as_stored(const struct snap_writer *w, const struct node *a) {
+  return w->kinds && (a->zvalue || a->logged);
+}
+
+static inline size_t snap_value_size(const struct snap_writer *w, const struct node *a) {
+  return snap_as_stored(w, a) ? node_value_bytes(a) : a->vlen;
+}
+
+static inline size_t snap_compact_size(const struct snap_writer *w, const struct node *a,
+                                       uint32_t shared) {
+  return varint_size(snap_shared_field(w, a, shared)) + varint_size(a->klen - shared) +
+         varint_size(a->vlen) + a->klen - shared + snap_value_size(w, a);
+}
+
+static void snap_add(struct snap_writer *w, struct node *a) {
+  uint32_t shared = w->compact ? snap_shared(w, a) : 0;
+  size_t need = w->compact ? snap_compact_size(w, a, shared) : 8 + (size_t)a->klen + a->vlen;
+  if (w->len + need > w->cap) {
+    snap_flush_block(w);
+    if (w->compact)
+      need = snap_compact_size(w, a, shared = 0); // A new block starts with a full key
+    if (need > w->cap) {
+      // An entry larger than a block gets a block of its own
+      uint8_t *p = w->indexing ? w->buf : realloc(w->buf, need);
+      if (p == NULL) {
+        w->err = KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+        return;
+      }
+      w->buf = p;
+      w->cap = need;
+    }
+  }
+  if (w->indexing) {
+    // Lays out the blocks exactly like the first pass
+    uint8_t off[8];
+    put_le64(off, w->pos + 8 + w->len);
+    if (fwrite_str(off, sizeof off, w->file) < 0)
+      w->err = KVDBLITE_DB_WRITE_ERR;
+    w->len += need;
+    w->n++;
+    return;
+  }
+  uint8_t *p = w->buf + w->len;
+  if (w->compact) {
+    p += varint_put(p, snap_shared_field(w, a, shared));
+    p += varint_put(p, a->klen - shared);
+    p += varint_put(p, a->vlen);
+    memcpy(p, a->key + shared, a->klen - shared);
+    p += a->klen - shared;
+    w->prev = a;
+    if (snap_as_stored(w, a)) {
+      memcpy(p, a->value, node_value_bytes(a));
+      w->len += need;
+      w->n++;
+      return;
+    }
+  } else {
+    put_le32(p, a->klen);
+    put_le32(p + 4, a->vlen);
+    memcpy(p + 8, a->key, a->klen);
+    p += 8 + a->klen;
+  }
+  if (node_value_copy(w->sh, a, p) < 0)
+    w->err = KVDBLITE_UNEXPECTED_EOF;
+  w->len += need;
+  w->n++;
+}
+
+// In order, recursion depth is bounded by the tree height
+static void snap_add_tree(struct snap_writer *w, struct node *a) {
+  for (; a != NULL && w->err == KVDBLITE_SUCCESS; a = a->right) {
+    snap_add_tree(w, a->left);
+    snap_add(w, a);
+  }
+}
+
+// What a snapshot is written from: the AVL tree at root, or for the B+tree
+// its n entries in order, and the shard's batch_id at the time
+struct snap_source {
+  struct node *root;
+  struct node **ents;
+  size_t n;
+  uint64_t batch;
+};
+
+static void snap_add_shard(struct snap_writer *w, struct shard *sh, const struct snap_source *src) {
+  if (!sh->btree) {
+    snap_add_tree(w, src->root);
+    return;
+  }
+  for (size_t i = 0; i < src->n && w->err == KVDBLITE_SUCCESS; i++)
+    snap_add(w, src->ents[i]);
+}
+
+static int save_tree_to_disk(struct shard *sh, const struct snap_source *src, FILE *file) {
+  struct snap_writer w = {.sh = sh, .file = file, .buf = malloc(KVDBLITE_SNAP_BLOCK),
+                          .cap = KVDBLITE_SNAP_BLOCK, .pos = 16,
+                          .compact = sh->avl->opts.compact_snapshots != 0,
+                          .compress = sh->avl->opts.compress_snapshots != 0,
+                          .kinds = sh->vlog != NULL ? 2 : sh->avl->opts.compress_values != 0};
+  uint8_t header[16], footer[48];
+  uint64_t i;
+
+  if (w.buf == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  // No entry index to point into compressed blocks, no room for references
+  if (w.compress || sh->vlog != NULL)
+    w.compact = 1;
+  if (!w.compact)
+    w.kinds = 0;
+  uint64_t count = sh->btree ? src->n : src->root == NULL ? 0 : src->root->size;
+  put_le32(header, w.compact ? KVDBLITE_SNAP3_MAGIC : KVDBLITE_SNAP_MAGIC);
+  put_le64(header + 4, count);
+  put_le32(header + 12, calc_CRC32(header, 12, 0));
+  if (fwrite_str(header, sizeof header, file) < 0)
+    w.err = KVDBLITE_DB_WRITE_ERR;
+
+  snap_add_shard(&w, sh, src);
+  if (w.err == KVDBLITE_SUCCESS)
+    snap_flush_block(&w);
+
+  uint64_t index_off = w.pos, blocks_off = index_off, nblocks = w.nblocks;
+  if (!w.compact) {
+    w.len = w.n = 0;
+    w.pos = 16;
+    w.cap = KVDBLITE_SNAP_BLOCK;
+    w.indexing = 1;
+    snap_add_shard(&w, sh, src);
+    blocks_off += count * 8;
+  }
+
+  for (i = 0; i < 2 * nblocks; i++)
+    put_le64((uint8_t *)&w.blocks[i], w.blocks[i]);
+  if (w.err == KVDBLITE_SUCCESS && nblocks > 0 &&
+      fwrite(w.blocks, 2 * sizeof *w.blocks, nblocks, file) != nblocks)
+    w.err = KVDBLITE_DB_WRITE_ERR;
+  put_le64(footer, src->batch);
+  put_le64(footer + 8, blocks_off);
+  put_le64(footer + 16, nblocks);
+  put_le64(footer + 24, index_off);
+  put_le64(footer + 32, count);
+  put_le32(footer + 40, KVDBLITE_SNAP_BATCH_MAGIC);
+  put_le32(footer + 44, calc_CRC32(footer, 44, 0));
+  if (w.err == KVDBLITE_SUCCESS && fwrite_str(footer, sizeof footer, file) < 0)
+    w.err = KVDBLITE_DB_WRITE_ERR;
+  free(w.buf);
+  free(w.zbuf);
+  free(w.blocks);
+  return w.err;
+}
+
+// Size of a file, 0 if it isn't there
+static uint64_t file_size(const char *fn) {
+  struct stat st;
+  return stat(fn, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+// Make a rename or a new file in the directory holding path durable
+static int fsync_parent_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+  int fd, rc = KVDBLITE_SUCCESS;
+
+  if (dir == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  fd = open(dir, O_RDONLY | O_DIRECTORY);
+  free(dir);
+  if (fd < 0)
+    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  if (fsync(fd) < 0)
+    rc = KVDBLITE_DB_WRITE_ERR;
+  close(fd);
+  return rc;
+}
+
+// Write the tree to <dbname>.tmp, fsync it and rename it over the database
+// file, so a crash part way through leaves the previous snapshot alone
+static int write_snapshot_file(struct shard *sh, const struct snap_source *src) {
+  char *tmpname = malloc(strlen(sh->dbname) + 5);
+  int rc = KVDBLITE_SUCCESS;
+
+  if (tmpname == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  sprintf(tmpname, "%s.tmp", sh->dbname);
+  FILE *file = fopen(tmpname, "wb");
   if (!file) {
+    free(tmpname);
     return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
   }
 
-  uint8_t op;
+  rc = save_tree_to_disk(sh, src, file);
+
+  // The journal records this replaces are deleted next, so always fsync
+  if (rc == KVDBLITE_SUCCESS && (fflush(file) != 0 || ferror(file) || fsync(fileno(file)) < 0))
+    rc = KVDBLITE_DB_WRITE_ERR;
+  if (fclose(file) != 0 && rc == KVDBLITE_SUCCESS)
+    rc = KVDBLITE_DB_WRITE_ERR;
+  if (rc == KVDBLITE_SUCCESS && rename(tmpname, sh->dbname) < 0)
+    rc = KVDBLITE_DB_WRITE_ERR;
+  if (rc < 0)
+    unlink(tmpname);
+  free(tmpname);
+  if (rc < 0)
+    return rc;
+  return fsync_parent_dir(sh->dbname);
+}
+
+static struct node *load_tree_from_disk(struct shard *sh, FILE *file) {
+  //char key[256], value[256];
+  uint32_t l, klen, crc_calculated, crc_from_file, diff;
+  uint8_t *key, *value;
+  
+  // Magic number (0x42473000)
+  if (fread_uint32_t(&l, file) < 0)
+    return NULL;
+  if (l == 0)
+    return NULL;
+  if (l!=0x42473000) {
+    // Bad magic number
+    return NULL;
+  }
+
+  // Read the key length
+  if (fread_uint32_t(&l, file) < 0)
+    return NULL;
+  if (l == 0) {
+    // A length of zero here also marks the end of a branch
+    return NULL;
+  }
+
+  // Read the key
+  if (fread_str(&key, l, file) < 0)
+    return NULL;
+  klen = l;
+
+  // Read the value length and the value
+  if (fread_uint32_t(&l, file) < 0 || fread_str(&value, l, file) < 0) {
+    free(key);
+    return NULL;
+  }
+
+  // Read the CRC32 and check
+  if (fread_uint32_t(&crc_from_file, file) < 0) {
+    free(key);
+    free(value);
+    return NULL;
+  }
+  crc_calculated = key_and_value_CRC32(key, klen, value, l);
+  if (crc_calculated!=crc_from_file) {
+    // CRC error
+    free(key);
+    free(value);
+    return NULL;
+  }
+
+  struct node *new_node = node_make(sh, key, klen, value, l);
+  free(key);
+  free(value);
+  if (!new_node) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+
+  // Load diff value
+  if (fread_uint32_t(&diff, file) < 0)
+    return NULL;
+  new_node->diff = (int)diff;
+
+  new_node->left = load_tree_from_disk(sh, file);
+  new_node->right = load_tree_from_disk(sh, file);
+  fix_size(new_node);
+
+  return new_node;
+}
+
+// The end of a format 2 or 3 file. nblocks is 0 for files written before
+// the block index.
+struct snap_footer {
+  uint64_t blocks_off, nblocks;
+  uint64_t index_off, count;
+  uint64_t batch;
+};
+
+// Returns 1 if the file ends in a footer that checks out. A compact (format
+// 3) file has no entry index.
+static int snap_read_footer(int fd, uint64_t size, struct snap_footer *f, int compact) {
+  uint8_t footer[44], tail[8];
+  uint32_t magic, crc;
+  size_t len;
+
+  if (size < 16 + 24 || pread(fd, tail, 8, size - 8) != 8)
+    return 0;
+  magic = get_le32(tail);
+  crc = get_le32(tail + 4);
+  if (magic == KVDBLITE_SNAP_BATCH_MAGIC)
+    len = 44;
+  else if (magic == KVDBLITE_SNAP_BLOCKS_MAGIC)
+    len = 36;
+  else if (magic == KVDBLITE_SNAP_INDEX_MAGIC && !compact)
+    len = 20;
+  else
+    return 0;
+  if (size < 16 + len + 4 || pread(fd, footer, len, size - len - 4) != (ssize_t)len ||
+      crc != calc_CRC32(footer, len, 0))
+    return 0;
+  memset(f, 0, sizeof *f);
+  if (len == 44)
+    f->batch = get_le64(footer);
+  if (len >= 36) {
+    f->blocks_off = get_le64(footer + len - 36);
+    f->nblocks = get_le64(footer + len - 28);
+  }
+  f->index_off = get_le64(footer + len - 20);
+  f->count = get_le64(footer + len - 12);
+
+  uint64_t index_end = len >= 36 ? f->blocks_off : size - 24;
+  if (f->count > UINT32_MAX || f->index_off < 16 || index_end > size ||
+      f->index_off + (compact ? 0 : f->count * 8) != index_end)
+    return 0;
+  return len == 20 ||
+         (f->nblocks <= (size - index_end) / 16 && index_end + f->nblocks * 16 + len + 4 == size);
+}
+
+static inline int balanced_height(size_t n) { return n == 0 ? 0 : 64 - __builtin_clzll(n); }
+
+// Link nodes[0, n), which are in key order, into a perfectly balanced tree.
+// The two halves of every subtree differ in size by at most one, so their
+// heights follow from the sizes and so does diff.
+static struct node *build_balanced(struct node **nodes, size_t n) {
+  if (n == 0)
+    return NULL;
+  size_t m = (n - 1) / 2;
+  struct node *a = nodes[m];
+  a->left = build_balanced(nodes, m);
+  a->right = build_balanced(nodes + m + 1, n - m - 1);
+  a->size = (uint32_t)n;
+  a->diff = balanced_height(n - m - 1) - balanced_height(m);
+  return a;
+}
+
+// Index nodes[0, n), which are in key order, with the shard's engine
+static void shard_build(struct shard *sh, struct node **nodes, size_t n) {
+  hidx_build(sh, nodes, n);
+  if (!sh->btree) {
+    sh->root = build_balanced(nodes, n);
+  } else if (bt_build(sh, nodes, n) < 0) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Format 3 entries, the key is put together in key from the part shared with
+// the node before and the rest. The first entry can't share anything. The
+// low kinds bits of shared say how the value is stored, compressed values and
+// value log references are taken as they are.
+static uint32_t snap_parse_compact(struct shard *sh, const uint8_t *buf, uint32_t len, uint32_t n,
+                                   struct node **nodes, int kinds) {
+  uint32_t i, shared, rest, vlen;
+  size_t off = 0, a, b, c, cap = 0, vsize;
+  uint8_t *key = NULL;
+  int z = 0, logged = 0;
+
+  for (i = 0; i < n; i++) {
+    if (!(a = varint_get(buf + off, len - off, &shared)) ||
+        !(b = varint_get(buf + off + a, len - off - a, &rest)) ||
+        !(c = varint_get(buf + off + a + b, len - off - a - b, &vlen)))
+      break;
+    off += a + b + c;
+    if (kinds) {
+      z = shared & 1;
+      logged = kinds == 2 && (shared & 2);
+      shared >>= kinds;
+    }
+    vsize = logged ? KVDBLITE_VLOG_REF : vlen;
+    if (logged && sh->vlog == NULL)
+      break;
+    if (z && !logged &&
+        (rest > len - off || len - off - rest < 4 ||
+         (vsize = 4 + (size_t)get_le32(buf + off + rest)) > len - off - rest || vlen / 255 > vsize))
+      break;
+    if ((uint64_t)rest + vsize > len - off || (i == 0 ? shared > 0 : shared > nodes[i - 1]->klen) ||
+        (uint64_t)shared + rest > UINT32_MAX)
+      break;
+    if (shared + rest > cap) {
+      uint8_t *p = realloc(key, shared + rest);
+      if (p == NULL)
+        break;
+      key = p;
+      cap = shared + rest;
+    }
+    if (shared > 0)
+      memcpy(key, nodes[i - 1]->key, shared);
+    memcpy(key + shared, buf + off, rest);
+    if (z || logged)
+      nodes[i] = node_make_packed(sh, key, shared + rest, buf + off + rest, vsize,
+                                  logged << 1 | z, vlen);
+    else
+      nodes[i] = node_make(sh, key, shared + rest, buf + off + rest, vlen);
+    if (nodes[i] == NULL) {
+      perror("Failed to allocate memory for node");
+      exit(EXIT_FAILURE);
+    }
+    off += (size_t)rest + vsize;
+  }
+  free(key);
+  return i;
+}
+
+// Make nodes for the n entries of a block whose CRC checked out. Returns how
+// many were made, fewer than n if the block is malformed.
+static uint32_t snap_parse_block(struct shard *sh, const uint8_t *buf, uint32_t len, uint32_t n,
+                                 struct node **nodes, int compact, uint32_t flags) {
+  uint32_t i, klen, vlen;
+  size_t off = 0;
+
+  if (compact)
+    return snap_parse_compact(sh, buf, len, n, nodes,
+                              flags & KVDBLITE_SNAP_VLOG      ? 2
+                              : flags & KVDBLITE_SNAP_ZVALUES ? 1
+                                                              : 0);
+  for (i = 0; i < n; i++) {
+    if (len - off < 8)
+      break;
+    klen = get_le32(buf + off);
+    vlen = get_le32(buf + off + 4);
+    off += 8;
+    if ((uint64_t)klen + vlen > len - off)
+      break;
+    nodes[i] = node_make(sh, buf + off, klen, buf + off + klen, vlen);
+    if (nodes[i] == NULL) {
+      perror("Failed to allocate memory for node");
+      exit(EXIT_FAILURE);
+    }
+    off += (size_t)klen + vlen;
+  }
+  return i;
+}
+
+// The entries of a block whose CRC checked out: buf itself, or if flags has
+// KVDBLITE_SNAP_LZ set what it decompresses to in *out. *len goes from the
+// length in the file to the length of the entries. NULL if the block is
+// malformed or out of memory.
+static const uint8_t *snap_block_data(const uint8_t *buf, uint32_t *len, uint32_t flags,
+                                      uint8_t **out, size_t *cap) {
+  uint32_t stored = *len, raw;
+  if (!(flags & KVDBLITE_SNAP_LZ))
+    return buf;
+  // LZ can't expand data more than 255 times
+  if (stored < 4 || (raw = get_le32(buf)) / 255 > stored ||
+      lz_grow(out, cap, raw > 0 ? raw : 1) == NULL ||
+      lz_decompress(buf + 4, stored - 4, *out, raw) < 0)
+    return NULL;
+  *len = raw;
+  return *out;
+}
+
+// Loads blocks [b, e) of a file with a block index. Each worker makes its
+// nodes in a slab of its own, the shard takes the slabs over at the end.
+struct load_worker {
+  struct shard part; // Only the slab and the value log are used
+  int fd;
+  const uint64_t *blocks; // The block index
+  uint64_t nblocks, b, e;
+  uint64_t end;   // Offset of the entry index, where the last block stops
+  uint64_t count; // Entries in the file
+  int compact;    // Format 3
+  struct node **nodes;
+  uint64_t filled; // nodes[first entry of block b, filled) were made
+  int rc;
+  int started;
+  pthread_t thread;
+};
+
+static void *load_worker_run(void *arg) {
+  struct load_worker *w = arg;
+  uint8_t *buf = NULL, *raw = NULL;
+  const uint8_t *data;
+  size_t cap = 0, rawcap = 0;
+  uint32_t len, n, crc, flags;
+
+  w->filled = w->b < w->nblocks ? w->blocks[2 * w->b + 1] : w->count;
+  for (uint64_t b = w->b; b < w->e; b++) {
+    uint64_t off = w->blocks[2 * b], first = w->blocks[2 * b + 1];
+    uint64_t size = (b + 1 < w->nblocks ? w->blocks[2 * b + 2] : w->end) - off;
+    uint64_t want = (b + 1 < w->nblocks ? w->blocks[2 * b + 3] : w->count) - first;
+    if (size > cap) {
+      uint8_t *p = realloc(buf, size);
+      if (p == NULL) {
+        w->rc = KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+        break;
+      }
+      buf = p;
+      cap = size;
+    }
+    if (pread(w->fd, buf, size, off) != (ssize_t)size) {
+      w->rc = KVDBLITE_UNEXPECTED_EOF;
+      break;
+    }
+    len = get_le32(buf);
+    n = get_le32(buf + 4);
+    flags = w->compact ? len & KVDBLITE_SNAP_FLAGS : 0;
+    len ^= flags;
+    if (len == size - 12)
+      crc = get_le32(buf + size - 4);
+    if (len != size - 12 || n != want || crc != calc_CRC32(buf + 8, size - 12, 0) ||
+        (data = snap_block_data(buf + 8, &len, flags, &raw, &rawcap)) == NULL) {
+      w->rc = KVDBLITE_UNEXPECTED_EOF;
+      break;
+    }
+    uint32_t made = snap_parse_block(&w->part, data, len, n, w->nodes + first, w->compact, flags);
+    w->filled = first + made;
+    if (made < n) {
+      w->rc = KVDBLITE_UNEXPECTED_EOF;
+      break;
+    }
+  }
+  free(buf);
+  free(raw);
+  return NULL;
+}
+
+// The block index, if it describes count entries in blocks laid out one
+// after the other between the header and the entry index
+static uint64_t *snap_read_blocks(int fd, const struct snap_footer *f, uint64_t count) {
+  if (f->nblocks == 0 || f->count != count)
+    return NULL;
+  uint64_t *blocks = malloc(f->nblocks * 16);
+  if (blocks == NULL)
+    return NULL;
+  if (pread(fd, blocks, f->nblocks * 16, f->blocks_off) != (ssize_t)(f->nblocks * 16)) {
+    free(blocks);
+    return NULL;
+  }
+  for (uint64_t b = 0; b < 2 * f->nblocks; b++)
+    blocks[b] = get_le64((const uint8_t *)&blocks[b]);
+  if (blocks[0] != 16 || blocks[1] != 0) {
+    free(blocks);
+    return NULL;
+  }
+  for (uint64_t b = 0; b < f->nblocks; b++) {
+    uint64_t next = b + 1 < f->nblocks ? blocks[2 * b + 2] : f->index_off;
+    uint64_t last = b + 1 < f->nblocks ? blocks[2 * b + 3] : count;
+    if (next < blocks[2 * b] + 12 || next - blocks[2 * b] - 12 > UINT32_MAX ||
+        last <= blocks[2 * b + 1] || last > count) {
+      free(blocks);
+      return NULL;
+    }
+  }
+  return blocks;
+}
+
+static unsigned load_threads(struct avltree *avl) {
+  if (avl->opts.load_threads > 0)
+    return avl->opts.load_threads;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned)n : 1;
+}
+
+// Like load_sorted_snapshot(), with the blocks spread over threads. A bad
+// block still ends the load, the entries before it are kept.
+static int load_snapshot_blocks(struct shard *sh, int fd, const struct snap_footer *f,
+                                uint64_t *blocks, int compact) {
+  uint64_t count = f->count, nblocks = f->nblocks, got = count;
+  unsigned nw = load_threads(sh->avl), i;
+  int rc = KVDBLITE_SUCCESS;
+
+  if (nw > nblocks)
+    nw = (unsigned)nblocks;
+  struct node **nodes = malloc(count * sizeof *nodes);
+  struct load_worker *w = calloc(nw, sizeof *w);
+  if (nodes == NULL || w == NULL) {
+    free(nodes);
+    free(w);
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  }
+  for (i = 0; i < nw; i++) {
+    w[i].part.avl = sh->avl;
+    w[i].part.vlog = sh->vlog;
+    slab_init(&w[i].part.slab);
+    w[i].fd = fd;
+    w[i].blocks = blocks;
+    w[i].nblocks = nblocks;
+    w[i].b = nblocks * i / nw;
+    w[i].e = nblocks * (i + 1) / nw;
+    w[i].end = f->index_off;
+    w[i].count = count;
+    w[i].compact = compact;
+    w[i].nodes = nodes;
+  }
+  // The calling thread takes the first run
+  for (i = 1; i < nw; i++) {
+    w[i].started = pthread_create(&w[i].thread, NULL, load_worker_run, &w[i]) == 0;
+    if (!w[i].started)
+      load_worker_run(&w[i]);
+  }
+  load_worker_run(&w[0]);
+
+  for (i = 0; i < nw; i++) {
+    if (w[i].started)
+      pthread_join(w[i].thread, NULL);
+    slab_merge(&sh->slab, &w[i].part.slab);
+  }
+  // Keep what comes before the first bad block, free what was made after it
+  for (i = 0; i < nw; i++) {
+    uint64_t from = w[i].b < nblocks ? blocks[2 * w[i].b + 1] : count;
+    if (rc < 0) {
+      for (uint64_t j = from; j < w[i].filled; j++)
+        node_free(sh, nodes[j]);
+    } else if (w[i].rc < 0) {
+      rc = w[i].rc;
+      got = w[i].filled;
+    }
+  }
+
+  shard_build(sh, nodes, got);
+  free(nodes);
+  free(w);
+  return rc;
+}
+
+// Format 2 or 3 (compact), the magic has been read already. Entries go
+// straight from the block buffer into nodes, the tree is built once they are
+// all in. A bad block ends the load, the entries before it are kept but the
+// error fails db_open().
+static int load_sorted_snapshot(struct shard *sh, FILE *file, int compact) {
+  uint8_t header[16], *buf = NULL, *raw = NULL;
+  const uint8_t *data;
+  uint64_t count, *blocks;
+  uint32_t crc, len, flags, n, made;
+  size_t got = 0, cap = 0, rawcap = 0;
+  struct snap_footer f;
+  struct stat st;
+  int fd = fileno(file), rc = KVDBLITE_SUCCESS;
+
+  put_le32(header, compact ? KVDBLITE_SNAP3_MAGIC : KVDBLITE_SNAP_MAGIC);
+  if (fread(header + 4, 12, 1, file) != 1 || get_le32(header + 12) != calc_CRC32(header, 12, 0))
+    return KVDBLITE_UNEXPECTED_EOF;
+  count = get_le64(header + 4);
+  if (count > UINT32_MAX)
+    return KVDBLITE_UNEXPECTED_EOF;
+  if (fstat(fd, &st) == 0 && snap_read_footer(fd, st.st_size, &f, compact)) {
+    sh->snap_batch = f.batch;
+    if ((blocks = snap_read_blocks(fd, &f, count)) != NULL) {
+      rc = load_snapshot_blocks(sh, fd, &f, blocks, compact);
+      free(blocks);
+      return rc;
+    }
+  }
+
+  struct node **nodes = malloc((count ? count : 1) * sizeof *nodes);
+  if (nodes == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+
+  while (got < count) {
+    if (fread(header, 8, 1, file) != 1 || (n = get_le32(header + 4)) > count - got) {
+      rc = KVDBLITE_UNEXPECTED_EOF;
+      break;
+    }
+    len = get_le32(header);
+    flags = compact ? len & KVDBLITE_SNAP_FLAGS : 0;
+    len ^= flags;
+    if (len > cap) {
+      uint8_t *p = realloc(buf, len);
+      if (p == NULL) {
+        rc = KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+        break;
+      }
+      buf = p;
+      cap = len;
+    }
+    if ((len > 0 && fread(buf, len, 1, file) != 1) || fread(header, 4, 1, file) != 1 ||
+        (crc = get_le32(header)) != calc_CRC32(buf, len, 0) ||
+        (data = snap_block_data(buf, &len, flags, &raw, &rawcap)) == NULL) {
+      rc = KVDBLITE_UNEXPECTED_EOF;
+      break;
+    }
+    made = snap_parse_block(sh, data, len, n, nodes + got, compact, flags);
+    got += made;
+    if (made < n) {
+      rc = KVDBLITE_UNEXPECTED_EOF;
+      break;
+    }
+  }
+
+  shard_build(sh, nodes, got);
+  free(nodes);
+  free(buf);
+  free(raw);
+  return rc;
+}
+
+static int load_avl_tree(struct shard *sh) {
+  uint8_t magic[4];
+  int rc = KVDBLITE_SUCCESS;
+
+  FILE *file = fopen(sh->dbname, "rb");
+  if (!file) {
+    // Never saved is fine, the journals hold everything
+    return errno == ENOENT ? KVDBLITE_SUCCESS : KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  }
+
+  if (fread(magic, 4, 1, file) == 1 &&
+      (get_le32(magic) == KVDBLITE_SNAP_MAGIC || get_le32(magic) == KVDBLITE_SNAP3_MAGIC)) {
+    rc = load_sorted_snapshot(sh, file, get_le32(magic) == KVDBLITE_SNAP3_MAGIC);
+  } else {
+    // Format 1
+    rewind(file);
+    sh->root = load_tree_from_disk(sh, file);
+    if (sh->btree)
+      bt_adopt(sh);
+    else
+      hidx_build_tree(sh);
+  }
+
+  fclose(file);
+  return rc;
+}
+
+// Check the CRCs of the blocks of a mapped snapshot that overlap chunk c,
+// the first time an entry in it is read. Threads may race to check the same
+// chunk, they come to the same answer.
+static int map_check_chunk(struct snap_map *map, uint64_t c) {
+  uint64_t from = c << KVDBLITE_MAP_CHUNK_SHIFT, to = from + (1ull << KVDBLITE_MAP_CHUNK_SHIFT);
+  uint64_t end = (uint64_t)(map->index - map->base), lo = 0, hi = map->nblocks;
+  uint8_t state = 1;
+
+  // The last block starting at or before the chunk
+  while (hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (map->blocks[2 * mid] <= from)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  for (uint64_t b = lo; b < map->nblocks && map->blocks[2 * b] < to; b++) {
+    uint64_t off = map->blocks[2 * b];
+    uint64_t size = (b + 1 < map->nblocks ? map->blocks[2 * b + 2] : end) - off;
+    if (get_le32(map->base + off) != size - 12 ||
+        get_le32(map->base + off + size - 4) != calc_CRC32(map->base + off + 8, size - 12, 0)) {
+      state = 2;
+      __atomic_store_n(&map->bad, 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  __atomic_store_n(&map->checked[c], state, __ATOMIC_RELEASE);
+  return state;
+}
+
+static inline int map_bad(const struct snap_map *map) {
+  return __atomic_load_n(&map->bad, __ATOMIC_RELAXED);
+}
+
+// Entry i of a mapped snapshot. A corrupt offset, or an entry in a block that
+// fails its CRC, gives an empty entry rather than a read outside the mapping
+// or of bad data, the second also marks the map bad.
+static void map_entry(struct snap_map *map, uint64_t i, struct avl_view *v) {
+  uint64_t off, end = (uint64_t)(map->index - map->base), c;
+  uint32_t klen, vlen;
+
+  off = get_le64(map->index + i * 8);
+  v->key = v->value = map->base;
+  v->klen = v->vlen = 0;
+  if (off < 16 || off > end || end - off < 8)
+    return;
+  c = off >> KVDBLITE_MAP_CHUNK_SHIFT;
+  uint8_t state = __atomic_load_n(&map->checked[c], __ATOMIC_ACQUIRE);
+  if (state == 0)
+    state = map_check_chunk(map, c);
+  if (state != 1)
+    return;
+  klen = get_le32(map->base + off);
+  vlen = get_le32(map->base + off + 4);
+  if ((uint64_t)klen + vlen > end - off - 8)
+    return;
+  v->key = map->base + off + 8;
+  v->klen = klen;
+  v->value = v->key + klen;
+  v->vlen = vlen;
+}
+
+// Index of the first entry not below key, map->count if there is none
+static uint64_t map_lower_bound(struct snap_map *map, const avl_key_t *key, uint32_t klen) {
+  uint64_t lo = 0, hi = map->count;
+  struct avl_view v;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    map_entry(map, mid, &v);
+    if (keycmp(v.key, v.klen, key, klen) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Sets *pos to map_lower_bound(), returns 1 if the entry there is key, or
+// KVDBLITE_CORRUPT
+static int map_find_pos(struct snap_map *map, const avl_key_t *key, uint32_t klen,
+                        struct avl_view *v, uint64_t *pos) {
+  struct avl_view e;
+  uint64_t i = map_lower_bound(map, key, klen);
+  *pos = i;
+  if (i < map->count)
+    map_entry(map, i, &e);
+  if (map_bad(map))
+    return KVDBLITE_CORRUPT;
+  if (i == map->count || keycmp(e.key, e.klen, key, klen) != 0)
+    return 0;
+  if (v != NULL)
+    *v = e;
+  return 1;
+}
+
+static inline int map_find(struct snap_map *map, const avl_key_t *key, uint32_t klen,
+                           struct avl_view *v) {
+  uint64_t pos;
+  return map_find_pos(map, key, klen, v, &pos);
+}
+
+// Entries hidden by the overlay tree: 1 for each replaced value and 2 for
+// each deleted key, by position. The tree holds those nodes plus the new
+// keys, so a shard has map count + tree size - shadow sum keys, and the
+// prefix sums give the rank without walking the tree.
+static void map_shadow_add(struct snap_map *map, uint64_t pos, int64_t delta) {
+  for (uint64_t i = pos + 1; i <= map->count; i += i & -i)
+    map->shadow[i - 1] += (uint64_t)delta;
+}
+
+// Sum for the entries before pos
+static uint64_t map_shadow_sum(const struct snap_map *map, uint64_t pos) {
+  uint64_t r = 0;
+  for (uint64_t i = pos; i > 0; i -= i & -i)
+    r += map->shadow[i - 1];
+  return r;
+}
+
+// The block index of a mapped snapshot written before files had one, found
+// by walking the block headers
+static uint64_t *map_walk_blocks(const uint8_t *base, const struct snap_footer *f,
+                                 uint64_t *nblocks) {
+  uint64_t off = 16, first = 0, n = 0, cap = 0, *blocks = NULL, *p;
+  while (off < f->index_off) {
+    if (f->index_off - off < 12 || get_le32(base + off) > f->index_off - off - 12)
+      break;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 256;
+      if ((p = realloc(blocks, cap * 2 * sizeof *p)) == NULL)
+        break;
+      blocks = p;
+    }
+    blocks[2 * n] = off;
+    blocks[2 * n + 1] = first;
+    n++;
+    first += get_le32(base + off + 4);
+    off += 12 + get_le32(base + off);
+  }
+  if (off != f->index_off || first != f->count) {
+    free(blocks);
+    return NULL;
+  }
+  *nblocks = n;
+  return blocks;
+}
+
+// Map the shard's snapshot instead of loading it. Nothing is read but the
+// header, the footer and the block index, lookups binary search the index
+// in place and the blocks are CRC checked as reads first get to them, see
+// map_entry(). Returns 0 if the file has no index (format 1 or 3, or no file
+// at all).
+static int map_snapshot(struct shard *sh) {
+  struct snap_footer f;
+  uint64_t count;
+  uint8_t header[16];
+  struct stat st;
+  void *p;
+
+  int fd = open(sh->dbname, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || pread(fd, header, 16, 0) != 16 ||
+      get_le32(header) != KVDBLITE_SNAP_MAGIC || !snap_read_footer(fd, st.st_size, &f, 0)) {
+    close(fd);
+    return 0;
+  }
+  count = f.count;
+  if (get_le32(header + 12) != calc_CRC32(header, 12, 0) || get_le64(header + 4) != count) {
+    close(fd);
+    return KVDBLITE_CORRUPT;
+  }
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  }
+  sh->map.base = p;
+  sh->map.size = st.st_size;
+  if (count == 0)
+    sh->map.blocks = NULL;
+  else if (f.nblocks == 0)
+    sh->map.blocks = map_walk_blocks(p, &f, &sh->map.nblocks);
+  else if ((sh->map.blocks = snap_read_blocks(fd, &f, count)) != NULL)
+    sh->map.nblocks = f.nblocks;
+  close(fd);
+  if (count > 0 && sh->map.blocks == NULL)
+    return KVDBLITE_CORRUPT;
+  // Zeroed pages are only touched once the overlay changes a key near them
+  sh->map.shadow = calloc(count + 1, sizeof *sh->map.shadow);
+  sh->map.checked = calloc((f.index_off >> KVDBLITE_MAP_CHUNK_SHIFT) + 1, 1);
+  if (sh->map.shadow == NULL || sh->map.checked == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  sh->map.count = count;
+  sh->map.index = sh->map.base + f.index_off;
+  sh->snap_batch = f.batch;
+  return 1;
+}
+
+// The database file of a sharded database only holds the shard count, the
+// trees live in <dbname>.<i> with journals <dbname>.<i>.jnl. The count is
+// fixed when the database is created, this returns the one to use.
+static int load_shard_manifest(const char *fn, unsigned nshards) {
+  uint32_t magic, n;
+  int exists;
+
+  FILE *file = fopen(fn, "rb");
+  if (file != NULL) {
+    int sharded = fread_uint32_t(&magic, file) > 0 && magic == KVDBLITE_SHARD_MAGIC &&
+                  fread_uint32_t(&n, file) > 0;
+    fclose(file);
+    if (!sharded)
+      return 1; // An existing single tree database
+    if (n == 0 || n > KVDBLITE_MAX_SHARDS)
+      return KVDBLITE_UNEXPECTED_EOF;
+    return (int)n;
+  }
+  if (nshards <= 1)
+    return 1;
+  // Never saved, but there may be a journal, or one rotated by a checkpoint
+  char *journalname = malloc(strlen(fn) + 7);
+  if (journalname == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  sprintf(journalname, "%s%s", fn, ".jnl");
+  exists = access(journalname, F_OK) == 0;
+  strcat(journalname, ".1");
+  exists |= access(journalname, F_OK) == 0;
+  free(journalname);
+  if (exists)
+    return 1;
+
+  // New database
+  file = fopen(fn, "wb");
+  if (!file)
+    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  if (fwrite_uint32_t(KVDBLITE_SHARD_MAGIC, file) < 0 || fwrite_uint32_t(nshards, file) < 0 ||
+      fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fclose(file);
+    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  }
+  fclose(file);
+  return (int)nshards;
+}
+//
+// END DISK
+//
+
+//
+// Journalling
+//
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return KVDBLITE_JOURNAL_WRITE_ERR;
+    }
+    buf += n;
+    len -= n;
+  }
+  return KVDBLITE_SUCCESS;
+}
+
+static int journal_open(struct shard *sh) {
+  if (sh->journal_fd >= 0)
+    return KVDBLITE_SUCCESS;
+  sh->journal_fd = open(sh->journalname, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (sh->journal_fd < 0) {
+    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  }
+  return KVDBLITE_SUCCESS;
+}
+
+// One flush of a shard's journal buffer, see journal_flush_begin()
+struct journal_io {
+  struct shard *sh;
+  struct journal_buf out; // The records taken from sh->journal
+  uint64_t lsn;           // Written (and synced) up to here once it is done
+  uint64_t start;
+  int sync;
+  int rc;
+  ssize_t res; // io_uring write result, see jring_enter()
+  int left;    // io_uring entries that haven't completed, -1 once finished
+  int dropped; // Entries the ring never took, jring_finish() does their part
+};
+
+// Take the buffered records of sh for writing out, and fdatasync()ing if sync
+// is set. Called with sh->journal_lock held, which is dropped while an earlier
+// flush finishes. Returns 1 if there is something to do, journal_flush_end()
+// then has to follow, with the lock held again.
+static int journal_flush_begin(struct shard *sh, int sync, struct journal_io *io) {
+  while (sh->journal_flushing)
+    pthread_cond_wait(&sh->journal_cond, &sh->journal_lock);
+
+  // Whoever kicked the journal writer is looked after by this flush
+  sh->journal_kicked = 0;
+  if (sh->journal_err < 0)
+    return sh->journal_err;
+  if (sh->journal.len == 0 && (!sync || sh->synced_lsn >= sh->journal_lsn))
+    return 0;
+
+  io->sh = sh;
+  io->out = sh->journal;
+  io->lsn = sh->journal_lsn;
+  io->start = now_ns();
+  io->sync = sync;
+  io->rc = KVDBLITE_SUCCESS;
+  sh->journal = sh->journal_spare;
+  sh->journal_flushing = 1;
+  // Writers waiting for room can carry on in the spare buffer
+  pthread_cond_broadcast(&sh->journal_cond);
+  return 1;
+}
+
+// The I/O of a flush, without the journal lock
+static void journal_flush_io(struct journal_io *io) {
+  struct shard *sh = io->sh;
+  struct stat_stripe *st = stat_stripe(sh->avl);
+  uint64_t synced;
+
+  io->rc = journal_open(sh);
+  if (io->rc == KVDBLITE_SUCCESS && io->out.len > 0)
+    io->rc = write_all(sh->journal_fd, io->out.data, io->out.len);
+  synced = now_ns();
+  if (io->rc == KVDBLITE_SUCCESS && io->sync && fdatasync(sh->journal_fd) < 0)
+    io->rc = KVDBLITE_JOURNAL_WRITE_ERR;
+  if (io->sync) {
+    stat_count(&st->fsyncs, 1);
+    stat_count(&st->fsync_ns, now_ns() - synced);
+  }
+}
+
+// Hand the buffer back and publish the outcome of the flush. Called with
+// sh->journal_lock held.
+static int journal_flush_end(struct journal_io *io) {
+  struct shard *sh = io->sh;
+  struct stat_stripe *st = stat_stripe(sh->avl);
+  struct journal_buf out = io->out;
+  size_t written = out.len;
+
+  if (io->rc == KVDBLITE_SUCCESS)
+    stat_count(&st->journal_bytes, written);
+  hist_add(&st->hist[STAT_FLUSH], now_ns() - io->start, 1);
+
+  if (out.cap > KVDBLITE_JOURNAL_BUF_SIZE) {
+    // Grown for an oversized record, give the memory back
+    uint8_t *p = realloc(out.data, KVDBLITE_JOURNAL_BUF_SIZE);
+    if (p != NULL) {
+      out.data = p;
+      out.cap = KVDBLITE_JOURNAL_BUF_SIZE;
+    }
+  }
+  out.len = 0;
+
+  sh->journal_spare = out;
+  sh->journal_flushing = 0;
+  if (io->rc < 0) {
+    // Sticky, the journal no longer matches the tree
+    sh->journal_err = io->rc;
+  } else {
+    sh->written_lsn = io->lsn;
+    if (io->sync) {
+      sh->group_size = io->lsn - sh->synced_lsn;
+      sh->synced_lsn = io->lsn;
+    }
+    __atomic_store_n(&sh->journal_bytes, sh->journal_bytes + written, __ATOMIC_RELAXED);
+  }
+  pthread_cond_broadcast(&sh->journal_cond);
+  return io->rc;
+}
+
+// Write out the buffered journal records, and fdatasync() them if sync is set.
+// Called with sh->journal_lock held. The lock is dropped while the I/O runs so other
+// writers can keep appending to the (swapped in) spare buffer.
+static int journal_flush_locked(struct shard *sh, int sync) {
+  struct journal_io io;
+  int rc = journal_flush_begin(sh, sync, &io);
+
+  if (rc <= 0)
+    return rc;
+  pthread_mutex_unlock(&sh->journal_lock);
+  journal_flush_io(&io);
+  pthread_mutex_lock(&sh->journal_lock);
+  return journal_flush_end(&io);
+}
+
+// Tell the journal writer there is work, see journal_writer_thread()
+static void journal_kick(struct avltree *avl) {
+  pthread_mutex_lock(&avl->writer_lock);
+  avl->writer_pending = 1;
+  pthread_cond_signal(&avl->writer_cond);
+  pthread_mutex_unlock(&avl->writer_lock);
+}
+
+// After a record went into the journal buffer. With a journal writer it gets
+// going once the buffer is half full, so the other half is there to carry on
+// in. Called with sh->journal_lock held.
+static inline void journal_appended(struct shard *sh) {
+  if (sh->journal_leader && sh->journal_lsn - sh->synced_lsn >= sh->group_size)
+    pthread_cond_signal(&sh->leader_cond);
+  if (sh->avl->writer_running && !sh->journal_kicked &&
+      sh->journal.len >= sh->journal.cap / 2) {
+    sh->journal_kicked = 1;
+    journal_kick(sh->avl);
+  }
+}
+
+// KVDBLITE_SYNC_GROUP: before a sync, wait until deadline for as many records
+// as the last synced flush took, which is for the writers that shared it to
+// come back. A lone writer's group is one record, so it never waits. Called
+// with sh->journal_lock held, which is dropped while waiting.
+static void journal_group_wait(struct shard *sh, const struct timespec *deadline) {
+  sh->journal_leader = 1;
+  while (sh->journal_lsn > sh->synced_lsn && sh->journal_lsn - sh->synced_lsn < sh->group_size &&
+         pthread_cond_timedwait(&sh->leader_cond, &sh->journal_lock, deadline) != ETIMEDOUT)
+    ;
+  sh->journal_leader = 0;
+}
+
+static void group_deadline(struct avltree *avl, struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += avl->opts.group_commit_us / 1000000;
+  ts->tv_nsec += (avl->opts.group_commit_us % 1000000) * 1000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+// Block until the record with sequence number lsn is as durable as the
+// configured policy requires. Called without sh->journal_lock held.
+static int journal_commit(struct shard *sh, uint64_t lsn) {
+  int rc = KVDBLITE_SUCCESS;
+
+  if (sh->avl->opts.durability != KVDBLITE_SYNC_ALWAYS &&
+      sh->avl->opts.durability != KVDBLITE_SYNC_GROUP)
+    return KVDBLITE_SUCCESS;
+
+  pthread_mutex_lock(&sh->journal_lock);
+  if (sh->avl->writer_running) {
+    // Every flush of the writer is synced in these modes
+    if (sh->synced_lsn < lsn && !sh->journal_kicked) {
+      sh->journal_kicked = 1;
+      journal_kick(sh->avl);
+    }
+    while (sh->synced_lsn < lsn && sh->journal_err == KVDBLITE_SUCCESS)
+      pthread_cond_wait(&sh->journal_cond, &sh->journal_lock);
+  }
+  while (sh->synced_lsn < lsn && sh->journal_err == KVDBLITE_SUCCESS) {
+    if (sh->journal_leader || sh->journal_flushing) {
+      // Somebody else is about to sync, our record may be in their batch
+      pthread_cond_wait(&sh->journal_cond, &sh->journal_lock);
+      continue;
+    }
+    if (sh->avl->opts.durability == KVDBLITE_SYNC_GROUP && sh->avl->opts.group_commit_us > 0) {
+      // Become the leader and give other writers a window to join in
+      struct timespec deadline;
+      group_deadline(sh->avl, &deadline);
+      journal_group_wait(sh, &deadline);
+    }
+    journal_flush_locked(sh, 1);
+  }
+  rc = sh->journal_err;
+  pthread_mutex_unlock(&sh->journal_lock);
+  return rc;
+}
+
+// Flush and fdatasync() the journal up to lsn whatever the durability policy
+// is, for records other shards depend on (see kvdb_write_batch_commit()).
+// Called without sh->journal_lock held.
+static int journal_sync_to(struct shard *sh, uint64_t lsn) {
+  int rc;
+
+  pthread_mutex_lock(&sh->journal_lock);
+  while (sh->synced_lsn < lsn && sh->journal_err == KVDBLITE_SUCCESS)
+    journal_flush_locked(sh, 1);
+  rc = sh->journal_err;
+  pthread_mutex_unlock(&sh->journal_lock);
+  return rc;
+}
+
+#ifdef KVDBLITE_IO_URING
+// Just enough io_uring for the journal writer: the rings are mapped as the
+// kernel lays them out, and each flush is a write linked to its fdatasync.
+// Needs Linux 5.6 (IORING_OP_WRITE).
+struct jring {
+  int fd;
+  void *ring;
+  size_t ringsz;
+  struct io_uring_sqe *sqes;
+  size_t sqessz;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sqe_tail; // Tail with the entries filled in, jring_enter() publishes it
+  unsigned queued;   // Entries not submitted yet
+  unsigned inflight; // Submitted entries that haven't completed
+  int broken;        // io_uring_enter() failed, see jring_enter()
+};
+
+static void jring_exit(struct jring *r) {
+  munmap(r->sqes, r->sqessz);
+  munmap(r->ring, r->ringsz);
+  close(r->fd);
+}
+
+// A ring with room for a flush of each of n shards. Fails if the kernel
+// doesn't have io_uring, or it is turned off.
+static int jring_init(struct jring *r, unsigned n) {
+  struct io_uring_params p;
+  size_t sqsz, cqsz;
+
+  memset(&p, 0, sizeof p);
+  r->fd = (int)syscall(__NR_io_uring_setup, 2 * n, &p);
+  if (r->fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+    close(r->fd);
+    return -1;
+  }
+  sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->ringsz = sqsz > cqsz ? sqsz : cqsz;
+  r->sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->ring = mmap(NULL, r->ringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQ_RING);
+  r->sqes = mmap(NULL, r->sqessz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (r->ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+    if (r->ring != MAP_FAILED)
+      munmap(r->ring, r->ringsz);
+    if (r->sqes != MAP_FAILED)
+      munmap(r->sqes, r->sqessz);
+    close(r->fd);
+    return -1;
+  }
+  r->sq_tail = (unsigned *)((char *)r->ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *)((char *)r->ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *)r->ring + p.sq_off.array);
+  r->cq_head = (unsigned *)((char *)r->ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)((char *)r->ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *)((char *)r->ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->ring + p.cq_off.cqes);
+  r->sqe_tail = *r->sq_tail;
+  r->queued = r->inflight = 0;
+  r->broken = 0;
+  return 0;
+}
+
+static struct io_uring_sqe *jring_push(struct jring *r, uint8_t op, int fd, uint64_t user_data) {
+  unsigned i = r->sqe_tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[i];
+
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  r->sq_array[i] = i;
+  r->sqe_tail++;
+  r->queued++;
+  return sqe;
+}
+
+// The ring entries of io have completed, or won't be submitted. Whatever they
+// didn't get done goes the plain way, then the result is handed to the waiters.
+static void jring_finish(struct journal_io *io) {
+  struct shard *sh = io->sh;
+  struct stat_stripe *st = stat_stripe(sh->avl);
+
+  if (io->rc == KVDBLITE_SUCCESS && (io->res != (ssize_t)io->out.len || io->dropped)) {
+    // A short write cancels its fdatasync. So does a write the kernel
+    // turned down, if it doesn't do IORING_OP_WRITE on this file.
+    size_t done = io->res > 0 ? (size_t)io->res : 0;
+    if (io->res < 0 && io->res != -EINVAL && io->res != -EOPNOTSUPP)
+      io->rc = KVDBLITE_JOURNAL_WRITE_ERR;
+    else
+      io->rc = write_all(sh->journal_fd, io->out.data + done, io->out.len - done);
+    if (io->rc == KVDBLITE_SUCCESS && io->sync && fdatasync(sh->journal_fd) < 0)
+      io->rc = KVDBLITE_JOURNAL_WRITE_ERR;
+  }
+  if (io->sync) {
+    // Includes the write and the wait for the ring
+    stat_count(&st->fsyncs, 1);
+    stat_count(&st->fsync_ns, now_ns() - io->start);
+  }
+  pthread_mutex_lock(&sh->journal_lock);
+  journal_flush_end(io);
+  pthread_mutex_unlock(&sh->journal_lock);
+  io->left = -1;
+}
+
+// Queue the I/O of the flush io, which is ios[i] of the journal writer
+static void jring_queue(struct jring *r, struct journal_io *io, unsigned i) {
+  struct io_uring_sqe *sqe;
+
+  io->res = 0;
+  io->left = 0;
+  io->dropped = 0;
+  if ((io->rc = journal_open(io->sh)) < 0) {
+    jring_finish(io);
+    return;
+  }
+  if (io->out.len > 0) {
+    // The journal is O_APPEND, the offset only says "no offset"
+    sqe = jring_push(r, IORING_OP_WRITE, io->sh->journal_fd, 2 * (uint64_t)i);
+    sqe->addr = (uintptr_t)io->out.data;
+    sqe->len = (uint32_t)io->out.len;
+    sqe->off = (uint64_t)-1;
+    if (io->sync)
+      sqe->flags = IOSQE_IO_LINK;
+    io->left++;
+  }
+  if (io->sync) {
+    sqe = jring_push(r, IORING_OP_FSYNC, io->sh->journal_fd, 2 * (uint64_t)i + 1);
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    io->left++;
+  }
+}
+
+// Submit what is queued, wait for at least one completion if wait is set, and
+// finish the flushes whose entries have all completed. If the kernel won't
+// take the entries the ring is broken: the queued ones are done the plain way
+// and nothing is queued any more, the caller closes it once inflight is 0.
+static void jring_enter(struct jring *r, struct journal_io *ios, int wait) {
+  unsigned head;
+  long ret;
+
+  // The caller fills in an entry after jring_push(), so the kernel only gets
+  // to see the new tail here, once they are all complete
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  ret = syscall(__NR_io_uring_enter, r->fd, r->queued, wait ? 1 : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+  if (ret > 0) {
+    r->queued -= (unsigned)ret;
+    r->inflight += (unsigned)ret;
+  } else if (ret < 0 && r->queued > 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    // Entries are taken in order, the last r->queued ones never will be.
+    // Their flushes finish once what they have in flight completes.
+    for (head = *r->sq_tail - r->queued; head != *r->sq_tail; head++) {
+      struct journal_io *io = &ios[r->sqes[head & *r->sq_mask].user_data / 2];
+      io->dropped = 1;
+      if (--io->left == 0)
+        jring_finish(io);
+    }
+    r->queued = 0;
+    r->broken = 1;
+  } else if (ret < 0 && wait && errno != EINTR) {
+    // Can't wait in the kernel, poll for the completions
+    struct timespec ts = {0, 50000};
+    nanosleep(&ts, NULL);
+  }
+
+  head = *r->cq_head;
+  while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    struct journal_io *io = &ios[cqe->user_data / 2];
+    if (cqe->user_data % 2 == 0)
+      io->res = cqe->res;
+    else if (cqe->res < 0 && cqe->res != -ECANCELED && io->rc == KVDBLITE_SUCCESS)
+      io->rc = KVDBLITE_JOURNAL_WRITE_ERR;
+    head++;
+    r->inflight--;
+    if (--io->left == 0)
+      jring_finish(io);
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// avl_options.journal_writer: does the journal I/O of all the shards, so
+// writers don't. Woken by journal_kick(), when a buffer is half full or a
+// writer waits for a sync, it takes what the shards have buffered. With
+// io_uring the flushes of all of them go to the kernel together, and while
+// they are in flight the next ones of other shards are started as soon as
+// they are asked for. Without it the flushes are one write() and fdatasync()
+// after the other.
+static void *journal_writer_thread(void *arg) {
+  struct avltree *avl = arg;
+  struct journal_io *ios = avl->writer_ios;
+  int sync = avl->opts.durability == KVDBLITE_SYNC_ALWAYS ||
+             avl->opts.durability == KVDBLITE_SYNC_GROUP;
+  int busy = 0, again = 0, kicked, group;
+  struct timespec deadline;
+  unsigned i;
+#ifdef KVDBLITE_IO_URING
+  struct jring ring = {.fd = -1};
+  int uring = jring_init(&ring, avl->nshards) == 0;
+#endif
+
+  for (i = 0; i < avl->nshards; i++)
+    ios[i].left = -1;
+  pthread_mutex_lock(&avl->writer_lock);
+  for (;;) {
+    while (!avl->writer_pending && !avl->writer_stop && !busy && !again)
+      pthread_cond_wait(&avl->writer_cond, &avl->writer_lock);
+    // avl_free() flushes what is left
+    if (avl->writer_stop && !busy)
+      break;
+    kicked = avl->writer_pending || again;
+    avl->writer_pending = again = 0;
+    pthread_mutex_unlock(&avl->writer_lock);
+
+    // Give other writers a window to join in, shared by the shards
+    group = kicked && !busy && avl->opts.durability == KVDBLITE_SYNC_GROUP &&
+            avl->opts.group_commit_us > 0;
+    if (group)
+      group_deadline(avl, &deadline);
+    for (i = 0; kicked && i < avl->nshards; i++) {
+      struct shard *sh = &avl->shards[i];
+      if (ios[i].left >= 0) {
+        // Still in flight, look again once something completes
+        again = 1;
+        continue;
+      }
+      pthread_mutex_lock(&sh->journal_lock);
+      if (group)
+        journal_group_wait(sh, &deadline);
+      if (journal_flush_begin(sh, sync, &ios[i]) <= 0) {
+        pthread_mutex_unlock(&sh->journal_lock);
+        continue;
+      }
+      pthread_mutex_unlock(&sh->journal_lock);
+#ifdef KVDBLITE_IO_URING
+      if (uring && !ring.broken) {
+        jring_queue(&ring, &ios[i], i);
+        continue;
+      }
+#endif
+      journal_flush_io(&ios[i]);
+      pthread_mutex_lock(&sh->journal_lock);
+      journal_flush_end(&ios[i]);
+      pthread_mutex_unlock(&sh->journal_lock);
+    }
+#ifdef KVDBLITE_IO_URING
+    if (uring && ring.queued + ring.inflight > 0)
+      jring_enter(&ring, ios, 1);
+    if (uring && ring.broken && ring.inflight == 0) {
+      jring_exit(&ring);
+      uring = 0;
+    }
+    busy = uring && ring.inflight > 0;
+#endif
+    pthread_mutex_lock(&avl->writer_lock);
+  }
+  pthread_mutex_unlock(&avl->writer_lock);
+#ifdef KVDBLITE_IO_URING
+  if (uring)
+    jring_exit(&ring);
+#endif
+  return NULL;
+}
+
+// KVDBLITE_SYNC_INTERVAL: flush and fdatasync the journals every sync_interval_ms
+static void *journal_sync_thread(void *arg) {
+  struct avltree *avl = arg;
+  struct timespec deadline;
+  unsigned i;
+
+  pthread_mutex_lock(&avl->sync_lock);
+  while (!avl->sync_thread_stop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += avl->opts.sync_interval_ms / 1000;
+    deadline.tv_nsec += (avl->opts.sync_interval_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!avl->sync_thread_stop &&
+           pthread_cond_timedwait(&avl->sync_cond, &avl->sync_lock, &deadline) != ETIMEDOUT)
+      ;
+    if (avl->sync_thread_stop)
+      break;
+    pthread_mutex_unlock(&avl->sync_lock);
+    for (i = 0; i < avl->nshards; i++) {
+      struct shard *sh = &avl->shards[i];
+      pthread_mutex_lock(&sh->journal_lock);
+      journal_flush_locked(sh, 1);
+      pthread_mutex_unlock(&sh->journal_lock);
+    }
+    pthread_mutex_lock(&avl->sync_lock);
+  }
+  pthread_mutex_unlock(&avl->sync_lock);
+  return NULL;
+}
+
+// Add the journal to the end of the rotated journal and remove it
+static int journal_append_rotated(struct shard *sh, int sync) {
+  uint8_t buf[64 * 1024];
+  ssize_t n;
+  int rc = KVDBLITE_SUCCESS;
+  int in = open(sh->journalname, O_RDONLY);
+  int out = open(sh->rotatedname, O_WRONLY | O_APPEND);
+
+  if (in < 0 || out < 0)
+    rc = KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  while (rc == KVDBLITE_SUCCESS && (n = read(in, buf, sizeof buf)) != 0) {
+    if (n < 0) {
+      if (errno != EINTR)
+        rc = KVDBLITE_JOURNAL_WRITE_ERR;
+      continue;
+    }
+    rc = write_all(out, buf, n);
+  }
+  if (rc == KVDBLITE_SUCCESS && sync && fdatasync(out) < 0)
+    rc = KVDBLITE_JOURNAL_WRITE_ERR;
+  if (in >= 0)
+    close(in);
+  if (out >= 0)
+    close(out);
+  // Until the unlink replay sees these records twice, which does no harm
+  if (rc == KVDBLITE_SUCCESS && unlink(sh->journalname) < 0)
+    rc = KVDBLITE_JOURNAL_WRITE_ERR;
+  return rc;
+}
+
+// Move the records journalled so far to <journalname>.1, new ones go to a
+// fresh journal (see checkpoint_shard()). Called with sh->rwlock held
+// exclusively and sh->journal_lock held.
+static int journal_rotate(struct shard *sh) {
+  int sync = sh->avl->opts.durability != KVDBLITE_SYNC_NONE;
+  int rc = journal_flush_locked(sh, sync);
+
+  if (rc < 0)
+    return rc;
+  sh->rotated_bytes = sh->journal_bytes;
+  if (sh->journal_fd >= 0) {
+    close(sh->journal_fd);
+    sh->journal_fd = -1;
+  }
+  if (access(sh->journalname, F_OK) != 0)
+    return KVDBLITE_SUCCESS;
+
+  if (access(sh->rotatedname, F_OK) == 0) {
+    // An earlier checkpoint didn't finish and its rotated journal is still needed
+    rc = journal_append_rotated(sh, sync);
+  } else if (rename(sh->journalname, sh->rotatedname) < 0) {
+    rc = KVDBLITE_JOURNAL_WRITE_ERR;
+  }
+  if (rc == KVDBLITE_SUCCESS && sync)
+    rc = fsync_parent_dir(sh->journalname);
+  return rc;
+}
+
+static inline void journal_put_uint8_t(struct shard *sh, uint8_t value) {
+  sh->journal.data[sh->journal.len++] = value;
+}
+
+static inline void journal_put_uint32_t(struct shard *sh, uint32_t value) {
+  put_le32(sh->journal.data + sh->journal.len, value);
+  sh->journal.len += sizeof(uint32_t);
+}
+
+static inline void journal_put_varint(struct shard *sh, uint32_t value) {
+  sh->journal.len += varint_put(sh->journal.data + sh->journal.len, value);
+}
+
+static inline void journal_put_bytes(struct shard *sh, const uint8_t *s, uint32_t l) {
+  if (l == 0)
+    return;
+  memcpy(sh->journal.data + sh->journal.len, s, l);
+  sh->journal.len += l;
+}
+
+// Make room for need bytes in the journal buffer. Called with sh->journal_lock held.
+static int journal_reserve(struct shard *sh, size_t need) {
+  int rc;
+
+  // Flushing drops the journal lock, look again once it returns
+  while (sh->journal.len + need > sh->journal.cap) {
+    if (sh->journal.len == 0) {
+      // Record is larger than the whole buffer, grow it until the next flush
+      uint8_t *p = realloc(sh->journal.data, need);
+      if (p == NULL)
+        return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+      sh->journal.data = p;
+      sh->journal.cap = need;
+    } else if (sh->avl->writer_running) {
+      // Wait for the journal writer to take the full buffer
+      if (!sh->journal_kicked) {
+        sh->journal_kicked = 1;
+        journal_kick(sh->avl);
+      }
+      pthread_cond_wait(&sh->journal_cond, &sh->journal_lock);
+      if (sh->journal_err < 0)
+        return sh->journal_err;
+    } else if ((rc = journal_flush_locked(sh, 0)) < 0) {
+      return rc;
+    }
+  }
+  return KVDBLITE_SUCCESS;
+}
+
+// Append a record to the journal buffer. Called with sh->journal_lock held, the
+// sequence number of the record is returned in *lsn. The records are
+//   [PUT_CRC][varint klen][varint vlen][key][value][u32 CRC32]
+//   [DEL_CRC][varint klen][key][u32 CRC32]
+// with the CRC32 of what comes before it, little endian.
+static int add_transaction(struct shard *sh, uint8_t op, const avl_key_t *key, uint32_t klen,
+                           const avl_value_t *value, uint32_t vlen, uint64_t *lsn) {
+  int rc;
+  size_t need = 1 + 2 * VARINT_MAX + klen + vlen + 4, start;
+
+  if ((rc = journal_reserve(sh, need)) < 0)
+    return rc;
+
+  start = sh->journal.len;
+  if (op == KVDBLITE_OP_INSERT) {
+    journal_put_uint8_t(sh, KVDBLITE_OP_PUT_CRC);
+    journal_put_varint(sh, klen);
+    journal_put_varint(sh, vlen);
+    journal_put_bytes(sh, key, klen);
+    journal_put_bytes(sh, value, vlen);
+  } else {
+    journal_put_uint8_t(sh, KVDBLITE_OP_DEL_CRC);
+    journal_put_varint(sh, klen);
+    journal_put_bytes(sh, key, klen);
+  }
+  journal_put_uint32_t(sh, calc_CRC32(sh->journal.data + start, sh->journal.len - start, 0));
+
+  *lsn = ++sh->journal_lsn;
+  journal_appended(sh);
+  return KVDBLITE_SUCCESS;
+}
+
+static int flush_all_journals(struct avltree *avl, int sync) {
+  int rc = KVDBLITE_SUCCESS, r;
+  unsigned i;
+  if (avl->dbname == NULL)
+    return KVDBLITE_SUCCESS;
+  for (i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    pthread_mutex_lock(&sh->journal_lock);
+    if ((r = journal_flush_locked(sh, sync)) < 0)
+      rc = r;
+    pthread_mutex_unlock(&sh->journal_lock);
+  }
+  return rc;
+}
+
+int avl_flush_journal(struct avltree *avl) { return flush_all_journals(avl, 0); }
+
+int avl_sync(struct avltree *avl) { return flush_all_journals(avl, 1); }
+
+// A PUT/DEL record, the op has been read already
+static int debug_dump_compact(uint8_t op, FILE *file) {
+  int put = op == KVDBLITE_OP_PUT || op == KVDBLITE_OP_PUT_CRC;
+  uint32_t klen, vlen = 0;
+  uint8_t *key, *value = NULL, crc[4];
+
+  if (fread_varint(&klen, file) < 0 || (put && fread_varint(&vlen, file) < 0) ||
+      fread_str(&key, klen, file) < 0)
+    return -1;
+  if (put && fread_str(&value, vlen, file) < 0) {
+    free(key);
+    return -1;
+  }
+  printf("%s: Len: %u %s\n", put ? "INSERT" : "REMOVE", klen, key);
+  if (put)
+    printf("Len: %u %s\n", vlen, value);
+  free(key);
+  free(value);
+  if (op == KVDBLITE_OP_PUT_CRC || op == KVDBLITE_OP_DEL_CRC) {
+    if (fread(crc, sizeof crc, 1, file) != 1)
+      return -1;
+    printf("CRC32 %08x\n", get_le32(crc));
+  }
+  return 1;
+}
+
+static int debug_dump_transactions(char *journalname) {
+  uint32_t l;
+  uint8_t *v;
+
+  FILE *file = fopen(journalname, "r");
+  if (!file) {
+    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  }
+
+  uint8_t op;
+
+  while (1) {
+    if (fread_uint8_t(&op, file) < 0) {
+      fclose(file);
+      return 1;
+    }
+
+    switch (op) {
+      case KVDBLITE_OP_INSERT:
+      case KVDBLITE_OP_INSERT_CRC:
+        printf("INSERT: ");
+        break;
+      case KVDBLITE_OP_REMOVE:
+      case KVDBLITE_OP_REMOVE_CRC:
+        printf("REMOVE: ");
+        break;
+      case KVDBLITE_OP_BATCH_BEGIN:
+        // The records of a batch follow each other, framed by a count and a
+        // length up front and a COMMIT byte plus CRC32 at the end
+        if (fread_uint32_t(&l, file) < 0 || fread_uint32_t(&l, file) < 0) {
+          fclose(file);
+          return -1;
+        }
+        printf("BATCH: %u bytes\n", l);
+        continue;
+      case KVDBLITE_OP_BATCH_PART:
+        // The same with the batch id and the shards that have a part
+        if (fread_uint32_t(&l, file) < 0 || fread_uint32_t(&l, file) < 0 ||
+            fread_str(&v, 8, file) < 0) {
+          fclose(file);
+          return -1;
+        }
+        printf("BATCH PART: %u bytes, id %llu\n", l, (unsigned long long)get_le64(v));
+        free(v);
+        if (fread_uint32_t(&l, file) < 0 || fread_str(&v, (l + 7) / 8, file) < 0) {
+          fclose(file);
+          return -1;
+        }
+        free(v);
+        continue;
+      case KVDBLITE_OP_BATCH_ABORT:
+        if (fread_str(&v, 8, file) < 0 || fread_uint32_t(&l, file) < 0) {
+          fclose(file);
+          return -1;
+        }
+        printf("ABORT: id %llu\n", (unsigned long long)get_le64(v));
+        free(v);
+        continue;
+      case KVDBLITE_OP_BATCH_COMMIT:
+        if (fread_uint32_t(&l, file) < 0) {
+          fclose(file);
+          return -1;
+        }
+        printf("COMMIT: CRC32 %08x\n", l);
+        continue;
+      case KVDBLITE_OP_PUT:
+      case KVDBLITE_OP_PUT_CRC:
+      case KVDBLITE_OP_DEL:
+      case KVDBLITE_OP_DEL_CRC:
+        if (debug_dump_compact(op, file) < 0) {
+          fclose(file);
+          return -1;
+        }
+        continue;
+      default:
+        // All KVDBLITE_OP_ codes are characters for easy debug
+        printf("UNKNOWN %c: ", op);
+    }
+
+    // Key
+    if (fread_uint32_t(&l, file) < 0) {
+      fclose(file);
+      return -1;
+    }
+    printf("Len: %d ", l);
+    if (fread_str(&v, l, file) < 0) {
+      fclose(file);
+      return -1;
+    }
+    printf("%s\n", v);
+
+    if (op == KVDBLITE_OP_INSERT || op == KVDBLITE_OP_INSERT_CRC) {
+      // Value
+      if (fread_uint32_t(&l, file) < 0) {
+        fclose(file);
+        return -1;
+      }
+      printf("Len: %d ", l);
+      if (fread_str(&v, l, file) < 0) {
+        fclose(file);
+        return -1;
+      }
+      printf("%s\n", v);
+    }
+    if (op == KVDBLITE_OP_INSERT_CRC || op == KVDBLITE_OP_REMOVE_CRC) {
+      if (fread_uint32_t(&l, file) < 0) {
+        fclose(file);
+        return -1;
+      }
+      printf("CRC32 %08x\n", l);
+    }
+  }
+
+  fclose(file);
+}
+
+// One insert/remove record, pointing into a decode buffer
+struct journal_record {
+  uint8_t op;
+  const avl_key_t *key;
+  const avl_value_t *value;
+  uint32_t klen, vlen;
+};
+
+// PUT/DEL records, see add_transaction()
+static long decode_compact(const uint8_t *p, size_t len, struct journal_record *r) {
+  size_t off = 1, used;
+  if (!(used = varint_get(p + off, len - off, &r->klen)))
+    return len - off < VARINT_MAX ? KVDBLITE_UNEXPECTED_EOF : -1;
+  off += used;
+  r->vlen = 0;
+  if (r->op == KVDBLITE_OP_INSERT) {
+    if (!(used = varint_get(p + off, len - off, &r->vlen)))
+      return len - off < VARINT_MAX ? KVDBLITE_UNEXPECTED_EOF : -1;
+    off += used;
+  }
+  if (r->klen == 0)
+    return -1;
+  if (len - off < r->klen || len - off - r->klen < r->vlen)
+    return KVDBLITE_UNEXPECTED_EOF;
+  r->key = p + off;
+  off += r->klen;
+  r->value = r->op == KVDBLITE_OP_INSERT ? p + off : NULL;
+  off += r->vlen;
+  if (p[0] == KVDBLITE_OP_PUT_CRC || p[0] == KVDBLITE_OP_DEL_CRC) {
+    if (len - off < 4)
+      return KVDBLITE_UNEXPECTED_EOF;
+    off += 4;
+  }
+  return (long)off;
+}
+
+// Decode one insert/remove record (the layouts add_transaction() and
+// batch_add() write, or the fixed length ones of older journals) from
+// memory. Returns the number of bytes used, KVDBLITE_UNEXPECTED_EOF if the
+// record runs past len, or -1 if it is malformed (an unknown op, an empty
+// key). The op comes back as plain insert or remove, record_crc_ok() checks
+// the CRC of the records that carry one.
+static long decode_record(const uint8_t *p, size_t len, struct journal_record *r) {
+  size_t off = 1 + 4;
+  int checked;
+  if (len < 1)
+    return KVDBLITE_UNEXPECTED_EOF;
+  r->op = p[0];
+  if (r->op == KVDBLITE_OP_PUT || r->op == KVDBLITE_OP_PUT_CRC) {
+    r->op = KVDBLITE_OP_INSERT;
+    return decode_compact(p, len, r);
+  }
+  if (r->op == KVDBLITE_OP_DEL || r->op == KVDBLITE_OP_DEL_CRC) {
+    r->op = KVDBLITE_OP_REMOVE;
+    return decode_compact(p, len, r);
+  }
+  checked = r->op == KVDBLITE_OP_INSERT_CRC || r->op == KVDBLITE_OP_REMOVE_CRC;
+  if (checked)
+    r->op = r->op == KVDBLITE_OP_INSERT_CRC ? KVDBLITE_OP_INSERT : KVDBLITE_OP_REMOVE;
+  else if (r->op != KVDBLITE_OP_INSERT && r->op != KVDBLITE_OP_REMOVE)
+    return -1;
+  if (len < off)
+    return KVDBLITE_UNEXPECTED_EOF;
+  r->klen = get_le32(p + 1);
+  if (r->klen == 0)
+    return -1;
+  if (len - off < r->klen)
+    return KVDBLITE_UNEXPECTED_EOF;
+  r->key = p + off;
+  off += r->klen;
+  r->value = NULL;
+  r->vlen = 0;
+  if (r->op == KVDBLITE_OP_INSERT) {
+    if (len - off < 4)
+      return KVDBLITE_UNEXPECTED_EOF;
+    r->vlen = get_le32(p + off);
+    off += 4;
+    if (len - off < r->vlen)
+      return KVDBLITE_UNEXPECTED_EOF;
+    r->value = p + off;
+    off += r->vlen;
+  }
+  if (checked) {
+    if (len - off < 4)
+      return KVDBLITE_UNEXPECTED_EOF;
+    off += 4;
+  }
+  return (long)off;
+}
+
+// Insert into / remove from the shard's AVL tree or B+tree, see insert() and remove_()
+static inline int shard_insert(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                               const avl_value_t *value, uint32_t vlen) {
+  if (sh->btree)
+    return bt_insert(sh, key, klen, value, vlen);
+  return insert(sh, key, klen, value, vlen, shard_wroot(sh));
+}
+
+static inline int shard_remove(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  if (sh->btree)
+    return bt_remove(sh, key, klen);
+  return remove_(sh, key, klen, shard_wroot(sh));
+}
+
+// Apply a record to the tree, returns the change in the number of keys
+// Read only database: a deleted key that is in the mapped snapshot stays in
+// the tree as a node without a value. Nothing is applied once the snapshot
+// turned out to be corrupt, see map_bad().
+static int overlay_apply(struct shard *sh, const struct journal_record *r) {
+  struct node **rp = shard_wroot(sh);
+  struct node *a = avl_search(r->key, r->klen, *rp);
+  uint64_t pos;
+  int mapped = map_find_pos(&sh->map, r->key, r->klen, NULL, &pos);
+  if (mapped < 0)
+    return 0;
+  int shadow = a == NULL ? 0 : a->value == NULL ? 2 : 1;
+  int before = a != NULL ? a->value != NULL : mapped;
+
+  if (r->op == KVDBLITE_OP_INSERT) {
+    if (insert(sh, r->key, r->klen, r->value, r->vlen, rp) < 0)
+      return 0;
+    if (mapped)
+      map_shadow_add(&sh->map, pos, 1 - shadow);
+    return !before;
+  }
+  if (!mapped) {
+    remove_(sh, r->key, r->klen, rp);
+    return -before;
+  }
+  if (insert(sh, r->key, r->klen, (const avl_value_t *)"", 0, rp) < 0)
+    return 0;
+  a = avl_search(r->key, r->klen, *rp);
+  node_free_value(sh, a);
+  a->value = NULL;
+  a->vlen = 0;
+  a->zvalue = a->logged = 0;
+  map_shadow_add(&sh->map, pos, 2 - shadow);
+  return -before;
+}
+
+// Returns the change in the number of keys
+static int apply_record(struct shard *sh, const struct journal_record *r) {
+  int rc;
+  if (sh->map.base != NULL)
+    return overlay_apply(sh, r);
+  if (r->op == KVDBLITE_OP_INSERT) {
+    rc = shard_insert(sh, r->key, r->klen, r->value, r->vlen);
+    return rc < 0 ? 0 : rc;
+  }
+  return -shard_remove(sh, r->key, r->klen);
+}
+
+// Check the CRC of a record decode_record() accepted, records without one pass
+static int record_crc_ok(const uint8_t *p, long used) {
+  if (p[0] != KVDBLITE_OP_PUT_CRC && p[0] != KVDBLITE_OP_DEL_CRC &&
+      p[0] != KVDBLITE_OP_INSERT_CRC && p[0] != KVDBLITE_OP_REMOVE_CRC)
+    return 1;
+  return get_le32(p + used - 4) == calc_CRC32(p, used - 4, 0);
+}
+
+// Journal replay works on a mapping of the whole file. A first pass checks
+// every record and batch and notes where the records are. Once the journals
+// of every shard have been through it, replay_batches() decides which
+// batches of several shards go in, a key written more than once keeps only
+// its last record, and what is left is applied in journal order. The result
+// is the same as applying the valid prefix one record at a time, with each
+// key touching the tree once.
+struct replay {
+  struct shard *sh;
+  int fd; // -1 if there is no journal
+  const uint8_t *base;
+  size_t size;
+  uint64_t good; // End of the valid prefix
+  int rc;        // How the first pass ended
+  uint64_t *recs; // Record offsets, REPLAY_DEAD once a later record replaces one
+  size_t n, cap;
+  struct replay_slot {
+    uint64_t hash;
+    uint64_t rec; // Index into recs + 1, 0 for an empty slot
+  } *slots;
+  size_t nslots, used;
+  // Parts of batches of several shards, with records recs[first, first + n)
+  struct replay_part {
+    uint64_t id;
+    const uint8_t *shards; // Bitmap of the shards with a part
+    size_t first, n;
+    int ok;     // Goes in, set by replay_batches()
+    int orphan; // Its batch didn't make it and nothing says so yet
+  } *parts;
+  size_t nparts, partcap;
+  uint64_t *aborts; // Ids of the BATCH_ABORT records
+  size_t naborts, abortcap;
+};
+
+#define REPLAY_DEAD UINT64_MAX
+
+// Room for element n of an array with *cap elements of size bytes, NULL if
+// there is no memory (p is still valid then)
+static void *replay_room(void *p, size_t n, size_t *cap, size_t size) {
+  size_t c = *cap ? *cap * 2 : 1024;
+  if (n < *cap)
+    return p;
+  if ((p = realloc(p, c * size)) != NULL)
+    *cap = c;
+  return p;
+}
+
+static int replay_grow(struct replay *rp) {
+  size_t i, j, nslots = rp->nslots ? rp->nslots * 2 : 1024;
+  struct replay_slot *slots = calloc(nslots, sizeof(*slots));
+  if (slots == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  for (i = 0; i < rp->nslots; i++) {
+    if (rp->slots[i].rec == 0)
+      continue;
+    for (j = rp->slots[i].hash & (nslots - 1); slots[j].rec != 0; j = (j + 1) & (nslots - 1))
+      ;
+    slots[j] = rp->slots[i];
+  }
+  free(rp->slots);
+  rp->slots = slots;
+  rp->nslots = nslots;
+  return KVDBLITE_SUCCESS;
+}
+
+// Note a checked record
+static int replay_note(struct replay *rp, uint64_t off) {
+  uint64_t *recs = replay_room(rp->recs, rp->n, &rp->cap, sizeof *recs);
+  if (recs == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  rp->recs = recs;
+  rp->recs[rp->n++] = off;
+  return KVDBLITE_SUCCESS;
+}
+
+// Keep record i, retiring the earlier record of the same key
+static int replay_dedup(struct replay *rp, size_t i) {
+  struct journal_record r, q;
+  uint64_t h;
+  size_t j, mask;
+
+  decode_record(rp->base + rp->recs[i], rp->size - rp->recs[i], &r);
+  h = hash_key(r.key, r.klen);
+  if ((rp->used + 1) * 2 > rp->nslots && replay_grow(rp) < 0)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+
+  mask = rp->nslots - 1;
+  for (j = h & mask; rp->slots[j].rec != 0; j = (j + 1) & mask) {
+    uint64_t *prev = &rp->recs[rp->slots[j].rec - 1];
+    if (rp->slots[j].hash != h)
+      continue;
+    decode_record(rp->base + *prev, rp->size - *prev, &q);
+    if (keycmp(q.key, q.klen, r.key, r.klen) == 0) {
+      *prev = REPLAY_DEAD;
+      break;
+    }
+  }
+  if (rp->slots[j].rec == 0)
+    rp->used++;
+  rp->slots[j].hash = h;
+  rp->slots[j].rec = i + 1;
+  return KVDBLITE_SUCCESS;
+}
+
+// Bytes in the shard bitmap of a batch part, see batch_journal()
+static inline size_t batch_map_size(const struct avltree *avl) { return (avl->nshards + 7) / 8; }
+
+// A record that ends at end and fails its checks. If it runs to the end of
+// the file it is the torn last write of a crash, anything after it means the
+// file is damaged.
+static inline long replay_bad(const struct replay *rp, uint64_t end) {
+  return end >= rp->size ? KVDBLITE_UNEXPECTED_EOF : KVDBLITE_CORRUPT;
+}
+
+// Whether the file is all zero bytes from off, which a file system can leave
+// after a crash when the file size got to the disk before the data did
+static int replay_zeros(const struct replay *rp, uint64_t off) {
+  for (; off < rp->size; off++) {
+    if (rp->base[off] != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Check a batch starting at off, all of it or none of it goes in. Returns the
+// size of the batch, or the error replay_scan() ends with. The part of a
+// batch of several shards is noted in rp->parts for replay_batches().
+static long replay_batch(struct replay *rp, uint64_t off) {
+  const uint8_t *p = rp->base + off, *payload;
+  size_t left = rp->size - off, pos, extra = 0;
+  uint32_t count, len, i;
+  struct journal_record r;
+  long used;
+  int rc;
+
+  if (*p == KVDBLITE_OP_BATCH_PART)
+    extra = 8 + 4 + batch_map_size(rp->sh->avl);
+  if (left < 1 + 4 + 4 + extra)
+    return KVDBLITE_UNEXPECTED_EOF;
+  count = get_le32(p + 1);
+  len = get_le32(p + 5);
+  if (left - 9 - extra < (size_t)len + 1 + 4)
+    return KVDBLITE_UNEXPECTED_EOF;
+  payload = p + 9 + extra;
+  if (payload[len] != KVDBLITE_OP_BATCH_COMMIT ||
+      calc_CRC32(p + 9, extra + len, 0) != get_le32(payload + len + 1))
+    return replay_bad(rp, off + 9 + extra + len + 1 + 4);
+  // Past the CRC, so written like this
+  if (extra && get_le32(p + 17) != rp->sh->avl->nshards)
+    return KVDBLITE_CORRUPT;
+
+  for (i = 0, pos = 0; i < count; i++, pos += used) {
+    if ((used = decode_record(payload + pos, len - pos, &r)) < 0 ||
+        !record_crc_ok(payload + pos, used))
+      break;
+  }
+  if (i != count || pos != len)
+    return KVDBLITE_CORRUPT;
+
+  if (extra) {
+    struct replay_part *parts = replay_room(rp->parts, rp->nparts, &rp->partcap, sizeof *parts);
+    if (parts == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    rp->parts = parts;
+    parts[rp->nparts++] = (struct replay_part){.id = get_le64(p + 9), .shards = p + 21,
+                                               .first = rp->n, .n = count};
+  }
+  for (i = 0, pos = 0; i < count; i++, pos += used) {
+    used = decode_record(payload + pos, len - pos, &r);
+    if ((rc = replay_note(rp, off + 9 + extra + pos)) < 0)
+      return rc;
+  }
+  return 9 + (long)(extra + len) + 1 + 4;
+}
+
+// Check a BATCH_ABORT record starting at off, returns its size
+static long replay_abort(struct replay *rp, uint64_t off) {
+  const uint8_t *p = rp->base + off;
+  uint64_t *aborts;
+
+  if (rp->size - off < 1 + 8 + 4)
+    return KVDBLITE_UNEXPECTED_EOF;
+  if (calc_CRC32(p, 9, 0) != get_le32(p + 9))
+    return replay_bad(rp, off + 1 + 8 + 4);
+  if ((aborts = replay_room(rp->aborts, rp->naborts, &rp->abortcap, sizeof *aborts)) == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  rp->aborts = aborts;
+  rp->aborts[rp->naborts++] = get_le64(p + 1);
+  return 1 + 8 + 4;
+}
+
+// First pass over a journal of sh. A record or batch that is cut short by the
+// end of the file, or fails its checks and runs to the end of the file, is the
+// torn last write of a crash. It ends the pass with KVDBLITE_UNEXPECTED_EOF
+// and replay_apply() cuts it off. One with more of the file after it (a bad
+// CRC, an unknown op) ends it with KVDBLITE_CORRUPT, and the file is left
+// alone for the open to fail.
+static int replay_scan(struct replay *rp, struct shard *sh, const char *journalname) {
+  struct journal_record r;
+  struct stat st;
+  long used;
+  void *base;
+
+  rp->sh = sh;
+  // Read only databases leave the files alone
+  rp->fd = open(journalname, sh->avl->readonly ? O_RDONLY : O_RDWR);
+  if (rp->fd < 0)
+    return rp->rc = errno == ENOENT ? KVDBLITE_SUCCESS : KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  if (fstat(rp->fd, &st) < 0 || st.st_size == 0)
+    return KVDBLITE_SUCCESS;
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, rp->fd, 0);
+  if (base == MAP_FAILED)
+    return rp->rc = KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+  rp->base = base;
+  rp->size = st.st_size;
+
+  while (rp->good < rp->size) {
+    const uint8_t *p = rp->base + rp->good;
+    if (*p == KVDBLITE_OP_BATCH_BEGIN || *p == KVDBLITE_OP_BATCH_PART)
+      used = replay_batch(rp, rp->good);
+    else if (*p == KVDBLITE_OP_BATCH_ABORT)
+      used = replay_abort(rp, rp->good);
+    else if ((used = decode_record(p, rp->size - rp->good, &r)) == -1)
+      used = KVDBLITE_CORRUPT;
+    else if (used >= 0 && !record_crc_ok(p, used))
+      used = replay_bad(rp, rp->good + used);
+    else if (used >= 0 && (rp->rc = replay_note(rp, rp->good)) < 0)
+      used = rp->rc;
+    if (used == KVDBLITE_CORRUPT && replay_zeros(rp, rp->good))
+      used = KVDBLITE_UNEXPECTED_EOF;
+    if (used < 0) {
+      rp->rc = (int)used;
+      break;
+    }
+    rp->good += used;
+  }
+  return rp->rc;
+}
+
+struct replay_ref {
+  uint64_t id;
+  unsigned shard;
+  struct replay_part *part;
+};
+
+static int replay_ref_cmp(const void *a, const void *b) {
+  const struct replay_ref *x = a, *y = b;
+  if (x->id != y->id)
+    return x->id < y->id ? -1 : 1;
+  return (x->shard > y->shard) - (x->shard < y->shard);
+}
+
+static int u64_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// A batch of several shards goes in if none of its parts was aborted and
+// every shard it lists has its part in a journal, or in the snapshot, which
+// holds every part up to its batch id (see kvdb_write_batch_commit()). Also
+// picks up where the batch ids left off.
+static int replay_batches(struct avltree *avl, struct replay *rps, size_t nrps) {
+  struct replay_ref *refs;
+  uint64_t *aborts, seq = 0;
+  size_t i, j, k, nrefs = 0, naborts = 0;
+  unsigned t;
+
+  for (t = 0; t < avl->nshards; t++) {
+    avl->shards[t].batch_id = avl->shards[t].snap_batch;
+    if (avl->shards[t].snap_batch > seq)
+      seq = avl->shards[t].snap_batch;
+  }
+  for (i = 0; i < nrps; i++) {
+    nrefs += rps[i].nparts;
+    naborts += rps[i].naborts;
+  }
+  refs = malloc((nrefs + 1) * sizeof *refs);
+  aborts = malloc((naborts + 1) * sizeof *aborts);
+  if (refs == NULL || aborts == NULL) {
+    // No part goes in
+    free(refs);
+    free(aborts);
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  }
+  for (i = 0, nrefs = naborts = 0; i < nrps; i++) {
+    struct shard *sh = rps[i].sh;
+    for (j = 0; j < rps[i].nparts; j++) {
+      struct replay_part *p = &rps[i].parts[j];
+      refs[nrefs++] = (struct replay_ref){p->id, (unsigned)(sh - avl->shards), p};
+      if (p->id > sh->batch_id)
+        sh->batch_id = p->id;
+      if (p->id > seq)
+        seq = p->id;
+    }
+    for (j = 0; j < rps[i].naborts; j++) {
+      aborts[naborts++] = rps[i].aborts[j];
+      if (rps[i].aborts[j] > seq)
+        seq = rps[i].aborts[j];
+    }
+  }
+  qsort(refs, nrefs, sizeof *refs, replay_ref_cmp);
+  qsort(aborts, naborts, sizeof *aborts, u64_cmp);
+
+  for (i = 0; i < nrefs; i = j) {
+    uint64_t id = refs[i].id;
+    const uint8_t *shards = refs[i].part->shards;
+    int aborted = bsearch(&id, aborts, naborts, sizeof *aborts, u64_cmp) != NULL, ok = !aborted;
+    for (j = i; j < nrefs && refs[j].id == id; j++)
+      ;
+    for (t = 0, k = i; t < avl->nshards && ok; t++) {
+      if (!(shards[t / 8] & (1 << (t % 8))))
+        continue;
+      while (k < j && refs[k].shard < t)
+        k++;
+      ok = (k < j && refs[k].shard == t) || id <= avl->shards[t].snap_batch;
+    }
+    for (k = i; k < j; k++) {
+      refs[k].part->ok = ok;
+      refs[k].part->orphan = !ok && !aborted;
+    }
+  }
+  avl->batch_seq = seq;
+  free(refs);
+  free(aborts);
+  return KVDBLITE_SUCCESS;
+}
+
+// Second pass, once replay_batches() has been through every journal. The
+// torn end of the journal is chopped off, so that new records don't end up
+// behind it.
+static int replay_apply(struct replay *rp) {
+  struct journal_record r;
+  size_t i, j;
+  int rc = rp->rc;
+
+  for (i = 0; i < rp->nparts; i++) {
+    for (j = 0; !rp->parts[i].ok && j < rp->parts[i].n; j++)
+      rp->recs[rp->parts[i].first + j] = REPLAY_DEAD;
+  }
+  for (i = 0; i < rp->n; i++) {
+    // Without the memory to find them, replaced records are applied as well,
+    // which comes to the same
+    if (rp->recs[i] != REPLAY_DEAD && replay_dedup(rp, i) < 0)
+      break;
+  }
+
+  rp->sh->avl->replay_records += rp->n;
+  for (i = 0; i < rp->n; i++) {
+    if (rp->recs[i] == REPLAY_DEAD)
+      continue;
+    decode_record(rp->base + rp->recs[i], rp->size - rp->recs[i], &r);
+    apply_record(rp->sh, &r);
+    rp->sh->avl->replay_applied++;
+  }
+
+  if (rc == KVDBLITE_UNEXPECTED_EOF && !rp->sh->avl->readonly) {
+    // Drop the torn tail
+    if (ftruncate(rp->fd, rp->good) < 0)
+      rc = KVDBLITE_JOURNAL_WRITE_ERR;
+  }
+  return rc;
+}
+
+static void replay_free(struct replay *rp) {
+  if (rp->base != NULL)
+    munmap((void *)rp->base, rp->size);
+  if (rp->fd >= 0)
+    close(rp->fd);
+  free(rp->recs);
+  free(rp->slots);
+  free(rp->parts);
+  free(rp->aborts);
+}
+
+// Replay the journals of every shard into the trees. A checkpoint that didn't
+// finish leaves the older records of a shard in the rotated journal, they go
+// first. Returns the first error, a torn journal isn't one. A damaged one is,
+// and then nothing is applied or written. The rotated journal was complete
+// when the newer one was started, so if it stops early while the newer one
+// has records, applying those would make a state that never was: that counts
+// as damage too. With nothing after it, its torn end is cut off as usual.
+static int replay_journals(struct avltree *avl) {
+  struct replay *rps = calloc(2 * avl->nshards, sizeof *rps);
+  int rc = KVDBLITE_SUCCESS, r;
+  size_t i, j;
+
+  if (rps == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  for (i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    replay_scan(&rps[2 * i], sh, (const char *)sh->rotatedname);
+    replay_scan(&rps[2 * i + 1], sh, (const char *)sh->journalname);
+  }
+  for (i = 0; i < 2 * avl->nshards && rc == KVDBLITE_SUCCESS; i++) {
+    if (rps[i].rc < 0 && rps[i].rc != KVDBLITE_UNEXPECTED_EOF)
+      rc = rps[i].rc;
+    else if (i % 2 == 0 && rps[i].rc == KVDBLITE_UNEXPECTED_EOF && rps[i + 1].size > 0)
+      rc = KVDBLITE_CORRUPT;
+  }
+  if (rc < 0)
+    goto out;
+
+  rc = replay_batches(avl, rps, 2 * avl->nshards);
+  for (i = 0; i < 2 * avl->nshards; i++) {
+    if ((r = replay_apply(&rps[i])) < 0 && r != KVDBLITE_UNEXPECTED_EOF && rc == KVDBLITE_SUCCESS)
+      rc = r;
+  }
+
+  // A part whose batch didn't make it must not be completed by a later
+  // snapshot of another shard, see kvdb_write_batch_commit()
+  for (i = 0; i < 2 * avl->nshards && !avl->readonly; i++) {
+    uint64_t lsn = 0;
+    for (j = 0; j < rps[i].nparts; j++) {
+      if (rps[i].parts[j].orphan && (r = batch_abort(rps[i].sh, rps[i].parts[j].id, &lsn)) < 0 &&
+          rc == KVDBLITE_SUCCESS)
+        rc = r;
+    }
+    if (lsn != 0 && (r = journal_sync_to(rps[i].sh, lsn)) < 0 && rc == KVDBLITE_SUCCESS)
+      rc = r;
+  }
+out:
+  for (i = 0; i < 2 * avl->nshards; i++)
+    replay_free(&rps[i]);
+  free(rps);
+  return rc;
+}
+
+//
+// End Journalling
+//
+
+//
+// AVL tree internals
+//
+
+static inline int max(int a, int b) { return a > b ? a : b; }
+
+static inline int min(int a, int b) { return a < b ? a : b; }
+
+static inline void fix_diffs_right(int8_t *ap, int8_t *bp) {
+  int a = *ap, b = *bp, k = (b > 0) * b;
+  *ap = k + (a - b) + 1;
+  *bp = max(b, k + a + 1) + 1;
+}
+
+static inline void fix_diffs_left(int8_t *ap, int8_t *bp) {
+  int a = *ap, b = *bp, k = (b < 0) * b;
+  *ap = k + (a - b) - 1;
+  *bp = min(b, k + a - 1) - 1;
+}
+
+static inline uint32_t node_size(struct node *a) { return a == NULL ? 0 : a->size; }
+
+static inline void fix_size(struct node *a) {
+  a->size = node_size(a->left) + node_size(a->right) + 1;
+}
+
+static inline void rotate_right(struct node **rp) {
+  struct node *a = *rp, *b = a->left;
+  a->left = b->right;
+  b->right = a;
+  fix_diffs_right(&a->diff, &b->diff);
+  fix_size(a);
+  fix_size(b);
+  *rp = b;
+}
+
+static inline void rotate_left(struct node **rp) {
+  struct node *a = *rp, *b = a->right;
+  a->right = b->left;
+  b->left = a;
+  fix_diffs_left(&a->diff, &b->diff);
+  fix_size(a);
+  fix_size(b);
+  *rp = b;
+}
+
+static struct node *node_cow(struct shard *sh, struct node **link);
+
+// *rp must be writable, see node_cow()
+static inline int balance(struct shard *sh, struct node **rp) {
+  struct node *a = *rp;
+  if (a->diff == 2) {
+    if (node_cow(sh, &a->right)->diff == -1) {
+      node_cow(sh, &a->right->left);
+      rotate_right(&a->right);
+    }
+    rotate_left(rp);
+    return 1;
+  } else if (a->diff == -2) {
+    if (node_cow(sh, &a->left)->diff == 1) {
+      node_cow(sh, &a->left->right);
+      rotate_left(&a->left);
+    }
+    rotate_right(rp);
+    return 1;
+  }
+  return 0;
+}
+
+// Compare two byte strings: memcmp() over the common part, then the shorter
+// one sorts first. This is the same order strcmp() gives for C strings.
+static inline int keycmp(const avl_key_t *a, uint32_t alen, const avl_key_t *b, uint32_t blen) {
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  if (c != 0)
+    return c;
+  return (alen > blen) - (alen < blen);
+}
+
+// Copy of a byte string with a NUL added, so the string API can use it as is
+static uint8_t *dup_bytes(const uint8_t *s, uint32_t l) {
+  uint8_t *p = malloc((size_t)l + 1);
+  if (p == NULL)
+    return NULL;
+  memcpy(p, s, l);
+  p[l] = 0;
+  return p;
+}
+
+// A node block is laid out as [struct node][key][NUL][inline value space].
+// vcap is the inline space, values that don't fit live in their own block.
+static inline uint8_t *node_inline_value(struct node *a) {
+  return (uint8_t *)(a + 1) + a->klen + 1;
+}
+
+static inline size_t node_block_size(struct node *a) {
+  return sizeof *a + a->klen + 1 + a->vcap;
+}
+
+static inline int node_value_is_inline(struct node *a) {
+  return a->vcap > 0 && a->value == node_inline_value(a);
+}
+
+// Checkpoint: was the node already in the tree when the running checkpoint froze it
+static inline int node_frozen(struct shard *sh, struct node *a) {
+  return sh->ckpt_stamp != 0 && (a->cow & ~1u) != sh->ckpt_stamp;
+}
+
+// Bytes the value takes where it is stored
+static inline size_t node_value_bytes(const struct node *a) {
+  if (a->logged)
+    return KVDBLITE_VLOG_REF;
+  return a->zvalue ? 4 + (size_t)get_le32(a->value) : (size_t)a->vlen + 1;
+}
+
+// Out of line values don't record when they were made, so a checkpoint keeps
+// every one that is replaced while it runs
+static inline void node_free_value(struct shard *sh, struct node *a) {
+  if (a->value != NULL && a->logged)
+    vlog_ref_drop(sh->vlog, a->value, a->klen);
+  if (a->value != NULL && !node_value_is_inline(a))
+    shard_free_block(sh, a->value, node_value_bytes(a), 1);
+}
+
+static void node_free(struct shard *sh, struct node *a) {
+  node_free_value(sh, a);
+  shard_free_block(sh, a, node_block_size(a), node_frozen(sh, a));
+}
+
+static void node_track_cow(struct shard *sh, struct node *a) {
+  if (sh->ncow == sh->cowcap)
+    sh->cow = mvcc_grow(sh->cow, &sh->cowcap, sizeof *sh->cow);
+  sh->cow[sh->ncow++] = a;
+  a->cow |= 1;
+}
+
+// A copy of a (block, key and inline value, an out of line value moves over
+// to the copy) that takes its place in the hash index. The original is
+// retired, or kept for the checkpoint if it is frozen.
+static struct node *node_copy(struct shard *sh, struct node *a) {
+  size_t size = node_block_size(a);
+  struct node *b = slab_alloc(&sh->slab, size);
+  if (b == NULL) {
+    // Half done copies can't be backed out
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(b, a, size);
+  b->key = (uint8_t *)(b + 1);
+  if (node_value_is_inline(a))
+    b->value = node_inline_value(b);
+  b->cow = sh->ckpt_stamp;
+  hidx_move(sh, a, b);
+  shard_free_block(sh, a, size, node_frozen(sh, a));
+  return b;
+}
+
+// Copy on write: return a node at *link that this write may change. Nodes
+// reachable from the published root are copied, see node_copy(). Only the
+// copy is linked in at *link, so link itself must already be private. Does
+// nothing unless the shard is in MVCC mode or checkpointing.
+static struct node *node_cow(struct shard *sh, struct node **link) {
+  struct node *a = *link, *b;
+  if (!sh->mvcc || (a->cow & 1))
+    return a;
+  // Without lock free readers only the checkpoint needs the old node, and it
+  // doesn't look at nodes made after the tree was frozen
+  if (!sh->avl->opts.mvcc && !node_frozen(sh, a))
+    return a;
+  b = node_copy(sh, a);
+  node_track_cow(sh, b);
+  *link = b;
+  return b;
+}
+
+// What to store for a value. With compress_values set, a value that long
+// which shrinks by at least an eighth is compressed into the thread's scratch
+// buffer as [le32 length][LZ data] and bit 0 of *kind is set. With a value
+// log, a value of value_log bytes or more is then appended to it, and what is
+// stored is the reference to it, with bit 1 of *kind set. If appending fails
+// the value stays in memory. Otherwise it is the value, stored with a NUL
+// after it. *size is the bytes to store.
+static const uint8_t *value_pack(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                                 const avl_value_t *value, uint32_t vlen, size_t *size,
+                                 int *kind) {
+  uint32_t min = sh->avl->opts.compress_values, logmin = sh->avl->opts.value_log;
+  size_t cap = (size_t)vlen - vlen / 8, zlen;
+  struct lz_scratch *s = NULL;
+  const uint8_t *p = value;
+
+  *kind = 0;
+  *size = (size_t)vlen + 1;
+  if (min > 0 && vlen >= min && cap > 4 && (s = lz_scratch()) != NULL &&
+      lz_grow(&s->pack, &s->packcap, cap) != NULL &&
+      (zlen = lz_compress(value, vlen, s->pack + 4, cap - 4, s->table)) > 0) {
+    put_le32(s->pack, (uint32_t)zlen);
+    *kind = 1;
+    *size = 4 + zlen;
+    p = s->pack;
+  }
+  if (sh->vlog != NULL && !sh->vlog->readonly && logmin > 0 && vlen >= logmin &&
+      (s != NULL || (s = lz_scratch()) != NULL) &&
+      vlog_append(sh->vlog, key, klen, p, *kind ? *size : vlen, s->ref) == KVDBLITE_SUCCESS) {
+    *kind |= 2;
+    *size = KVDBLITE_VLOG_REF;
+    p = s->ref;
+  }
+  return p;
+}
+
+// Store what value_pack() returned in a
+static int node_store_value(struct shard *sh, struct node *a, const uint8_t *p, size_t size,
+                            int kind, uint32_t vlen) {
+  uint8_t *v = node_inline_value(a);
+  if (size > a->vcap) {
+    v = slab_alloc(&sh->slab, size);
+    if (v == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  }
+  node_free_value(sh, a);
+  if (size > 1)
+    memcpy(v, p, kind ? size : vlen);
+  if (!kind)
+    v[vlen] = 0;
+  a->value = v;
+  a->vlen = vlen;
+  a->zvalue = kind & 1;
+  a->logged = (kind & 2) != 0;
+  if (a->logged)
+    vlog_ref_add(sh->vlog, v, a->klen);
+  return KVDBLITE_SUCCESS;
+}
+
+static int node_set_value(struct shard *sh, struct node *a, const avl_value_t *value,
+                          uint32_t vlen) {
+  size_t size;
+  int kind;
+  const uint8_t *p = value_pack(sh, a->key, a->klen, value, vlen, &size, &kind);
+  return node_store_value(sh, a, p, size, kind, vlen);
+}
+
+// The value as stored, read from the value log if it is in there
+static int node_packed(struct shard *sh, const struct node *a, const uint8_t **p) {
+  uint8_t *q;
+  int rc;
+  *p = a->value;
+  if (!a->logged)
+    return KVDBLITE_SUCCESS;
+  if ((rc = vlog_fetch(sh, a, &q)) < 0)
+    return rc;
+  *p = q;
+  return KVDBLITE_SUCCESS;
+}
+
+// The value's bytes, decompressed if need be, into dst
+static int node_value_copy(struct shard *sh, const struct node *a, uint8_t *dst) {
+  const uint8_t *p;
+  int rc;
+  if ((rc = node_packed(sh, a, &p)) < 0)
+    return rc;
+  if (a->zvalue)
+    return lz_decompress(p + 4, get_le32(p), dst, a->vlen) < 0 ? KVDBLITE_UNEXPECTED_EOF : 0;
+  if (a->vlen > 0)
+    memcpy(dst, p, a->vlen);
+  return 0;
+}
+
+// Point v at a's key and value. A compressed value is decompressed, and a
+// value in the value log read, into the calling thread's scratch buffers,
+// where it stays until the thread's next view.
+static int node_view(struct shard *sh, const struct node *a, struct avl_view *v) {
+  struct lz_scratch *s;
+  const uint8_t *p;
+  int rc;
+  v->key = a->key;
+  v->klen = a->klen;
+  v->value = a->value;
+  v->vlen = a->vlen;
+  if (!a->zvalue && !a->logged)
+    return KVDBLITE_SUCCESS;
+  if ((rc = node_packed(sh, a, &p)) < 0)
+    return rc;
+  v->value = p;
+  if (!a->zvalue)
+    return KVDBLITE_SUCCESS;
+  if ((s = lz_scratch()) == NULL || lz_grow(&s->view, &s->viewcap, (size_t)a->vlen + 1) == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  if (lz_decompress(p + 4, get_le32(p), s->view, a->vlen) < 0)
+    return KVDBLITE_UNEXPECTED_EOF;
+  s->view[a->vlen] = 0;
+  v->value = s->view;
+  return KVDBLITE_SUCCESS;
+}
+
+// For the debug dumps
+static const avl_value_t *node_value_str(struct shard *sh, const struct node *a) {
+  struct avl_view v;
+  if (a->value == NULL || node_view(sh, a, &v) < 0)
+    return (const avl_value_t *)"";
+  return v.value;
+}
+
+static struct node *node_make(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                              const avl_value_t *value, uint32_t vlen) {
+  size_t vsize;
+  int kind;
+  const uint8_t *p = value_pack(sh, key, klen, value, vlen, &vsize, &kind);
+  return node_make_packed(sh, key, klen, p, vsize, kind, vlen);
+}
+
+// A node for a value value_pack() has been through already, p, vsize and
+// kind being what it returned
+static struct node *node_make_packed(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                                     const uint8_t *p, size_t vsize, int kind, uint32_t vlen) {
+  struct node *a;
+  size_t size = sizeof *a + klen + 1;
+
+  if (size + vsize <= SLAB_MAX_SIZE) {
+    // Value goes inline
+    size += vsize;
+  }
+  // Whatever slack the size class leaves is inline value space too
+  size = slab_usable_size(size);
+  a = slab_alloc(&sh->slab, size);
+  if (a == NULL)
+    return NULL;
+  a->left = a->right = NULL;
+  a->cow = sh->ckpt_stamp;
+  a->diff = 0;
+  a->size = 1;
+  a->klen = klen;
+  a->vcap = size - sizeof *a - klen - 1;
+  a->key = (uint8_t *)(a + 1);
+  memcpy(a->key, key, klen);
+  a->key[klen] = 0;
+  a->value = NULL;
+  a->zvalue = a->logged = 0;
+  if (node_store_value(sh, a, p, vsize, kind, vlen) < 0) {
+    slab_free(&sh->slab, a, size);
+    return NULL;
+  }
+  if (sh->mvcc)
+    node_track_cow(sh, a);
+  return a;
+}
+
+static int insert_leaf(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                       const avl_value_t *value, uint32_t vlen, struct node **rp) {
+  struct node *a;
+  if (hidx_reserve(sh, 1) < 0 || (a = node_make(sh, key, klen, value, vlen)) == NULL) {
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  }
+  *rp = a;
+  hidx_add(sh, a);
+  return 1;
+}
+
+// The insert and remove paths keep the links they followed down the tree in
+// path[] (path[0] is the root link) and which way they went at each level in
+// dir[] (1 = right), then walk back up fixing diffs without recursion.
+// In MVCC mode every node on the way down is made private with node_cow().
+
+// Returns 1 if a new node was added, 0 if an existing value was replaced
+static int insert(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                  const avl_value_t *value, uint32_t vlen, struct node **rp) {
+  struct node **path[AVL_MAX_HEIGHT + 1];
+  uint8_t dir[AVL_MAX_HEIGHT];
+  struct node *a;
+  int n = 0, i, rc;
+
+  path[0] = rp;
+  while (*path[n] != NULL) {
+    a = node_cow(sh, path[n]);
+    int c = keycmp(key, klen, a->key, a->klen);
+    if (c == 0) {
+      // Key already exists
+      return node_set_value(sh, a, value, vlen); // Tree structure didn't change
+    }
+    dir[n] = c > 0;
+    path[n + 1] = c > 0 ? &a->right : &a->left;
+    n++;
+  }
+
+  if ((rc = insert_leaf(sh, key, klen, value, vlen, path[n])) < 0)
+    return rc;
+
+  for (i = 0; i < n; i++)
+    (*path[i])->size++;
+
+  // The subtree at path[i + 1] grew by one level
+  for (i = n - 1; i >= 0; i--) {
+    a = *path[i];
+    a->diff += dir[i] ? 1 : -1;
+    if (a->diff == 0)
+      break; // Height of this subtree didn't change
+    if (a->diff == 2 || a->diff == -2) {
+      balance(sh, path[i]); // After an insert a rotation restores the old height
+      break;
+    }
+  }
+  return 1;
+}
+
+// Unlink the node at *path[n] (which the caller frees) and return the depth
+// of the link whose subtree lost a level. A node with two children is
+// replaced by its in-order successor, which extends path[] and dir[].
+static int remove_root(struct shard *sh, struct node ***path, uint8_t *dir, int n) {
+  struct node *a = *path[n], *s;
+  int t = n;
+
+  hidx_del(sh, a);
+  if (a->left == NULL || a->right == NULL) {
+    *path[n] = a->right == NULL ? a->left : a->right;
+    return n;
+  }
+
+  dir[n] = 1;
+  path[++n] = &a->right;
+  while ((s = node_cow(sh, path[n]))->left != NULL) {
+    s->size--;
+    dir[n] = 0;
+    path[n + 1] = &s->left;
+    n++;
+  }
+  *path[n] = s->right;
+
+  s->left = a->left;
+  s->right = a->right;
+  s->diff = a->diff;
+  s->size = a->size - 1;
+  *path[t] = s;
+  path[t + 1] = &s->right;
+  return n;
+}
+
+// Returns 1 if the key was found and removed
+static int remove_(struct shard *sh, const avl_key_t *key, uint32_t klen, struct node **rp) {
+  struct node **path[AVL_MAX_HEIGHT + 1];
+  uint8_t dir[AVL_MAX_HEIGHT];
+  struct node *a;
+  int n = 0, i;
+
+  path[0] = rp;
+  if (sh->mvcc && avl_search(key, klen, *rp) == NULL)
+    return 0; // Don't copy a path for nothing
+  for (;;) {
+    if (*path[n] == NULL)
+      return 0;
+    a = node_cow(sh, path[n]);
+    int c = keycmp(key, klen, a->key, a->klen);
+    if (c == 0)
+      break;
+    dir[n] = c > 0;
+    path[n + 1] = c > 0 ? &a->right : &a->left;
+    n++;
+  }
+
+  for (i = 0; i < n; i++)
+    (*path[i])->size--;
+
+  n = remove_root(sh, path, dir, n);
+  node_free(sh, a);
+
+  // The subtree at path[i + 1] lost a level
+  for (i = n - 1; i >= 0; i--) {
+    a = *path[i];
+    a->diff += dir[i] ? -1 : 1;
+    if (a->diff == 1 || a->diff == -1)
+      break; // Height of this subtree didn't change
+    if (a->diff != 0 && (!balance(sh, path[i]) || (*path[i])->diff != 0))
+      break; // The rotation kept the height
+  }
+  return 1;
+}
+
+void zaptree_root_rm_method(struct avltree *avl) {
+  for (unsigned i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    while (sh->root != NULL) {
+      avl_del(avl, sh->root->key, sh->root->klen);
+    }
+  }
+}
+
+struct node *leaf_left(struct node *root) {
+  if (root == NULL) {
+    return NULL;
+  }
+
+  leaf_left(root->left);
+  return root;
+}
+
+struct node *leaf_right(struct node *root) {
+  if (root == NULL) {
+    return NULL;
+  }
+
+  leaf_right(root->right);
+  return root;
+}
+
+static void zap_tree_traversal(struct avltree *avl) {
+  struct node *lr;
+  for (unsigned i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    while (sh->root != NULL) {
+      lr = leaf_left(sh->root);
+      if (lr != NULL)
+        avl_del(avl, lr->key, lr->klen);
+      lr = leaf_right(sh->root);
+      if (lr != NULL)
+        avl_del(avl, lr->key, lr->klen);
+    }
+  }
+}
+
+// Recursion depth is bounded by the tree height
+static int valid(struct node *a) {
+  int lh, rh, b;
+  if (a == NULL)
+    return 0;
+  lh = valid(a->left);
+  if(lh < 0)
+    return lh;
+  rh = valid(a->right);
+  if(rh < 0)
+    return rh;
+  b = rh - lh;
+
+  if (a->size != node_size(a->left) + node_size(a->right) + 1) {
+    printf("size %u, left %u, right %u - a->key %s\n", a->size, node_size(a->left),
+           node_size(a->right), a->key);
+    return KVDBLITE_INTERNAL_BALANCE_ERR;
+  }
+
+  if (b != a->diff) {
+    printf("b %d, a->diff %d, rh %d, lh %d - a->key %s\n", b, a->diff, rh, lh,
+           a->key);
+    return KVDBLITE_INTERNAL_BALANCE_ERR;
+  }
+  if (abs(b) > 1)
+    return KVDBLITE_LOPSIDED_ERR;
+
+  return max(lh, rh) + 1;
+}
+
+// inorder traversal of the tree
+static void inorder(struct shard *sh, struct node *root) {
+  if (root == NULL) {
+    return;
+  }
+
+  inorder(sh, root->left);
+  printf("%s: %s (%d)\n", root->key, node_value_str(sh, root), root->diff);
+  inorder(sh, root->right);
+}
+
+// In-order iteration with an explicit stack holding the path from the root
+// to the current node. An empty stack means the iterator is off either end.
+struct tree_iter {
+  int depth;
+  struct node *stack[AVL_MAX_HEIGHT];
+};
+
+static inline struct node *tree_iter_node(struct tree_iter *it) {
+  return it->depth > 0 ? it->stack[it->depth - 1] : NULL;
+}
+
+static void tree_iter_leftmost(struct tree_iter *it, struct node *a) {
+  for (; a != NULL; a = a->left)
+    it->stack[it->depth++] = a;
+}
+
+static void tree_iter_rightmost(struct tree_iter *it, struct node *a) {
+  for (; a != NULL; a = a->right)
+    it->stack[it->depth++] = a;
+}
+
+static void tree_iter_first(struct tree_iter *it, struct node *root) {
+  it->depth = 0;
+  tree_iter_leftmost(it, root);
+}
+
+static void tree_iter_last(struct tree_iter *it, struct node *root) {
+  it->depth = 0;
+  tree_iter_rightmost(it, root);
+}
+
+// Position on the first key >= key
+static void tree_iter_seek(struct tree_iter *it, struct node *root, const avl_key_t *key,
+                           uint32_t klen) {
+  int found = 0; // Depth of the smallest node >= key seen so far
+  struct node *a = root;
+
+  it->depth = 0;
+  while (a != NULL) {
+    int c = keycmp(key, klen, a->key, a->klen);
+    it->stack[it->depth++] = a;
+    if (c == 0)
+      return;
+    if (c < 0) {
+      found = it->depth;
+      a = a->left;
+    } else {
+      a = a->right;
+    }
+  }
+  it->depth = found;
+}
+
+static void tree_iter_next(struct tree_iter *it) {
+  struct node *a = tree_iter_node(it), *child;
+  if (a == NULL)
+    return;
+  if (a->right != NULL) {
+    tree_iter_leftmost(it, a->right);
+    return;
+  }
+  // Climb until we come up from a left child
+  do {
+    child = it->stack[--it->depth];
+  } while (it->depth > 0 && it->stack[it->depth - 1]->right == child);
+}
+
+static void tree_iter_prev(struct tree_iter *it) {
+  struct node *a = tree_iter_node(it), *child;
+  if (a == NULL)
+    return;
+  if (a->left != NULL) {
+    tree_iter_rightmost(it, a->left);
+    return;
+  }
+  do {
+    child = it->stack[--it->depth];
+  } while (it->depth > 0 && it->stack[it->depth - 1]->left == child);
+}
+
+// Walks the in-order iterators of all shards side by side. Keys are unique
+// across shards, so the current entry is the smallest of the iterators'
+// entries going forwards and the largest going backwards.
+// The entries of a read only database's mapped snapshot can be walked like
+// a tree, pos == count is off either end
+struct map_iter {
+  struct snap_map *map;
+  uint64_t pos;
+};
+
+// Walks several sources in key order: the trees of the shards and, in a
+// read only database, their mapped snapshots (it[nshards + i] for shard i).
+// A key can then be in two sources, the tree's entry wins and a tree entry
+// without a value (a deleted key) hides both.
+struct merge_iter {
+  unsigned n;      // Trees
+  unsigned nmaps;  // Mapped snapshots, 0 or n
+  int cur;         // Source that holds the current entry, -1 if off the end
+  int backward;    // Last move was prev/last
+  struct node **roots; // The tree of each shard being walked
+  struct shard *shards;
+  struct map_iter *maps;
+  struct shard *bt;     // The shards, if they are B+trees. Walked with bts[] instead of it[].
+  struct bt_iter *bts;
+  struct tree_iter it[];
+};
+
+// Room for the iterator, its roots[], its maps[] and its bts[]
+static inline size_t merge_iter_size(unsigned n, unsigned nmaps) {
+  return sizeof(struct merge_iter) +
+         n * (sizeof(struct tree_iter) + sizeof(struct node *) + sizeof(struct bt_iter)) +
+         nmaps * sizeof(struct map_iter);
+}
+
+// Walks the mapped snapshots of a read only database's shards too
+static inline unsigned db_nmaps(struct avltree *avl) { return avl->readonly ? avl->nshards : 0; }
+
+static void merge_iter_init(struct merge_iter *m, struct avltree *avl) {
+  unsigned n = avl->nshards;
+  m->n = n;
+  m->nmaps = db_nmaps(avl);
+  m->cur = -1;
+  m->backward = 0;
+  m->roots = (struct node **)(m->it + n);
+  m->shards = avl->shards;
+  m->maps = (struct map_iter *)(m->roots + n);
+  m->bts = (struct bt_iter *)(m->maps + m->nmaps);
+  m->bt = avl->shards[0].btree ? avl->shards : NULL;
+  for (unsigned i = 0; i < m->nmaps; i++) {
+    m->maps[i].map = &avl->shards[i].map;
+    m->maps[i].pos = avl->shards[i].map.count;
+  }
+}
+
+static inline struct node *merge_iter_node(struct merge_iter *m, unsigned i) {
+  return m->bt != NULL ? bt_iter_node(&m->bts[i]) : tree_iter_node(&m->it[i]);
+}
+
+// Source i's current entry, 0 if it is off the end. Values may still be
+// compressed or in the value log, see merge_iter_value().
+static int merge_iter_src(struct merge_iter *m, unsigned i, struct avl_view *v) {
+  if (i < m->n) {
+    struct node *a = merge_iter_node(m, i);
+    if (a == NULL)
+      return 0;
+    v->key = a->key;
+    v->klen = a->klen;
+    v->value = a->value;
+    v->vlen = a->vlen;
+    return 1;
+  }
+  struct map_iter *mi = &m->maps[i - m->n];
+  if (mi->pos >= mi->map->count)
+    return 0;
+  map_entry(mi->map, mi->pos, v);
+  return 1;
+}
+
+static void merge_iter_src_first(struct merge_iter *m, unsigned i) {
+  if (i < m->n && m->bt != NULL)
+    bt_iter_first(&m->bts[i], &m->bt[i]);
+  else if (i < m->n)
+    tree_iter_first(&m->it[i], m->roots[i]);
+  else
+    m->maps[i - m->n].pos = 0;
+}
+
+static void merge_iter_src_last(struct merge_iter *m, unsigned i) {
+  if (i < m->n && m->bt != NULL) {
+    bt_iter_last(&m->bts[i], &m->bt[i]);
+  } else if (i < m->n) {
+    tree_iter_last(&m->it[i], m->roots[i]);
+  } else {
+    struct map_iter *mi = &m->maps[i - m->n];
+    mi->pos = mi->map->count > 0 ? mi->map->count - 1 : 0;
+  }
+}
+
+static void merge_iter_src_seek(struct merge_iter *m, unsigned i, const avl_key_t *key,
+                                uint32_t klen) {
+  if (i < m->n && m->bt != NULL)
+    bt_iter_seek(&m->bts[i], &m->bt[i], key, klen);
+  else if (i < m->n)
+    tree_iter_seek(&m->it[i], m->roots[i], key, klen);
+  else
+    m->maps[i - m->n].pos = map_lower_bound(m->maps[i - m->n].map, key, klen);
+}
+
+static void merge_iter_src_next(struct merge_iter *m, unsigned i) {
+  if (i < m->n && m->bt != NULL)
+    bt_iter_next(&m->bts[i]);
+  else if (i < m->n)
+    tree_iter_next(&m->it[i]);
+  else
+    m->maps[i - m->n].pos++;
+}
+
+static void merge_iter_src_prev(struct merge_iter *m, unsigned i) {
+  if (i < m->n && m->bt != NULL) {
+    bt_iter_prev(&m->bts[i]);
+  } else if (i < m->n) {
+    tree_iter_prev(&m->it[i]);
+  } else {
+    struct map_iter *mi = &m->maps[i - m->n];
+    mi->pos = mi->pos > 0 ? mi->pos - 1 : mi->map->count;
+  }
+}
+
+static inline int merge_iter_get(struct merge_iter *m, struct avl_view *v) {
+  return m->cur >= 0 && merge_iter_src(m, (unsigned)m->cur, v);
+}
+
+// Whether a mapped snapshot failed a CRC check, then the order and the
+// entries seen can't be trusted
+static int merge_iter_bad(const struct merge_iter *m) {
+  for (unsigned i = 0; i < m->nmaps; i++) {
+    if (map_bad(m->maps[i].map))
+      return 1;
+  }
+  return 0;
+}
+
+// The current entry for the caller, with its value decompressed and read
+// from the value log. Returns 1, 0 off the end or an error code.
+static int merge_iter_value(struct merge_iter *m, struct avl_view *v) {
+  struct node *a;
+  int rc;
+  if (merge_iter_bad(m))
+    return KVDBLITE_CORRUPT;
+  if (!merge_iter_get(m, v))
+    return 0;
+  if ((unsigned)m->cur >= m->n)
+    return 1;
+  a = merge_iter_node(m, (unsigned)m->cur);
+  if ((a->zvalue || a->logged) && (rc = node_view(&m->shards[m->cur], a, v)) < 0)
+    return rc;
+  return 1;
+}
+
+// Move every source sitting on key past it
+static void merge_iter_step_over(struct merge_iter *m, const avl_key_t *key, uint32_t klen,
+                                 int backward) {
+  struct avl_view v;
+  for (unsigned i = 0; i < m->n + m->nmaps; i++) {
+    if (!merge_iter_src(m, i, &v) || keycmp(v.key, v.klen, key, klen) != 0)
+      continue;
+    if (backward)
+      merge_iter_src_prev(m, i);
+    else
+      merge_iter_src_next(m, i);
+  }
+}
+
+static void merge_iter_pick(struct merge_iter *m, int backward) {
+  struct avl_view best = {0}, v;
+  m->backward = backward;
+  for (;;) {
+    m->cur = -1;
+    for (unsigned i = 0; i < m->n + m->nmaps; i++) {
+      if (!merge_iter_src(m, i, &v))
+        continue;
+      // On a tie the earlier source, the tree, wins
+      int c = m->cur < 0 ? 0 : keycmp(v.key, v.klen, best.key, best.klen);
+      if (m->cur < 0 || (c != 0 && (c < 0) != backward)) {
+        best = v;
+        m->cur = (int)i;
+      }
+    }
+    if (m->cur < 0 || best.value != NULL)
+      return;
+    // Deleted from the mapped snapshot
+    merge_iter_step_over(m, best.key, best.klen, backward);
+  }
+}
+
+static void merge_iter_first(struct merge_iter *m) {
+  for (unsigned i = 0; i < m->n + m->nmaps; i++)
+    merge_iter_src_first(m, i);
+  merge_iter_pick(m, 0);
+}
+
+static void merge_iter_last(struct merge_iter *m) {
+  for (unsigned i = 0; i < m->n + m->nmaps; i++)
+    merge_iter_src_last(m, i);
+  merge_iter_pick(m, 1);
+}
+
+static void merge_iter_seek(struct merge_iter *m, const avl_key_t *key, uint32_t klen) {
+  for (unsigned i = 0; i < m->n + m->nmaps; i++)
+    merge_iter_src_seek(m, i, key, klen);
+  merge_iter_pick(m, 0);
+}
+
+static void merge_iter_next(struct merge_iter *m) {
+  struct avl_view a;
+  if (!merge_iter_get(m, &a))
+    return;
+  if (m->backward) {
+    // The other sources are behind the current key, move them up to it
+    for (unsigned i = 0; i < m->n + m->nmaps; i++) {
+      if ((int)i != m->cur)
+        merge_iter_src_seek(m, i, a.key, a.klen);
+    }
+  }
+  merge_iter_step_over(m, a.key, a.klen, 0);
+  merge_iter_pick(m, 0);
+}
+
+static void merge_iter_prev(struct merge_iter *m) {
+  struct avl_view a, v;
+  if (!merge_iter_get(m, &a))
+    return;
+  if (!m->backward) {
+    // The other sources are ahead of the current key, move them before it
+    for (unsigned i = 0; i < m->n + m->nmaps; i++) {
+      if ((int)i == m->cur)
+        continue;
+      merge_iter_src_seek(m, i, a.key, a.klen);
+      if (merge_iter_src(m, i, &v))
+        merge_iter_src_prev(m, i);
+      else
+        merge_iter_src_last(m, i);
+    }
+  }
+  merge_iter_step_over(m, a.key, a.klen, 1);
+  merge_iter_pick(m, 1);
+}
+
+//
+// END AVL tree internals
+//
+
+//
+// B+tree
+//
+
+// First 8 bytes of the key, zero padded, as a big endian number. Prefixes
+// compare like the keys do unless they are equal.
+static inline uint64_t bt_prefix(const avl_key_t *key, uint32_t klen) {
+  uint64_t p = 0;
+  memcpy(&p, key, klen < 8 ? klen : 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  p = __builtin_bswap64(p);
+#endif
+  return p;
+}
+
+// keycmp() with the prefixes of both keys
+static inline int bt_cmp(uint64_t p, const avl_key_t *a, uint32_t alen, uint64_t q,
+                         const avl_key_t *b, uint32_t blen) {
+  if (p != q)
+    return p < q ? -1 : 1;
+  if (alen >= 8 && blen >= 8)
+    return keycmp(a + 8, alen - 8, b + 8, blen - 8);
+  return keycmp(a, alen, b, blen);
+}
+
+// Index of the first entry not below key, l->n if there is none
+static uint32_t bt_leaf_search(const struct bt_leaf *l, uint64_t p, const avl_key_t *key,
+                               uint32_t klen) {
+  uint32_t lo = 0, hi = l->n;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    const struct node *e = l->ent[mid];
+    if (bt_cmp(l->pfx[mid], e->key, e->klen, p, key, klen) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static inline int bt_leaf_has(const struct bt_leaf *l, uint32_t i, uint64_t p,
+                              const avl_key_t *key, uint32_t klen) {
+  return i < l->n && l->pfx[i] == p && keycmp(l->ent[i]->key, l->ent[i]->klen, key, klen) == 0;
+}
+
+// The child whose keys key belongs with
+static uint32_t bt_inner_search(const struct bt_inner *a, uint64_t p, const avl_key_t *key,
+                                uint32_t klen) {
+  uint32_t lo = 0, hi = a->n - 1;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    const struct bt_sep *s = a->sep[mid];
+    if (bt_cmp(a->pfx[mid], s->key, s->klen, p, key, klen) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static inline uint32_t bt_inner_total(const struct bt_inner *a) {
+  uint32_t t = 0;
+  for (uint32_t i = 0; i < a->n; i++)
+    t += a->cnt[i];
+  return t;
+}
+
+// Nodes come from aligned_alloc() so they start on a cache line, the slab
+// only aligns to 16 bytes
+static void *bt_alloc(struct shard *sh, size_t size) {
+  void *p = aligned_alloc(64, size);
+  if (p == NULL)
+    return NULL;
+  memset(p, 0, size);
+  sh->bt_bytes += size;
+  return p;
+}
+
+static void bt_free(struct shard *sh, void *p, size_t size) {
+  sh->bt_bytes -= size;
+  free(p);
+}
+
+static struct bt_sep *bt_sep_make(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  struct bt_sep *s = slab_alloc(&sh->slab, sizeof *s + klen);
+  if (s == NULL)
+    return NULL;
+  s->klen = klen;
+  memcpy(s->key, key, klen);
+  return s;
+}
+
+static void bt_sep_free(struct shard *sh, struct bt_sep *s) {
+  slab_free(&sh->slab, s, sizeof *s + s->klen);
+}
+
+static struct bt_leaf *bt_first_leaf(struct shard *sh) {
+  void *a = sh->bt_root;
+  for (unsigned h = sh->bt_height; h > 1; h--)
+    a = ((struct bt_inner *)a)->child[0];
+  return a;
+}
+
+static size_t bt_size(struct shard *sh) {
+  if (sh->bt_height == 0)
+    return 0;
+  if (sh->bt_height == 1)
+    return ((struct bt_leaf *)sh->bt_root)->n;
+  return bt_inner_total(sh->bt_root);
+}
+
+// The leaf entry holding key, NULL if there is none
+static struct node **bt_search_ent(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  uint64_t p = bt_prefix(key, klen);
+  void *a = sh->bt_root;
+  unsigned h;
+
+  if (a == NULL)
+    return NULL;
+  for (h = sh->bt_height; h > 1; h--)
+    a = ((struct bt_inner *)a)->child[bt_inner_search(a, p, key, klen)];
+  struct bt_leaf *l = a;
+  uint32_t i = bt_leaf_search(l, p, key, klen);
+  return bt_leaf_has(l, i, p, key, klen) ? &l->ent[i] : NULL;
+}
+
+static struct node *bt_search(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  struct node **e = bt_search_ent(sh, key, klen);
+  return e != NULL ? *e : NULL;
+}
+
+// The B+tree itself is never frozen, a checkpoint writes out an array of the
+// entries instead (see checkpoint_shard()). Only the nodes in it have to stay
+// as they were, so the entry at *e is copied before it changes.
+static struct node *bt_entry_cow(struct shard *sh, struct node **e) {
+  if (node_frozen(sh, *e))
+    *e = node_copy(sh, *e);
+  return *e;
+}
+
+// Put a separator and the child after it into a at i, a isn't full
+static void bt_inner_add(struct bt_inner *a, uint32_t i, struct bt_sep *s, void *child,
+                         uint32_t cnt) {
+  memmove(a->sep + i + 1, a->sep + i, (a->n - 1 - i) * sizeof *a->sep);
+  memmove(a->pfx + i + 1, a->pfx + i, (a->n - 1 - i) * sizeof *a->pfx);
+  memmove(a->child + i + 2, a->child + i + 1, (a->n - 1 - i) * sizeof *a->child);
+  memmove(a->cnt + i + 2, a->cnt + i + 1, (a->n - 1 - i) * sizeof *a->cnt);
+  a->sep[i] = s;
+  a->pfx[i] = bt_prefix(s->key, s->klen);
+  a->child[i + 1] = child;
+  a->cnt[i + 1] = cnt;
+  a->n++;
+}
+
+// Take separator i and the child after it out of a
+static void bt_inner_del(struct bt_inner *a, uint32_t i) {
+  memmove(a->sep + i, a->sep + i + 1, (a->n - 2 - i) * sizeof *a->sep);
+  memmove(a->pfx + i, a->pfx + i + 1, (a->n - 2 - i) * sizeof *a->pfx);
+  memmove(a->child + i + 1, a->child + i + 2, (a->n - 2 - i) * sizeof *a->child);
+  memmove(a->cnt + i + 1, a->cnt + i + 2, (a->n - 2 - i) * sizeof *a->cnt);
+  a->n--;
+}
+
+// Split the full child c of a, which has room for one more. Nothing changes
+// if memory runs out.
+static int bt_split(struct shard *sh, struct bt_inner *a, uint32_t c, int leaf) {
+  if (leaf) {
+    struct bt_leaf *l = a->child[c], *r = bt_alloc(sh, sizeof *r);
+    uint32_t h = l->n / 2;
+    struct bt_sep *s = r == NULL ? NULL : bt_sep_make(sh, l->ent[h]->key, l->ent[h]->klen);
+    if (s == NULL) {
+      if (r != NULL)
+        bt_free(sh, r, sizeof *r);
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    }
+    r->n = l->n - h;
+    memcpy(r->ent, l->ent + h, r->n * sizeof *r->ent);
+    memcpy(r->pfx, l->pfx + h, r->n * sizeof *r->pfx);
+    l->n = h;
+    r->prev = l;
+    r->next = l->next;
+    if (l->next != NULL)
+      l->next->prev = r;
+    l->next = r;
+    a->cnt[c] = l->n;
+    bt_inner_add(a, c, s, r, r->n);
+    return KVDBLITE_SUCCESS;
+  }
+
+  // The middle separator moves up
+  struct bt_inner *l = a->child[c], *r = bt_alloc(sh, sizeof *r);
+  uint32_t h = l->n / 2;
+  if (r == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  r->n = l->n - h;
+  memcpy(r->child, l->child + h, r->n * sizeof *r->child);
+  memcpy(r->cnt, l->cnt + h, r->n * sizeof *r->cnt);
+  memcpy(r->sep, l->sep + h, (r->n - 1) * sizeof *r->sep);
+  memcpy(r->pfx, l->pfx + h, (r->n - 1) * sizeof *r->pfx);
+  l->n = h;
+  a->cnt[c] = bt_inner_total(l);
+  bt_inner_add(a, c, l->sep[h - 1], r, bt_inner_total(r));
+  return KVDBLITE_SUCCESS;
+}
+
+// Returns 1 if a new node was added, 0 if an existing value was replaced.
+// Full nodes are split on the way down, so there is always room for what a
+// split below adds.
+static int bt_insert(struct shard *sh, const avl_key_t *key, uint32_t klen,
+                     const avl_value_t *value, uint32_t vlen) {
+  struct bt_inner *path[BT_MAX_HEIGHT];
+  uint32_t idx[BT_MAX_HEIGHT], i;
+  uint64_t p = bt_prefix(key, klen);
+  unsigned h, n = 0;
+  int rc;
+
+  if (sh->bt_root == NULL) {
+    if ((sh->bt_root = bt_alloc(sh, sizeof(struct bt_leaf))) == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    sh->bt_height = 1;
+  }
+  uint32_t rootn = sh->bt_height == 1 ? ((struct bt_leaf *)sh->bt_root)->n
+                                      : ((struct bt_inner *)sh->bt_root)->n;
+  if (rootn == BT_ORDER) {
+    if (sh->bt_height == BT_MAX_HEIGHT)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    struct bt_inner *a = bt_alloc(sh, sizeof *a);
+    if (a == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    a->n = 1;
+    a->child[0] = sh->bt_root;
+    a->cnt[0] = (uint32_t)bt_size(sh);
+    if ((rc = bt_split(sh, a, 0, sh->bt_height == 1)) < 0) {
+      bt_free(sh, a, sizeof *a);
+      return rc;
+    }
+    sh->bt_root = a;
+    sh->bt_height++;
+  }
+
+  void *a = sh->bt_root;
+  for (h = sh->bt_height; h > 1; h--) {
+    struct bt_inner *in = a;
+    uint32_t c = bt_inner_search(in, p, key, klen);
+    uint32_t cn = h == 2 ? ((struct bt_leaf *)in->child[c])->n
+                         : ((struct bt_inner *)in->child[c])->n;
+    if (cn == BT_ORDER) {
+      if ((rc = bt_split(sh, in, c, h == 2)) < 0)
+        return rc;
+      if (bt_cmp(in->pfx[c], in->sep[c]->key, in->sep[c]->klen, p, key, klen) <= 0)
+        c++;
+    }
+    path[n] = in;
+    idx[n++] = c;
+    a = in->child[c];
+  }
+
+  struct bt_leaf *l = a;
+  i = bt_leaf_search(l, p, key, klen);
+  if (bt_leaf_has(l, i, p, key, klen)) // Tree structure doesn't change
+    return node_set_value(sh, bt_entry_cow(sh, &l->ent[i]), value, vlen);
+  struct node *e;
+  if (hidx_reserve(sh, 1) < 0 || (e = node_make(sh, key, klen, value, vlen)) == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  hidx_add(sh, e);
+  memmove(l->ent + i + 1, l->ent + i, (l->n - i) * sizeof *l->ent);
+  memmove(l->pfx + i + 1, l->pfx + i, (l->n - i) * sizeof *l->pfx);
+  l->ent[i] = e;
+  l->pfx[i] = p;
+  l->n++;
+  while (n-- > 0)
+    path[n]->cnt[idx[n]]++;
+  return 1;
+}
+
+// Child c of a has fewer than BT_MIN entries or children. Merge it with a
+// neighbour if they fit in one node, else even them out. If memory for a
+// new separator runs out the node stays small, which is still a valid tree.
+static void bt_rebalance(struct shard *sh, struct bt_inner *a, uint32_t c, int leaf) {
+  uint32_t j = c > 0 ? c - 1 : c, k;
+  if (a->n < 2)
+    return;
+
+  if (leaf) {
+    struct bt_leaf *l = a->child[j], *r = a->child[j + 1];
+    uint32_t tot = l->n + r->n;
+    if (tot <= BT_ORDER) {
+      memcpy(l->ent + l->n, r->ent, r->n * sizeof *r->ent);
+      memcpy(l->pfx + l->n, r->pfx, r->n * sizeof *r->pfx);
+      l->n = tot;
+      l->next = r->next;
+      if (r->next != NULL)
+        r->next->prev = l;
+      bt_sep_free(sh, a->sep[j]);
+      bt_inner_del(a, j);
+      a->cnt[j] = tot;
+      bt_free(sh, r, sizeof *r);
+      return;
+    }
+    uint32_t want = tot / 2; // New size of l
+    struct node *first = want < l->n ? l->ent[want] : r->ent[want - l->n];
+    struct bt_sep *s = bt_sep_make(sh, first->key, first->klen);
+    if (s == NULL)
+      return;
+    if (want > l->n) {
+      k = want - l->n;
+      memcpy(l->ent + l->n, r->ent, k * sizeof *r->ent);
+      memcpy(l->pfx + l->n, r->pfx, k * sizeof *r->pfx);
+      memmove(r->ent, r->ent + k, (r->n - k) * sizeof *r->ent);
+      memmove(r->pfx, r->pfx + k, (r->n - k) * sizeof *r->pfx);
+    } else {
+      k = l->n - want;
+      memmove(r->ent + k, r->ent, r->n * sizeof *r->ent);
+      memmove(r->pfx + k, r->pfx, r->n * sizeof *r->pfx);
+      memcpy(r->ent, l->ent + want, k * sizeof *r->ent);
+      memcpy(r->pfx, l->pfx + want, k * sizeof *r->pfx);
+    }
+    l->n = want;
+    r->n = tot - want;
+    bt_sep_free(sh, a->sep[j]);
+    a->sep[j] = s;
+    a->pfx[j] = bt_prefix(s->key, s->klen);
+    a->cnt[j] = l->n;
+    a->cnt[j + 1] = r->n;
+    return;
+  }
+
+  struct bt_inner *l = a->child[j], *r = a->child[j + 1];
+  if (l->n + r->n <= BT_ORDER) {
+    // The separator between them comes down
+    l->sep[l->n - 1] = a->sep[j];
+    l->pfx[l->n - 1] = a->pfx[j];
+    memcpy(l->sep + l->n, r->sep, (r->n - 1) * sizeof *r->sep);
+    memcpy(l->pfx + l->n, r->pfx, (r->n - 1) * sizeof *r->pfx);
+    memcpy(l->child + l->n, r->child, r->n * sizeof *r->child);
+    memcpy(l->cnt + l->n, r->cnt, r->n * sizeof *r->cnt);
+    l->n += r->n;
+    a->cnt[j] += a->cnt[j + 1];
+    bt_inner_del(a, j);
+    bt_free(sh, r, sizeof *r);
+    return;
+  }
+  // Rotate children through the separator, one at a time
+  while (l->n < r->n - 1) {
+    l->sep[l->n - 1] = a->sep[j];
+    l->pfx[l->n - 1] = a->pfx[j];
+    l->child[l->n] = r->child[0];
+    l->cnt[l->n] = r->cnt[0];
+    l->n++;
+    a->sep[j] = r->sep[0];
+    a->pfx[j] = r->pfx[0];
+    a->cnt[j] += r->cnt[0];
+    a->cnt[j + 1] -= r->cnt[0];
+    memmove(r->sep, r->sep + 1, (r->n - 2) * sizeof *r->sep);
+    memmove(r->pfx, r->pfx + 1, (r->n - 2) * sizeof *r->pfx);
+    memmove(r->child, r->child + 1, (r->n - 1) * sizeof *r->child);
+    memmove(r->cnt, r->cnt + 1, (r->n - 1) * sizeof *r->cnt);
+    r->n--;
+  }
+  while (r->n < l->n - 1) {
+    memmove(r->sep + 1, r->sep, (r->n - 1) * sizeof *r->sep);
+    memmove(r->pfx + 1, r->pfx, (r->n - 1) * sizeof *r->pfx);
+    memmove(r->child + 1, r->child, r->n * sizeof *r->child);
+    memmove(r->cnt + 1, r->cnt, r->n * sizeof *r->cnt);
+    r->sep[0] = a->sep[j];
+    r->pfx[0] = a->pfx[j];
+    r->child[0] = l->child[l->n - 1];
+    r->cnt[0] = l->cnt[l->n - 1];
+    r->n++;
+    a->sep[j] = l->sep[l->n - 2];
+    a->pfx[j] = l->pfx[l->n - 2];
+    a->cnt[j] -= r->cnt[0];
+    a->cnt[j + 1] += r->cnt[0];
+    l->n--;
+  }
+}
+
+// Returns 1 if the key was found and removed
+static int bt_remove(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  struct bt_inner *path[BT_MAX_HEIGHT];
+  uint32_t idx[BT_MAX_HEIGHT], i;
+  uint64_t p = bt_prefix(key, klen);
+  unsigned h, n = 0;
+  void *a = sh->bt_root;
+
+  if (a == NULL)
+    return 0;
+  for (h = sh->bt_height; h > 1; h--) {
+    path[n] = a;
+    idx[n] = bt_inner_search(a, p, key, klen);
+    a = path[n]->child[idx[n]];
+    n++;
+  }
+  struct bt_leaf *l = a;
+  i = bt_leaf_search(l, p, key, klen);
+  if (!bt_leaf_has(l, i, p, key, klen))
+    return 0;
+  hidx_del(sh, l->ent[i]);
+  node_free(sh, l->ent[i]);
+  memmove(l->ent + i, l->ent + i + 1, (l->n - i - 1) * sizeof *l->ent);
+  memmove(l->pfx + i, l->pfx + i + 1, (l->n - i - 1) * sizeof *l->pfx);
+  l->n--;
+  for (h = 0; h < n; h++)
+    path[h]->cnt[idx[h]]--;
+
+  // Fix small nodes from the bottom up, the root can be as small as it likes
+  uint32_t size = l->n;
+  for (h = n; h-- > 0 && size < BT_MIN;) {
+    bt_rebalance(sh, path[h], idx[h], h == n - 1);
+    size = path[h]->n;
+  }
+  while (sh->bt_height > 1 && ((struct bt_inner *)sh->bt_root)->n == 1) {
+    struct bt_inner *root = sh->bt_root;
+    sh->bt_root = root->child[0];
+    sh->bt_height--;
+    bt_free(sh, root, sizeof *root);
+  }
+  if (sh->bt_height == 1 && ((struct bt_leaf *)sh->bt_root)->n == 0) {
+    bt_free(sh, sh->bt_root, sizeof(struct bt_leaf));
+    sh->bt_root = NULL;
+    sh->bt_height = 0;
+  }
+  return 1;
+}
+
+// Number of keys in the B+tree that sort before key
+static uint64_t bt_rank(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  uint64_t p = bt_prefix(key, klen), r = 0;
+  void *a = sh->bt_root;
+
+  if (a == NULL)
+    return 0;
+  for (unsigned h = sh->bt_height; h > 1; h--) {
+    struct bt_inner *in = a;
+    uint32_t c = bt_inner_search(in, p, key, klen);
+    for (uint32_t i = 0; i < c; i++)
+      r += in->cnt[i];
+    a = in->child[c];
+  }
+  return r + bt_leaf_search(a, p, key, klen);
+}
+
+// k-th node in key order, counting from 0
+static struct node *bt_select(struct shard *sh, uint64_t k) {
+  void *a = sh->bt_root;
+  uint32_t c;
+
+  if (k >= bt_size(sh))
+    return NULL;
+  for (unsigned h = sh->bt_height; h > 1; h--) {
+    struct bt_inner *in = a;
+    for (c = 0; c + 1 < in->n && k >= in->cnt[c]; c++)
+      k -= in->cnt[c];
+    a = in->child[c];
+  }
+  return ((struct bt_leaf *)a)->ent[k];
+}
+
+// Build the tree bottom up from nodes[0, n), which are in key order. Each
+// level is spread evenly over nodes BT_FILL full, so the next inserts don't
+// split them straight away.
+static int bt_build(struct shard *sh, struct node **nodes, size_t n) {
+  size_t m = (n + BT_FILL - 1) / BT_FILL, i, j, k;
+  void **level;
+  struct node **first; // Smallest entry under each node of the level
+  uint32_t *cnt;
+  struct bt_leaf *prev = NULL;
+
+  sh->bt_root = NULL;
+  sh->bt_height = 0;
+  if (m == 0) // No entries, and below m > 0 so level[0] is always set
+    return KVDBLITE_SUCCESS;
+  level = malloc(m * sizeof *level);
+  first = malloc(m * sizeof *first);
+  cnt = malloc(m * sizeof *cnt);
+  if (level == NULL || first == NULL || cnt == NULL) {
+    free(level);
+    free(first);
+    free(cnt);
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  }
+
+  for (i = 0; i < m; i++) {
+    size_t from = n * i / m, to = n * (i + 1) / m;
+    struct bt_leaf *l = bt_alloc(sh, sizeof *l);
+    if (l == NULL)
+      goto fail;
+    for (j = from; j < to; j++) {
+      l->ent[j - from] = nodes[j];
+      l->pfx[j - from] = bt_prefix(nodes[j]->key, nodes[j]->klen);
+    }
+    l->n = (uint32_t)(to - from);
+    l->prev = prev;
+    if (prev != NULL)
+      prev->next = l;
+    prev = l;
+    level[i] = l;
+    first[i] = nodes[from];
+    cnt[i] = l->n;
+  }
+  sh->bt_root = level[0];
+  sh->bt_height = 1;
+
+  // Each pass replaces level[0, m) with their parents, in place
+  while (m > 1) {
+    size_t up = (m + BT_FILL - 1) / BT_FILL;
+    for (i = 0; i < up; i++) {
+      size_t from = m * i / up, to = m * (i + 1) / up;
+      struct bt_inner *a = bt_alloc(sh, sizeof *a);
+      if (a == NULL)
+        goto fail;
+      for (j = from; j < to; j++) {
+        k = j - from;
+        a->child[k] = level[j];
+        a->cnt[k] = cnt[j];
+        if (k > 0) {
+          if ((a->sep[k - 1] = bt_sep_make(sh, first[j]->key, first[j]->klen)) == NULL) {
+            a->n = (uint32_t)k;
+            bt_free(sh, a, sizeof *a);
+            goto fail;
+          }
+          a->pfx[k - 1] = bt_prefix(first[j]->key, first[j]->klen);
+        }
+      }
+      a->n = (uint32_t)(to - from);
+      level[i] = a;
+      first[i] = first[from];
+      cnt[i] = bt_inner_total(a);
+    }
+    m = up;
+    sh->bt_root = level[0];
+    sh->bt_height++;
+  }
+  free(level);
+  free(first);
+  free(cnt);
+  return KVDBLITE_SUCCESS;
+
+fail:
+  // The nodes made so far are lost, shard_build() gives up on the process
+  free(level);
+  free(first);
+  free(cnt);
+  return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+}
+
+// Format 1 snapshots are loaded into an AVL tree, index its nodes instead
+static void bt_adopt(struct shard *sh) {
+  size_t n = node_size(sh->root), i = 0;
+  struct tree_iter it;
+  struct node **nodes = malloc((n ? n : 1) * sizeof *nodes);
+
+  if (nodes == NULL) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  for (tree_iter_first(&it, sh->root); tree_iter_node(&it) != NULL; tree_iter_next(&it))
+    nodes[i++] = tree_iter_node(&it);
+  sh->root = NULL;
+  shard_build(sh, nodes, n);
+  free(nodes);
+}
+
+// Free the B+tree nodes, the separators and entries live in the slab
+static void bt_destroy_node(struct shard *sh, void *a, unsigned h) {
+  if (h > 1) {
+    struct bt_inner *in = a;
+    for (uint32_t i = 0; i < in->n; i++)
+      bt_destroy_node(sh, in->child[i], h - 1);
+    bt_free(sh, in, sizeof *in);
+  } else {
+    bt_free(sh, a, sizeof(struct bt_leaf));
+  }
+}
+
+static void bt_destroy(struct shard *sh) {
+  if (sh->bt_root != NULL)
+    bt_destroy_node(sh, sh->bt_root, sh->bt_height);
+  sh->bt_root = NULL;
+  sh->bt_height = 0;
+}
+
+// Check the subtree at a of height h holds keys in [lo, hi) (NULL is open)
+// and chains its leaves after *prev. Returns the number of keys under it.
+static int64_t bt_valid_node(void *a, unsigned h, const struct bt_sep *lo,
+                             const struct bt_sep *hi, struct bt_leaf **prev) {
+  int64_t t = 0, c;
+  uint32_t i;
+
+  if (h == 1) {
+    struct bt_leaf *l = a;
+    if (l->prev != *prev || (*prev != NULL && (*prev)->next != l))
+      return KVDBLITE_INTERNAL_BALANCE_ERR;
+    for (i = 0; i < l->n; i++) {
+      struct node *e = l->ent[i];
+      if (l->pfx[i] != bt_prefix(e->key, e->klen) ||
+          (i > 0 && keycmp(l->ent[i - 1]->key, l->ent[i - 1]->klen, e->key, e->klen) >= 0) ||
+          (lo != NULL && keycmp(e->key, e->klen, lo->key, lo->klen) < 0) ||
+          (hi != NULL && keycmp(e->key, e->klen, hi->key, hi->klen) >= 0))
+        return KVDBLITE_INTERNAL_BALANCE_ERR;
+    }
+    *prev = l;
+    return l->n;
+  }
+
+  struct bt_inner *in = a;
+  if (in->n < 2 || in->n > BT_ORDER)
+    return KVDBLITE_INTERNAL_BALANCE_ERR;
+  for (i = 0; i < in->n; i++) {
+    if (i + 1 < in->n && in->pfx[i] != bt_prefix(in->sep[i]->key, in->sep[i]->klen))
+      return KVDBLITE_INTERNAL_BALANCE_ERR;
+    c = bt_valid_node(in->child[i], h - 1, i > 0 ? in->sep[i - 1] : lo,
+                      i + 1 < in->n ? in->sep[i] : hi, prev);
+    if (c < 0)
+      return c;
+    if (c != in->cnt[i])
+      return KVDBLITE_INTERNAL_BALANCE_ERR;
+    t += c;
+  }
+  return t;
+}
+
+// Returns the height, like valid()
+static int bt_valid(struct shard *sh) {
+  struct bt_leaf *prev = NULL;
+  if (sh->bt_root == NULL)
+    return sh->bt_height == 0 ? 0 : KVDBLITE_INTERNAL_BALANCE_ERR;
+  int64_t n = bt_valid_node(sh->bt_root, sh->bt_height, NULL, NULL, &prev);
+  if (n < 0)
+    return (int)n;
+  if (prev->next != NULL || (size_t)n != bt_size(sh))
+    return KVDBLITE_INTERNAL_BALANCE_ERR;
+  return (int)sh->bt_height;
+}
+
+static inline struct node *bt_iter_node(struct bt_iter *it) {
+  return it->leaf != NULL ? it->leaf->ent[it->pos] : NULL;
+}
+
+// Leaves are only empty when memory ran out while deleting, step over them
+static void bt_iter_skip_forward(struct bt_iter *it) {
+  while (it->leaf != NULL && it->pos >= it->leaf->n) {
+    it->leaf = it->leaf->next;
+    it->pos = 0;
+  }
+}
+
+static void bt_iter_skip_back(struct bt_iter *it) {
+  while (it->leaf != NULL && it->leaf->n == 0)
+    it->leaf = it->leaf->prev;
+  if (it->leaf != NULL)
+    it->pos = it->leaf->n - 1;
+}
+
+static void bt_iter_first(struct bt_iter *it, struct shard *sh) {
+  it->leaf = bt_first_leaf(sh);
+  it->pos = 0;
+  bt_iter_skip_forward(it);
+}
+
+static void bt_iter_last(struct bt_iter *it, struct shard *sh) {
+  void *a = sh->bt_root;
+  for (unsigned h = sh->bt_height; h > 1; h--)
+    a = ((struct bt_inner *)a)->child[((struct bt_inner *)a)->n - 1];
+  it->leaf = a;
+  bt_iter_skip_back(it);
+}
+
+// Position on the first key >= key
+static void bt_iter_seek(struct bt_iter *it, struct shard *sh, const avl_key_t *key,
+                         uint32_t klen) {
+  uint64_t p = bt_prefix(key, klen);
+  void *a = sh->bt_root;
+
+  it->leaf = NULL;
+  if (a == NULL)
+    return;
+  for (unsigned h = sh->bt_height; h > 1; h--)
+    a = ((struct bt_inner *)a)->child[bt_inner_search(a, p, key, klen)];
+  it->leaf = a;
+  it->pos = bt_leaf_search(a, p, key, klen);
+  bt_iter_skip_forward(it);
+}
+
+static void bt_iter_next(struct bt_iter *it) {
+  if (it->leaf == NULL)
+    return;
+  it->pos++;
+  bt_iter_skip_forward(it);
+}
+
+static void bt_iter_prev(struct bt_iter *it) {
+  if (it->leaf == NULL)
+    return;
+  if (it->pos > 0) {
+    it->pos--;
+    return;
+  }
+  it->leaf = it->leaf->prev;
+  bt_iter_skip_back(it);
+}
+
+//
+// END B+tree
+//
+
+//
+// Hash index
+//
+
+// Control bytes hold the low 7 bits of hash_key(), the group a key starts
+// probing at comes from the bits above them. shard_for() uses the top 32
+// bits, so the keys of one shard still spread over the whole table.
+static inline uint8_t hidx_h2(uint64_t h) { return h & 0x7f; }
+
+static inline size_t hidx_group(const struct hidx *t, uint64_t h) {
+  return (h >> 7) & (t->cap / HIDX_GROUP - 1);
+}
+
+// Groups are probed 1, 2, 3... groups apart, which visits every group of a
+// power of two table
+static inline size_t hidx_next(const struct hidx *t, size_t g, size_t step) {
+  return (g + step) & (t->cap / HIDX_GROUP - 1);
+}
+
+// Bit i is set for each control byte i of the group at c that is b
+static inline uint32_t hidx_match(const uint8_t *c, uint8_t b) {
+#ifdef KVDBLITE_HIDX_SSE2
+  __m128i v = _mm_load_si128((const __m128i *)c);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)b)));
+#else
+  uint32_t m = 0;
+  for (int i = 0; i < HIDX_GROUP; i++)
+    m |= (uint32_t)(c[i] == b) << i;
+  return m;
+#endif
+}
+
+// Empty and deleted slots, their control bytes have the top bit set
+static inline uint32_t hidx_match_free(const uint8_t *c) {
+#ifdef KVDBLITE_HIDX_SSE2
+  return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)c));
+#else
+  uint32_t m = 0;
+  for (int i = 0; i < HIDX_GROUP; i++)
+    m |= (uint32_t)(c[i] >> 7) << i;
+  return m;
+#endif
+}
+
+// A lookup ends at the first group with an empty slot, as the key would
+// have been put there
+static struct node *hidx_find(const struct hidx *t, const avl_key_t *key, uint32_t klen) {
+  if (t->used == 0)
+    return NULL;
+  uint64_t h = hash_key(key, klen);
+  size_t g = hidx_group(t, h), step = 0;
+  for (;;) {
+    const uint8_t *c = t->ctrl + g * HIDX_GROUP;
+    for (uint32_t m = hidx_match(c, hidx_h2(h)); m != 0; m &= m - 1) {
+      struct node *a = t->slot[g * HIDX_GROUP + __builtin_ctz(m)];
+      if (a->klen == klen && memcmp(a->key, key, klen) == 0)
+        return a;
+    }
+    if (hidx_match(c, HIDX_EMPTY) != 0)
+      return NULL;
+    g = hidx_next(t, g, ++step);
+  }
+}
+
+// The slot holding a, SIZE_MAX if it isn't in the table
+static size_t hidx_slot_of(const struct hidx *t, const struct node *a) {
+  if (t->used == 0)
+    return SIZE_MAX;
+  uint64_t h = hash_key(a->key, a->klen);
+  size_t g = hidx_group(t, h), step = 0;
+  for (;;) {
+    const uint8_t *c = t->ctrl + g * HIDX_GROUP;
+    for (uint32_t m = hidx_match(c, hidx_h2(h)); m != 0; m &= m - 1) {
+      size_t i = g * HIDX_GROUP + __builtin_ctz(m);
+      if (t->slot[i] == a)
+        return i;
+    }
+    if (hidx_match(c, HIDX_EMPTY) != 0)
+      return SIZE_MAX;
+    g = hidx_next(t, g, ++step);
+  }
+}
+
+// Add a, whose key isn't in the table yet, to the first free slot on its
+// probe sequence. There must be room, see hidx_reserve().
+static void hidx_put(struct hidx *t, struct node *a, uint64_t h) {
+  size_t g = hidx_group(t, h), step = 0, i;
+  uint32_t m;
+  while ((m = hidx_match_free(t->ctrl + g * HIDX_GROUP)) == 0)
+    g = hidx_next(t, g, ++step);
+  i = g * HIDX_GROUP + __builtin_ctz(m);
+  if (t->ctrl[i] == HIDX_DELETED)
+    t->deleted--;
+  t->ctrl[i] = hidx_h2(h);
+  t->slot[i] = a;
+  t->used++;
+}
+
+static inline size_t hidx_bytes(const struct hidx *t) {
+  return t->cap * (1 + sizeof *t->slot);
+}
+
+// Make room for n more keys. Once used and deleted slots pass 7/8 of the
+// table it is rebuilt without the tombstones, at a size that leaves as much
+// room again as it holds (or n if that is more). The table is left alone if
+// memory runs out.
+static int hidx_reserve(struct shard *sh, size_t n) {
+  struct hidx *t = &sh->hidx, nt;
+  size_t want, i;
+
+  if (!t->on || t->used + t->deleted + n <= t->cap / 8 * 7)
+    return KVDBLITE_SUCCESS;
+  want = t->used + (n > t->used ? n : t->used);
+  for (nt.cap = HIDX_GROUP; nt.cap / 8 * 7 < want; nt.cap *= 2)
+    ;
+  // Control bytes first, 16 byte aligned for the group loads
+  nt.ctrl = aligned_alloc(HIDX_GROUP, hidx_bytes(&nt));
+  if (nt.ctrl == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  memset(nt.ctrl, HIDX_EMPTY, nt.cap);
+  nt.slot = (struct node **)(nt.ctrl + nt.cap);
+  nt.used = nt.deleted = 0;
+  nt.on = 1;
+  for (i = 0; i < t->cap; i++) {
+    if (!(t->ctrl[i] & 0x80))
+      hidx_put(&nt, t->slot[i], hash_key(t->slot[i]->key, t->slot[i]->klen));
+  }
+  free(t->ctrl);
+  *t = nt;
+  return KVDBLITE_SUCCESS;
+}
+
+// a was just linked into the tree, after hidx_reserve(sh, 1)
+static inline void hidx_add(struct shard *sh, struct node *a) {
+  if (sh->hidx.on)
+    hidx_put(&sh->hidx, a, hash_key(a->key, a->klen));
+}
+
+// a is being unlinked from the tree
+static void hidx_del(struct shard *sh, struct node *a) {
+  struct hidx *t = &sh->hidx;
+  size_t i;
+
+  if (!t->on || (i = hidx_slot_of(t, a)) == SIZE_MAX)
+    return;
+  // A group that never filled up never sent a probe on to the next one, so
+  // its slots can go back to empty
+  if (hidx_match(t->ctrl + (i & ~(size_t)(HIDX_GROUP - 1)), HIDX_EMPTY) != 0) {
+    t->ctrl[i] = HIDX_EMPTY;
+  } else {
+    t->ctrl[i] = HIDX_DELETED;
+    t->deleted++;
+  }
+  t->used--;
+}
+
+// Copy on write replaced a by b in the tree
+static void hidx_move(struct shard *sh, struct node *a, struct node *b) {
+  size_t i;
+  if (sh->hidx.on && (i = hidx_slot_of(&sh->hidx, a)) != SIZE_MAX)
+    sh->hidx.slot[i] = b;
+}
+
+// Index the n nodes just loaded into an empty shard
+static void hidx_build(struct shard *sh, struct node **nodes, size_t n) {
+  if (!sh->hidx.on)
+    return;
+  if (hidx_reserve(sh, n) < 0) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < n; i++)
+    hidx_add(sh, nodes[i]);
+}
+
+// Format 1 snapshots are loaded as an AVL tree
+static void hidx_build_tree(struct shard *sh) {
+  struct tree_iter it;
+  if (!sh->hidx.on)
+    return;
+  if (hidx_reserve(sh, node_size(sh->root)) < 0) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  for (tree_iter_first(&it, sh->root); tree_iter_node(&it) != NULL; tree_iter_next(&it))
+    hidx_add(sh, tree_iter_node(&it));
+}
+
+// Every node of the tree is found through the table, and nothing else is in it
+static int hidx_valid(struct shard *sh) {
+  struct hidx *t = &sh->hidx;
+  size_t i, n = 0;
+
+  if (!t->on)
+    return 0;
+  for (i = 0; i < t->cap; i++) {
+    if (t->ctrl[i] & 0x80)
+      continue;
+    if (hidx_find(t, t->slot[i]->key, t->slot[i]->klen) != t->slot[i] ||
+        t->ctrl[i] != hidx_h2(hash_key(t->slot[i]->key, t->slot[i]->klen)))
+      return -1;
+    n++;
+  }
+  return n == t->used && n == (sh->btree ? bt_size(sh) : node_size(sh->root)) ? 0 : -1;
+}
+
+//
+// END Hash index
+//
+
+//
+// AVL tree public API
+//
+
+// Key hash used to pick a shard. Eight bytes at a time, with a final mix
+// so that keys differing only in their last bytes still spread out.
+static inline uint64_t hash_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t hash_key(const avl_key_t *key, uint32_t klen) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ klen, w;
+  for (; klen >= 8; key += 8, klen -= 8) {
+    memcpy(&w, key, 8);
+    h = (h ^ hash_mix(w)) * 0x9e3779b97f4a7c15ULL;
+  }
+  w = 0;
+  memcpy(&w, key, klen);
+  return hash_mix(h ^ w);
+}
+
+static inline struct shard *shard_for(struct avltree *avl, const avl_key_t *key, uint32_t klen) {
+  if (avl->nshards == 1)
+    return avl->shards;
+  return &avl->shards[(uint32_t)(hash_key(key, klen) >> 32) % avl->nshards];
+}
+
+// Several shards are always locked in index order
+static void lock_all_shared(struct avltree *avl) {
+  for (unsigned i = 0; i < avl->nshards; i++)
+    pthread_rwlock_rdlock(&avl->shards[i].rwlock);
+}
+
+static void unlock_all(struct avltree *avl) {
+  for (unsigned i = avl->nshards; i-- > 0;)
+    pthread_rwlock_unlock(&avl->shards[i].rwlock);
+}
+
+static inline struct node *shard_root(struct shard *sh) {
+  return __atomic_load_n(&sh->root, __ATOMIC_ACQUIRE);
+}
+
+// Readers pin the tree they look at, with the shard's lock held shared or in
+// MVCC mode by entering an epoch, which doesn't hold up writers
+static struct node *shard_read_begin(struct shard *sh, struct epoch_slot **slot) {
+  if (sh->avl->opts.mvcc) {
+    *slot = epoch_enter(sh->avl);
+    return __atomic_load_n(&sh->root, __ATOMIC_SEQ_CST);
+  }
+  *slot = NULL;
+  pthread_rwlock_rdlock(&sh->rwlock);
+  return sh->root;
+}
+
+static void shard_read_end(struct shard *sh, struct epoch_slot *slot) {
+  if (slot != NULL)
+    epoch_exit(slot);
+  else
+    pthread_rwlock_unlock(&sh->rwlock);
+}
+
+// MVCC: the roots of all shards as they were at one moment. Called inside
+// an epoch. Changes that span shards bump avl->publish_seq around publishing,
+// reading every root twice catches changes to single shards in between.
+static void load_roots(struct avltree *avl, struct node **roots) {
+  unsigned i, tries;
+  uint64_t seq;
+
+  for (tries = 0; tries < 8; tries++) {
+    seq = __atomic_load_n(&avl->publish_seq, __ATOMIC_SEQ_CST);
+    for (i = 0; i < avl->nshards; i++)
+      roots[i] = __atomic_load_n(&avl->shards[i].root, __ATOMIC_SEQ_CST);
+    if (avl->nshards == 1)
+      return;
+    if (seq & 1)
+      continue;
+    for (i = 0; i < avl->nshards; i++) {
+      if (__atomic_load_n(&avl->shards[i].root, __ATOMIC_SEQ_CST) != roots[i])
+        break;
+    }
+    if (i == avl->nshards && __atomic_load_n(&avl->publish_seq, __ATOMIC_SEQ_CST) == seq)
+      return;
+  }
+  // Writers keep getting in the way, hold them off for a moment
+  lock_all_shared(avl);
+  for (i = 0; i < avl->nshards; i++)
+    roots[i] = avl->shards[i].root;
+  unlock_all(avl);
+}
+
+static struct epoch_slot *db_read_begin(struct avltree *avl, struct node **roots) {
+  struct epoch_slot *slot;
+  if (avl->opts.mvcc) {
+    slot = epoch_enter(avl);
+    load_roots(avl, roots);
+    return slot;
+  }
+  lock_all_shared(avl);
+  for (unsigned i = 0; i < avl->nshards; i++)
+    roots[i] = avl->shards[i].root;
+  return NULL;
+}
+
+static void db_read_end(struct avltree *avl, struct epoch_slot *slot) {
+  if (slot != NULL)
+    epoch_exit(slot);
+  else
+    unlock_all(avl);
+}
+
+// Sum of the shard versions, changes whenever any shard does
+static uint64_t db_version(struct avltree *avl) {
+  uint64_t v = 0;
+  for (unsigned i = 0; i < avl->nshards; i++)
+    v += __atomic_load_n(&avl->shards[i].version, __ATOMIC_RELAXED);
+  return v;
+}
+
+// Called with sh->rwlock held exclusively, after the records went into the journal
+static inline void shard_changed(struct shard *sh, int added) {
+  __atomic_store_n(&sh->count, sh->count + added, __ATOMIC_RELAXED);
+  __atomic_store_n(&sh->version, sh->version + 1, __ATOMIC_RELAXED);
+}
+
+int avl_put(struct avltree *avl, const avl_key_t *key, uint32_t klen, const avl_value_t *value,
+            uint32_t vlen) {
+  int rc = KVDBLITE_SUCCESS;
+  uint64_t lsn = 0, start;
+
+  // A zero length key marks the end of a branch in the database file
+  if (key == NULL || klen == 0 || (value == NULL && vlen > 0))
+    return KVDBLITE_INVALID_ARGUMENT;
+  if (avl->readonly && !avl->overlay)
+    return KVDBLITE_READ_ONLY;
+  start = stat_begin(avl);
+
+  struct shard *sh = shard_for(avl, key, klen);
+  pthread_rwlock_wrlock(&sh->rwlock);
+  if (sh->journalname != NULL) {
+    pthread_mutex_lock(&sh->journal_lock);
+    rc = add_transaction(sh, KVDBLITE_OP_INSERT, key, klen, value, vlen, &lsn);
+    pthread_mutex_unlock(&sh->journal_lock);
+  }
+  if (rc == KVDBLITE_SUCCESS) {
+    shard_write_begin(sh);
+    struct journal_record r = {KVDBLITE_OP_INSERT, key, value, klen, vlen};
+    int added = sh->map.base != NULL ? overlay_apply(sh, &r)
+                                     : shard_insert(sh, key, klen, value, vlen);
+    if (added < 0)
+      rc = added;
+    else if (sh->map.base != NULL && map_bad(&sh->map))
+      rc = KVDBLITE_CORRUPT;
+    shard_changed(sh, added < 0 ? 0 : added);
+    shard_write_end(sh);
+  }
+  pthread_rwlock_unlock(&sh->rwlock);
+
+  if (rc == KVDBLITE_SUCCESS && lsn != 0)
+    rc = journal_commit(sh, lsn);
+  stat_end(avl, STAT_INSERT, start);
+  return rc;
+}
+
+int avl_del(struct avltree *avl, const avl_key_t *key, uint32_t klen) {
+  int rc = KVDBLITE_SUCCESS;
+  uint64_t lsn = 0, start;
+
+  if (key == NULL || klen == 0)
+    return KVDBLITE_INVALID_ARGUMENT;
+  if (avl->readonly && !avl->overlay)
+    return KVDBLITE_READ_ONLY;
+  start = stat_begin(avl);
+
+  struct shard *sh = shard_for(avl, key, klen);
+  pthread_rwlock_wrlock(&sh->rwlock);
+  if (sh->journalname != NULL) {
+    pthread_mutex_lock(&sh->journal_lock);
+    rc = add_transaction(sh, KVDBLITE_OP_REMOVE, key, klen, NULL, 0, &lsn);
+    pthread_mutex_unlock(&sh->journal_lock);
+  }
+  if (rc == KVDBLITE_SUCCESS) {
+    shard_write_begin(sh);
+    struct journal_record r = {KVDBLITE_OP_REMOVE, key, NULL, klen, 0};
+    shard_changed(sh, sh->map.base != NULL ? overlay_apply(sh, &r)
+                                           : -shard_remove(sh, key, klen));
+    if (sh->map.base != NULL && map_bad(&sh->map))
+      rc = KVDBLITE_CORRUPT;
+    shard_write_end(sh);
+  }
+  pthread_rwlock_unlock(&sh->rwlock);
+
+  if (rc == KVDBLITE_SUCCESS && lsn != 0)
+    rc = journal_commit(sh, lsn);
+  stat_end(avl, STAT_REMOVE, start);
+  return rc;
+}
+
+int avl_insert(struct avltree *avl, avl_key_t *key, avl_value_t *value) {
+  return avl_put(avl, key, strlen(key), value, strlen(value));
+}
+
+int avl_remove(struct avltree *avl, avl_key_t *key) {
+  return avl_del(avl, key, strlen(key));
+}
+
+// search a node in the AVL tree
+static struct node *avl_search(const avl_key_t *key, uint32_t klen, struct node *root) {
+  while (root != NULL) {
+    int c = keycmp(key, klen, root->key, root->klen);
+    if (c == 0) {
+      return root;
+    }
+    root = c > 0 ? root->right : root->left;
+  }
+  return NULL;
+}
+
+// Find key in the shard's tree, and in a read only database in the mapped
+// snapshot under it. Returns 1 and fills in v (if not NULL) when found, or an
+// error code if a compressed value couldn't be decompressed.
+static int shard_lookup(struct shard *sh, struct node *root, const avl_key_t *key, uint32_t klen,
+                        struct avl_view *v) {
+  struct node *n;
+  if (sh->hidx.on)
+    n = hidx_find(&sh->hidx, key, klen);
+  else
+    n = sh->btree ? bt_search(sh, key, klen) : avl_search(key, klen, root);
+  if (n == NULL)
+    return sh->map.base != NULL ? map_find(&sh->map, key, klen, v) : 0;
+  if (n->value == NULL)
+    return 0; // Deleted from the mapped snapshot
+  if (v != NULL) {
+    int rc = node_view(sh, n, v);
+    if (rc < 0)
+      return rc;
+  }
+  return 1;
+}
+
+// Nodes in the shard's tree, root is ignored for a B+tree
+static inline size_t shard_tree_size(struct shard *sh, struct node *root) {
+  return sh->btree ? bt_size(sh) : node_size(root);
+}
+
+static size_t shard_key_count(struct shard *sh, struct node *root) {
+  if (sh->map.base == NULL)
+    return shard_tree_size(sh, root);
+  return sh->map.count + node_size(root) - map_shadow_sum(&sh->map, sh->map.count);
+}
+
+static struct avl_lookup_result *make_lookup_result(const struct avl_view *n) {
+  struct avl_lookup_result *r = malloc(sizeof *r);
+  if(r == NULL) {
+    return NULL;
+  }
+
+  r->key = dup_bytes(n->key, n->klen);
+  r->value = dup_bytes(n->value, n->vlen);
+  r->klen = n->klen;
+  r->vlen = n->vlen;
+  if (r->key == NULL || r->value == NULL) {
+    avl_free_lookup_result(r);
+    return NULL;
+  }
+  return r;
+}
+
+// Counts a lookup that started at start, found or not
+static inline void stat_lookup(struct avltree *avl, uint64_t start, int found) {
+  if (!found)
+    stat_count(&stat_stripe(avl)->lookup_misses, 1);
+  stat_end(avl, STAT_LOOKUP, start);
+}
+
+struct avl_lookup_result *avl_get(struct avltree *avl, const avl_key_t *key, uint32_t klen) {
+  struct avl_lookup_result *r = NULL;
+  struct shard *sh = shard_for(avl, key, klen);
+  struct epoch_slot *slot;
+  struct avl_view n;
+  uint64_t start = stat_begin(avl);
+  int found = shard_lookup(sh, shard_read_begin(sh, &slot), key, klen, &n);
+  if (found > 0) {
+    r = make_lookup_result(&n);
+  }
+  shard_read_end(sh, slot);
+  stat_lookup(avl, start, found);
+  return r;
+}
+
+// No locking, the pointers are only good until the next insert/remove
+int avl_get_view(struct avltree *avl, const avl_key_t *key, uint32_t klen, struct avl_view *view) {
+  struct shard *sh = shard_for(avl, key, klen);
+  uint64_t start = stat_begin(avl);
+  int found = shard_lookup(sh, shard_root(sh), key, klen, view);
+  stat_lookup(avl, start, found);
+  if (found < 0)
+    return found;
+  if (!found)
+    return KVDBLITE_NOT_FOUND;
+  return KVDBLITE_SUCCESS;
+}
+
+int avl_get_copy(struct avltree *avl, const avl_key_t *key, uint32_t klen, avl_value_t *buf,
+                 uint32_t bufsize, uint32_t *vlen) {
+  int rc = KVDBLITE_SUCCESS;
+  struct shard *sh = shard_for(avl, key, klen);
+  struct epoch_slot *slot;
+  struct avl_view n;
+  uint64_t start = stat_begin(avl);
+  int found = shard_lookup(sh, shard_read_begin(sh, &slot), key, klen, &n);
+  if (found <= 0) {
+    rc = found < 0 ? found : KVDBLITE_NOT_FOUND;
+  } else {
+    *vlen = n.vlen;
+    if (n.vlen > bufsize)
+      rc = KVDBLITE_BUFFER_TOO_SMALL;
+    else if (n.vlen > 0)
+      memcpy(buf, n.value, n.vlen);
+  }
+  shard_read_end(sh, slot);
+  stat_lookup(avl, start, rc != KVDBLITE_NOT_FOUND);
+  return rc;
+}
+
+// The node can't go away while fn runs
+int avl_get_visit(struct avltree *avl, const avl_key_t *key, uint32_t klen, avl_visit_fn fn,
+                  void *ctx) {
+  int rc;
+  struct shard *sh = shard_for(avl, key, klen);
+  struct epoch_slot *slot;
+  struct avl_view n;
+  uint64_t start = stat_begin(avl);
+  int found = shard_lookup(sh, shard_read_begin(sh, &slot), key, klen, &n);
+  if (found <= 0)
+    rc = found < 0 ? found : KVDBLITE_NOT_FOUND;
+  else
+    rc = fn(ctx, n.key, n.klen, n.value, n.vlen);
+  shard_read_end(sh, slot);
+  stat_lookup(avl, start, found);
+  return rc;
+}
+
+struct avl_lookup_result *avl_lookup(struct avltree *avl, avl_key_t *key) {
+  return avl_get(avl, key, strlen(key));
+}
+
+void avl_free_lookup_result(struct avl_lookup_result *r) {
+  free(r->key);
+  free(r->value);
+  free(r);
+}
+
+static void shard_destroy(struct shard *sh) {
+  if (sh->journalname != NULL) {
+    pthread_mutex_lock(&sh->journal_lock);
+    journal_flush_locked(sh, sh->avl->opts.durability != KVDBLITE_SYNC_NONE);
+    pthread_mutex_unlock(&sh->journal_lock);
+  }
+  if (sh->journal_fd >= 0)
+    close(sh->journal_fd);
+  free(sh->journal.data);
+  free(sh->journal_spare.data);
+  // Every node, key and value lives in the slab, retired ones too
+  bt_destroy(sh);
+  free(sh->hidx.ctrl);
+  slab_destroy(&sh->slab);
+  free(sh->cow);
+  free(sh->retired);
+  free(sh->frozen);
+  if(sh->dbname!=NULL)
+    free(sh->dbname);
+  if(sh->journalname!=NULL)
+    free(sh->journalname);
+  free(sh->rotatedname);
+  if (sh->map.base != NULL)
+    munmap((void *)sh->map.base, sh->map.size);
+  free(sh->map.shadow);
+  free(sh->map.blocks);
+  free(sh->map.checked);
+  vlog_close(sh->vlog);
+  pthread_cond_destroy(&sh->journal_cond);
+  pthread_cond_destroy(&sh->leader_cond);
+  pthread_mutex_destroy(&sh->journal_lock);
+  pthread_rwlock_destroy(&sh->rwlock);
+}
+
+void avl_free(struct avltree *avl) {
+  if (avl->gc_thread_running) {
+    pthread_mutex_lock(&avl->gc_lock);
+    avl->gc_thread_stop = 1;
+    pthread_cond_signal(&avl->gc_cond);
+    pthread_mutex_unlock(&avl->gc_lock);
+    pthread_join(avl->gc_thread, NULL);
+  }
+  // Stop it first, it could start another checkpoint
+  if (avl->policy_thread_running) {
+    pthread_mutex_lock(&avl->policy_lock);
+    avl->policy_thread_stop = 1;
+    pthread_cond_signal(&avl->policy_cond);
+    pthread_mutex_unlock(&avl->policy_lock);
+    pthread_join(avl->policy_thread, NULL);
+  }
+  avl_checkpoint_wait(avl);
+  if (avl->sync_thread_running) {
+    pthread_mutex_lock(&avl->sync_lock);
+    avl->sync_thread_stop = 1;
+    pthread_cond_signal(&avl->sync_cond);
+    pthread_mutex_unlock(&avl->sync_lock);
+    pthread_join(avl->sync_thread, NULL);
+  }
+  if (avl->writer_running) {
+    pthread_mutex_lock(&avl->writer_lock);
+    avl->writer_stop = 1;
+    pthread_cond_signal(&avl->writer_cond);
+    pthread_mutex_unlock(&avl->writer_lock);
+    pthread_join(avl->writer_thread, NULL);
+    avl->writer_running = 0;
+  }
+  free(avl->writer_ios);
+  for (unsigned i = 0; i < avl->nshards; i++)
+    shard_destroy(&avl->shards[i]);
+  free(avl->shards);
+  free(avl->slots);
+  free(avl->stats);
+  if(avl->dbname!=NULL)
+    free(avl->dbname);
+  pthread_cond_destroy(&avl->sync_cond);
+  pthread_mutex_destroy(&avl->sync_lock);
+  pthread_cond_destroy(&avl->policy_cond);
+  pthread_mutex_destroy(&avl->policy_lock);
+  pthread_cond_destroy(&avl->gc_cond);
+  pthread_mutex_destroy(&avl->gc_lock);
+  pthread_mutex_destroy(&avl->gc_run);
+  pthread_cond_destroy(&avl->writer_cond);
+  pthread_mutex_destroy(&avl->writer_lock);
+  pthread_mutex_destroy(&avl->ckpt_lock);
+  free(avl);
+}
+
+void avl_default_options(struct avl_options *opts) {
+  opts->durability = KVDBLITE_SYNC_NONE;
+  opts->sync_interval_ms = 1000;
+  opts->group_commit_us = 200;
+  opts->nshards = 1;
+  opts->mvcc = 0;
+  opts->load_threads = 0;
+  opts->ckpt_journal_bytes = 0;
+  opts->ckpt_journal_pct = 0;
+  opts->ckpt_interval_s = 0;
+  opts->stats_latency = 1;
+  opts->engine = KVDBLITE_ENGINE_AVL;
+  opts->hash_index = 0;
+  opts->compact_snapshots = 0;
+  opts->compress_values = 0;
+  opts->compress_snapshots = 0;
+  opts->value_log = 0;
+  opts->value_log_segment_bytes = KVDBLITE_VLOG_SEGMENT;
+  opts->value_cache_bytes = 64 << 20;
+  opts->value_log_gc_pct = 50;
+  opts->journal_writer = 0;
+}
+
+// Shard i of a sharded database lives in <fn>.<i>, a single shard in <fn>
+static int shard_init(struct avltree *avl, struct shard *sh, const char *fn, unsigned i) {
+  pthread_condattr_t ca;
+
+  sh->avl = avl;
+  sh->root = NULL;
+  sh->btree = avl->opts.engine == KVDBLITE_ENGINE_BTREE;
+  sh->hidx.on = avl->opts.hash_index != 0;
+  slab_init(&sh->slab);
+  sh->journal_fd = -1;
+  sh->reclaim_at = KVDBLITE_MVCC_RECLAIM;
+  pthread_rwlock_init(&sh->rwlock, NULL);
+  pthread_mutex_init(&sh->journal_lock, NULL);
+  pthread_cond_init(&sh->journal_cond, NULL);
+  pthread_condattr_init(&ca);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&sh->leader_cond, &ca);
+  pthread_condattr_destroy(&ca);
+
+  if (fn == NULL)
+    return KVDBLITE_SUCCESS;
+
+  sh->dbname = malloc(strlen(fn) + 12);
+  sh->journalname = malloc(strlen(fn) + 16);
+  sh->rotatedname = malloc(strlen(fn) + 18);
+  sh->journal.data = malloc(KVDBLITE_JOURNAL_BUF_SIZE);
+  sh->journal_spare.data = malloc(KVDBLITE_JOURNAL_BUF_SIZE);
+  if (sh->dbname == NULL || sh->journalname == NULL || sh->rotatedname == NULL ||
+      sh->journal.data == NULL || sh->journal_spare.data == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  if (avl->nshards == 1)
+    strcpy(sh->dbname, fn);
+  else
+    sprintf(sh->dbname, "%s.%u", fn, i);
+  sprintf(sh->journalname, "%s%s", sh->dbname, ".jnl");
+  sprintf(sh->rotatedname, "%s%s", sh->journalname, ".1");
+  sh->journal.cap = sh->journal_spare.cap = KVDBLITE_JOURNAL_BUF_SIZE;
+  return KVDBLITE_SUCCESS;
+}
+
+// A read only database maps the snapshots it can, loads the others, and
+// keeps what the journals and (with overlay) later writes change in the trees
+static struct avltree *db_open(uint8_t *fn, const struct avl_options *opts, int readonly,
+                               int overlay) {
+  pthread_condattr_t ca;
+  int n = 1;
+  unsigned i;
+
+  pthread_once(&crc_once, crc_init);
+  struct avltree *avl = calloc(1, sizeof *avl);
+  if (avl == NULL) {
+    return NULL;
+  }
+  if (opts != NULL) {
+    avl->opts = *opts;
+  } else {
+    avl_default_options(&avl->opts);
+  }
+  if (readonly) {
+    // The mapping is shared by every reader, a tree only holds the changes
+    avl->readonly = 1;
+    avl->overlay = overlay != 0;
+    avl->opts.mvcc = 0;
+    avl->opts.engine = KVDBLITE_ENGINE_AVL;
+    avl->opts.hash_index = 0;
+  }
+  pthread_mutex_init(&avl->sync_lock, NULL);
+  pthread_mutex_init(&avl->ckpt_lock, NULL);
+  pthread_mutex_init(&avl->policy_lock, NULL);
+  pthread_mutex_init(&avl->gc_lock, NULL);
+  pthread_mutex_init(&avl->gc_run, NULL);
+  pthread_mutex_init(&avl->writer_lock, NULL);
+  pthread_cond_init(&avl->writer_cond, NULL);
+  pthread_condattr_init(&ca);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&avl->sync_cond, &ca);
+  pthread_cond_init(&avl->policy_cond, &ca);
+  pthread_cond_init(&avl->gc_cond, &ca);
+  pthread_condattr_destroy(&ca);
+  avl->ckpt_last_us = now_us();
+
+  avl->stats = aligned_alloc(64, KVDBLITE_STAT_STRIPES * sizeof(struct stat_stripe));
+  if (avl->opts.nshards > KVDBLITE_MAX_SHARDS || avl->stats == NULL ||
+      (avl->opts.engine != KVDBLITE_ENGINE_AVL && avl->opts.engine != KVDBLITE_ENGINE_BTREE) ||
+      (avl->opts.engine == KVDBLITE_ENGINE_BTREE && avl->opts.mvcc) ||
+      (avl->opts.hash_index && avl->opts.mvcc) || (avl->opts.value_log && avl->opts.mvcc)) {
+    avl_free(avl);
+    return NULL;
+  }
+  memset(avl->stats, 0, KVDBLITE_STAT_STRIPES * sizeof(struct stat_stripe));
+  if(fn==NULL) {
+    avl->dbname = NULL;
+    if (avl->opts.nshards > 1)
+      n = (int)avl->opts.nshards;
+  } else {
+    avl->dbname = strdup(fn);
+    // Asking for one shard never creates the database file
+    n = load_shard_manifest(fn, readonly ? 1 : avl->opts.nshards);
+    if (avl->dbname == NULL || n < 0) {
+      avl_free(avl);
+      return NULL;
+    }
+  }
+
+  avl->shards = aligned_alloc(64, n * sizeof(struct shard));
+  if (avl->shards == NULL) {
+    avl_free(avl);
+    return NULL;
+  }
+  if (avl->opts.mvcc) {
+    avl->epoch = 1;
+    avl->slots = aligned_alloc(64, KVDBLITE_MVCC_SLOTS * sizeof(struct epoch_slot));
+    if (avl->slots == NULL) {
+      free(avl->shards);
+      avl->shards = NULL;
+      avl_free(avl);
+      return NULL;
+    }
+    memset(avl->slots, 0, KVDBLITE_MVCC_SLOTS * sizeof(struct epoch_slot));
+  }
+  memset(avl->shards, 0, n * sizeof(struct shard));
+  avl->nshards = n;
+  for (i = 0; i < avl->nshards; i++) {
+    if (shard_init(avl, &avl->shards[i], fn, i) < 0) {
+      avl->nshards = i + 1;
+      avl_free(avl);
+      return NULL;
+    }
+  }
 
-  while (1) {
-    if (fread_uint8_t(&op, file) < 0) {
-      fclose(file);
-      return 1;
+  for (i = 0; fn != NULL && i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    int mapped = readonly ? map_snapshot(sh) : 0;
+    if (mapped < 0 || vlog_open(sh) < 0) {
+      avl_free(avl);
+      return NULL;
+    }
+    uint64_t t = now_us();
+    // Load the tree from disk if the file exists. A snapshot that can't be
+    // read fails the open, before vlog_trim() goes by what it references
+    // and before any thread could checkpoint what was loaded over it.
+    sh->snapshot_bytes = file_size(sh->dbname);
+    if (!mapped) {
+      if (load_avl_tree(sh) < 0) {
+        avl_free(avl);
+        return NULL;
+      }
+      avl->load_bytes += sh->snapshot_bytes;
+      avl->load_us += now_us() - t;
     }
+    vlog_trim(sh->vlog);
+  }
 
-    switch (op) {
-      case KVDBLITE_OP_INSERT:
-        printf("INSERT: ");
-        break;
-      case KVDBLITE_OP_REMOVE:
-        printf("REMOVE: ");
-        break;
-      default:
-        // All KVDBLITE_OP_ codes are characters for easy debug
-        printf("UNKNOWN %c: ", op);
+  if (fn != NULL) {
+    // Apply any transactions from the journals
+    uint64_t t = now_us();
+    int rc = replay_journals(avl);
+    avl->replay_us += now_us() - t;
+    if (rc < 0) {
+      avl_free(avl);
+      return NULL;
     }
+  }
 
-    // Key
-    if (fread_uint32_t(&l, file) < 0) {
-      fclose(file);
-      return -1;
+  for (i = 0; fn != NULL && i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    if (sh->map.base != NULL && map_bad(&sh->map)) {
+      // Replay ran into a block that fails its CRC
+      avl_free(avl);
+      return NULL;
     }
-    printf("Len: %d ", l);
-    if (fread_str(&v, l, file) < 0) {
-      fclose(file);
-      return -1;
+    sh->journal_bytes = file_size(sh->rotatedname) + file_size(sh->journalname);
+    avl->replay_bytes += sh->journal_bytes;
+    sh->count = shard_key_count(sh, sh->root);
+    vlog_settle(sh->vlog);
+    if (sh->vlog != NULL)
+      avl->vlog = 1;
+    if (readonly) {
+      // Nothing is written back, overlay changes are lost on avl_free()
+      free(sh->journalname);
+      free(sh->rotatedname);
+      sh->journalname = sh->rotatedname = NULL;
     }
-    printf("%s\n", v);
+  }
+  // Nothing can be looking at the trees while they are loaded
+  for (i = 0; i < avl->nshards; i++)
+    avl->shards[i].mvcc = avl->opts.mvcc != 0;
 
-    if (op == KVDBLITE_OP_INSERT){
-      // Value
-      if (fread_uint32_t(&l, file) < 0) {
-        fclose(file);
-        return -1;
-      }
-      printf("Len: %d ", l);
-      if (fread_str(&v, l, file) < 0) {
-        fclose(file);
-        return -1;
+  if (fn != NULL && !readonly && avl->opts.durability == KVDBLITE_SYNC_INTERVAL &&
+      avl->opts.sync_interval_ms > 0) {
+    if (pthread_create(&avl->sync_thread, NULL, journal_sync_thread, avl) == 0)
+      avl->sync_thread_running = 1;
+  }
+  if (fn != NULL && !readonly &&
+      (avl->opts.ckpt_journal_bytes > 0 || avl->opts.ckpt_journal_pct > 0 ||
+       avl->opts.ckpt_interval_s > 0)) {
+    if (pthread_create(&avl->policy_thread, NULL, checkpoint_policy_thread, avl) == 0)
+      avl->policy_thread_running = 1;
+  }
+  if (fn != NULL && !readonly && avl->opts.journal_writer) {
+    // Without it writers do their own journal I/O as usual
+    avl->writer_ios = malloc(avl->nshards * sizeof(struct journal_io));
+    if (avl->writer_ios != NULL &&
+        pthread_create(&avl->writer_thread, NULL, journal_writer_thread, avl) == 0)
+      avl->writer_running = 1;
+  }
+  if (avl->vlog && !readonly && avl->opts.value_log_gc_pct > 0) {
+    if (pthread_create(&avl->gc_thread, NULL, vlog_gc_thread, avl) == 0)
+      avl->gc_thread_running = 1;
+  }
+
+  return avl;
+}
+
+struct avltree *avl_make_with_options(uint8_t *fn, const struct avl_options *opts) {
+  return db_open(fn, opts, 0, 0);
+}
+
+struct avltree *avl_make(uint8_t *fn) { return avl_make_with_options(fn, NULL); }
+
+struct avltree *avl_open_readonly(uint8_t *fn, int overlay) {
+  if (fn == NULL)
+    return NULL;
+  return db_open(fn, NULL, 1, overlay);
+}
+
+int avl_check_valid(struct avltree *avl) {
+  int h = 0, rc;
+  for (unsigned i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    pthread_rwlock_rdlock(&sh->rwlock);
+    if (sh->count != shard_key_count(sh, sh->root))
+      rc = KVDBLITE_INTERNAL_BALANCE_ERR;
+    else
+      rc = sh->btree ? bt_valid(sh) : valid(sh->root);
+    if (rc >= 0 && hidx_valid(sh) < 0)
+      rc = KVDBLITE_INTERNAL_BALANCE_ERR;
+    pthread_rwlock_unlock(&sh->rwlock);
+    if (rc < 0)
+      return rc;
+    h = max(h, rc);
+  }
+  return h;
+}
+
+int avl_db_size(struct avltree *avl) {
+  size_t n = 0;
+  for (unsigned i = 0; i < avl->nshards; i++)
+    n += __atomic_load_n(&avl->shards[i].count, __ATOMIC_RELAXED);
+  return (int)n;
+}
+
+// Number of keys in the tree that sort before key
+static uint32_t tree_rank(struct node *a, const avl_key_t *key, uint32_t klen) {
+  uint32_t r = 0;
+  while (a != NULL) {
+    int c = keycmp(key, klen, a->key, a->klen);
+    if (c <= 0) {
+      if (c == 0) {
+        r += node_size(a->left);
+        break;
       }
-      printf("%s\n", v);
+      a = a->left;
+    } else {
+      r += node_size(a->left) + 1;
+      a = a->right;
     }
   }
+  return r;
+}
 
-  fclose(file);
+// Number of keys in the shard that sort before key
+static uint64_t shard_rank(struct shard *sh, struct node *root, const avl_key_t *key,
+                           uint32_t klen) {
+  uint64_t r = sh->btree ? bt_rank(sh, key, klen) : tree_rank(root, key, klen);
+  if (sh->map.base == NULL)
+    return r;
+  uint64_t pos = map_lower_bound(&sh->map, key, klen);
+  return pos + r - map_shadow_sum(&sh->map, pos);
 }
 
-static int apply_all_transactions(struct avltree *avl) {
-  uint32_t l;
-  uint8_t *v, *key, *value;
-  
-  FILE *file = fopen(avl->journalname, "r+b");
-  if (!file) {
-    return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+static int db_map_bad(struct avltree *avl) {
+  for (unsigned i = 0; i < avl->nshards; i++) {
+    if (avl->shards[i].map.base != NULL && map_bad(&avl->shards[i].map))
+      return 1;
   }
+  return 0;
+}
 
-  uint8_t op;
+static uint64_t db_rank(struct avltree *avl, struct node **roots, const avl_key_t *key,
+                        uint32_t klen) {
+  uint64_t r = 0;
+  for (unsigned i = 0; i < avl->nshards; i++)
+    r += shard_rank(&avl->shards[i], roots[i], key, klen);
+  return r;
+}
 
-  while (1) {
-    if (fread_uint8_t(&op, file) < 0) {
-      fclose(file);
-      return KVDBLITE_SUCCESS;
+int avl_rank(struct avltree *avl, const avl_key_t *key, uint32_t klen) {
+  struct node *roots[avl->nshards];
+  struct epoch_slot *slot = db_read_begin(avl, roots);
+  int r = (int)db_rank(avl, roots, key, klen);
+  db_read_end(avl, slot);
+  return db_map_bad(avl) ? KVDBLITE_CORRUPT : r;
+}
+
+// k-th node in key order, counting from 0
+static struct node *select_node(struct node *a, uint32_t k) {
+  while (a != NULL) {
+    uint32_t ls = node_size(a->left);
+    if (k == ls)
+      return a;
+    if (k < ls) {
+      a = a->left;
+    } else {
+      k -= ls + 1;
+      a = a->right;
     }
+  }
+  return NULL;
+}
 
-    // Key
-    if (fread_uint32_t(&l, file) < 0) {
-      fclose(file);
-      return KVDBLITE_UNEXPECTED_EOF;
+static inline struct node *shard_select(struct shard *sh, struct node *root, uint32_t k) {
+  return sh->btree ? bt_select(sh, k) : select_node(root, k);
+}
+
+// The k-th key overall is in exactly one shard, in its tree or in a read
+// only database its mapped snapshot. Each of those is in key order, so
+// binary search each for the last entry whose rank across all shards is at
+// most k and see if it is the one. O((shards * log n)^2) plus the cost of
+// walking the trees of a read only database.
+static int db_select(struct avltree *avl, struct node **roots, uint32_t k, struct avl_view *v) {
+  struct node *a;
+  struct avl_view e;
+  uint64_t lo, hi, mid;
+  int rc;
+
+  if (avl->nshards == 1 && avl->shards[0].map.base == NULL) {
+    a = shard_select(avl->shards, roots[0], k);
+    return a != NULL ? shard_lookup(avl->shards, roots[0], a->key, a->klen, v) : 0;
+  }
+
+  for (unsigned s = 0; s < avl->nshards; s++) {
+    struct shard *sh = &avl->shards[s];
+    for (lo = 0, hi = shard_tree_size(sh, roots[s]); lo < hi;) {
+      mid = lo + (hi - lo) / 2;
+      a = shard_select(sh, roots[s], (uint32_t)mid);
+      if (db_rank(avl, roots, a->key, a->klen) <= k)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
-    if (fread_str(&v, l, file) < 0) {
-      fclose(file);
-      return KVDBLITE_UNEXPECTED_EOF;
+    if (lo > 0) {
+      a = shard_select(sh, roots[s], (uint32_t)(lo - 1));
+      if (a->value != NULL && db_rank(avl, roots, a->key, a->klen) == k)
+        return shard_lookup(sh, roots[s], a->key, a->klen, v);
     }
-    key = strdup(v);
-    free(v);
 
-    if (op == KVDBLITE_OP_INSERT) {
-      // Value
-      if (fread_uint32_t(&l, file) < 0) {
-        fclose(file);
-        return KVDBLITE_UNEXPECTED_EOF;
-      }
-      if (fread_str(&v, l, file) < 0) {
-        fclose(file);
-        return KVDBLITE_UNEXPECTED_EOF;
-      }
-      value = strdup(v);
-      free(v);
-      
-      insert(key, value, &avl->root);
+    if (sh->map.base == NULL)
+      continue;
+    for (lo = 0, hi = sh->map.count; lo < hi;) {
+      mid = lo + (hi - lo) / 2;
+      map_entry(&sh->map, mid, &e);
+      if (db_rank(avl, roots, e.key, e.klen) <= k)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo > 0) {
+      map_entry(&sh->map, lo - 1, &e);
+      if (db_rank(avl, roots, e.key, e.klen) == k &&
+          (rc = shard_lookup(sh, roots[s], e.key, e.klen, v)) != 0)
+        return rc;
+    }
+  }
+  return 0;
+}
 
-      free(key);
-      free(value);
-    } else {
-      // KVDBLITE_OP_REMOVE
-      remove_(key, &avl->root);
+struct avl_lookup_result *avl_select(struct avltree *avl, int k) {
+  struct avl_lookup_result *r = NULL;
+  struct avl_view v;
+  if (k < 0)
+    return NULL;
+  struct node *roots[avl->nshards];
+  struct epoch_slot *slot = db_read_begin(avl, roots);
+  if (db_select(avl, roots, (uint32_t)k, &v) > 0 && !db_map_bad(avl))
+    r = make_lookup_result(&v);
+  db_read_end(avl, slot);
+  return r;
+}
 
-      free(key);
+// extended inorder traversal of the tree
+void avl_debug_inorder(struct avltree *avl) {
+  for (unsigned i = 0; i < avl->nshards; i++) {
+    struct node *root = avl->shards[i].root;
+    if (avl->nshards > 1)
+      printf("Shard %u:\n", i);
+    printf("--\n");
+    if (avl->shards[i].btree) {
+      struct bt_leaf *l = bt_first_leaf(&avl->shards[i]);
+      if (l == NULL)
+        printf("Empty!\n");
+      for (; l != NULL; l = l->next) {
+        for (uint32_t j = 0; j < l->n; j++)
+          printf("%s: %s\n", l->ent[j]->key, node_value_str(&avl->shards[i], l->ent[j]));
+      }
+      continue;
+    }
+    if (root == NULL) {
+      printf("Empty!\n");
+      continue;
     }
+
+    printf("Left:\n");
+    inorder(&avl->shards[i], root->left);
+    printf("Root:\n");
+    printf("%s: %s (%d)\n", root->key, node_value_str(&avl->shards[i], root), root->diff);
+    printf("Right:\n");
+    inorder(&avl->shards[i], root->right);
   }
-  fclose(file);
+}
 
-  return KVDBLITE_SUCCESS;
+//
+// END AVL tree public API
+//
+
+//
+// Cursors and range scans
+//
+
+// Cursors don't lock, see kvdblite.h. With several shards they merge the
+// shards' trees on the fly.
+struct avl_cursor {
+  struct avltree *avl;
+  struct avl_snapshot *snap; // Reading a snapshot, which never goes stale
+  uint64_t version;          // db_version() when the cursor was positioned
+  struct merge_iter *m;
+};
+
+// A pinned epoch and the roots of the shards as they were when it was taken
+struct avl_snapshot {
+  struct avltree *avl;
+  struct epoch_slot *slot;
+  struct node *roots[];
+};
+
+static struct avl_cursor *cursor_make(struct avltree *avl, struct avl_snapshot *snap) {
+  struct avl_cursor *c = malloc(sizeof *c + merge_iter_size(avl->nshards, db_nmaps(avl)));
+  if (c == NULL)
+    return NULL;
+  c->avl = avl;
+  c->snap = snap;
+  c->version = db_version(avl);
+  c->m = (struct merge_iter *)(c + 1);
+  merge_iter_init(c->m, avl);
+  return c;
+}
+
+struct avl_cursor *avl_cursor_open(struct avltree *avl) { return cursor_make(avl, NULL); }
+
+void avl_cursor_close(struct avl_cursor *c) { free(c); }
+
+static int cursor_status(struct avl_cursor *c) {
+  struct avl_view v;
+  if (merge_iter_bad(c->m))
+    return KVDBLITE_CORRUPT;
+  return merge_iter_get(c->m, &v) ? KVDBLITE_SUCCESS : KVDBLITE_NOT_FOUND;
+}
+
+// Start over on the current trees
+static void cursor_reset(struct avl_cursor *c) {
+  for (unsigned i = 0; i < c->m->n; i++)
+    c->m->roots[i] = c->snap != NULL ? c->snap->roots[i] : shard_root(&c->avl->shards[i]);
+  c->version = db_version(c->avl);
+}
+
+static inline int cursor_stale(struct avl_cursor *c) {
+  return c->snap == NULL && c->version != db_version(c->avl);
+}
+
+int avl_cursor_first(struct avl_cursor *c) {
+  cursor_reset(c);
+  merge_iter_first(c->m);
+  return cursor_status(c);
+}
+
+int avl_cursor_last(struct avl_cursor *c) {
+  cursor_reset(c);
+  merge_iter_last(c->m);
+  return cursor_status(c);
+}
+
+int avl_cursor_seek(struct avl_cursor *c, const avl_key_t *key, uint32_t klen) {
+  cursor_reset(c);
+  merge_iter_seek(c->m, key, klen);
+  return cursor_status(c);
+}
+
+int avl_cursor_next(struct avl_cursor *c) {
+  if (cursor_stale(c))
+    return KVDBLITE_CURSOR_STALE;
+  merge_iter_next(c->m);
+  return cursor_status(c);
+}
+
+int avl_cursor_prev(struct avl_cursor *c) {
+  if (cursor_stale(c))
+    return KVDBLITE_CURSOR_STALE;
+  merge_iter_prev(c->m);
+  return cursor_status(c);
+}
+
+int avl_cursor_get(struct avl_cursor *c, struct avl_view *view) {
+  int rc;
+  if (c->avl->vlog && c->snap == NULL) {
+    // Reading from the value log, keep its collector from moving the value
+    lock_all_shared(c->avl);
+    rc = cursor_stale(c) ? KVDBLITE_CURSOR_STALE : merge_iter_value(c->m, view);
+    unlock_all(c->avl);
+  } else {
+    rc = cursor_stale(c) ? KVDBLITE_CURSOR_STALE : merge_iter_value(c->m, view);
+  }
+  if (rc < 0)
+    return rc;
+  return rc ? KVDBLITE_SUCCESS : KVDBLITE_NOT_FOUND;
+}
+
+// Visit lo <= key < hi in order, a NULL bound is open. Stops early and
+// returns fn's value as soon as fn returns non-zero.
+int avl_scan_range(struct avltree *avl, const avl_key_t *lo, uint32_t lolen, const avl_key_t *hi,
+                   uint32_t hilen, avl_visit_fn fn, void *ctx) {
+  struct merge_iter *m;
+  struct epoch_slot *slot;
+  struct avl_view n;
+  int rc = KVDBLITE_SUCCESS, got;
+
+  if ((m = malloc(merge_iter_size(avl->nshards, db_nmaps(avl)))) == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  merge_iter_init(m, avl);
+  slot = db_read_begin(avl, m->roots);
+  if (lo != NULL)
+    merge_iter_seek(m, lo, lolen);
+  else
+    merge_iter_first(m);
+  for (; (got = merge_iter_value(m, &n)) > 0; merge_iter_next(m)) {
+    if (hi != NULL && keycmp(n.key, n.klen, hi, hilen) >= 0)
+      break;
+    if ((rc = fn(ctx, n.key, n.klen, n.value, n.vlen)) != 0)
+      break;
+  }
+  if (got < 0)
+    rc = got;
+  db_read_end(avl, slot);
+  free(m);
+  return rc;
+}
+
+int avl_scan_prefix(struct avltree *avl, const avl_key_t *prefix, uint32_t plen, avl_visit_fn fn,
+                    void *ctx) {
+  struct merge_iter *m;
+  struct epoch_slot *slot;
+  struct avl_view n;
+  int rc = KVDBLITE_SUCCESS, got;
+
+  if ((m = malloc(merge_iter_size(avl->nshards, db_nmaps(avl)))) == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  merge_iter_init(m, avl);
+  slot = db_read_begin(avl, m->roots);
+  merge_iter_seek(m, prefix, plen);
+  for (; (got = merge_iter_value(m, &n)) > 0; merge_iter_next(m)) {
+    if (n.klen < plen || memcmp(n.key, prefix, plen) != 0)
+      break;
+    if ((rc = fn(ctx, n.key, n.klen, n.value, n.vlen)) != 0)
+      break;
+  }
+  if (got < 0)
+    rc = got;
+  db_read_end(avl, slot);
+  free(m);
+  return rc;
+}
+
+struct avl_snapshot *avl_snapshot_open(struct avltree *avl) {
+  struct avl_snapshot *s;
+  if (!avl->opts.mvcc)
+    return NULL;
+  s = malloc(sizeof *s + avl->nshards * sizeof(struct node *));
+  if (s == NULL)
+    return NULL;
+  s->avl = avl;
+  s->slot = db_read_begin(avl, s->roots);
+  return s;
+}
+
+void avl_snapshot_close(struct avl_snapshot *s) {
+  db_read_end(s->avl, s->slot);
+  free(s);
+}
+
+int avl_snapshot_get(struct avl_snapshot *s, const avl_key_t *key, uint32_t klen,
+                     struct avl_view *view) {
+  struct node *n = avl_search(key, klen, s->roots[shard_for(s->avl, key, klen) - s->avl->shards]);
+  if (n == NULL)
+    return KVDBLITE_NOT_FOUND;
+  return node_view(shard_for(s->avl, key, klen), n, view);
+}
+
+struct avl_cursor *avl_snapshot_cursor_open(struct avl_snapshot *s) {
+  return cursor_make(s->avl, s);
 }
 
 //
-// End Journalling
+// END Cursors and range scans
 //
 
 //
-// AVL tree internals
+// Write batches
 //
 
-static inline int max(int a, int b) { return a > b ? a : b; }
+// Staged operations, encoded exactly like journal records so that commit
+// can copy them into the journal in one piece
+struct kvdb_write_batch {
+  uint8_t *data;
+  size_t len, cap;
+  uint32_t count;
+};
 
-static inline int min(int a, int b) { return a < b ? a : b; }
+struct kvdb_write_batch *kvdb_write_batch_make(void) {
+  return calloc(1, sizeof(struct kvdb_write_batch));
+}
 
-static inline void fix_diffs_right(int *ap, int *bp) {
-  int a = *ap, b = *bp, k = (b > 0) * b;
-  *ap = k + (a - b) + 1;
-  *bp = max(b, k + a + 1) + 1;
+void kvdb_write_batch_free(struct kvdb_write_batch *b) {
+  if (b == NULL)
+    return;
+  free(b->data);
+  free(b);
+}
+
+void kvdb_write_batch_clear(struct kvdb_write_batch *b) {
+  b->len = 0;
+  b->count = 0;
+}
+
+static int batch_add(struct kvdb_write_batch *b, uint8_t op, const avl_key_t *key, uint32_t klen,
+                     const avl_value_t *value, uint32_t vlen) {
+  size_t need = 1 + varint_size(klen) + klen +
+                (op == KVDBLITE_OP_INSERT ? varint_size(vlen) + vlen : 0);
+
+  if (key == NULL || klen == 0 || (value == NULL && vlen > 0))
+    return KVDBLITE_INVALID_ARGUMENT;
+
+  if (b->len + need > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + need)
+      cap *= 2;
+    uint8_t *p = realloc(b->data, cap);
+    if (p == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    b->data = p;
+    b->cap = cap;
+  }
+
+  uint8_t *p = b->data + b->len;
+  *p++ = op == KVDBLITE_OP_INSERT ? KVDBLITE_OP_PUT : KVDBLITE_OP_DEL;
+  p += varint_put(p, klen);
+  if (op == KVDBLITE_OP_INSERT)
+    p += varint_put(p, vlen);
+  memcpy(p, key, klen);
+  p += klen;
+  if (op == KVDBLITE_OP_INSERT && vlen > 0)
+    memcpy(p, value, vlen);
+  b->len += need;
+  b->count++;
+  return KVDBLITE_SUCCESS;
+}
+
+int kvdb_write_batch_put(struct kvdb_write_batch *b, const avl_key_t *key, uint32_t klen,
+                         const avl_value_t *value, uint32_t vlen) {
+  return batch_add(b, KVDBLITE_OP_INSERT, key, klen, value, vlen);
+}
+
+int kvdb_write_batch_delete(struct kvdb_write_batch *b, const avl_key_t *key, uint32_t klen) {
+  return batch_add(b, KVDBLITE_OP_REMOVE, key, klen, NULL, 0);
+}
+
+// Per shard share of a batch being committed
+struct batch_part {
+  uint32_t count;
+  size_t len;
+  uint64_t lsn;
+};
+
+// Journal the records of b that belong to shard s as one batch record
+//   BATCH_BEGIN, count, payload length, payload, BATCH_COMMIT, CRC32(payload)
+// or, as the part of a batch of several shards, id > 0
+//   BATCH_PART, count, payload length, u64 id, u32 shards, shard bitmap,
+//   payload, BATCH_COMMIT, CRC32(id through payload)
+// Called with the shard locked exclusively.
+static int batch_journal(struct avltree *avl, struct kvdb_write_batch *b, unsigned s,
+                         struct batch_part *part, uint64_t id, const uint8_t *shards) {
+  struct shard *sh = &avl->shards[s];
+  struct journal_record r;
+  size_t off, start, extra = id ? 8 + 4 + batch_map_size(avl) : 0;
+  long used;
+  int rc;
+
+  pthread_mutex_lock(&sh->journal_lock);
+  if ((rc = journal_reserve(sh, 1 + 4 + 4 + extra + part->len + 1 + 4)) == KVDBLITE_SUCCESS) {
+    journal_put_uint8_t(sh, id ? KVDBLITE_OP_BATCH_PART : KVDBLITE_OP_BATCH_BEGIN);
+    journal_put_uint32_t(sh, part->count);
+    journal_put_uint32_t(sh, (uint32_t)part->len);
+    start = sh->journal.len;
+    if (id) {
+      put_le64(sh->journal.data + sh->journal.len, id);
+      sh->journal.len += 8;
+      journal_put_uint32_t(sh, avl->nshards);
+      journal_put_bytes(sh, shards, (uint32_t)batch_map_size(avl));
+    }
+    if (avl->nshards == 1) {
+      journal_put_bytes(sh, b->data, (uint32_t)b->len);
+    } else {
+      for (off = 0; off < b->len; off += used) {
+        used = decode_record(b->data + off, b->len - off, &r);
+        if (shard_for(avl, r.key, r.klen) == sh)
+          journal_put_bytes(sh, b->data + off, (uint32_t)used);
+      }
+    }
+    uint32_t crc = calc_CRC32(sh->journal.data + start, sh->journal.len - start, 0);
+    journal_put_uint8_t(sh, KVDBLITE_OP_BATCH_COMMIT);
+    journal_put_uint32_t(sh, crc);
+    part->lsn = ++sh->journal_lsn;
+    if (id)
+      __atomic_store_n(&sh->batch_lsn, part->lsn, __ATOMIC_RELAXED);
+    journal_appended(sh);
+  }
+  pthread_mutex_unlock(&sh->journal_lock);
+  return rc;
+}
+
+// Journal that the batch id never committed, its part in this shard is
+// dropped by replay. The record is
+//   BATCH_ABORT, u64 id, CRC32(op and id)
+// and its sequence number is returned in *lsn.
+static int batch_abort(struct shard *sh, uint64_t id, uint64_t *lsn) {
+  size_t start;
+  int rc;
+
+  pthread_mutex_lock(&sh->journal_lock);
+  if ((rc = journal_reserve(sh, 1 + 8 + 4)) == KVDBLITE_SUCCESS) {
+    start = sh->journal.len;
+    journal_put_uint8_t(sh, KVDBLITE_OP_BATCH_ABORT);
+    put_le64(sh->journal.data + sh->journal.len, id);
+    sh->journal.len += 8;
+    journal_put_uint32_t(sh, calc_CRC32(sh->journal.data + start, 9, 0));
+    *lsn = ++sh->journal_lsn;
+    journal_appended(sh);
+  }
+  pthread_mutex_unlock(&sh->journal_lock);
+  return rc;
+}
+
+// Every shard the batch touches is locked exclusively (in index order) while
+// it is journalled and applied, so readers see all of it or none of it. Each
+// shard journals its part of the batch as one record that replay applies
+// completely or not at all.
+//
+// A batch of several shards gets an id, and each part lists the shards that
+// have one. Replay only applies a part once it has found every other part in
+// the journals, or knows it is in that shard's snapshot: parts are
+// journalled in id order within a shard, and a snapshot records the last id
+// it holds (struct snap_source). So a crash that leaves some parts on disk
+// and not others loses the whole batch. Two more rules keep that true:
+//   - a checkpoint writes the snapshot of a shard only once the batch parts
+//     of the other shards are synced, see checkpoint_shard()
+//   - parts left without their batch are followed by a BATCH_ABORT record,
+//     by replay (see replay_batches()) or here when journalling a later part
+//     failed, so they can't be completed by a later snapshot
+int kvdb_write_batch_commit(struct avltree *avl, struct kvdb_write_batch *b) {
+  int rc = KVDBLITE_SUCCESS, r2;
+  struct batch_part one, *parts = &one;
+  struct journal_record r;
+  uint8_t shards[KVDBLITE_MAX_SHARDS / 8];
+  uint64_t id = 0;
+  unsigned i, touched = 1;
+  long used;
+  size_t off;
+
+  if (b->count == 0)
+    return KVDBLITE_SUCCESS;
+  if (avl->readonly && !avl->overlay)
+    return KVDBLITE_READ_ONLY;
+  stat_count(&stat_stripe(avl)->batches, 1);
+
+  if (avl->nshards == 1) {
+    one.count = b->count;
+    one.len = b->len;
+    one.lsn = 0;
+  } else {
+    parts = calloc(avl->nshards, sizeof *parts);
+    if (parts == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    for (off = 0; off < b->len; off += used) {
+      used = decode_record(b->data + off, b->len - off, &r);
+      struct batch_part *p = &parts[shard_for(avl, r.key, r.klen) - avl->shards];
+      p->count++;
+      p->len += used;
+    }
+    memset(shards, 0, batch_map_size(avl));
+    for (i = 0, touched = 0; i < avl->nshards; i++) {
+      if (parts[i].count > 0) {
+        shards[i / 8] |= 1 << (i % 8);
+        touched++;
+      }
+    }
+  }
+
+  for (i = 0; i < avl->nshards; i++) {
+    if (parts[i].count > 0)
+      pthread_rwlock_wrlock(&avl->shards[i].rwlock);
+  }
+  // Ids go up in journal order in every shard, see checkpoint_shard()
+  if (touched > 1)
+    id = __atomic_add_fetch(&avl->batch_seq, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < avl->nshards && rc == KVDBLITE_SUCCESS; i++) {
+    if (parts[i].count > 0 && avl->shards[i].journalname != NULL)
+      rc = batch_journal(avl, b, i, &parts[i], id, shards);
+  }
+  for (i = 0; i < avl->nshards && rc < 0 && id; i++) {
+    uint64_t lsn;
+    if (parts[i].lsn != 0 && batch_abort(&avl->shards[i], id, &lsn) == KVDBLITE_SUCCESS)
+      journal_sync_to(&avl->shards[i], lsn);
+  }
+  if (rc == KVDBLITE_SUCCESS) {
+    for (i = 0; i < avl->nshards; i++) {
+      if (parts[i].count > 0) {
+        shard_write_begin(&avl->shards[i]);
+        if (id)
+          avl->shards[i].batch_id = id;
+      }
+    }
+    for (off = 0; off < b->len; off += used) {
+      used = decode_record(b->data + off, b->len - off, &r);
+      struct shard *sh = shard_for(avl, r.key, r.klen);
+      shard_changed(sh, apply_record(sh, &r));
+      if (sh->map.base != NULL && map_bad(&sh->map))
+        rc = KVDBLITE_CORRUPT;
+    }
+    // MVCC snapshots see all of the batch or none of it, see load_roots()
+    int several = parts != &one && avl->opts.mvcc;
+    if (several)
+      __atomic_add_fetch(&avl->publish_seq, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < avl->nshards; i++) {
+      if (parts[i].count > 0)
+        shard_publish(&avl->shards[i]);
+    }
+    if (several)
+      __atomic_add_fetch(&avl->publish_seq, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < avl->nshards; i++) {
+      if (parts[i].count > 0)
+        shard_retire_published(&avl->shards[i]);
+    }
+  }
+  for (i = avl->nshards; i-- > 0;) {
+    if (parts[i].count > 0)
+      pthread_rwlock_unlock(&avl->shards[i].rwlock);
+  }
+
+  for (i = 0; i < avl->nshards && rc == KVDBLITE_SUCCESS; i++) {
+    if (parts[i].count > 0 && parts[i].lsn != 0 &&
+        (r2 = journal_commit(&avl->shards[i], parts[i].lsn)) < 0)
+      rc = r2;
+  }
+  if (parts != &one)
+    free(parts);
+  return rc;
+}
+
+//
+// END Write batches
+//
+
+//
+// Value log
+//
+
+static inline uint32_t vlog_ref_seg(const uint8_t *ref) { return get_le32(ref); }
+static inline uint64_t vlog_ref_off(const uint8_t *ref) { return get_le64(ref + 4); }
+static inline uint32_t vlog_ref_size(const uint8_t *ref) { return get_le32(ref + 12); }
+
+// Bytes of the record holding a size byte value for a klen byte key
+static inline uint64_t vlog_rec_bytes(uint32_t klen, uint32_t size) {
+  return 8 + (uint64_t)klen + size + 4;
 }
 
-static inline void fix_diffs_left(int *ap, int *bp) {
-  int a = *ap, b = *bp, k = (b < 0) * b;
-  *ap = k + (a - b) - 1;
-  *bp = min(b, k + a - 1) - 1;
+static inline uint32_t vcache_hash(uint32_t seg, uint64_t off) {
+  return (uint32_t)(((off ^ (uint64_t)seg << 40) * 0x9e3779b97f4a7c15ULL) >> 32);
 }
 
-static inline void rotate_right(struct node **rp) {
-  struct node *a = *rp, *b = a->left;
-  a->left = b->right;
-  b->right = a;
-  fix_diffs_right(&a->diff, &b->diff);
-  *rp = b;
+static uint32_t vcache_find(const struct vcache *c, uint32_t seg, uint64_t off) {
+  uint32_t i;
+  if (c->cap == 0)
+    return VCACHE_NONE;
+  for (i = c->heads[vcache_hash(seg, off) & (c->cap - 1)]; i != VCACHE_NONE; i = c->ents[i].next)
+    if (c->ents[i].seg == seg && c->ents[i].off == off)
+      return i;
+  return VCACHE_NONE;
 }
 
-static inline void rotate_left(struct node **rp) {
-  struct node *a = *rp, *b = a->right;
-  a->right = b->left;
-  b->left = a;
-  fix_diffs_left(&a->diff, &b->diff);
-  *rp = b;
+static void vcache_link(struct vcache *c, uint32_t i) {
+  uint32_t *head = &c->heads[vcache_hash(c->ents[i].seg, c->ents[i].off) & (c->cap - 1)];
+  c->ents[i].next = *head;
+  *head = i;
 }
 
-static inline int balance(struct node **rp) {
-  struct node *a = *rp;
-  if (a->diff == 2) {
-    if (a->right->diff == -1)
-      rotate_right(&a->right);
-    rotate_left(rp);
-    return 1;
-  } else if (a->diff == -2) {
-    if (a->left->diff == 1)
-      rotate_left(&a->left);
-    rotate_right(rp);
-    return 1;
-  }
-  return 0;
+static void vcache_evict(struct vcache *c, uint32_t i) {
+  struct vcache_ent *e = &c->ents[i];
+  uint32_t *link = &c->heads[vcache_hash(e->seg, e->off) & (c->cap - 1)];
+  while (*link != i)
+    link = &c->ents[*link].next;
+  *link = e->next;
+  c->bytes -= e->size;
+  free(e->data);
+  e->data = NULL;
+  e->seg = 0;
+  e->next = c->free;
+  c->free = i;
 }
 
-static int insert_leaf(avl_key_t *key, avl_value_t *value, struct node **rp) {
-  struct node *a = (*rp = malloc(sizeof *a));
-  if (a == NULL) {
+// Double the entries and rehash, the table has as many chains as entries
+static int vcache_grow(struct vcache *c) {
+  uint32_t cap = c->cap ? c->cap * 2 : 64, i;
+  struct vcache_ent *ents;
+  uint32_t *heads;
+
+  if (cap == 0 || (ents = realloc(c->ents, cap * sizeof *ents)) == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  c->ents = ents;
+  if ((heads = realloc(c->heads, cap * sizeof *heads)) == NULL)
     return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  c->heads = heads;
+  c->cap = cap;
+  for (i = 0; i < cap; i++)
+    heads[i] = VCACHE_NONE;
+  for (i = 0; i < c->n; i++)
+    if (ents[i].seg != 0)
+      vcache_link(c, i);
+  return KVDBLITE_SUCCESS;
+}
+
+// Keep a copy of a value read from segment seg at off. Nothing bigger than an
+// eighth of the budget is cached, so a few large values can't flush it.
+static void vcache_put(struct vcache *c, uint32_t seg, uint64_t off, const uint8_t *data,
+                       uint32_t size) {
+  struct vcache_ent *e;
+  uint8_t *copy;
+  uint32_t i;
+
+  if (size > c->budget / 8 || vcache_find(c, seg, off) != VCACHE_NONE)
+    return;
+  // CLOCK: the hand clears the bit of entries used since it last came by and
+  // evicts the first one it finds clear
+  while (c->bytes + size > c->budget) {
+    if (c->hand >= c->n)
+      c->hand = 0;
+    e = &c->ents[c->hand];
+    if (e->seg != 0 && e->ref)
+      e->ref = 0;
+    else if (e->seg != 0)
+      vcache_evict(c, c->hand);
+    c->hand++;
   }
-  a->left = a->right = NULL;
-  a->diff = 0;
-  a->key = strdup(key);
-  a->value = strdup(value);
-  return 1;
+  if ((copy = malloc(size)) == NULL)
+    return;
+  if (c->free == VCACHE_NONE && c->n == c->cap && vcache_grow(c) < 0) {
+    free(copy);
+    return;
+  }
+  if (c->free != VCACHE_NONE) {
+    i = c->free;
+    c->free = c->ents[i].next;
+  } else {
+    i = c->n++;
+  }
+  e = &c->ents[i];
+  e->seg = seg;
+  e->off = off;
+  e->size = size;
+  e->ref = 0; // A value read once goes before one read again
+  e->data = copy;
+  memcpy(copy, data, size);
+  vcache_link(c, i);
+  c->bytes += size;
 }
 
-static int insert(avl_key_t *key, avl_value_t *value, struct node **rp) {
-  struct node *a = *rp;
-  if (a == NULL)
-    return insert_leaf(key, value, rp);
-  if (strcmp(key, a->key) == 0) {
-    // Key already exists
-    free(a->value);
-    a->value = strdup(value);
-    return 0; // Tree structure didn't change
-  }
-  if (strcmp(key, a->key) > 0)
-    if (insert(key, value, &a->right) && (++a->diff) == 1)
-      return 1;
-  if (strcmp(key, a->key) < 0)
-    if (insert(key, value, &a->left) && (--a->diff) == -1)
-      return 1;
-  if (a->diff != 0)
-    balance(rp);
-  return 0;
+static void vcache_destroy(struct vcache *c) {
+  for (uint32_t i = 0; i < c->n; i++)
+    free(c->ents[i].data);
+  free(c->ents);
+  free(c->heads);
 }
 
-static int unlink_left(struct node **rp, struct node **lp) // with *rp != NULL
-{
-  struct node *a = *rp;
-  if (a->left == NULL) {
-    *rp = a->right;
-    *lp = a;
-    return 1;
+// Index of segment id in vl->segs, -1 if it isn't there
+static long vlog_find(const struct vlog *vl, uint32_t id) {
+  size_t lo = 0, hi = vl->nsegs;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (vl->segs[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  if (unlink_left(&a->left, lp) && (++a->diff) == 0)
-    return 1;
-  if (a->diff != 0)
-    return balance(rp) && (*rp)->diff == 0;
-  return 0;
+  return lo < vl->nsegs && vl->segs[lo].id == id ? (long)lo : -1;
 }
 
-static int remove_root(struct node **rp) {
-  int delta;
-  struct node *a = *rp, *b;
-  if (a->left == NULL || a->right == NULL) {
-    *rp = a->right == NULL ? a->left : a->right;
-    free(a->key);
-    free(a->value);
-    free(a);
-    return 1;
+static long vlog_add_seg(struct vlog *vl, uint32_t id, int fd, uint64_t size) {
+  size_t i;
+  if (vl->nsegs == vl->segcap) {
+    size_t cap = vl->segcap ? vl->segcap * 2 : 16;
+    struct vlog_seg *segs = realloc(vl->segs, cap * sizeof *segs);
+    if (segs == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    vl->segs = segs;
+    vl->segcap = cap;
   }
-  delta = unlink_left(&a->right, rp);
-  b = *rp;
-  b->left = a->left;
-  b->right = a->right;
-  b->diff = a->diff;
-
-  free(a->key);
-  free(a->value);
-  free(a);
-  if (delta && (--b->diff) == 0)
-    return 1;
-  if (b->diff != 0)
-    return balance(rp) && (*rp)->diff == 0;
-  return 0;
+  for (i = vl->nsegs; i > 0 && vl->segs[i - 1].id > id; i--)
+    vl->segs[i] = vl->segs[i - 1];
+  memset(&vl->segs[i], 0, sizeof *vl->segs);
+  vl->segs[i].id = id;
+  vl->segs[i].fd = fd;
+  vl->segs[i].size = size;
+  vl->nsegs++;
+  return (long)i;
 }
 
-static int remove_(avl_key_t *key, struct node **rp) {
-  struct node *a = *rp;
-  if (a == NULL)
-    return 0;
-  if (strcmp(key, a->key) == 0)
-    return remove_root(rp);
-  if (strcmp(key, a->key) > 0)
-    if (remove_(key, &a->right) && (--a->diff) == 0)
-      return 1;
-  if (strcmp(key, a->key) < 0)
-    if (remove_(key, &a->left) && (++a->diff) == 0)
-      return 1;
-  if (a->diff != 0)
-    return balance(rp) && (*rp)->diff == 0;
-  return 0;
+static char *vlog_seg_name(const struct vlog *vl, uint32_t id) {
+  char *name = malloc(strlen(vl->prefix) + 11);
+  if (name != NULL)
+    sprintf(name, "%s%u", vl->prefix, id);
+  return name;
 }
 
-static void free_(struct node *a) {
-  if (a == NULL)
+static void vlog_close(struct vlog *vl) {
+  if (vl == NULL)
     return;
-  free_(a->left);
-  free_(a->right);
-  free(a);
+  for (size_t i = 0; i < vl->nsegs; i++)
+    close(vl->segs[i].fd);
+  vcache_destroy(&vl->cache);
+  free(vl->segs);
+  free(vl->prefix);
+  pthread_mutex_destroy(&vl->lock);
+  free(vl);
 }
 
-void zaptree_root_rm_method(struct avltree *avl) {
-  while (avl->root != NULL) {
-    avl_remove(avl, avl->root->key);
+// Open the segments of the shard's value log found next to its database
+// file. A shard gets a value log if the options ask for one or segments are
+// there already, their values have to stay readable.
+static int vlog_open(struct shard *sh) {
+  struct avltree *avl = sh->avl;
+  const char *fn = (const char *)sh->dbname, *slash = strrchr(fn, '/');
+  const char *base = slash ? slash + 1 : fn;
+  size_t blen = strlen(base);
+  char *dir = slash == NULL ? strdup(".") : strndup(fn, slash == fn ? 1 : slash - fn);
+  struct vlog *vl = calloc(1, sizeof *vl);
+  struct dirent *de;
+  DIR *d = NULL;
+  int rc = KVDBLITE_SUCCESS;
+
+  if (dir == NULL || vl == NULL || (vl->prefix = malloc(strlen(fn) + 7)) == NULL) {
+    free(dir);
+    free(vl);
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  }
+  pthread_mutex_init(&vl->lock, NULL);
+  sprintf(vl->prefix, "%s.vlog.", fn);
+  vl->readonly = avl->readonly;
+  vl->next_id = 1;
+  vl->seg_bytes = avl->opts.value_log_segment_bytes ? avl->opts.value_log_segment_bytes
+                                                    : KVDBLITE_VLOG_SEGMENT;
+  vl->cache.budget = avl->opts.value_cache_bytes / avl->nshards;
+  vl->cache.free = VCACHE_NONE;
+
+  if ((d = opendir(dir)) != NULL) {
+    while (rc == KVDBLITE_SUCCESS && (de = readdir(d)) != NULL) {
+      const char *p = de->d_name + blen + 6;
+      char *end, *name;
+      unsigned long id;
+      struct stat st;
+      int fd;
+
+      if (strncmp(de->d_name, base, blen) != 0 || strncmp(de->d_name + blen, ".vlog.", 6) != 0 ||
+          *p < '1' || *p > '9')
+        continue;
+      id = strtoul(p, &end, 10);
+      if (*end != 0 || id > UINT32_MAX - 1)
+        continue;
+      if ((name = vlog_seg_name(vl, (uint32_t)id)) == NULL) {
+        rc = KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+        break;
+      }
+      fd = open(name, vl->readonly ? O_RDONLY : O_RDWR);
+      free(name);
+      if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0)
+          close(fd);
+        rc = KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+      } else if (vlog_add_seg(vl, (uint32_t)id, fd, (uint64_t)st.st_size) < 0) {
+        close(fd);
+        rc = KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+      } else if (id >= vl->next_id) {
+        vl->next_id = (uint32_t)id + 1;
+      }
+    }
+    closedir(d);
   }
+  free(dir);
+  if (rc < 0 || (vl->nsegs == 0 && (!avl->opts.value_log || avl->readonly))) {
+    vlog_close(vl);
+    return rc;
+  }
+  sh->vlog = vl;
+  return KVDBLITE_SUCCESS;
 }
 
-struct node *leaf_left(struct node *root) {
-  if (root == NULL) {
-    return NULL;
+// Called once the snapshot is loaded, before the journals are replayed.
+// Segments past the last one the snapshot points into only hold values the
+// journals have in full, replay appends those again. Delete them now, or
+// every open would leave another copy behind until a checkpoint ran.
+static void vlog_trim(struct vlog *vl) {
+  uint32_t last = 0;
+  size_t i;
+  if (vl == NULL || vl->readonly)
+    return;
+  for (i = 0; i < vl->nsegs; i++)
+    if (vl->segs[i].live)
+      last = vl->segs[i].id;
+  while (vl->nsegs > 0 && vl->segs[vl->nsegs - 1].id > last) {
+    struct vlog_seg *sg = &vl->segs[vl->nsegs - 1];
+    char *name = vlog_seg_name(vl, sg->id);
+    if (name == NULL || unlink(name) < 0) {
+      free(name);
+      break;
+    }
+    free(name);
+    close(sg->fd);
+    vl->nsegs--;
+    vl->collected++;
   }
+  vl->next_id = (vl->nsegs ? vl->segs[vl->nsegs - 1].id : 0) + 1;
+}
 
-  leaf_left(root->left);
-  return root;
+// Once the snapshot and the journals are loaded every reference has been
+// counted, and the segments nothing points into can go
+static void vlog_settle(struct vlog *vl) {
+  if (vl == NULL)
+    return;
+  for (size_t i = 0; i < vl->nsegs; i++)
+    if (vl->segs[i].live == 0 && vl->segs[i].id != vl->active && !vl->segs[i].dead)
+      vl->segs[i].dead = vl->ckpt + 1;
 }
 
-struct node *leaf_right(struct node *root) {
-  if (root == NULL) {
-    return NULL;
+// A new segment to append to, called with vl->lock held
+static long vlog_new_seg(struct vlog *vl) {
+  long i;
+  for (;;) {
+    char *name;
+    int fd;
+    uint32_t id = vl->next_id;
+    if (id == UINT32_MAX)
+      return KVDBLITE_DB_WRITE_ERR;
+    vl->next_id++;
+    if ((name = vlog_seg_name(vl, id)) == NULL)
+      return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+    fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    free(name);
+    if (fd < 0 && errno == EEXIST)
+      continue;
+    if (fd < 0)
+      return KVDBLITE_FAILED_TO_OPEN_DB_FILE;
+    if ((i = vlog_add_seg(vl, id, fd, 0)) < 0) {
+      close(fd);
+      return i;
+    }
+    vl->active = id;
+    vl->created = 1;
+    return i;
   }
+}
 
-  leaf_right(root->right);
-  return root;
+// Append a record holding key and the size bytes at data, and put the
+// reference to the value in ref. Segments are closed once the next record
+// would take them past seg_bytes.
+static int vlog_append(struct vlog *vl, const avl_key_t *key, uint32_t klen, const uint8_t *data,
+                       size_t size, uint8_t *ref) {
+  uint64_t rec = vlog_rec_bytes(klen, (uint32_t)size);
+  uint8_t head[8], tail[4];
+  struct iovec iov[4];
+  struct vlog_seg *sg;
+  long i = -1;
+  int rc = KVDBLITE_SUCCESS;
+
+  if (size > UINT32_MAX - 12 - (uint64_t)klen)
+    return KVDBLITE_INVALID_ARGUMENT;
+  put_le32(head, klen);
+  put_le32(head + 4, (uint32_t)size);
+  put_le32(tail, calc_CRC32(data, size, calc_CRC32(key, klen, calc_CRC32(head, 8, 0))));
+  iov[0] = (struct iovec){head, 8};
+  iov[1] = (struct iovec){(void *)key, klen};
+  iov[2] = (struct iovec){(void *)data, size};
+  iov[3] = (struct iovec){tail, 4};
+
+  pthread_mutex_lock(&vl->lock);
+  if (vl->active != 0)
+    i = vlog_find(vl, vl->active);
+  if (i < 0 || (vl->segs[i].size > 0 && vl->segs[i].size + rec > vl->seg_bytes)) {
+    if (i >= 0 && vl->segs[i].live == 0)
+      vl->segs[i].dead = vl->ckpt + 1;
+    i = vlog_new_seg(vl);
+  }
+  if (i < 0) {
+    rc = (int)i;
+  } else {
+    sg = &vl->segs[i];
+    // A short write leaves a torn record that the next one overwrites
+    if (pwritev(sg->fd, iov, 4, (off_t)sg->size) != (ssize_t)rec) {
+      rc = KVDBLITE_DB_WRITE_ERR;
+    } else {
+      put_le32(ref, sg->id);
+      put_le64(ref + 4, sg->size + 8 + klen);
+      put_le32(ref + 12, (uint32_t)size);
+      sg->size += rec;
+      sg->dirty = 1;
+    }
+  }
+  pthread_mutex_unlock(&vl->lock);
+  return rc;
 }
 
-static void zap_tree_traversal(struct avltree *avl) {
-  struct node *lr;
-  while (avl->root != NULL) {
-    lr = leaf_left(avl->root);
-    if (lr != NULL)
-      avl_remove(avl, lr->key);
-    lr = leaf_right(avl->root);
-    if (lr != NULL)
-      avl_remove(avl, lr->key);
+// A node now points at ref
+static void vlog_ref_add(struct vlog *vl, const uint8_t *ref, uint32_t klen) {
+  long i;
+  if (vl == NULL)
+    return;
+  pthread_mutex_lock(&vl->lock);
+  if ((i = vlog_find(vl, vlog_ref_seg(ref))) >= 0)
+    vl->segs[i].live += vlog_rec_bytes(klen, vlog_ref_size(ref));
+  pthread_mutex_unlock(&vl->lock);
+}
+
+// A node no longer points at ref. A closed segment nothing points into is
+// dead, and goes once a snapshot without references to it is on disk.
+static void vlog_ref_drop(struct vlog *vl, const uint8_t *ref, uint32_t klen) {
+  struct vlog_seg *sg;
+  long i;
+  if (vl == NULL)
+    return;
+  pthread_mutex_lock(&vl->lock);
+  if ((i = vlog_find(vl, vlog_ref_seg(ref))) >= 0) {
+    sg = &vl->segs[i];
+    sg->live -= vlog_rec_bytes(klen, vlog_ref_size(ref));
+    if (sg->live == 0 && sg->id != vl->active && !sg->dead)
+      sg->dead = vl->ckpt + 1;
   }
+  pthread_mutex_unlock(&vl->lock);
 }
 
-static int valid(struct node *a) {
-  int lh, rh, b;
-  if (a == NULL)
-    return 0;
-  lh = valid(a->left);
-  if(lh < 0)
-    return lh;
-  rh = valid(a->right);
-  if(rh < 0)
-    return rh;
-  b = rh - lh;
+// Read a's value from the value log into the calling thread's fetch buffer,
+// with a NUL after it. A value not in the cache is read with its whole
+// record, and the record's length, key and CRC are checked. Called with the
+// shard locked, so the segment can't be deleted underneath.
+static int vlog_fetch(struct shard *sh, const struct node *a, uint8_t **out) {
+  struct vlog *vl = sh->vlog;
+  struct lz_scratch *s = lz_scratch();
+  uint32_t seg = vlog_ref_seg(a->value), size = vlog_ref_size(a->value), i;
+  uint64_t off = vlog_ref_off(a->value), rec = vlog_rec_bytes(a->klen, size);
+  uint8_t *p;
+  long k;
+  int fd = -1;
 
-  if (b != a->diff) {
-    printf("b %d, a->diff %d, rh %d, lh %d - a->key %s\n", b, a->diff, rh, lh,
-           a->key);
-    return KVDBLITE_INTERNAL_BALANCE_ERR;
+  if (vl == NULL)
+    return KVDBLITE_UNEXPECTED_EOF;
+  if (s == NULL || rec > SIZE_MAX || lz_grow(&s->fetch, &s->fetchcap, (size_t)rec) == NULL)
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  pthread_mutex_lock(&vl->lock);
+  if ((i = vcache_find(&vl->cache, seg, off)) != VCACHE_NONE) {
+    vl->cache.ents[i].ref = 1;
+    vl->cache.hits++;
+    memcpy(s->fetch, vl->cache.ents[i].data, size);
+    pthread_mutex_unlock(&vl->lock);
+    s->fetch[size] = 0;
+    *out = s->fetch;
+    return KVDBLITE_SUCCESS;
   }
-  if (abs(b) > 1)
-    return KVDBLITE_LOPSIDED_ERR;
+  vl->cache.misses++;
+  if ((k = vlog_find(vl, seg)) >= 0)
+    fd = vl->segs[k].fd;
+  pthread_mutex_unlock(&vl->lock);
 
-  return max(lh, rh) + 1;
+  p = s->fetch;
+  if (fd < 0 || off < 8 + (uint64_t)a->klen ||
+      pread(fd, p, (size_t)rec, (off_t)(off - 8 - a->klen)) != (ssize_t)rec ||
+      get_le32(p) != a->klen || get_le32(p + 4) != size || memcmp(p + 8, a->key, a->klen) != 0 ||
+      get_le32(p + rec - 4) != calc_CRC32(p, (size_t)rec - 4, 0))
+    return KVDBLITE_UNEXPECTED_EOF;
+  p += 8 + a->klen;
+  pthread_mutex_lock(&vl->lock);
+  vcache_put(&vl->cache, seg, off, p, size);
+  pthread_mutex_unlock(&vl->lock);
+  p[size] = 0; // Over the CRC
+  *out = p;
+  return KVDBLITE_SUCCESS;
 }
 
-// inorder traversal of the tree
-static void inorder(struct node *root) {
-  if (root == NULL) {
+// A checkpoint is freezing the shard, called with it locked. Segments that
+// die from now on may still be in the snapshot it writes.
+static void vlog_checkpoint_begin(struct vlog *vl) {
+  if (vl == NULL)
+    return;
+  pthread_mutex_lock(&vl->lock);
+  vl->ckpt++;
+  pthread_mutex_unlock(&vl->lock);
+}
+
+// Make the records the frozen tree points at durable, before a snapshot
+// pointing at them replaces the old one
+static int vlog_sync(struct vlog *vl) {
+  int rc = KVDBLITE_SUCCESS, created;
+  uint32_t after = 0;
+  if (vl == NULL)
+    return rc;
+  // Appends may move the array about, so go by id
+  for (;;) {
+    uint32_t id = 0;
+    int fd = -1;
+    long k;
+    pthread_mutex_lock(&vl->lock);
+    for (size_t i = 0; i < vl->nsegs; i++) {
+      if (vl->segs[i].id > after && vl->segs[i].dirty) {
+        id = vl->segs[i].id;
+        fd = dup(vl->segs[i].fd);
+        vl->segs[i].dirty = 0;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&vl->lock);
+    if (id == 0)
+      break;
+    after = id;
+    if (fd < 0 || fdatasync(fd) < 0) {
+      rc = KVDBLITE_DB_WRITE_ERR;
+      pthread_mutex_lock(&vl->lock);
+      if ((k = vlog_find(vl, id)) >= 0)
+        vl->segs[k].dirty = 1;
+      pthread_mutex_unlock(&vl->lock);
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  pthread_mutex_lock(&vl->lock);
+  created = vl->created;
+  vl->created = 0;
+  pthread_mutex_unlock(&vl->lock);
+  if (created && rc == KVDBLITE_SUCCESS && (rc = fsync_parent_dir(vl->prefix)) < 0) {
+    pthread_mutex_lock(&vl->lock);
+    vl->created = 1;
+    pthread_mutex_unlock(&vl->lock);
+  }
+  return rc;
+}
+
+// The checkpoint's snapshot is on disk, delete the segments that were dead
+// before it froze the tree
+static void vlog_checkpoint_done(struct vlog *vl) {
+  size_t i, n = 0;
+  if (vl == NULL)
     return;
+  pthread_mutex_lock(&vl->lock);
+  for (i = 0; i < vl->nsegs; i++) {
+    struct vlog_seg *sg = &vl->segs[i];
+    if (sg->dead && sg->dead <= vl->ckpt) {
+      char *name = vlog_seg_name(vl, sg->id);
+      if (name != NULL && unlink(name) == 0) {
+        close(sg->fd);
+        vl->collected++;
+        free(name);
+        continue;
+      }
+      free(name);
+    }
+    vl->segs[n++] = *sg;
   }
+  vl->nsegs = n;
+  pthread_mutex_unlock(&vl->lock);
+}
 
-  inorder(root->left);
-  printf("%s: %s (%d)\n", root->key, root->value, root->diff);
-  inorder(root->right);
+// The node holding key, NULL if there is none
+static struct node *shard_find(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  if (sh->hidx.on)
+    return hidx_find(&sh->hidx, key, klen);
+  return sh->btree ? bt_search(sh, key, klen) : avl_search(key, klen, sh->root);
 }
 
-// Too much recursion for large databases? Over 32K???
-static int inorder_count(struct node *root) {
-  if (root == NULL) {
+// The node holding key in the tree being changed, copying the path down to it
+// if a checkpoint has the tree frozen. The key must be there.
+static struct node *shard_find_for_write(struct shard *sh, const avl_key_t *key, uint32_t klen) {
+  struct node **link = shard_wroot(sh), *a;
+  if (sh->btree)
+    return bt_entry_cow(sh, bt_search_ent(sh, key, klen));
+  while ((a = node_cow(sh, link)) != NULL) {
+    int c = keycmp(key, klen, a->key, a->klen);
+    if (c == 0)
+      break;
+    link = c > 0 ? &a->right : &a->left;
+  }
+  return a;
+}
+
+// Move the record rec of segment id, whose value is at off, to the end of
+// the log if a node still points at it. Called with the shard locked.
+static void vlog_move(struct shard *sh, const uint8_t *rec, uint32_t id, uint64_t off) {
+  uint32_t klen = get_le32(rec), size = get_le32(rec + 4);
+  const avl_key_t *key = rec + 8;
+  uint8_t ref[KVDBLITE_VLOG_REF];
+  struct node *a = shard_find(sh, key, klen);
+
+  if (a == NULL || a->value == NULL || !a->logged || vlog_ref_seg(a->value) != id ||
+      vlog_ref_off(a->value) != off ||
+      vlog_append(sh->vlog, key, klen, rec + 8 + klen, size, ref) < 0)
+    return;
+  shard_write_begin(sh);
+  a = shard_find_for_write(sh, key, klen);
+  // Only fails for a key with no room for the reference inline, which then
+  // stays where it is
+  node_store_value(sh, a, ref, KVDBLITE_VLOG_REF, 2 | a->zvalue, a->vlen);
+  // Cursors only go stale if nodes were copied, the tree is the same otherwise
+  if (sh->ncow > 0)
+    shard_changed(sh, 0);
+  shard_write_end(sh);
+}
+
+// Copy the records of segment id nodes still point at to the end of the log,
+// taking the shard lock for one record at a time. Returns 1 if nothing
+// points into the segment any more.
+static int vlog_collect(struct shard *sh, uint32_t id) {
+  struct vlog *vl = sh->vlog;
+  uint64_t pos = 0, size = 0, rec;
+  uint8_t head[8], *buf = NULL;
+  size_t cap = 0;
+  long k;
+  int fd = -1, dead;
+
+  pthread_mutex_lock(&vl->lock);
+  if ((k = vlog_find(vl, id)) >= 0) {
+    fd = dup(vl->segs[k].fd);
+    size = vl->segs[k].size;
+  }
+  pthread_mutex_unlock(&vl->lock);
+  if (fd < 0)
     return 0;
+  // A bad record ends the walk, it would only be a torn tail nothing points to
+  for (; size - pos >= 12; pos += rec) {
+    if (pread(fd, head, 8, (off_t)pos) != 8)
+      break;
+    rec = vlog_rec_bytes(get_le32(head), get_le32(head + 4));
+    if (rec > size - pos || lz_grow(&buf, &cap, (size_t)rec) == NULL ||
+        pread(fd, buf, (size_t)rec, (off_t)pos) != (ssize_t)rec ||
+        get_le32(buf + rec - 4) != calc_CRC32(buf, (size_t)rec - 4, 0))
+      break;
+    pthread_rwlock_wrlock(&sh->rwlock);
+    vlog_move(sh, buf, id, pos + 8 + get_le32(head));
+    pthread_rwlock_unlock(&sh->rwlock);
   }
+  close(fd);
+  free(buf);
+  pthread_mutex_lock(&vl->lock);
+  dead = (k = vlog_find(vl, id)) < 0 || vl->segs[k].dead != 0;
+  pthread_mutex_unlock(&vl->lock);
+  return dead;
+}
 
-  int c = 0;
+// Collect the closed segments of each shard that are at least pct percent
+// garbage, most garbage first. Returns how many were freed up.
+static int vlog_gc(struct avltree *avl, unsigned pct) {
+  int n = 0;
+  pthread_mutex_lock(&avl->gc_run);
+  for (unsigned i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    struct vlog *vl = sh->vlog;
+    if (vl == NULL || vl->readonly)
+      continue;
+    for (;;) {
+      uint64_t most = 0;
+      uint32_t id = 0;
+      pthread_mutex_lock(&vl->lock);
+      for (size_t j = 0; j < vl->nsegs; j++) {
+        const struct vlog_seg *sg = &vl->segs[j];
+        uint64_t garbage = sg->size - sg->live;
+        if (sg->id != vl->active && !sg->dead && garbage > most &&
+            garbage * 100 >= sg->size * pct) {
+          most = garbage;
+          id = sg->id;
+        }
+      }
+      pthread_mutex_unlock(&vl->lock);
+      if (id == 0 || !vlog_collect(sh, id))
+        break;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&avl->gc_run);
+  return n;
+}
 
-  c = c + inorder_count(root->left);
-  c++;
-  c = c + inorder_count(root->right);
+int kvdb_value_log_gc(struct avltree *avl) {
+  if (avl == NULL)
+    return KVDBLITE_INVALID_ARGUMENT;
+  if (avl->readonly)
+    return KVDBLITE_READ_ONLY;
+  return vlog_gc(avl, avl->opts.value_log_gc_pct);
+}
 
-  return c;
+// Background collection, every KVDBLITE_VLOG_GC_POLL_MS
+static void *vlog_gc_thread(void *arg) {
+  struct avltree *avl = arg;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&avl->gc_lock);
+  while (!avl->gc_thread_stop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += KVDBLITE_VLOG_GC_POLL_MS * 1000000L;
+    while (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!avl->gc_thread_stop &&
+           pthread_cond_timedwait(&avl->gc_cond, &avl->gc_lock, &deadline) != ETIMEDOUT)
+      ;
+    if (avl->gc_thread_stop)
+      break;
+    pthread_mutex_unlock(&avl->gc_lock);
+    vlog_gc(avl, avl->opts.value_log_gc_pct);
+    pthread_mutex_lock(&avl->gc_lock);
+  }
+  pthread_mutex_unlock(&avl->gc_lock);
+  return NULL;
 }
 
 //
-// END AVL tree internals
+// END Value log
 //
 
 //
-// AVL tree public API
+// Checkpoints
 //
 
-void avl_insert(struct avltree *avl, avl_key_t *key, avl_value_t *value) {
-  if(avl->journalname!=NULL)
-    add_transaction(avl, KVDBLITE_OP_INSERT, key, value);
-  insert(key, value, &avl->root);
+// A checkpoint writes a new snapshot of every shard without holding up
+// writers. One shard at a time is frozen: with the shard locked for a moment
+// its journal is rotated to <journal>.1 and the tree is switched to copy on
+// write (see node_cow()), so the tree as of that point stays intact however
+// it changes afterwards. The frozen tree is written to a temporary file,
+// fsync'd and renamed over the database file, and then <journal>.1 is no
+// longer needed. A crash at any point leaves either the old snapshot and
+// both journals or the new snapshot and the new journal, and replay applies
+// <journal>.1 before <journal>.
+
+#define KVDBLITE_THAW_BATCH 4096 // Frozen blocks released per hold of the shard lock
+
+// The snapshot is on disk, drop the nodes only the checkpoint was looking at.
+// There can be millions of them, so writers get the lock back now and then.
+static void checkpoint_thaw(struct shard *sh) {
+  struct avltree *avl = sh->avl;
+  struct retired *frozen;
+  size_t i, n, done;
+
+  pthread_rwlock_wrlock(&sh->rwlock);
+  frozen = sh->frozen;
+  n = sh->nfrozen;
+  sh->frozen = NULL;
+  sh->nfrozen = sh->frozencap = 0;
+  sh->ckpt_stamp = 0;
+  sh->mvcc = avl->opts.mvcc != 0;
+  pthread_rwlock_unlock(&sh->rwlock);
+
+  for (done = 0; done < n; done += i) {
+    pthread_rwlock_wrlock(&sh->rwlock);
+    if (avl->opts.mvcc) {
+      // Lock free readers may still see them, hand them to epoch reclamation
+      uint64_t e = __atomic_load_n(&avl->epoch, __ATOMIC_SEQ_CST);
+      for (i = 0; i < KVDBLITE_THAW_BATCH && done + i < n; i++) {
+        if (sh->nretired == sh->retiredcap)
+          sh->retired = mvcc_grow(sh->retired, &sh->retiredcap, sizeof *sh->retired);
+        sh->retired[sh->nretired] = frozen[done + i];
+        sh->retired[sh->nretired].epoch = e;
+        sh->nretired++;
+      }
+      sh->ntagged = sh->nretired;
+    } else {
+      for (i = 0; i < KVDBLITE_THAW_BATCH && done + i < n; i++)
+        slab_free(&sh->slab, frozen[done + i].p, frozen[done + i].size);
+    }
+    pthread_rwlock_unlock(&sh->rwlock);
+  }
+  free(frozen);
 }
 
-void avl_remove(struct avltree *avl, avl_key_t *key) {
-  if(avl->journalname!=NULL)
-    add_transaction(avl, KVDBLITE_OP_REMOVE, key, NULL);
-  remove_(key, &avl->root);
+// The snapshot was written with result rc
+static int checkpoint_done(struct shard *sh, int rc) {
+  // On failure the rotated journal stays, the next checkpoint adds to it
+  if (rc == KVDBLITE_SUCCESS && unlink(sh->rotatedname) < 0 && errno != ENOENT)
+    rc = KVDBLITE_JOURNAL_WRITE_ERR;
+  if (rc == KVDBLITE_SUCCESS) {
+    pthread_mutex_lock(&sh->journal_lock);
+    __atomic_store_n(&sh->journal_bytes, sh->journal_bytes - sh->rotated_bytes, __ATOMIC_RELAXED);
+    sh->rotated_bytes = 0;
+    pthread_mutex_unlock(&sh->journal_lock);
+    __atomic_store_n(&sh->snapshot_bytes, file_size(sh->dbname), __ATOMIC_RELAXED);
+    vlog_checkpoint_done(sh->vlog);
+  }
+  return rc;
 }
 
-// search a node in the AVL tree
-struct node *avl_search(avl_key_t *key, struct node *root) {
-  if (root == NULL) {
-    return NULL;
+static int checkpoint_shard(struct shard *sh, uint32_t stamp) {
+  struct avltree *avl = sh->avl;
+  struct snap_source src = {NULL, NULL, 0, 0};
+  unsigned i;
+  int rc;
+
+  // Freeze, writers wait for the journal flush and nothing else. The AVL
+  // tree turns copy on write. The B+tree's nodes change in place, so its
+  // entries are taken in order instead, and only they are copied on write
+  // (see bt_entry_cow()).
+  pthread_rwlock_wrlock(&sh->rwlock);
+  if (sh->btree && (src.n = bt_size(sh)) > 0 &&
+      (src.ents = malloc(src.n * sizeof *src.ents)) == NULL) {
+    pthread_rwlock_unlock(&sh->rwlock);
+    return KVDBLITE_FAILED_TO_ALLOC_MEMORY;
+  }
+  pthread_mutex_lock(&sh->journal_lock);
+  rc = journal_rotate(sh);
+  pthread_mutex_unlock(&sh->journal_lock);
+  if (rc == KVDBLITE_SUCCESS) {
+    if (sh->btree) {
+      size_t n = 0;
+      for (struct bt_leaf *l = bt_first_leaf(sh); l != NULL; n += l->n, l = l->next)
+        memcpy(src.ents + n, l->ent, l->n * sizeof *src.ents);
+    } else {
+      src.root = sh->root;
+      sh->mvcc = 1;
+    }
+    sh->ckpt_stamp = stamp;
+    src.batch = sh->batch_id;
+    vlog_checkpoint_begin(sh->vlog);
+  }
+  pthread_rwlock_unlock(&sh->rwlock);
+  if (rc < 0) {
+    free(src.ents);
+    return rc;
   }
 
-  if (strcmp(root->key, key) == 0) {
-    return root;
+  // Once the snapshot is in, the parts of batches in it are no longer
+  // checked by replay, so the other parts have to be on disk first
+  for (i = 0; i < avl->nshards && rc == KVDBLITE_SUCCESS && src.batch; i++) {
+    struct shard *t = &avl->shards[i];
+    if (t != sh)
+      rc = journal_sync_to(t, __atomic_load_n(&t->batch_lsn, __ATOMIC_RELAXED));
   }
+  if (rc == KVDBLITE_SUCCESS && (rc = vlog_sync(sh->vlog)) == KVDBLITE_SUCCESS)
+    rc = write_snapshot_file(sh, &src);
+  free(src.ents);
+  rc = checkpoint_done(sh, rc);
+  checkpoint_thaw(sh);
+  return rc;
+}
 
-  if (strcmp(key, root->key) > 0) {
-    avl_search(key, root->right);
-  } else {
-    avl_search(key, root->left);
+static void *checkpoint_thread(void *arg) {
+  struct avltree *avl = arg;
+  int rc = KVDBLITE_SUCCESS, r;
+  uint64_t start = now_ns();
+  unsigned i;
+
+  // Stamps live above bit 0 of node->cow and 0 means no checkpoint
+  avl->ckpt_seq = (avl->ckpt_seq + 1) & 0x7fffffff;
+  if (avl->ckpt_seq == 0)
+    avl->ckpt_seq = 1;
+  for (i = 0; i < avl->nshards; i++) {
+    if ((r = checkpoint_shard(&avl->shards[i], avl->ckpt_seq << 1)) < 0)
+      rc = r;
   }
+  start = now_ns() - start;
+  hist_add(&avl->ckpt_hist, start, 1);
+  __atomic_store_n(&avl->ckpt_last_ns, start, __ATOMIC_RELAXED);
+  if (rc < 0)
+    stat_count(&avl->ckpt_failures, 1);
+  __atomic_store_n(&avl->ckpt_rc, rc, __ATOMIC_RELAXED);
+  __atomic_store_n(&avl->ckpt_running, 0, __ATOMIC_RELEASE);
+  return NULL;
 }
 
-struct avl_lookup_result *avl_lookup(struct avltree *avl, avl_key_t *key) {
-  struct avl_lookup_result *r = NULL;
-  struct node *n = avl_search(key, avl->root);
-  if(n==NULL) {
-    return NULL;
+int avl_checkpoint_start(struct avltree *avl) {
+  int rc = KVDBLITE_SUCCESS;
+
+  if (avl->dbname == NULL)
+    return KVDBLITE_DBNAME_IS_NULL;
+  if (avl->readonly)
+    return KVDBLITE_READ_ONLY;
+  pthread_mutex_lock(&avl->ckpt_lock);
+  if (__atomic_load_n(&avl->ckpt_running, __ATOMIC_ACQUIRE)) {
+    rc = KVDBLITE_CHECKPOINT_RUNNING;
   } else {
-    r = malloc(sizeof *r);
-    if(r == NULL) {
-      return NULL;
+    if (avl->ckpt_started)
+      pthread_join(avl->ckpt_thread, NULL);
+    avl->ckpt_started = 0;
+    __atomic_store_n(&avl->ckpt_running, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&avl->ckpt_last_us, now_us(), __ATOMIC_RELAXED);
+    if (pthread_create(&avl->ckpt_thread, NULL, checkpoint_thread, avl) == 0) {
+      avl->ckpt_started = 1;
+    } else {
+      __atomic_store_n(&avl->ckpt_running, 0, __ATOMIC_RELEASE);
+      rc = KVDBLITE_FAILED_TO_ALLOC_MEMORY;
     }
-
-    r->key = strdup(n->key);
-    r->value = strdup(n->value);
   }
+  pthread_mutex_unlock(&avl->ckpt_lock);
+  return rc;
 }
 
-void avl_free_lookup_result(struct avl_lookup_result *r) {
-  free(r->key);
-  free(r->value);
-  free(r);
+int avl_checkpoint_wait(struct avltree *avl) {
+  pthread_mutex_lock(&avl->ckpt_lock);
+  if (avl->ckpt_started)
+    pthread_join(avl->ckpt_thread, NULL);
+  avl->ckpt_started = 0;
+  pthread_mutex_unlock(&avl->ckpt_lock);
+  return __atomic_load_n(&avl->ckpt_rc, __ATOMIC_RELAXED);
 }
 
-void avl_free(struct avltree *avl) {
-  free_(avl->root);
-  if(avl->dbname!=NULL)
-    free(avl->dbname);
-  if(avl->journalname!=NULL)
-    free(avl->journalname);
-  free(avl);
+int avl_save_database(struct avltree *avl) {
+  int rc;
+
+  if (avl->dbname == NULL)
+    return KVDBLITE_DBNAME_IS_NULL;
+  if (avl->readonly)
+    return KVDBLITE_READ_ONLY;
+  while ((rc = avl_checkpoint_start(avl)) == KVDBLITE_CHECKPOINT_RUNNING)
+    avl_checkpoint_wait(avl);
+  if (rc < 0)
+    return rc;
+  return avl_checkpoint_wait(avl);
 }
 
-struct avltree *avl_make(uint8_t *fn) {
-  generate_CRC32_table();
-  struct avltree *avl = malloc(sizeof *avl);
-  if (avl == NULL) {
-    return NULL;
+// Automatic checkpoints. Writers only keep count of the journal bytes they
+// write, a thread wakes up every KVDBLITE_CKPT_POLL_MS and starts a
+// checkpoint once the journals pass a limit in the options.
+static int checkpoint_due(struct avltree *avl) {
+  const struct avl_options *o = &avl->opts;
+  uint64_t journal = 0, snapshot = 0;
+  uint64_t since = now_us() - __atomic_load_n(&avl->ckpt_last_us, __ATOMIC_RELAXED);
+  unsigned i;
+
+  if (__atomic_load_n(&avl->ckpt_running, __ATOMIC_ACQUIRE))
+    return 0;
+  if (__atomic_load_n(&avl->ckpt_rc, __ATOMIC_RELAXED) < 0 &&
+      since < KVDBLITE_CKPT_RETRY_S * 1000000ULL)
+    return 0;
+  for (i = 0; i < avl->nshards; i++) {
+    journal += __atomic_load_n(&avl->shards[i].journal_bytes, __ATOMIC_RELAXED);
+    snapshot += __atomic_load_n(&avl->shards[i].snapshot_bytes, __ATOMIC_RELAXED);
   }
-  avl->root = NULL;
-  if(fn==NULL) {
-    avl->dbname = NULL;
-    avl->journalname = NULL;
-  } else {
-    avl->dbname = strdup(fn);
-    avl->journalname = malloc(strlen(fn) + 5);
-    sprintf(avl->journalname, "%s%s", fn, ".jnl");
+  if (journal == 0)
+    return 0;
+  if (o->ckpt_journal_bytes > 0 && journal >= o->ckpt_journal_bytes)
+    return 1;
+  if (o->ckpt_journal_pct > 0 && journal >= KVDBLITE_CKPT_MIN_JOURNAL &&
+      journal * 100 >= snapshot * o->ckpt_journal_pct)
+    return 1;
+  return o->ckpt_interval_s > 0 && since >= o->ckpt_interval_s * 1000000ULL;
+}
+
+static void *checkpoint_policy_thread(void *arg) {
+  struct avltree *avl = arg;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&avl->policy_lock);
+  while (!avl->policy_thread_stop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += KVDBLITE_CKPT_POLL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!avl->policy_thread_stop &&
+           pthread_cond_timedwait(&avl->policy_cond, &avl->policy_lock, &deadline) != ETIMEDOUT)
+      ;
+    if (avl->policy_thread_stop)
+      break;
+    pthread_mutex_unlock(&avl->policy_lock);
+    // Runs in the background, avl_checkpoint_start() or avl_free() joins it
+    if (checkpoint_due(avl))
+      avl_checkpoint_start(avl);
+    pthread_mutex_lock(&avl->policy_lock);
   }
+  pthread_mutex_unlock(&avl->policy_lock);
+  return NULL;
+}
+
+int avl_recovery_estimate(struct avltree *avl, struct avl_recovery_info *info) {
+  double load_rate = KVDBLITE_LOAD_RATE, replay_rate = KVDBLITE_REPLAY_RATE, load = 0;
+  unsigned i;
 
-  // Load the tree from disk if the file exists
-  if(fn!=NULL) {
-    load_avl_tree(avl, fn);
+  if (avl == NULL || info == NULL)
+    return KVDBLITE_INVALID_ARGUMENT;
+  // Bytes per second seen by db_open()
+  if (avl->load_bytes >= KVDBLITE_RATE_MIN_BYTES && avl->load_us > 0)
+    load_rate = avl->load_bytes * 1e6 / avl->load_us;
+  if (avl->replay_bytes >= KVDBLITE_RATE_MIN_BYTES && avl->replay_us > 0)
+    replay_rate = avl->replay_bytes * 1e6 / avl->replay_us;
+
+  memset(info, 0, sizeof *info);
+  for (i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    uint64_t n = __atomic_load_n(&sh->snapshot_bytes, __ATOMIC_RELAXED);
+    info->snapshot_bytes += n;
+    info->journal_bytes += __atomic_load_n(&sh->journal_bytes, __ATOMIC_RELAXED);
+    // A mapped snapshot isn't read at startup
+    if (sh->map.base == NULL)
+      load += n;
   }
+  info->estimate_ms = (uint64_t)(load * 1000 / load_rate + info->journal_bytes * 1000 / replay_rate);
+  return KVDBLITE_SUCCESS;
+}
 
-  // Apply any transactions from the journal
-  apply_all_transactions(avl);
+//
+// END Checkpoints
+//
 
-  return avl;
+//
+// Statistics API
+//
+
+static void hist_sum(struct kvdb_histogram *to, const struct kvdb_histogram *h) {
+  unsigned b;
+  to->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  to->sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+  for (b = 0; b < KVDB_HIST_BUCKETS; b++)
+    to->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
 }
 
-int avl_check_valid(struct avltree *avl) { return valid(avl->root); }
+// Follow the taller side down, O(log n)
+static uint64_t tree_height(const struct node *a) {
+  uint64_t h = 0;
+  for (; a != NULL; a = a->diff > 0 ? a->right : a->left)
+    h++;
+  return h;
+}
 
-int avl_db_size(struct avltree *avl) {
-  struct node *root = avl->root;
-  if (root == NULL) {
-    return 0;
+int kvdb_get_stats(struct avltree *avl, struct kvdb_stats *stats) {
+  unsigned i;
+
+  if (avl == NULL || stats == NULL)
+    return KVDBLITE_INVALID_ARGUMENT;
+  memset(stats, 0, sizeof *stats);
+  for (i = 0; i < KVDBLITE_STAT_STRIPES; i++) {
+    struct stat_stripe *st = &avl->stats[i];
+    hist_sum(&stats->insert, &st->hist[STAT_INSERT]);
+    hist_sum(&stats->lookup, &st->hist[STAT_LOOKUP]);
+    hist_sum(&stats->remove, &st->hist[STAT_REMOVE]);
+    hist_sum(&stats->journal_flush, &st->hist[STAT_FLUSH]);
+    stats->lookup_misses += __atomic_load_n(&st->lookup_misses, __ATOMIC_RELAXED);
+    stats->batches += __atomic_load_n(&st->batches, __ATOMIC_RELAXED);
+    stats->journal_bytes += __atomic_load_n(&st->journal_bytes, __ATOMIC_RELAXED);
+    stats->fsyncs += __atomic_load_n(&st->fsyncs, __ATOMIC_RELAXED);
+    stats->fsync_ns += __atomic_load_n(&st->fsync_ns, __ATOMIC_RELAXED);
+  }
+  hist_sum(&stats->checkpoint, &avl->ckpt_hist);
+  stats->checkpoint_failures = __atomic_load_n(&avl->ckpt_failures, __ATOMIC_RELAXED);
+  stats->last_checkpoint_ns = __atomic_load_n(&avl->ckpt_last_ns, __ATOMIC_RELAXED);
+  stats->replay_records = avl->replay_records;
+  stats->replay_applied = avl->replay_applied;
+  stats->replay_bytes = avl->replay_bytes;
+  stats->replay_ns = avl->replay_us * 1000;
+
+  for (i = 0; i < avl->nshards; i++) {
+    struct shard *sh = &avl->shards[i];
+    uint64_t h;
+    pthread_rwlock_rdlock(&sh->rwlock);
+    stats->keys += sh->count;
+    stats->nodes += shard_tree_size(sh, sh->root);
+    stats->memory_bytes += sh->slab.bytes_in_use + sh->bt_bytes + hidx_bytes(&sh->hidx);
+    h = sh->btree ? sh->bt_height : tree_height(sh->root);
+    pthread_rwlock_unlock(&sh->rwlock);
+    if (sh->vlog != NULL) {
+      struct vlog *vl = sh->vlog;
+      pthread_mutex_lock(&vl->lock);
+      for (size_t j = 0; j < vl->nsegs; j++) {
+        stats->value_log_bytes += vl->segs[j].size;
+        stats->value_log_live_bytes += vl->segs[j].live;
+      }
+      stats->value_log_files += vl->nsegs;
+      stats->value_log_files_deleted += vl->collected;
+      stats->value_cache_bytes += vl->cache.bytes;
+      stats->value_cache_hits += vl->cache.hits;
+      stats->value_cache_misses += vl->cache.misses;
+      stats->memory_bytes += vl->cache.bytes + (uint64_t)vl->cache.cap * (sizeof *vl->cache.ents + 4);
+      pthread_mutex_unlock(&vl->lock);
+    }
+    if (h > stats->tree_height)
+      stats->tree_height = h;
   }
+  return KVDBLITE_SUCCESS;
+}
 
-  int c = 0;
-  c = c + inorder_count(root->left);
-  c = c + inorder_count(root->right);
-  return c + 1;
+// Appends to buf like snprintf(), *len counts what didn't fit as well
+static void stats_printf(char *buf, size_t size, size_t *len, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+static void stats_printf(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    *len += n;
 }
 
-// extended inorder traversal of the tree
-void avl_debug_inorder(struct avltree *avl) {
-  struct node *root = avl->root;
-  printf("--\n");
-  if (root == NULL) {
-    printf("Empty!\n");
-    return;
+// Counts and sizes are printed as integers, they can go past what a double
+// holds exactly
+static void stats_metric(char *buf, size_t size, size_t *len, const char *name, const char *type,
+                         const char *help, uint64_t value) {
+  stats_printf(buf, size, len, "# HELP kvdb_%s %s\n# TYPE kvdb_%s %s\nkvdb_%s %" PRIu64 "\n",
+               name, help, name, type, name, value);
+}
+
+// Times are counted in nanoseconds and printed in seconds
+static void stats_seconds(char *buf, size_t size, size_t *len, const char *name, const char *type,
+                          const char *help, uint64_t ns) {
+  stats_printf(buf, size, len, "# HELP kvdb_%s %s\n# TYPE kvdb_%s %s\nkvdb_%s %.9g\n", name,
+               help, name, type, name, ns * 1e-9);
+}
+
+// Buckets are cumulative in Prometheus, and bounds are in seconds
+static void stats_histogram(char *buf, size_t size, size_t *len, const char *op,
+                            const struct kvdb_histogram *h) {
+  uint64_t total = 0;
+  unsigned b;
+  for (b = 0; b < KVDB_HIST_BUCKETS; b++) {
+    total += h->buckets[b];
+    stats_printf(buf, size, len, "kvdb_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+                 op, (double)(2ULL << b) * 1e-9, total);
   }
+  stats_printf(buf, size, len,
+               "kvdb_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+               "kvdb_latency_seconds_sum{op=\"%s\"} %.9g\n"
+               "kvdb_latency_seconds_count{op=\"%s\"} %" PRIu64 "\n",
+               op, h->count, op, h->sum_ns * 1e-9, op, h->count);
+}
+
+int kvdb_stats_format(const struct kvdb_stats *s, char *buf, size_t size) {
+  size_t len = 0;
 
-  printf("Left:\n");
-  inorder(root->left);
-  printf("Root:\n");
-  printf("%s: %s (%d)\n", root->key, root->value, root->diff);
-  printf("Right:\n");
-  inorder(root->right);
+  if (s == NULL || (buf == NULL && size > 0))
+    return KVDBLITE_INVALID_ARGUMENT;
+  if (size > 0)
+    buf[0] = '\0';
+  stats_printf(buf, size, &len, "# HELP kvdb_ops_total Operations since the database was opened\n"
+                                "# TYPE kvdb_ops_total counter\n");
+  stats_printf(buf, size, &len, "kvdb_ops_total{op=\"insert\"} %" PRIu64 "\n", s->insert.count);
+  stats_printf(buf, size, &len, "kvdb_ops_total{op=\"lookup\"} %" PRIu64 "\n", s->lookup.count);
+  stats_printf(buf, size, &len, "kvdb_ops_total{op=\"remove\"} %" PRIu64 "\n", s->remove.count);
+  stats_printf(buf, size, &len, "kvdb_ops_total{op=\"batch\"} %" PRIu64 "\n", s->batches);
+  stats_metric(buf, size, &len, "lookup_misses_total", "counter", "Lookups of missing keys",
+               s->lookup_misses);
+  stats_metric(buf, size, &len, "journal_bytes_total", "counter", "Bytes written to the journals",
+               s->journal_bytes);
+  stats_metric(buf, size, &len, "fsyncs_total", "counter", "fdatasync() calls on the journals",
+               s->fsyncs);
+  stats_seconds(buf, size, &len, "fsync_seconds_total", "counter", "Time spent in fdatasync()",
+                s->fsync_ns);
+  stats_metric(buf, size, &len, "checkpoint_failures_total", "counter", "Checkpoints that failed",
+               s->checkpoint_failures);
+  stats_seconds(buf, size, &len, "last_checkpoint_seconds", "gauge",
+                "How long the last checkpoint took", s->last_checkpoint_ns);
+  stats_metric(buf, size, &len, "replay_records", "gauge", "Journal records read at startup",
+               s->replay_records);
+  stats_metric(buf, size, &len, "replay_applied_records", "gauge",
+               "Journal records applied at startup", s->replay_applied);
+  stats_metric(buf, size, &len, "replay_bytes", "gauge", "Journal bytes replayed at startup",
+               s->replay_bytes);
+  stats_seconds(buf, size, &len, "replay_seconds", "gauge", "Time spent replaying at startup",
+                s->replay_ns);
+  stats_metric(buf, size, &len, "keys", "gauge", "Keys in the database", s->keys);
+  stats_metric(buf, size, &len, "nodes", "gauge", "Tree nodes", s->nodes);
+  stats_metric(buf, size, &len, "tree_height", "gauge", "Height of the tallest shard tree",
+               s->tree_height);
+  stats_metric(buf, size, &len, "memory_bytes", "gauge", "Memory used by nodes, keys and values",
+               s->memory_bytes);
+  stats_metric(buf, size, &len, "value_log_bytes", "gauge", "Bytes in the value log files",
+               s->value_log_bytes);
+  stats_metric(buf, size, &len, "value_log_live_bytes", "gauge",
+               "Value log bytes the tree points at", s->value_log_live_bytes);
+  stats_metric(buf, size, &len, "value_log_files", "gauge", "Value log files",
+               s->value_log_files);
+  stats_metric(buf, size, &len, "value_log_files_deleted_total", "counter",
+               "Value log files deleted after collection", s->value_log_files_deleted);
+  stats_metric(buf, size, &len, "value_cache_bytes", "gauge", "Values cached from the value log",
+               s->value_cache_bytes);
+  stats_metric(buf, size, &len, "value_cache_hits_total", "counter",
+               "Value log reads served by the cache", s->value_cache_hits);
+  stats_metric(buf, size, &len, "value_cache_misses_total", "counter",
+               "Value log reads that went to the files", s->value_cache_misses);
+  stats_printf(buf, size, &len, "# HELP kvdb_latency_seconds Operation latency\n"
+                                "# TYPE kvdb_latency_seconds histogram\n");
+  stats_histogram(buf, size, &len, "insert", &s->insert);
+  stats_histogram(buf, size, &len, "lookup", &s->lookup);
+  stats_histogram(buf, size, &len, "remove", &s->remove);
+  stats_histogram(buf, size, &len, "journal_flush", &s->journal_flush);
+  stats_histogram(buf, size, &len, "checkpoint", &s->checkpoint);
+  return len > INT32_MAX ? INT32_MAX : (int)len;
 }
 
 //
-// END AVL tree public API
-//
\ No newline at end of file
+// END Statistics API
+//
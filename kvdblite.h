@@ -8,28 +8,301 @@
 #define KVDBLITE_FAILED_TO_OPEN_DB_FILE -1004
 #define KVDBLITE_FAILED_TO_ALLOC_MEMORY -1005
 #define KVDBLITE_UNEXPECTED_EOF -1006
+#define KVDBLITE_JOURNAL_WRITE_ERR -1007
+#define KVDBLITE_INVALID_ARGUMENT -1008
+#define KVDBLITE_NOT_FOUND -1009
+#define KVDBLITE_BUFFER_TOO_SMALL -1010
+#define KVDBLITE_CURSOR_STALE -1011
+#define KVDBLITE_DB_WRITE_ERR -1012
+#define KVDBLITE_CHECKPOINT_RUNNING -1013
+#define KVDBLITE_READ_ONLY -1014
+#define KVDBLITE_CORRUPT -1015
 
 
+// Durability policies for the journal (struct avl_options.durability)
+#define KVDBLITE_SYNC_NONE 0     // Written when the buffer fills, never fdatasync()'d
+#define KVDBLITE_SYNC_ALWAYS 1   // fdatasync() before every insert/remove returns
+#define KVDBLITE_SYNC_INTERVAL 2 // Background fdatasync() every sync_interval_ms
+#define KVDBLITE_SYNC_GROUP 3    // Like ALWAYS, but concurrent writers share one fdatasync()
+
+#define KVDBLITE_MAX_SHARDS 1024
+
+// In-memory index of each shard (struct avl_options.engine). Both keep the
+// same snapshot and journal formats, a database can be reopened with either.
+#define KVDBLITE_ENGINE_AVL 0   // Balanced binary tree, one node per key
+#define KVDBLITE_ENGINE_BTREE 1 // B+tree with wide cache line aligned nodes and linked leaves
+
 typedef uint8_t avl_key_t;
 typedef uint8_t avl_value_t;
 
 struct avltree;
+struct avl_cursor;
+struct avl_snapshot;
+struct kvdb_write_batch;
 
+// key and value are NUL terminated, klen/vlen don't include the NUL
 struct avl_lookup_result {
   avl_key_t *key;
   avl_value_t *value;
+  uint32_t klen, vlen;
+};
+
+struct avl_options {
+  int durability;            // KVDBLITE_SYNC_*
+  unsigned sync_interval_ms; // KVDBLITE_SYNC_INTERVAL period
+  unsigned group_commit_us;  // KVDBLITE_SYNC_GROUP: the longest a leader waits for others to join
+  unsigned nshards;          // Independent trees, each with its own lock and journal. Only
+                             // used when the database is created, reopening keeps its count.
+  int mvcc;                  // Copy on write trees, readers never lock, see avl_snapshot_open()
+  unsigned load_threads;     // Threads that load each snapshot at startup, 0 for one per CPU
+
+  // Automatic checkpoints, a limit of 0 is off. See avl_recovery_estimate().
+  uint64_t ckpt_journal_bytes; // Once the journals hold this many bytes
+  unsigned ckpt_journal_pct;   // Once the journals are this many percent of the snapshots
+  unsigned ckpt_interval_s;    // This often, if anything was journalled since the last one
+
+  int stats_latency; // Time operations for the kvdb_get_stats() histograms
+
+  // KVDBLITE_ENGINE_*. The B+tree can't be combined with mvcc (avl_make
+  // fails). Read only databases always use the AVL tree for their changes.
+  int engine;
+
+  // Also index each shard's keys with a hash table, so lookups of single keys
+  // don't walk the tree. Costs 10-20 bytes per key. Can't be combined with
+  // mvcc (avl_make fails), read only databases don't use it.
+  int hash_index;
+
+  // Write snapshots in format 3: varint lengths and keys stored as the part
+  // that differs from the key before. Smaller and quicker to write, loads as
+  // fast, but read only databases have to load them rather than map them. Either
+  // format is read whatever this says.
+  int compact_snapshots;
+
+  // Keep values of at least this many bytes LZ compressed in memory, 0 is
+  // off. Values that don't shrink by an eighth are kept as they are. Views of
+  // compressed values point into a buffer of the calling thread which its next
+  // view reuses.
+  uint32_t compress_values;
+
+  // LZ compress snapshot blocks, implies compact_snapshots. Compact snapshots
+  // keep values compress_values compressed as they are either way.
+  int compress_snapshots;
+
+  // Value log: values of at least this many bytes are appended to files
+  // next to the database (<dbname>.vlog.<n>, per shard) and the tree only
+  // keeps where they are, so the data can be far larger than memory. 0 is
+  // off. Lookups of such values read them back through a cache. Can't be
+  // combined with mvcc (avl_make fails). Journals still hold whole values.
+  uint32_t value_log;
+  uint64_t value_log_segment_bytes; // A new file is started at this size
+  uint64_t value_cache_bytes;       // Values read back kept in memory, split over the shards
+  // A background thread rewrites the live values of files that are at
+  // least this many percent garbage, 0 leaves it to kvdb_value_log_gc().
+  // Files are deleted by the next checkpoint.
+  unsigned value_log_gc_pct;
+
+  // Leave the journal writes and fdatasync()s to a thread of their own, which
+  // does those of every shard together (through io_uring where the kernel
+  // allows it). Writers only encode their records into the journal buffer,
+  // with KVDBLITE_SYNC_ALWAYS/GROUP they then wait for the thread's sync.
+  int journal_writer;
 };
 
+void avl_default_options(struct avl_options *);
+// Borrowed pointers into the tree, see avl_get_view()
+struct avl_view {
+  const avl_key_t *key;
+  const avl_value_t *value;
+  uint32_t klen, vlen;
+};
+
+typedef int (*avl_visit_fn)(void *ctx, const avl_key_t *key, uint32_t klen,
+                            const avl_value_t *value, uint32_t vlen);
+
+// All calls are thread safe, except where noted below. Keys are spread over
+// the shards by hash, calls on keys in different shards run in parallel.
+// Lookups take a shard's lock shared, writes take it exclusively.
+// Opening returns NULL if a snapshot fails its checks or the journals can't
+// be replayed (a torn last record is cut off, that isn't an error).
 struct avltree *avl_make(uint8_t *);
+struct avltree *avl_make_with_options(uint8_t *, const struct avl_options *);
 void avl_free(struct avltree *);
 
-void avl_insert(struct avltree *, avl_key_t *, avl_value_t *);
-void avl_remove(struct avltree *, avl_key_t *);
+// Opens a saved database without loading it: each shard's snapshot is
+// mmap()'d and lookups, cursors and scans binary search it in place, so
+// startup only costs replaying the journals. Views point into the mapping
+// and stay valid until avl_free(). Writes return KVDBLITE_READ_ONLY, unless
+// overlay is set, then they go to an in-memory tree in front of the mapping
+// and are never written back. Snapshots saved before the offset index was
+// added, and compact (format 3) ones, are loaded as usual. Checkpoints return
+// KVDBLITE_READ_ONLY. The snapshot blocks are CRC checked the first time a
+// read gets to them. Once one fails, reads of that shard (lookups, cursors,
+// scans, rank and select) return KVDBLITE_CORRUPT or no result, and the open
+// itself fails if replaying the journals runs into it.
+struct avltree *avl_open_readonly(uint8_t *fn, int overlay);
+
+// With KVDBLITE_SYNC_ALWAYS/GROUP these return once the record is durable
+int avl_insert(struct avltree *, avl_key_t *, avl_value_t *);
+int avl_remove(struct avltree *, avl_key_t *);
 struct avl_lookup_result *avl_lookup(struct avltree *, avl_key_t *);
+
+// Binary safe versions of the above, keys and values are byte strings with
+// explicit lengths and may contain zero bytes. Keys can't be empty.
+int avl_put(struct avltree *, const avl_key_t *key, uint32_t klen, const avl_value_t *value,
+            uint32_t vlen);
+int avl_del(struct avltree *, const avl_key_t *key, uint32_t klen);
+struct avl_lookup_result *avl_get(struct avltree *, const avl_key_t *key, uint32_t klen);
+
+// Lookups that don't allocate. They return KVDBLITE_NOT_FOUND if the key isn't there.
+// avl_get_view: points view at the stored key and value. Nothing is locked,
+//   the view is only valid until the next insert/remove/save, and for a
+//   compressed value (compress_values) or one read from the value log
+//   (value_log) until the thread's next view.
+// avl_get_copy: copies the value into buf. *vlen is always set to the value
+//   length, KVDBLITE_BUFFER_TOO_SMALL means nothing was copied.
+// avl_get_visit: calls fn with the stored key and value while writers are
+//   locked out and returns what fn returns. fn must not modify the database.
+int avl_get_view(struct avltree *, const avl_key_t *key, uint32_t klen, struct avl_view *view);
+int avl_get_copy(struct avltree *, const avl_key_t *key, uint32_t klen, avl_value_t *buf,
+                 uint32_t bufsize, uint32_t *vlen);
+int avl_get_visit(struct avltree *, const avl_key_t *key, uint32_t klen, avl_visit_fn fn,
+                  void *ctx);
+
 void avl_free_lookup_result(struct avl_lookup_result *r);
 int avl_check_valid(struct avltree *);
 void avl_debug_inorder(struct avltree *);
+
+// Checkpoints write a snapshot of the database to <dbname>.tmp, fsync it,
+// rename it over <dbname> and drop the journal records it covers. Writers
+// keep going while it runs, the snapshot is the database as of the moment
+// each shard was frozen.
+// avl_checkpoint_start: starts a checkpoint on a background thread, returns
+//   KVDBLITE_CHECKPOINT_RUNNING if one is already in progress.
+// avl_checkpoint_wait: waits for it and returns the result of the last one.
+// avl_save_database: runs a checkpoint and waits for it.
+int avl_checkpoint_start(struct avltree *);
+int avl_checkpoint_wait(struct avltree *);
 int avl_save_database(struct avltree *);
+
+// What a restart would have to read, the snapshots and every journal record
+// since the last checkpoint. estimate_ms is based on how fast this database
+// loaded and replayed when it was opened, or on typical speeds if there was
+// too little to measure. Buffered records that aren't written yet don't count.
+// With any ckpt_* option set a background thread checks the journals a few
+// times a second and starts a checkpoint when a limit is passed.
+struct avl_recovery_info {
+  uint64_t snapshot_bytes;
+  uint64_t journal_bytes;
+  uint64_t estimate_ms;
+};
+int avl_recovery_estimate(struct avltree *, struct avl_recovery_info *);
+int avl_flush_journal(struct avltree *);
+int avl_sync(struct avltree *);
 int avl_db_size(struct avltree *avl);
 
+// Order statistics, O(log n): how many keys sort before key, and the k-th
+// key (from 0) in sorted order. With several shards avl_select() gets
+// slower, O((shards * log n)^2).
+int avl_rank(struct avltree *, const avl_key_t *key, uint32_t klen);
+struct avl_lookup_result *avl_select(struct avltree *, int k);
+
+// Ordered iteration. Positioning calls and next/prev return KVDBLITE_SUCCESS
+// when the cursor is on an entry and KVDBLITE_NOT_FOUND when it ran off
+// either end. Views from avl_cursor_get() point into the tree. Any insert or
+// remove makes the cursor stale (KVDBLITE_CURSOR_STALE) until it is
+// positioned again with first/last/seek. Like avl_get_view() cursors don't
+// lock, don't use them while other threads write; the scans below do lock.
+struct avl_cursor *avl_cursor_open(struct avltree *);
+void avl_cursor_close(struct avl_cursor *);
+int avl_cursor_first(struct avl_cursor *);
+int avl_cursor_last(struct avl_cursor *);
+int avl_cursor_seek(struct avl_cursor *, const avl_key_t *key, uint32_t klen); // First key >= key
+int avl_cursor_next(struct avl_cursor *);
+int avl_cursor_prev(struct avl_cursor *);
+int avl_cursor_get(struct avl_cursor *, struct avl_view *view);
+
+// Streaming scans, fn is called for every entry in order with writers to all
+// shards locked out. A non-zero return from fn stops the scan and is passed back.
+// avl_scan_range visits lo <= key < hi, a NULL lo or hi leaves that end open.
+int avl_scan_range(struct avltree *, const avl_key_t *lo, uint32_t lolen, const avl_key_t *hi,
+                   uint32_t hilen, avl_visit_fn fn, void *ctx);
+int avl_scan_prefix(struct avltree *, const avl_key_t *prefix, uint32_t plen, avl_visit_fn fn,
+                    void *ctx);
+
+// MVCC mode (avl_options.mvcc). Writers copy the nodes they change and
+// publish a new tree in one atomic step. Lookups, scans, rank and select then
+// don't lock at all and never hold up writers. Replaced nodes are freed once
+// no reader can still see them. Writes cost more, every write copies a path
+// from the root.
+// A snapshot is a consistent view of the whole database as of
+// avl_snapshot_open(), later changes don't show up in it. Views and cursors
+// from a snapshot stay valid until it is closed, close its cursors first.
+// Holding a snapshot for a long time keeps the memory of every node replaced
+// since. avl_snapshot_open() returns NULL unless the database is in MVCC mode.
+struct avl_snapshot *avl_snapshot_open(struct avltree *);
+void avl_snapshot_close(struct avl_snapshot *);
+int avl_snapshot_get(struct avl_snapshot *, const avl_key_t *key, uint32_t klen,
+                     struct avl_view *view);
+struct avl_cursor *avl_snapshot_cursor_open(struct avl_snapshot *);
+
+// Runtime statistics. Counters are kept in per thread stripes, so keeping
+// them costs a few uncontended atomic adds per operation, plus two clock
+// reads when stats_latency is set. Without it the histograms only count.
+// Histogram bucket i counts latencies from 2^i up to 2^(i+1) nanoseconds,
+// bucket 0 also counts 0.
+#define KVDB_HIST_BUCKETS 40
+
+struct kvdb_histogram {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t buckets[KVDB_HIST_BUCKETS];
+};
+
+struct kvdb_stats {
+  // Since the database was opened
+  uint64_t lookup_misses;
+  uint64_t batches;
+  uint64_t journal_bytes; // Written to the journals
+  uint64_t fsyncs;
+  uint64_t fsync_ns;
+  uint64_t checkpoint_failures;
+  uint64_t last_checkpoint_ns;
+  // Journal replay at startup. Records that a later record for the same key
+  // replaced are read but not applied.
+  uint64_t replay_records, replay_applied, replay_bytes, replay_ns;
+  // Now
+  uint64_t keys, nodes, tree_height; // tree_height is the tallest shard's
+  uint64_t memory_bytes;             // Nodes, keys, values, indexes and the value cache
+  // Value log, see avl_options.value_log. Cache hits and misses are since the
+  // database was opened.
+  uint64_t value_log_bytes, value_log_live_bytes; // In the files, and what nodes point at
+  uint64_t value_log_files, value_log_files_deleted;
+  uint64_t value_cache_bytes, value_cache_hits, value_cache_misses;
+  struct kvdb_histogram insert, lookup, remove, journal_flush, checkpoint;
+};
+
+int kvdb_get_stats(struct avltree *, struct kvdb_stats *);
+// Collect the value log files that are at least value_log_gc_pct percent
+// garbage now, any garbage if it is 0. Returns the number of files freed
+// up, they are deleted by the next checkpoint.
+int kvdb_value_log_gc(struct avltree *);
+// Prometheus text exposition format. Returns the length of the whole text
+// and writes as much of it as fits, like snprintf().
+int kvdb_stats_format(const struct kvdb_stats *, char *buf, size_t size);
+
+// Atomic multi-key updates. Stage puts and deletes in a batch, then commit
+// it: it is journalled as one record with a CRC and applied all at once, and
+// journal replay applies it completely or not at all. A batch can be
+// committed more than once and is reused after kvdb_write_batch_clear().
+// With several shards each shard journals its part of the batch, tagged with
+// a batch id and the shards it touched, and replay applies the parts only if
+// every one of them made it, so that holds across shards too.
+struct kvdb_write_batch *kvdb_write_batch_make(void);
+void kvdb_write_batch_free(struct kvdb_write_batch *);
+void kvdb_write_batch_clear(struct kvdb_write_batch *);
+int kvdb_write_batch_put(struct kvdb_write_batch *, const avl_key_t *key, uint32_t klen,
+                         const avl_value_t *value, uint32_t vlen);
+int kvdb_write_batch_delete(struct kvdb_write_batch *, const avl_key_t *key, uint32_t klen);
+int kvdb_write_batch_commit(struct avltree *, struct kvdb_write_batch *);
+
 #endif /* KVDBLITE_H */
\ No newline at end of file
@@ -13,7 +13,7 @@
 
 //
 // Compile with:
-// gcc -o main main.c kvdblite.c
+// gcc -o main main.c kvdblite.c -lpthread
 //
 
 // Test program to create key-value DB, populate it, save it to disk
@@ -67,6 +67,7 @@ int main() {
     printf("FAIL: 3 doesn't exist in DB.. That is bad!\n");
     exit(-1);
   }
+  avl_free_lookup_result(r);
   if (avl_db_size(avl) != TREESIZE + 2) {
     printf("FAIL: Tree is wrong size\n");
     exit(-1);
@@ -77,5 +78,8 @@ int main() {
     exit(-1);
   }
 
+  // Flushes any buffered journal records to disk
+  avl_free(avl);
+
   printf("PASSED\n");
 }
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Snapshot consistency. A checkpoint runs while this thread keeps writing
+// and logs every change it makes. The snapshot the checkpoint leaves, opened
+// on its own without the journals, must be the database exactly as it was
+// at one point of that log: the changes up to there and none after. A
+// writer that changed a frozen node in place, or a snapshot that mixed two
+// moments, fails this. Runs once for each configuration below.
+// Usage: ckpt_consistency [rounds]
+
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NKEYS 30000
+#define MAXOPS 2000000
+
+static const char *fn = "ckpt_consistency.kvb", *copy = "ckpt_consistency_copy.kvb";
+
+struct config {
+  const char *name;
+  int engine, mvcc, hash_index, compact, compress;
+};
+
+static const struct config configs[] = {
+    {"avl", KVDBLITE_ENGINE_AVL, 0, 0, 0, 0},
+    {"mvcc", KVDBLITE_ENGINE_AVL, 1, 0, 0, 0},
+    {"btree", KVDBLITE_ENGINE_BTREE, 0, 0, 0, 0},
+    {"btree hash", KVDBLITE_ENGINE_BTREE, 0, 1, 0, 0},
+    {"compact", KVDBLITE_ENGINE_AVL, 0, 0, 1, 0},
+    {"btree compress", KVDBLITE_ENGINE_BTREE, 0, 0, 0, 8},
+};
+
+struct op {
+  int i, del;
+  char v[24];
+};
+
+struct state {
+  char v[NKEYS][24];
+  int present[NKEYS];
+};
+
+static struct state live, frozen, snap;
+static struct op *oplog;
+static int done;
+static uint64_t seed = 3;
+
+static uint32_t make_key(int i, uint8_t *k) { return (uint32_t)sprintf((char *)k, "k%05d", i); }
+
+static void *waiter(void *arg) {
+  avl_checkpoint_wait(arg);
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void apply(struct state *st, const struct op *p) {
+  st->present[p->i] = !p->del;
+  if (!p->del)
+    strcpy(st->v[p->i], p->v);
+}
+
+static int same(const struct state *a, const struct state *b, int i) {
+  return a->present[i] == b->present[i] && (!a->present[i] || strcmp(a->v[i], b->v[i]) == 0);
+}
+
+static void copy_file(const char *from, const char *to) {
+  char buf[65536];
+  size_t n;
+  FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+  if (in == NULL || out == NULL)
+    FAIL("copy %s", from);
+  while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+    fwrite(buf, 1, n, out);
+  fclose(in);
+  if (fclose(out) != 0)
+    FAIL("copy %s", from);
+}
+
+static void read_state(struct avltree *avl, struct state *st) {
+  uint8_t k[16];
+  uint32_t kl, vl;
+  for (int i = 0; i < NKEYS; i++) {
+    kl = make_key(i, k);
+    st->present[i] =
+        avl_get_copy(avl, k, kl, (uint8_t *)st->v[i], sizeof st->v[i] - 1, &vl) == KVDBLITE_SUCCESS;
+    if (st->present[i])
+      st->v[i][vl] = 0;
+  }
+}
+
+static void run(const struct config *cf, int rounds) {
+  struct avl_options o;
+  struct avltree *avl;
+  uint8_t k[16];
+  uint32_t kl;
+
+  test_remove_db(fn);
+  test_remove_db(copy);
+  memset(&live, 0, sizeof live);
+  avl_default_options(&o);
+  o.engine = cf->engine;
+  o.mvcc = cf->mvcc;
+  o.hash_index = cf->hash_index;
+  o.compact_snapshots = cf->compact;
+  o.compress_values = cf->compress;
+  o.compress_snapshots = cf->compress != 0;
+  if ((avl = avl_make_with_options((uint8_t *)fn, &o)) == NULL)
+    FAIL("%s: open", cf->name);
+
+  for (int round = 0; round < rounds; round++) {
+    long n = 0, diff = 0, at = -1;
+    pthread_t t;
+
+    for (int it = 0; it < 50000; it++) {
+      int i = (int)(test_rand(&seed) % NKEYS);
+      kl = make_key(i, k);
+      sprintf(live.v[i], "v%d", (int)(test_rand(&seed) % 1000000));
+      live.present[i] = 1;
+      avl_put(avl, k, kl, (uint8_t *)live.v[i], (uint32_t)strlen(live.v[i]));
+    }
+
+    // Write while the checkpoint runs, logging every change
+    frozen = live;
+    __atomic_store_n(&done, 0, __ATOMIC_RELAXED);
+    if (avl_checkpoint_start(avl) != KVDBLITE_SUCCESS)
+      FAIL("%s: checkpoint start", cf->name);
+    pthread_create(&t, NULL, waiter, avl);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE) && n < MAXOPS) {
+      struct op *p = &oplog[n++];
+      p->i = (int)(test_rand(&seed) % NKEYS);
+      p->del = test_rand(&seed) % 3 == 0;
+      kl = make_key(p->i, k);
+      if (p->del) {
+        avl_del(avl, k, kl);
+      } else {
+        sprintf(p->v, "w%d", (int)(test_rand(&seed) % 1000000));
+        avl_put(avl, k, kl, (uint8_t *)p->v, (uint32_t)strlen(p->v));
+      }
+      apply(&live, p);
+    }
+    pthread_join(t, NULL);
+    if (avl_check_valid(avl) < 0)
+      FAIL("%s: round %d: tree not valid", cf->name, round);
+    read_state(avl, &snap);
+    for (int i = 0; i < NKEYS; i++)
+      if (!same(&live, &snap, i))
+        FAIL("%s: round %d: key %d doesn't match the writes", cf->name, round, i);
+
+    // The snapshot on its own
+    copy_file(fn, copy);
+    struct avltree *s = avl_make_with_options((uint8_t *)copy, &o);
+    if (s == NULL)
+      FAIL("%s: open the snapshot", cf->name);
+    read_state(s, &snap);
+    avl_free(s);
+    test_remove_db(copy);
+
+    // Replay the log on the state from before the checkpoint until it matches
+    for (int i = 0; i < NKEYS; i++)
+      diff += !same(&frozen, &snap, i);
+    if (diff == 0)
+      at = 0;
+    for (long j = 0; j < n && at < 0; j++) {
+      diff -= !same(&frozen, &snap, oplog[j].i);
+      apply(&frozen, &oplog[j]);
+      diff += !same(&frozen, &snap, oplog[j].i);
+      if (diff == 0)
+        at = j + 1;
+    }
+    if (at < 0)
+      FAIL("%s: round %d: the snapshot isn't the database at any point of the %ld writes made "
+           "during the checkpoint",
+           cf->name, round, n);
+  }
+  avl_free(avl);
+  test_remove_db(fn);
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 10;
+  if ((oplog = malloc(MAXOPS * sizeof *oplog)) == NULL)
+    FAIL("malloc");
+  for (size_t i = 0; i < sizeof configs / sizeof *configs; i++)
+    run(&configs[i], rounds);
+  free(oplog);
+  printf("ckpt_consistency: %zu configurations OK\n", sizeof configs / sizeof *configs);
+  return 0;
+}
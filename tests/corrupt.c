@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Snapshot corruption. Saves a database, flips a byte in the middle of a
+// snapshot and opens it read only, which maps the snapshot and checks its
+// blocks as reads get to them. Lookups must return the right value or
+// KVDBLITE_CORRUPT, never a wrong value or KVDBLITE_NOT_FOUND, and a full
+// scan and a cursor walk must end in KVDBLITE_CORRUPT. A normal open, which
+// loads the snapshot, must fail. Runs once for each configuration below.
+// Then the same for a journal: a byte flipped early in it must fail the open
+// and leave the file as it was, while a journal cut off in the middle of its
+// last record opens without that record, unless it is a rotated journal with
+// a newer one after it.
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "test.h"
+
+#define NKEYS 20000
+#define JOURNAL_KEYS 1000
+#define VLEN 100
+
+static const char *fn = "corrupt.kvb";
+
+struct config {
+  const char *name;
+  unsigned nshards;
+};
+
+static const struct config configs[] = {
+    {"1 shard", 1},
+    {"3 shards", 3},
+};
+
+static uint32_t make_key(int i, uint8_t *k) { return (uint32_t)sprintf((char *)k, "key%06d", i); }
+
+static void make_value(int i, uint8_t *v) {
+  for (int j = 0; j < VLEN; j++)
+    v[j] = (uint8_t)(i * 31 + j);
+}
+
+static int count_visit(void *ctx, const avl_key_t *key, uint32_t klen, const avl_value_t *value,
+                       uint32_t vlen) {
+  (void)key, (void)klen, (void)value, (void)vlen;
+  ++*(int *)ctx;
+  return 0;
+}
+
+static off_t file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+// Flip the byte at the given fraction of the file
+static void flip_byte(const char *path, double at) {
+  struct stat st;
+  uint8_t b;
+  int fd = open(path, O_RDWR);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    FAIL("open %s", path);
+  off_t off = (off_t)(st.st_size * at);
+  if (pread(fd, &b, 1, off) != 1)
+    FAIL("read %s", path);
+  b ^= 0x5a;
+  if (pwrite(fd, &b, 1, off) != 1)
+    FAIL("write %s", path);
+  close(fd);
+}
+
+static void run_snapshot(const struct config *cf) {
+  uint8_t k[32], v[VLEN], got[VLEN];
+  uint32_t kl, vl;
+  char path[64];
+  struct avl_options o;
+  struct avltree *avl;
+  struct avl_cursor *c;
+  int n = 0, bad = 0, rc;
+
+  test_remove_db(fn);
+  avl_default_options(&o);
+  o.nshards = cf->nshards;
+  if ((avl = avl_make_with_options((uint8_t *)fn, &o)) == NULL)
+    FAIL("%s: open", cf->name);
+  for (int i = 0; i < NKEYS; i++) {
+    make_value(i, v);
+    if (avl_put(avl, k, make_key(i, k), v, VLEN) != KVDBLITE_SUCCESS)
+      FAIL("%s: put", cf->name);
+  }
+  if (avl_save_database(avl) < 0)
+    FAIL("%s: save", cf->name);
+  avl_free(avl);
+
+  if ((avl = avl_open_readonly((uint8_t *)fn, 0)) == NULL)
+    FAIL("%s: read only open", cf->name);
+  if (avl_scan_range(avl, NULL, 0, NULL, 0, count_visit, &n) != 0 || n != NKEYS)
+    FAIL("%s: clean scan visited %d", cf->name, n);
+  avl_free(avl);
+
+  if (cf->nshards > 1)
+    snprintf(path, sizeof path, "%s.0", fn);
+  else
+    snprintf(path, sizeof path, "%s", fn);
+  flip_byte(path, 1.0 / 3);
+
+  if ((avl = avl_open_readonly((uint8_t *)fn, 0)) == NULL)
+    FAIL("%s: read only open after the flip", cf->name);
+  for (int i = 0; i < NKEYS; i++) {
+    kl = make_key(i, k);
+    rc = avl_get_copy(avl, k, kl, got, VLEN, &vl);
+    if (rc == KVDBLITE_CORRUPT) {
+      bad++;
+      continue;
+    }
+    make_value(i, v);
+    if (rc != KVDBLITE_SUCCESS || vl != VLEN || memcmp(got, v, VLEN) != 0)
+      FAIL("%s: key %d: lookup returned %d", cf->name, i, rc);
+  }
+  if (bad == 0)
+    FAIL("%s: no lookup saw the flipped byte", cf->name);
+  n = 0;
+  if ((rc = avl_scan_range(avl, NULL, 0, NULL, 0, count_visit, &n)) != KVDBLITE_CORRUPT)
+    FAIL("%s: scan returned %d after %d entries", cf->name, rc, n);
+  if ((c = avl_cursor_open(avl)) == NULL)
+    FAIL("%s: cursor", cf->name);
+  for (rc = avl_cursor_first(c); rc == KVDBLITE_SUCCESS; rc = avl_cursor_next(c))
+    ;
+  if (rc != KVDBLITE_CORRUPT)
+    FAIL("%s: cursor walk ended in %d", cf->name, rc);
+  avl_cursor_close(c);
+  avl_free(avl);
+
+  if ((avl = avl_make_with_options((uint8_t *)fn, &o)) != NULL)
+    FAIL("%s: open loaded a corrupt snapshot", cf->name);
+  test_remove_db(fn);
+}
+
+// A database that only has its journal
+static void write_journal(void) {
+  uint8_t k[32], v[VLEN];
+  struct avltree *avl;
+
+  test_remove_db(fn);
+  if ((avl = avl_make((uint8_t *)fn)) == NULL)
+    FAIL("journal: open");
+  for (int i = 0; i < JOURNAL_KEYS; i++) {
+    make_value(i, v);
+    if (avl_put(avl, k, make_key(i, k), v, VLEN) != KVDBLITE_SUCCESS)
+      FAIL("journal: put");
+  }
+  avl_free(avl);
+}
+
+static void run_journal(void) {
+  char jnl[64], rotated[64];
+  struct avltree *avl;
+  off_t size;
+
+  snprintf(jnl, sizeof jnl, "%s.jnl", fn);
+  write_journal();
+  size = file_size(jnl);
+  flip_byte(jnl, 0.1);
+  if ((avl = avl_make((uint8_t *)fn)) != NULL)
+    FAIL("journal: open replayed a damaged journal, %d keys", avl_db_size(avl));
+  if ((avl = avl_open_readonly((uint8_t *)fn, 0)) != NULL)
+    FAIL("journal: read only open replayed a damaged journal");
+  if (file_size(jnl) != size)
+    FAIL("journal: damaged journal went from %lld to %lld bytes", (long long)size,
+         (long long)file_size(jnl));
+
+  // A torn last write
+  write_journal();
+  size = file_size(jnl);
+  if (truncate(jnl, size - 7) < 0)
+    FAIL("journal: truncate");
+  if ((avl = avl_make((uint8_t *)fn)) == NULL)
+    FAIL("journal: open with a torn last record");
+  if (avl_db_size(avl) != JOURNAL_KEYS - 1)
+    FAIL("journal: %d keys after the torn record, expected %d", avl_db_size(avl),
+         JOURNAL_KEYS - 1);
+  avl_free(avl);
+  if (file_size(jnl) != size / JOURNAL_KEYS * (JOURNAL_KEYS - 1))
+    FAIL("journal: torn record not cut off, %lld bytes", (long long)file_size(jnl));
+
+  // The same in a rotated journal, with a newer write in the journal after it
+  snprintf(rotated, sizeof rotated, "%s.1", jnl);
+  write_journal();
+  if (rename(jnl, rotated) < 0)
+    FAIL("journal: rename");
+  if ((avl = avl_make((uint8_t *)fn)) == NULL)
+    FAIL("journal: open with a rotated journal");
+  if (avl_put(avl, (const avl_key_t *)"zzz", 3, (const avl_value_t *)"1", 1) != KVDBLITE_SUCCESS)
+    FAIL("journal: put");
+  avl_free(avl);
+  size = file_size(rotated);
+  if (truncate(rotated, size - 7) < 0)
+    FAIL("journal: truncate");
+  if ((avl = avl_make((uint8_t *)fn)) != NULL)
+    FAIL("journal: open applied a journal after a torn rotated one, %d keys", avl_db_size(avl));
+  if (file_size(rotated) != size - 7)
+    FAIL("journal: torn rotated journal went from %lld to %lld bytes", (long long)size - 7,
+         (long long)file_size(rotated));
+  test_remove_db(fn);
+}
+
+int main(void) {
+  for (size_t i = 0; i < sizeof configs / sizeof *configs; i++)
+    run_snapshot(&configs[i]);
+  run_journal();
+  printf("corrupt: %zu configurations and the journal OK\n", sizeof configs / sizeof *configs);
+  return 0;
+}
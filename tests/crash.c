@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// kill -9 loop. A child process runs writers, each inserting its own keys in
+// order with a durability mode that waits for the disk, and a thread that
+// runs checkpoints back to back. After each insert returns, the writer
+// records it as acknowledged in memory shared with the parent. The parent
+// kills the child at a random moment and reopens the database. Every
+// acknowledged key must be there, and each writer's keys must form an
+// unbroken run from its first key. In the batch configurations each writer
+// instead commits batches that set a key in every shard to its next
+// generation, and after the kill its keys must all hold the same one. Those
+// keep the database from round to round, so the parts of batches a kill
+// broke up meet later checkpoints. Runs a number of rounds for each
+// configuration below.
+// Usage: crash [rounds]
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define MAXWRITERS 8
+#define BATCH_KEYS 12
+
+static const char *fn = "crash.kvb";
+
+struct config {
+  const char *name;
+  unsigned nshards, writers;
+  int durability, engine, journal_writer, batches;
+};
+
+static const struct config configs[] = {
+    {"always", 1, 1, KVDBLITE_SYNC_ALWAYS, KVDBLITE_ENGINE_AVL, 0, 0},
+    {"group 3 shards", 3, 4, KVDBLITE_SYNC_GROUP, KVDBLITE_ENGINE_AVL, 0, 0},
+    {"always btree", 2, 2, KVDBLITE_SYNC_ALWAYS, KVDBLITE_ENGINE_BTREE, 0, 0},
+    {"group journal writer", 2, 4, KVDBLITE_SYNC_GROUP, KVDBLITE_ENGINE_AVL, 1, 0},
+    {"batches group 4 shards", 4, 2, KVDBLITE_SYNC_GROUP, KVDBLITE_ENGINE_AVL, 0, 1},
+    {"batches none 5 shards", 5, 3, KVDBLITE_SYNC_NONE, KVDBLITE_ENGINE_BTREE, 0, 1},
+};
+
+static struct avltree *db;
+static long *acked; // Keys each writer had acknowledged, shared with the parent
+static long checked;
+
+static uint32_t make_key(long w, long i, uint8_t *k) {
+  return (uint32_t)sprintf((char *)k, "w%ld-%08ld", w, i);
+}
+
+static uint32_t make_batch_key(long w, int j, uint8_t *k) {
+  return (uint32_t)sprintf((char *)k, "b%ld-%02d", w, j);
+}
+
+// The generation writer w's batch key j holds, -1 if it isn't there
+static long batch_generation(long w, int j) {
+  uint8_t k[32], v[32];
+  uint32_t vl;
+  if (avl_get_copy(db, k, make_batch_key(w, j, k), v, sizeof v - 1, &vl) != KVDBLITE_SUCCESS)
+    return -1;
+  v[vl] = 0;
+  return atol((char *)v);
+}
+
+static struct avltree *open_db(const struct config *cf) {
+  struct avl_options o;
+  avl_default_options(&o);
+  o.nshards = cf->nshards;
+  o.durability = cf->durability;
+  o.engine = cf->engine;
+  o.journal_writer = cf->journal_writer;
+  o.group_commit_us = 50;
+  return avl_make_with_options((uint8_t *)fn, &o);
+}
+
+static void *writer(void *arg) {
+  long w = (long)arg;
+  uint8_t k[32];
+  for (long i = 0;; i++) {
+    uint32_t kl = make_key(w, i, k);
+    if (avl_put(db, k, kl, k, kl) != KVDBLITE_SUCCESS)
+      _exit(3);
+    __atomic_store_n(&acked[w], i + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void *batch_writer(void *arg) {
+  long w = (long)arg;
+  uint8_t k[32], v[32];
+  struct kvdb_write_batch *b = kvdb_write_batch_make();
+  // Carry on from where the last round got to
+  for (long g = batch_generation(w, 0) + 1;; g++) {
+    uint32_t vl = (uint32_t)sprintf((char *)v, "%ld", g);
+    kvdb_write_batch_clear(b);
+    for (int j = 0; j < BATCH_KEYS; j++)
+      kvdb_write_batch_put(b, k, make_batch_key(w, j, k), v, vl);
+    if (kvdb_write_batch_commit(db, b) != KVDBLITE_SUCCESS)
+      _exit(3);
+    __atomic_store_n(&acked[w], g + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void *checkpointer(void *arg) {
+  for (;;) {
+    if (avl_checkpoint_start(db) == KVDBLITE_SUCCESS)
+      avl_checkpoint_wait(db);
+  }
+  return NULL;
+}
+
+static void child(const struct config *cf) {
+  pthread_t t;
+  if ((db = open_db(cf)) == NULL)
+    _exit(2);
+  pthread_create(&t, NULL, checkpointer, NULL);
+  for (long w = 0; w < (long)cf->writers; w++)
+    pthread_create(&t, NULL, cf->batches ? batch_writer : writer, (void *)w);
+  for (;;)
+    pause();
+}
+
+static void run(const struct config *cf, int rounds, uint64_t *seed) {
+  uint8_t k[32], v[32];
+  uint32_t kl, vl;
+
+  for (int round = 0; round < rounds; round++) {
+    long total = 0;
+    int status;
+
+    if (round == 0 || !cf->batches)
+      test_remove_db(fn);
+    memset(acked, 0, MAXWRITERS * sizeof *acked);
+    pid_t pid = fork();
+    if (pid < 0)
+      FAIL("fork");
+    if (pid == 0)
+      child(cf);
+    usleep(50000 + test_rand(seed) % 250000);
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    if (!WIFSIGNALED(status))
+      FAIL("%s: the child exited with %d", cf->name, WEXITSTATUS(status));
+
+    if ((db = open_db(cf)) == NULL)
+      FAIL("%s: round %d: reopen", cf->name, round);
+    for (long w = 0; w < (long)cf->writers && cf->batches; w++) {
+      long g = batch_generation(w, 0), have = __atomic_load_n(&acked[w], __ATOMIC_ACQUIRE);
+      for (int j = 1; j < BATCH_KEYS; j++) {
+        if (batch_generation(w, j) != g)
+          FAIL("%s: round %d: writer %ld's key %d has generation %ld, key 0 %ld", cf->name,
+               round, w, j, batch_generation(w, j), g);
+      }
+      if (cf->durability != KVDBLITE_SYNC_NONE && g + 1 < have)
+        FAIL("%s: round %d: writer %ld had generation %ld acknowledged, %ld survived", cf->name,
+             round, w, have - 1, g);
+      total += g < 0 ? 0 : BATCH_KEYS;
+    }
+    for (long w = 0; w < (long)cf->writers && !cf->batches; w++) {
+      long n = 0, have = __atomic_load_n(&acked[w], __ATOMIC_ACQUIRE);
+      for (;; n++) {
+        kl = make_key(w, n, k);
+        if (avl_get_copy(db, k, kl, v, sizeof v, &vl) != KVDBLITE_SUCCESS)
+          break;
+        if (vl != kl || memcmp(v, k, kl) != 0)
+          FAIL("%s: round %d: key %s has the wrong value", cf->name, round, (char *)k);
+      }
+      if (n < have)
+        FAIL("%s: round %d: writer %ld had %ld keys acknowledged, %ld survived", cf->name, round,
+             w, have, n);
+      total += n;
+      checked += have;
+    }
+    if (avl_db_size(db) != total || avl_check_valid(db) < 0)
+      FAIL("%s: round %d: %d keys, expected %ld, or tree not valid", cf->name, round,
+           avl_db_size(db), total);
+    avl_free(db);
+  }
+  test_remove_db(fn);
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 10;
+  uint64_t seed = 12345;
+  acked = mmap(NULL, MAXWRITERS * sizeof *acked, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+               -1, 0);
+  if (acked == MAP_FAILED)
+    FAIL("mmap");
+  for (size_t i = 0; i < sizeof configs / sizeof *configs; i++)
+    run(&configs[i], rounds, &seed);
+  printf("crash: %zu configurations OK, %ld acknowledged keys survived\n",
+         sizeof configs / sizeof *configs, checked);
+  return 0;
+}
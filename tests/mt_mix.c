@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Eight threads mixing puts, deletes, batches, lookups, scans, rank/select,
+// snapshots and checkpoints on one database, meant to be built with
+// -fsanitize=thread ("make test" does). Each thread only writes the keys it
+// owns and keeps a model of them, so once the threads are done the
+// database, and the database reopened, must match the models. Runs once
+// for each configuration below.
+// Usage: mt_mix [ops per thread]
+
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NTHREADS 8
+#define NKEYS 3000 // Key i belongs to thread i % NTHREADS
+
+static const char *fn = "mt_mix.kvb";
+
+struct config {
+  unsigned nshards;
+  int durability, engine, mvcc, hash_index, journal_writer;
+};
+
+static const struct config configs[] = {
+    {1, KVDBLITE_SYNC_NONE, KVDBLITE_ENGINE_AVL, 0, 0, 0},
+    {1, KVDBLITE_SYNC_ALWAYS, KVDBLITE_ENGINE_AVL, 1, 0, 0},
+    {1, KVDBLITE_SYNC_INTERVAL, KVDBLITE_ENGINE_BTREE, 0, 1, 0},
+    {1, KVDBLITE_SYNC_GROUP, KVDBLITE_ENGINE_AVL, 0, 0, 1},
+    {3, KVDBLITE_SYNC_NONE, KVDBLITE_ENGINE_AVL, 1, 0, 0},
+    {3, KVDBLITE_SYNC_ALWAYS, KVDBLITE_ENGINE_BTREE, 0, 0, 0},
+    {3, KVDBLITE_SYNC_INTERVAL, KVDBLITE_ENGINE_AVL, 0, 1, 0},
+    {3, KVDBLITE_SYNC_GROUP, KVDBLITE_ENGINE_AVL, 1, 0, 0},
+    {8, KVDBLITE_SYNC_NONE, KVDBLITE_ENGINE_BTREE, 0, 1, 0},
+    {8, KVDBLITE_SYNC_ALWAYS, KVDBLITE_ENGINE_AVL, 0, 0, 1},
+    {8, KVDBLITE_SYNC_INTERVAL, KVDBLITE_ENGINE_AVL, 1, 0, 0},
+    {8, KVDBLITE_SYNC_GROUP, KVDBLITE_ENGINE_BTREE, 0, 0, 0},
+};
+
+static struct avltree *db;
+static int mvcc, ops;
+
+// The models, each thread only touches its own keys
+static char model[NKEYS][24];
+static int present[NKEYS];
+
+static uint32_t make_key(int i, uint8_t *k) { return (uint32_t)sprintf((char *)k, "key%05d", i); }
+
+static int count_visit(void *ctx, const avl_key_t *key, uint32_t klen, const avl_value_t *value,
+                       uint32_t vlen) {
+  (*(int *)ctx)++;
+  return 0;
+}
+
+// Walk a snapshot and check it is in order
+static void read_snapshot(void) {
+  struct avl_snapshot *s = avl_snapshot_open(db);
+  struct avl_view v, prev = {0};
+  if (s == NULL)
+    FAIL("snapshot open");
+  struct avl_cursor *c = avl_snapshot_cursor_open(s);
+  for (int rc = avl_cursor_first(c); rc == KVDBLITE_SUCCESS; rc = avl_cursor_next(c)) {
+    avl_cursor_get(c, &v);
+    // Keys are all 8 bytes
+    if (prev.key != NULL && memcmp(prev.key, v.key, 8) >= 0)
+      FAIL("snapshot cursor out of order");
+    prev = v;
+  }
+  avl_cursor_close(c);
+  avl_snapshot_close(s);
+}
+
+static void *worker(void *arg) {
+  long t = (long)arg;
+  uint64_t s = (uint64_t)(t + 1) * 2654435761u;
+  uint8_t k[32], v[64];
+  uint32_t kl, vl;
+
+  for (int it = 0; it < ops; it++) {
+    int op = (int)(test_rand(&s) % 100);
+    int own = (int)(test_rand(&s) % (NKEYS / NTHREADS)) * NTHREADS + (int)t;
+    int any = (int)(test_rand(&s) % NKEYS);
+    if (op < 20) {
+      kl = make_key(own, k);
+      vl = (uint32_t)sprintf((char *)v, "t%ld-%d", t, it);
+      if (avl_put(db, k, kl, v, vl) != KVDBLITE_SUCCESS)
+        FAIL("put");
+      memcpy(model[own], v, vl + 1);
+      present[own] = 1;
+    } else if (op < 30) {
+      kl = make_key(own, k);
+      avl_del(db, k, kl);
+      present[own] = 0;
+    } else if (op < 32) {
+      int n = 0;
+      avl_scan_prefix(db, (const uint8_t *)"key01", 5, count_visit, &n);
+    } else if (op < 34) {
+      struct kvdb_write_batch *b = kvdb_write_batch_make();
+      int keys[5];
+      for (int z = 0; z < 5; z++) {
+        keys[z] = (int)(test_rand(&s) % (NKEYS / NTHREADS)) * NTHREADS + (int)t;
+        kl = make_key(keys[z], k);
+        kvdb_write_batch_put(b, k, kl, (const uint8_t *)"batch", 5);
+      }
+      if (kvdb_write_batch_commit(db, b) < 0)
+        FAIL("batch");
+      kvdb_write_batch_free(b);
+      for (int z = 0; z < 5; z++) {
+        strcpy(model[keys[z]], "batch");
+        present[keys[z]] = 1;
+      }
+    } else if (op < 35) {
+      kl = make_key(any, k);
+      avl_rank(db, k, kl);
+      struct avl_lookup_result *r = avl_select(db, 5);
+      if (r != NULL)
+        avl_free_lookup_result(r);
+      avl_db_size(db);
+    } else if (op == 35 && mvcc) {
+      read_snapshot();
+    } else if (op == 36 && test_rand(&s) % 64 == 0) {
+      if (t == 0)
+        avl_save_database(db);
+      else if (avl_checkpoint_start(db) == KVDBLITE_SUCCESS)
+        avl_checkpoint_wait(db);
+    } else {
+      kl = make_key(any, k);
+      avl_get_copy(db, k, kl, v, sizeof v, &vl);
+    }
+  }
+  return NULL;
+}
+
+static void check(const char *when) {
+  uint8_t k[32], v[64];
+  uint32_t kl, vl;
+  int n = 0;
+  for (int i = 0; i < NKEYS; i++) {
+    kl = make_key(i, k);
+    int rc = avl_get_copy(db, k, kl, v, sizeof v, &vl);
+    if (present[i] && (rc != KVDBLITE_SUCCESS || vl != strlen(model[i]) ||
+                       memcmp(v, model[i], vl) != 0))
+      FAIL("%s: key %d wrong", when, i);
+    if (!present[i] && rc != KVDBLITE_NOT_FOUND)
+      FAIL("%s: key %d deleted but found", when, i);
+    n += present[i];
+  }
+  if (avl_db_size(db) != n || avl_check_valid(db) < 0)
+    FAIL("%s: size %d, expected %d, or tree not valid", when, avl_db_size(db), n);
+}
+
+static void run(const struct config *cf) {
+  struct avl_options o;
+  pthread_t th[NTHREADS];
+
+  test_remove_db(fn);
+  memset(present, 0, sizeof present);
+  avl_default_options(&o);
+  o.nshards = cf->nshards;
+  o.durability = cf->durability;
+  o.sync_interval_ms = 5;
+  o.group_commit_us = 50;
+  o.engine = cf->engine;
+  o.mvcc = mvcc = cf->mvcc;
+  o.hash_index = cf->hash_index;
+  o.journal_writer = cf->journal_writer;
+  if ((db = avl_make_with_options((uint8_t *)fn, &o)) == NULL)
+    FAIL("open");
+  for (long i = 0; i < NTHREADS; i++)
+    pthread_create(&th[i], NULL, worker, (void *)i);
+  for (int i = 0; i < NTHREADS; i++)
+    pthread_join(th[i], NULL);
+  check("after the threads");
+  avl_free(db);
+  if ((db = avl_make_with_options((uint8_t *)fn, &o)) == NULL)
+    FAIL("reopen");
+  check("after reopening");
+  avl_free(db);
+  test_remove_db(fn);
+}
+
+int main(int argc, char **argv) {
+  ops = argc > 1 ? atoi(argv[1]) : 5000;
+  for (size_t i = 0; i < sizeof configs / sizeof *configs; i++)
+    run(&configs[i]);
+  printf("mt_mix: %zu configurations OK\n", sizeof configs / sizeof *configs);
+  return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// MVCC transfer invariant. Accounts start with 1000 each, and two writers
+// move money between them in batches, which keeps the total. Three readers
+// keep adding up the accounts through snapshot lookups, snapshot cursors
+// going both ways and prefix scans, and every sum they see must be the
+// total. Writers also put and delete unrelated keys in between, so the
+// trees change shape under the readers. Runs at 1 and 8 shards, and
+// checks the total again after reopening. "make test" builds it with
+// -fsanitize=thread.
+// Usage: mvcc_transfer [transfers per writer]
+
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NACCOUNTS 200
+#define TOTAL (NACCOUNTS * 1000)
+
+static const char *fn = "mvcc_transfer.kvb";
+
+static struct avltree *db;
+static int transfers, stop;
+static long bad;
+
+static void account_key(int i, uint8_t *k) { sprintf((char *)k, "acct%03d", i); }
+
+static int64_t balance(const struct avl_view *v) {
+  int64_t x;
+  memcpy(&x, v->value, 8);
+  return x;
+}
+
+static int sum_visit(void *ctx, const avl_key_t *key, uint32_t klen, const avl_value_t *value,
+                     uint32_t vlen) {
+  int64_t *acc = ctx, x;
+  memcpy(&x, value, 8);
+  acc[0] += x;
+  acc[1]++;
+  return 0;
+}
+
+static void broken(void) { __atomic_add_fetch(&bad, 1, __ATOMIC_RELAXED); }
+
+// Writer w moves money between the accounts of its own parity. Reading
+// the balances and writing them back isn't atomic, so the two writers
+// mustn't share accounts.
+static void *writer(void *arg) {
+  long w = (long)arg;
+  uint64_t s = (uint64_t)w * 7919 + 3;
+  struct kvdb_write_batch *b = kvdb_write_batch_make();
+  uint8_t k[16], pad[64] = {0};
+  struct avl_view v;
+
+  for (int it = 0; it < transfers;) {
+    int i = (int)(test_rand(&s) % (NACCOUNTS / 2)) * 2 + (int)w;
+    int j = (int)(test_rand(&s) % (NACCOUNTS / 2)) * 2 + (int)w;
+    int64_t a, c;
+    if (i == j)
+      continue;
+    struct avl_snapshot *sn = avl_snapshot_open(db);
+    account_key(i, k);
+    if (avl_snapshot_get(sn, k, 7, &v) != KVDBLITE_SUCCESS)
+      FAIL("account %d missing", i);
+    a = balance(&v) - 5;
+    account_key(j, k);
+    if (avl_snapshot_get(sn, k, 7, &v) != KVDBLITE_SUCCESS)
+      FAIL("account %d missing", j);
+    c = balance(&v) + 5;
+    avl_snapshot_close(sn);
+
+    kvdb_write_batch_clear(b);
+    account_key(i, k);
+    kvdb_write_batch_put(b, k, 7, (uint8_t *)&a, 8);
+    account_key(j, k);
+    kvdb_write_batch_put(b, k, 7, (uint8_t *)&c, 8);
+    sprintf((char *)k, "junk%05d", (int)(test_rand(&s) % 5000));
+    if (s & 1)
+      avl_put(db, k, 9, pad, (uint32_t)(s >> 8) % 64);
+    else
+      avl_del(db, k, 9);
+    if (kvdb_write_batch_commit(db, b) < 0)
+      FAIL("batch");
+    it++;
+  }
+  kvdb_write_batch_free(b);
+  return NULL;
+}
+
+static void *reader(void *arg) {
+  uint8_t k[16];
+  struct avl_view v;
+  long reads = 0;
+
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    struct avl_snapshot *sn = avl_snapshot_open(db);
+    int64_t sum = 0, acc[2] = {0, 0};
+    int n = 0, rc;
+
+    for (int i = 0; i < NACCOUNTS; i++) {
+      account_key(i, k);
+      if (avl_snapshot_get(sn, k, 7, &v) == KVDBLITE_SUCCESS)
+        sum += balance(&v);
+    }
+    if (sum != TOTAL)
+      broken();
+
+    struct avl_cursor *c = avl_snapshot_cursor_open(sn);
+    sum = 0;
+    for (rc = avl_cursor_seek(c, (const uint8_t *)"acct", 4); rc == KVDBLITE_SUCCESS;
+         rc = avl_cursor_next(c), n++) {
+      avl_cursor_get(c, &v);
+      if (memcmp(v.key, "acct", 4) != 0)
+        break;
+      sum += balance(&v);
+    }
+    if (sum != TOTAL || n != NACCOUNTS)
+      broken();
+    sum = 0;
+    for (rc = avl_cursor_last(c); rc == KVDBLITE_SUCCESS; rc = avl_cursor_prev(c)) {
+      avl_cursor_get(c, &v);
+      if (memcmp(v.key, "acct", 4) == 0)
+        sum += balance(&v);
+    }
+    if (sum != TOTAL)
+      broken();
+    avl_cursor_close(c);
+    avl_snapshot_close(sn);
+
+    avl_scan_prefix(db, (const uint8_t *)"acct", 4, sum_visit, acc);
+    if (acc[0] != TOTAL || acc[1] != NACCOUNTS)
+      broken();
+    reads++;
+  }
+  return (void *)reads;
+}
+
+static int64_t total(void) {
+  int64_t acc[2] = {0, 0};
+  avl_scan_prefix(db, (const uint8_t *)"acct", 4, sum_visit, acc);
+  return acc[1] == NACCOUNTS ? acc[0] : -1;
+}
+
+static void run(unsigned nshards) {
+  struct avl_options o;
+  pthread_t w[2], r[3];
+  uint8_t k[16];
+  long reads = 0;
+
+  test_remove_db(fn);
+  avl_default_options(&o);
+  o.nshards = nshards;
+  o.mvcc = 1;
+  if ((db = avl_make_with_options((uint8_t *)fn, &o)) == NULL)
+    FAIL("open");
+  for (int i = 0; i < NACCOUNTS; i++) {
+    int64_t v = 1000;
+    account_key(i, k);
+    avl_put(db, k, 7, (uint8_t *)&v, 8);
+  }
+  stop = 0;
+  for (long i = 0; i < 2; i++)
+    pthread_create(&w[i], NULL, writer, (void *)i);
+  for (int i = 0; i < 3; i++)
+    pthread_create(&r[i], NULL, reader, NULL);
+  for (int i = 0; i < 2; i++)
+    pthread_join(w[i], NULL);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < 3; i++) {
+    void *n;
+    pthread_join(r[i], &n);
+    reads += (long)n;
+  }
+  if (bad)
+    FAIL("%u shards: %ld broken totals in %ld rounds of reads", nshards, bad, reads);
+  if (avl_check_valid(db) < 0 || total() != TOTAL)
+    FAIL("%u shards: wrong total at the end", nshards);
+  avl_free(db);
+  if ((db = avl_make_with_options((uint8_t *)fn, &o)) == NULL || total() != TOTAL)
+    FAIL("%u shards: wrong total after reopening", nshards);
+  avl_free(db);
+  test_remove_db(fn);
+}
+
+int main(int argc, char **argv) {
+  transfers = argc > 1 ? atoi(argv[1]) : 20000;
+  run(1);
+  run(8);
+  printf("mvcc_transfer: OK\n");
+  return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Model check. Random puts, deletes and batches over a few thousand binary
+// keys are applied to the database and to an array that models it. Every
+// so often the two are compared through every read path (lookups, rank,
+// select, cursors both ways, seek, range and prefix scans), then the
+// database is saved or not, reopened and compared again. Runs once for
+// each configuration below.
+// Usage: stress [ops per configuration]
+
+#include <string.h>
+
+#include "test.h"
+
+#define NKEYS 3000
+#define REOPEN_EVERY 25000
+
+static const char *fn = "stress.kvb";
+
+struct config {
+  const char *name;
+  unsigned nshards;
+  int engine, mvcc, hash_index, compact, compress, value_log, journal_writer;
+};
+
+static const struct config configs[] = {
+    {"avl", 1, KVDBLITE_ENGINE_AVL, 0, 0, 0, 0, 0, 0},
+    {"avl 7 shards", 7, KVDBLITE_ENGINE_AVL, 0, 0, 0, 0, 0, 0},
+    {"mvcc", 1, KVDBLITE_ENGINE_AVL, 1, 0, 0, 0, 0, 0},
+    {"mvcc 5 shards", 5, KVDBLITE_ENGINE_AVL, 1, 0, 0, 0, 0, 0},
+    {"btree", 1, KVDBLITE_ENGINE_BTREE, 0, 0, 0, 0, 0, 0},
+    {"btree 3 shards hash", 3, KVDBLITE_ENGINE_BTREE, 0, 1, 0, 0, 0, 0},
+    {"avl hash compact", 2, KVDBLITE_ENGINE_AVL, 0, 1, 1, 0, 0, 0},
+    {"compress", 2, KVDBLITE_ENGINE_AVL, 0, 0, 0, 64, 0, 0},
+    {"value log", 2, KVDBLITE_ENGINE_AVL, 0, 0, 0, 0, 512, 0},
+    {"btree value log compress", 1, KVDBLITE_ENGINE_BTREE, 0, 0, 0, 64, 512, 0},
+    {"journal writer", 3, KVDBLITE_ENGINE_AVL, 0, 0, 0, 0, 0, 1},
+};
+
+static uint64_t seed = 88172645463325252ULL;
+
+// The model
+static uint8_t *ref[NKEYS];
+static uint32_t reflen[NKEYS];
+static int present[NKEYS];
+
+// Key i. Keys end in a byte from 0 to 6, and don't sort in the order of i.
+static uint32_t make_key(int i, uint8_t *k) {
+  return (uint32_t)sprintf((char *)k, "k%05d%c", i % 100 * 37 + i / 100, (char)(i % 7));
+}
+
+static int key_cmp(const void *a, const void *b) {
+  uint8_t x[32], y[32];
+  uint32_t xl = make_key(*(const int *)a, x), yl = make_key(*(const int *)b, y);
+  int c = memcmp(x, y, xl < yl ? xl : yl);
+  return c ? c : (int)xl - (int)yl;
+}
+
+static void make_value(uint8_t *v, uint32_t vlen, int random) {
+  // Half the values repeat, so compress_values has something to do
+  for (uint32_t q = 0; q < vlen; q++)
+    v[q] = random ? (uint8_t)test_rand(&seed)
+                  : (uint8_t)("abcabcxyz"[q % 9] ^ (test_rand(&seed) % 16 == 0));
+}
+
+static void model_put(int i, const uint8_t *v, uint32_t vlen) {
+  free(ref[i]);
+  ref[i] = malloc(vlen + 1);
+  memcpy(ref[i], v, vlen);
+  reflen[i] = vlen;
+  present[i] = 1;
+}
+
+static int count_visit(void *ctx, const avl_key_t *key, uint32_t klen, const avl_value_t *value,
+                       uint32_t vlen) {
+  (*(int *)ctx)++;
+  return 0;
+}
+
+static void check_key(struct avl_cursor *c, int i, const char *what) {
+  uint8_t k[32];
+  uint32_t kl = make_key(i, k);
+  struct avl_view v;
+  if (avl_cursor_get(c, &v) != KVDBLITE_SUCCESS || v.klen != kl || memcmp(v.key, k, kl) != 0)
+    FAIL("%s: cursor not at key %d", what, i);
+}
+
+// Compare the database with the model through every way of reading it
+static void check(struct avltree *avl) {
+  static int order[NKEYS];
+  struct avl_cursor *c;
+  uint8_t k[32], hk[32];
+  uint32_t kl, hl;
+  int i, q, m = 0, rc;
+
+  for (i = 0; i < NKEYS; i++) {
+    kl = make_key(i, k);
+    struct avl_lookup_result *r = avl_get(avl, k, kl);
+    if (present[i] &&
+        (r == NULL || r->vlen != reflen[i] || memcmp(r->value, ref[i], reflen[i]) != 0))
+      FAIL("key %d: wrong value", i);
+    if (!present[i] && r != NULL)
+      FAIL("key %d: deleted but found", i);
+    if (r != NULL)
+      avl_free_lookup_result(r);
+    if (present[i])
+      order[m++] = i;
+  }
+  if (avl_db_size(avl) != m)
+    FAIL("size %d, expected %d", avl_db_size(avl), m);
+  if (avl_check_valid(avl) < 0)
+    FAIL("avl_check_valid");
+  qsort(order, m, sizeof *order, key_cmp);
+
+  for (q = 0; q < m; q += m / 50 + 1) {
+    kl = make_key(order[q], k);
+    if (avl_rank(avl, k, kl) != q)
+      FAIL("rank of entry %d", q);
+    struct avl_lookup_result *r = avl_select(avl, q);
+    if (r == NULL || r->klen != kl || memcmp(r->key, k, kl) != 0)
+      FAIL("select %d", q);
+    avl_free_lookup_result(r);
+  }
+  if (avl_select(avl, m) != NULL)
+    FAIL("select past the end");
+
+  c = avl_cursor_open(avl);
+  for (q = 0, rc = avl_cursor_first(c); rc == KVDBLITE_SUCCESS; rc = avl_cursor_next(c), q++)
+    check_key(c, order[q], "forward");
+  if (q != m)
+    FAIL("cursor visited %d of %d", q, m);
+  for (rc = avl_cursor_last(c); rc == KVDBLITE_SUCCESS; rc = avl_cursor_prev(c))
+    check_key(c, order[--q], "backward");
+  if (q != 0)
+    FAIL("cursor backward stopped at %d", q);
+
+  for (int t = 0; t < 50; t++) {
+    int lo = (int)(test_rand(&seed) % NKEYS), hi = (int)(test_rand(&seed) % NKEYS), cnt = 0;
+    int first = 0, expect = 0;
+    kl = make_key(lo, k);
+    hl = make_key(hi, hk);
+    while (first < m && key_cmp(&order[first], &lo) < 0)
+      first++;
+    rc = avl_cursor_seek(c, k, kl);
+    if (first == m && rc != KVDBLITE_NOT_FOUND)
+      FAIL("seek past the end");
+    if (first < m) {
+      check_key(c, order[first], "seek");
+      if (first > 0) {
+        avl_cursor_prev(c);
+        check_key(c, order[first - 1], "seek then prev");
+      }
+    }
+    avl_scan_range(avl, k, kl, hk, hl, count_visit, &cnt);
+    for (q = first; q < m && key_cmp(&order[q], &hi) < 0; q++)
+      expect++;
+    if (cnt != expect)
+      FAIL("range scan visited %d, expected %d", cnt, expect);
+    cnt = expect = 0;
+    avl_scan_prefix(avl, k, 3, count_visit, &cnt);
+    for (q = 0; q < m; q++) {
+      make_key(order[q], hk);
+      expect += memcmp(hk, k, 3) == 0;
+    }
+    if (cnt != expect)
+      FAIL("prefix scan visited %d, expected %d", cnt, expect);
+  }
+  avl_cursor_close(c);
+}
+
+static struct avltree *open_db(const struct config *cf) {
+  struct avl_options o;
+  avl_default_options(&o);
+  o.nshards = cf->nshards;
+  o.engine = cf->engine;
+  o.mvcc = cf->mvcc;
+  o.hash_index = cf->hash_index;
+  o.compact_snapshots = cf->compact;
+  o.compress_values = cf->compress;
+  o.compress_snapshots = cf->compress != 0;
+  o.value_log = cf->value_log;
+  o.value_log_segment_bytes = 64 << 10;
+  o.value_cache_bytes = 256 << 10;
+  o.value_log_gc_pct = 30;
+  if (cf->journal_writer) {
+    o.journal_writer = 1;
+    o.durability = KVDBLITE_SYNC_GROUP;
+    o.group_commit_us = 20;
+  }
+  struct avltree *avl = avl_make_with_options((uint8_t *)fn, &o);
+  if (avl == NULL)
+    FAIL("%s: open", cf->name);
+  return avl;
+}
+
+static void run(const struct config *cf, int ops) {
+  static uint8_t v[9000];
+  struct avltree *avl;
+  uint8_t k[32];
+  uint32_t kl, vlen;
+
+  test_remove_db(fn);
+  memset(present, 0, sizeof present);
+  avl = open_db(cf);
+  for (int it = 0; it < ops; it++) {
+    int i = (int)(test_rand(&seed) % NKEYS), op = (int)(test_rand(&seed) % 10);
+    kl = make_key(i, k);
+    if (op < 6) {
+      // A quarter of the values are large enough for the value log
+      vlen = test_rand(&seed) % 4 == 0 ? test_rand(&seed) % 8000 : test_rand(&seed) % 40;
+      make_value(v, vlen, it & 1);
+      if (avl_put(avl, k, kl, v, vlen) != KVDBLITE_SUCCESS)
+        FAIL("%s: put", cf->name);
+      model_put(i, v, vlen);
+    } else if (op < 9) {
+      avl_del(avl, k, kl);
+      present[i] = 0;
+    } else {
+      struct kvdb_write_batch *b = kvdb_write_batch_make();
+      int n = (int)(test_rand(&seed) % 20);
+      for (int z = 0; z < n; z++) {
+        int j = (int)(test_rand(&seed) % NKEYS);
+        kl = make_key(j, k);
+        if (test_rand(&seed) % 3) {
+          vlen = test_rand(&seed) % 50;
+          make_value(v, vlen, it & 1);
+          kvdb_write_batch_put(b, k, kl, v, vlen);
+          model_put(j, v, vlen);
+        } else {
+          kvdb_write_batch_delete(b, k, kl);
+          present[j] = 0;
+        }
+      }
+      if (kvdb_write_batch_commit(avl, b) < 0)
+        FAIL("%s: batch", cf->name);
+      kvdb_write_batch_free(b);
+    }
+    if (cf->value_log && it % 7000 == 6999) {
+      if (kvdb_value_log_gc(avl) < 0)
+        FAIL("%s: value log gc", cf->name);
+      if (test_rand(&seed) % 3 == 0)
+        avl_checkpoint_start(avl);
+    }
+    if (it % REOPEN_EVERY == REOPEN_EVERY - 1) {
+      check(avl);
+      if (test_rand(&seed) % 2 && avl_save_database(avl) < 0)
+        FAIL("%s: save", cf->name);
+      avl_free(avl);
+      avl = open_db(cf);
+      check(avl);
+    }
+  }
+  check(avl);
+  avl_free(avl);
+  test_remove_db(fn);
+  for (int i = 0; i < NKEYS; i++) {
+    free(ref[i]);
+    ref[i] = NULL;
+  }
+}
+
+int main(int argc, char **argv) {
+  int ops = argc > 1 ? atoi(argv[1]) : 100000;
+  for (size_t i = 0; i < sizeof configs / sizeof *configs; i++)
+    run(&configs[i], ops);
+  printf("stress: %zu configurations OK\n", sizeof configs / sizeof *configs);
+  return 0;
+}
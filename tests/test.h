@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2023 Gary Sims
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// What the tests in this directory share. Each test is a program of its own
+// that prints a line ending in OK and exits 0, or prints what went wrong and
+// exits 1. "make test" builds and runs them all from this directory.
+
+#ifndef KVDBLITE_TEST_H
+#define KVDBLITE_TEST_H
+
+#include <glob.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../kvdblite.h"
+
+#define FAIL(...)                                                                                  \
+  do {                                                                                             \
+    fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);                                           \
+    fprintf(stderr, __VA_ARGS__);                                                                  \
+    fprintf(stderr, "\n");                                                                         \
+    exit(1);                                                                                       \
+  } while (0)
+
+// xorshift64, every user keeps its own state so runs repeat
+static inline uint64_t test_rand(uint64_t *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+// Delete the database fn and every file next to it (shards, journals,
+// value log segments)
+static inline void test_remove_db(const char *fn) {
+  char pattern[256];
+  glob_t g;
+  snprintf(pattern, sizeof pattern, "%s*", fn);
+  if (glob(pattern, 0, NULL, &g) != 0)
+    return;
+  for (size_t i = 0; i < g.gl_pathc; i++)
+    unlink(g.gl_pathv[i]);
+  globfree(&g);
+}
+
+#endif